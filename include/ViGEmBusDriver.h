@@ -1,6 +1,6 @@
 /*
 * Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
-* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
 *
 * This program is free software: you can redistribute it and/or modify
 * it under the terms of the GNU General Public License as published by
@@ -28,6 +28,9 @@ DEFINE_GUID(GUID_DEVCLASS_VIGEM_RAWPDO,
 
 #pragma once
 
+//
+// Requires <ViGEm/km/BusShared.h> and "ViGEmBusShared.h" to be included first.
+// 
 
 //
 // Describes the current stage a PDO completed
@@ -52,6 +55,67 @@ VOID
     _In_ NTSTATUS Status
     );
 
+//
+// Plugs in a new child device, completes asynchronously (IRQL == PASSIVE_LEVEL)
+// 
+typedef
+NTSTATUS
+(*PVIGEM_BUS_PLUGIN)(
+    _In_ PVOID Context,
+    _In_ ULONG SerialNo,
+    _In_ VIGEM_TARGET_TYPE TargetType,
+    _In_ USHORT VendorId,
+    _In_ USHORT ProductId
+    );
+
+//
+// Unplugs a child device (IRQL == PASSIVE_LEVEL)
+// 
+typedef
+NTSTATUS
+(*PVIGEM_BUS_UNPLUG)(
+    _In_ PVOID Context,
+    _In_ ULONG SerialNo
+    );
+
+//
+// Sends an XUSB_, NSWITCH_ or XGIP_SUBMIT_REPORT to a child (IRQL <= DISPATCH_LEVEL)
+// 
+typedef
+NTSTATUS
+(*PVIGEM_BUS_SUBMIT_REPORT)(
+    _In_ PVOID Context,
+    _In_ PVOID Report
+    );
+
+//
+// Receives the output data (rumble, LED or output report) of a child.
+// 
+// Gets called at DISPATCH_LEVEL and must not block. It runs without any
+// bus lock held and may call RegisterNotificationCallback.
+// 
+typedef
+VOID
+(*PVIGEM_BUS_NOTIFICATION_CALLBACK)(
+    _In_opt_ PVOID CallbackContext,
+    _In_ PVIGEM_ANY_REQUEST_NOTIFICATION Notification
+    );
+
+//
+// Sets or, if Callback is NULL, removes the notification callback of a child (IRQL <= DISPATCH_LEVEL)
+// 
+// At PASSIVE_LEVEL the previous callback is guaranteed to not be running
+// anymore on return, at DISPATCH_LEVEL it may still be.
+// 
+typedef
+NTSTATUS
+(*PVIGEM_BUS_REGISTER_NOTIFICATION_CALLBACK)(
+    _In_ PVOID Context,
+    _In_ ULONG SerialNo,
+    _In_opt_ PVIGEM_BUS_NOTIFICATION_CALLBACK Callback,
+    _In_opt_ PVOID CallbackContext
+    );
+
 typedef struct _VIGEM_BUS_INTERFACE {
     // 
     // Standard interface header, must be present
@@ -63,9 +127,22 @@ typedef struct _VIGEM_BUS_INTERFACE {
     // 
     PVIGEM_BUS_PDO_STAGE_RESULT BusPdoStageResult;
 
+    //
+    // Version 2 and above: direct calls for kernel-mode feeders,
+    // InterfaceHeader.Context has to be passed as Context
+    // 
+
+    PVIGEM_BUS_PLUGIN PlugIn;
+
+    PVIGEM_BUS_UNPLUG UnPlug;
+
+    PVIGEM_BUS_SUBMIT_REPORT SubmitReport;
+
+    PVIGEM_BUS_REGISTER_NOTIFICATION_CALLBACK RegisterNotificationCallback;
+
 } VIGEM_BUS_INTERFACE, *PVIGEM_BUS_INTERFACE;
 
-#define VIGEM_BUS_INTERFACE_VERSION      1
+#define VIGEM_BUS_INTERFACE_VERSION      2
 
 VOID FORCEINLINE BUS_PDO_REPORT_STAGE_RESULT(
     VIGEM_BUS_INTERFACE Interface, 
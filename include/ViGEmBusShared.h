@@ -0,0 +1,776 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+//
+// Additional IOCTLs and structures shared between the bus and user-mode.
+//
+// Extends <ViGEm/km/BusShared.h> and must be included after it.
+//
+
+#pragma region IOCTL codes
+
+#define IOCTL_VIGEM_SUBMIT_REPORT_BATCH         BUSENUM_RW_IOCTL(IOCTL_VIGEM_BASE + 0x300)
+#define IOCTL_VIGEM_MAP_INPUT_RING              CTL_CODE(FILE_DEVICE_BUSENUM, \
+                                                    IOCTL_VIGEM_BASE + 0x301, \
+                                                    METHOD_OUT_DIRECT, \
+                                                    FILE_READ_DATA | FILE_WRITE_DATA)
+#define IOCTL_VIGEM_INPUT_RING_DOORBELL         BUSENUM_W_IOCTL(IOCTL_VIGEM_BASE + 0x302)
+#define IOCTL_VIGEM_GET_STATISTICS              BUSENUM_RW_IOCTL(IOCTL_VIGEM_BASE + 0x303)
+#define IOCTL_VIGEM_REQUEST_SESSION_NOTIFICATION \
+                                                BUSENUM_RW_IOCTL(IOCTL_VIGEM_BASE + 0x304)
+#define IOCTL_VIGEM_PLUGIN_TARGET_BATCH         BUSENUM_RW_IOCTL(IOCTL_VIGEM_BASE + 0x305)
+#define IOCTL_VIGEM_REQUEST_OUTPUT_EVENTS       BUSENUM_RW_IOCTL(IOCTL_VIGEM_BASE + 0x306)
+
+#pragma endregion
+
+#pragma region Report structures
+
+//
+// Holds any of the input report structures
+//
+typedef union _VIGEM_ANY_SUBMIT_REPORT
+{
+    //
+    // Common head of all *_SUBMIT_REPORT structures
+    //
+    struct
+    {
+        ULONG Size;
+        ULONG SerialNo;
+    } Header;
+
+    XUSB_SUBMIT_REPORT Xusb;
+    NSWITCH_SUBMIT_REPORT NintSwitch;
+    XGIP_SUBMIT_REPORT Xgip;
+
+} VIGEM_ANY_SUBMIT_REPORT, *PVIGEM_ANY_SUBMIT_REPORT;
+
+#pragma endregion
+
+#pragma region Batched report submission
+
+//
+// Maximum number of entries accepted in a single batch
+//
+#define VIGEM_SUBMIT_REPORT_BATCH_MAX_ENTRIES   0x40
+
+//
+// One report update inside a batch
+//
+typedef struct _VIGEM_SUBMIT_REPORT_BATCH_ENTRY
+{
+    //
+    // Result of this entry (NTSTATUS), set by the bus driver
+    //
+    LONG Status;
+
+    //
+    // Report for the target identified by its SerialNo
+    //
+    VIGEM_ANY_SUBMIT_REPORT Report;
+
+} VIGEM_SUBMIT_REPORT_BATCH_ENTRY, *PVIGEM_SUBMIT_REPORT_BATCH_ENTRY;
+
+//
+// Submits report updates for multiple targets in one call
+//
+typedef struct _VIGEM_SUBMIT_REPORT_BATCH
+{
+    //
+    // Size of the whole batch including all entries
+    //
+    ULONG Size;
+
+    //
+    // Number of entries following
+    //
+    ULONG Count;
+
+    VIGEM_SUBMIT_REPORT_BATCH_ENTRY Entries[ANYSIZE_ARRAY];
+
+} VIGEM_SUBMIT_REPORT_BATCH, *PVIGEM_SUBMIT_REPORT_BATCH;
+
+#define VIGEM_SUBMIT_REPORT_BATCH_SIZE(_count_) \
+    (FIELD_OFFSET(VIGEM_SUBMIT_REPORT_BATCH, Entries) + (_count_) * sizeof(VIGEM_SUBMIT_REPORT_BATCH_ENTRY))
+
+//
+// Initializes a batch header; the buffer must be VIGEM_SUBMIT_REPORT_BATCH_SIZE(Count) bytes
+//
+VOID FORCEINLINE VIGEM_SUBMIT_REPORT_BATCH_INIT(
+    PVIGEM_SUBMIT_REPORT_BATCH Batch,
+    ULONG Count
+)
+{
+    RtlZeroMemory(Batch, VIGEM_SUBMIT_REPORT_BATCH_SIZE(Count));
+
+    Batch->Size = (ULONG)VIGEM_SUBMIT_REPORT_BATCH_SIZE(Count);
+    Batch->Count = Count;
+}
+
+#pragma endregion
+
+#pragma region Batched plugin
+
+//
+// Maximum number of targets plugged in with a single batch
+//
+#define VIGEM_PLUGIN_TARGET_BATCH_MAX_ENTRIES   0x40
+
+//
+// One target to plug in as part of a batch
+//
+typedef struct _VIGEM_PLUGIN_TARGET_BATCH_ENTRY
+{
+    //
+    // Result of this entry (NTSTATUS), set by the bus driver once the
+    // target finished initialization or failed
+    //
+    LONG Status;
+
+    //
+    // Target to plug in, same as for IOCTL_VIGEM_PLUGIN_TARGET; a serial
+    // number of 0 gets replaced by the one the bus driver allocated
+    //
+    VIGEM_PLUGIN_TARGET Target;
+
+} VIGEM_PLUGIN_TARGET_BATCH_ENTRY, *PVIGEM_PLUGIN_TARGET_BATCH_ENTRY;
+
+//
+// Plugs in multiple targets with a single bus re-enumeration
+//
+typedef struct _VIGEM_PLUGIN_TARGET_BATCH
+{
+    //
+    // Size of the whole batch including all entries
+    //
+    ULONG Size;
+
+    //
+    // Number of entries following
+    //
+    ULONG Count;
+
+    VIGEM_PLUGIN_TARGET_BATCH_ENTRY Entries[ANYSIZE_ARRAY];
+
+} VIGEM_PLUGIN_TARGET_BATCH, *PVIGEM_PLUGIN_TARGET_BATCH;
+
+#define VIGEM_PLUGIN_TARGET_BATCH_SIZE(_count_) \
+    (FIELD_OFFSET(VIGEM_PLUGIN_TARGET_BATCH, Entries) + (_count_) * sizeof(VIGEM_PLUGIN_TARGET_BATCH_ENTRY))
+
+//
+// Initializes a batch header; the buffer must be VIGEM_PLUGIN_TARGET_BATCH_SIZE(Count) bytes
+//
+VOID FORCEINLINE VIGEM_PLUGIN_TARGET_BATCH_INIT(
+    PVIGEM_PLUGIN_TARGET_BATCH Batch,
+    ULONG Count
+)
+{
+    RtlZeroMemory(Batch, VIGEM_PLUGIN_TARGET_BATCH_SIZE(Count));
+
+    Batch->Size = (ULONG)VIGEM_PLUGIN_TARGET_BATCH_SIZE(Count);
+    Batch->Count = Count;
+}
+
+#pragma endregion
+
+#pragma region Polling profiles
+
+//
+// How often the host is asked to poll the data endpoints of a target
+//
+typedef enum _VIGEM_POLLING_PROFILE
+{
+    //
+    // Intervals of the emulated original device
+    //
+    VigemPollingProfileDefault = 0,
+
+    VigemPollingProfile1ms,
+    VigemPollingProfile2ms,
+    VigemPollingProfile4ms,
+    VigemPollingProfile8ms,
+
+    //
+    // Every high-speed microframe (125us)
+    //
+    VigemPollingProfileMicroframe,
+
+    VigemPollingProfileMax
+
+} VIGEM_POLLING_PROFILE, *PVIGEM_POLLING_PROFILE;
+
+//
+// Extended input buffer of IOCTL_VIGEM_PLUGIN_TARGET.
+//
+// Told apart from VIGEM_PLUGIN_TARGET by Target.Size, which must be
+// sizeof(VIGEM_PLUGIN_TARGET_EX).
+//
+typedef struct _VIGEM_PLUGIN_TARGET_EX
+{
+    VIGEM_PLUGIN_TARGET Target;
+
+    //
+    // Polling profile of the data endpoints
+    //
+    VIGEM_POLLING_PROFILE PollingProfile;
+
+} VIGEM_PLUGIN_TARGET_EX, *PVIGEM_PLUGIN_TARGET_EX;
+
+VOID FORCEINLINE VIGEM_PLUGIN_TARGET_EX_INIT(
+    PVIGEM_PLUGIN_TARGET_EX PlugIn,
+    ULONG SerialNo,
+    VIGEM_TARGET_TYPE TargetType,
+    VIGEM_POLLING_PROFILE PollingProfile
+)
+{
+    RtlZeroMemory(PlugIn, sizeof(VIGEM_PLUGIN_TARGET_EX));
+
+    PlugIn->Target.Size = sizeof(VIGEM_PLUGIN_TARGET_EX);
+    PlugIn->Target.SerialNo = SerialNo;
+    PlugIn->Target.TargetType = TargetType;
+    PlugIn->PollingProfile = PollingProfile;
+}
+
+#pragma endregion
+
+#pragma region Shared input ring
+
+//
+// Number of slots in an input ring, must be a power of two
+//
+#define VIGEM_INPUT_RING_SLOT_COUNT             0x10
+
+//
+// One report written by the feeder
+//
+typedef struct _VIGEM_INPUT_RING_SLOT
+{
+    //
+    // Odd while the producer is writing the slot, even once it's stable
+    //
+    volatile LONG Sequence;
+
+    //
+    // Report matching the target type of the ring owner
+    //
+    VIGEM_ANY_SUBMIT_REPORT Report;
+
+} VIGEM_INPUT_RING_SLOT, *PVIGEM_INPUT_RING_SLOT;
+
+//
+// Single-producer ring shared between a feeder and one target.
+//
+// The feeder keeps IOCTL_VIGEM_MAP_INPUT_RING pending with the ring
+// as its output buffer for as long as the mapping should stay alive.
+// Reports are published by advancing Head; the bus consumes the newest
+// one whenever the host asks for input. The producer never waits, it
+// simply overwrites reports the bus hasn't picked up yet.
+//
+typedef struct _VIGEM_INPUT_RING
+{
+    //
+    // sizeof(struct _VIGEM_INPUT_RING)
+    //
+    ULONG Size;
+
+    //
+    // Serial number of the target this ring feeds
+    //
+    ULONG SerialNo;
+
+    //
+    // Number of reports published by the producer
+    //
+    volatile LONG Head;
+
+    //
+    // Number of reports consumed by the bus (informational)
+    //
+    volatile LONG Tail;
+
+    //
+    // Set by the bus if the host is waiting for a report and the ring was
+    // empty; the first producer to clear it has to send
+    // IOCTL_VIGEM_INPUT_RING_DOORBELL then
+    //
+    volatile LONG ConsumerWaiting;
+
+    ULONG Reserved;
+
+    VIGEM_INPUT_RING_SLOT Slots[VIGEM_INPUT_RING_SLOT_COUNT];
+
+} VIGEM_INPUT_RING, *PVIGEM_INPUT_RING;
+
+//
+// Input buffer of IOCTL_VIGEM_MAP_INPUT_RING
+//
+typedef struct _VIGEM_MAP_INPUT_RING
+{
+    //
+    // sizeof(struct _VIGEM_MAP_INPUT_RING)
+    //
+    ULONG Size;
+
+    //
+    // Serial number of the target the ring feeds
+    //
+    ULONG SerialNo;
+
+} VIGEM_MAP_INPUT_RING, *PVIGEM_MAP_INPUT_RING;
+
+//
+// Input buffer of IOCTL_VIGEM_INPUT_RING_DOORBELL
+//
+typedef struct _VIGEM_INPUT_RING_DOORBELL
+{
+    //
+    // sizeof(struct _VIGEM_INPUT_RING_DOORBELL)
+    //
+    ULONG Size;
+
+    //
+    // Serial number of the target the ring feeds
+    //
+    ULONG SerialNo;
+
+} VIGEM_INPUT_RING_DOORBELL, *PVIGEM_INPUT_RING_DOORBELL;
+
+VOID FORCEINLINE VIGEM_INPUT_RING_INIT(
+    PVIGEM_INPUT_RING Ring,
+    ULONG SerialNo
+)
+{
+    RtlZeroMemory(Ring, sizeof(VIGEM_INPUT_RING));
+
+    Ring->Size = sizeof(VIGEM_INPUT_RING);
+    Ring->SerialNo = SerialNo;
+}
+
+VOID FORCEINLINE VIGEM_MAP_INPUT_RING_INIT(
+    PVIGEM_MAP_INPUT_RING Map,
+    ULONG SerialNo
+)
+{
+    RtlZeroMemory(Map, sizeof(VIGEM_MAP_INPUT_RING));
+
+    Map->Size = sizeof(VIGEM_MAP_INPUT_RING);
+    Map->SerialNo = SerialNo;
+}
+
+VOID FORCEINLINE VIGEM_INPUT_RING_DOORBELL_INIT(
+    PVIGEM_INPUT_RING_DOORBELL Doorbell,
+    ULONG SerialNo
+)
+{
+    RtlZeroMemory(Doorbell, sizeof(VIGEM_INPUT_RING_DOORBELL));
+
+    Doorbell->Size = sizeof(VIGEM_INPUT_RING_DOORBELL);
+    Doorbell->SerialNo = SerialNo;
+}
+
+//
+// Publishes a report (producer side). Returns TRUE if the bus asked for
+// a doorbell because the host is already waiting for input; only the
+// first push after the request gets told.
+//
+BOOLEAN FORCEINLINE VIGEM_INPUT_RING_PUSH(
+    PVIGEM_INPUT_RING Ring,
+    CONST VOID* Report,
+    ULONG Length
+)
+{
+    LONG head = Ring->Head;
+    PVIGEM_INPUT_RING_SLOT slot = &Ring->Slots[head & (VIGEM_INPUT_RING_SLOT_COUNT - 1)];
+
+    if (Length > sizeof(VIGEM_ANY_SUBMIT_REPORT))
+        return FALSE;
+
+    // Mark slot as being written
+    InterlockedIncrement(&slot->Sequence);
+
+    RtlCopyMemory(&slot->Report, Report, Length);
+
+    // Mark slot as stable again
+    InterlockedIncrement(&slot->Sequence);
+
+    // Publish
+    InterlockedExchange(&Ring->Head, (LONG)((ULONG)head + 1));
+
+    return (InterlockedExchange(&Ring->ConsumerWaiting, 0) != 0);
+}
+
+//
+// Takes the newest published report (bus side). Tail is the consumer's
+// private count of consumed reports, the one in the ring is informational.
+//
+// Returns FALSE if nothing got published since, in which case a doorbell
+// is requested, or if the producer kept overwriting the slot for Attempts
+// reads in a row.
+//
+BOOLEAN FORCEINLINE VIGEM_INPUT_RING_TAKE_LATEST(
+    PVIGEM_INPUT_RING Ring,
+    LONG* Tail,
+    PVIGEM_ANY_SUBMIT_REPORT Report,
+    ULONG Attempts
+)
+{
+    PVIGEM_INPUT_RING_SLOT slot;
+    LONG head;
+    LONG sequence;
+
+    while (Attempts-- > 0)
+    {
+        head = Ring->Head;
+
+        if (head == *Tail)
+        {
+            // Ask for a doorbell and look again so a report published meanwhile doesn't get missed
+            InterlockedExchange(&Ring->ConsumerWaiting, 1);
+
+            head = Ring->Head;
+
+            if (head == *Tail)
+                return FALSE;
+        }
+
+        slot = &Ring->Slots[(ULONG)(head - 1) & (VIGEM_INPUT_RING_SLOT_COUNT - 1)];
+
+        sequence = slot->Sequence;
+        MemoryBarrier();
+
+        // Producer is currently writing this slot
+        if (sequence & 1)
+            continue;
+
+        RtlCopyMemory(Report, &slot->Report, sizeof(VIGEM_ANY_SUBMIT_REPORT));
+        MemoryBarrier();
+
+        // Slot got overwritten while copying, retry with the newer one
+        if (slot->Sequence != sequence)
+            continue;
+
+        *Tail = head;
+        Ring->Tail = head;
+        InterlockedExchange(&Ring->ConsumerWaiting, 0);
+
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+#pragma endregion
+
+#pragma region Statistics
+
+//
+// Number of latency buckets per entry. Bucket 0 counts calls finishing
+// within a microsecond, bucket N those taking [2^(N-1), 2^N) microseconds;
+// the last bucket also holds everything slower.
+//
+#define VIGEM_STATISTICS_BUCKET_COUNT           0x18
+
+//
+// Maximum number of entries returned by IOCTL_VIGEM_GET_STATISTICS
+//
+#define VIGEM_STATISTICS_MAX_ENTRIES            0x80
+
+//
+// Entry describes an I/O control code sent to the bus
+//
+#define VIGEM_STATISTICS_TYPE_IOCTL             0x01
+
+//
+// Entry describes a URB function sent to a child device
+//
+#define VIGEM_STATISTICS_TYPE_URB               0x02
+
+//
+// Entry counts reports of a target type (Code) which differed from the
+// previous one and got forwarded to the host; only Count is used
+//
+#define VIGEM_STATISTICS_TYPE_REPORTS_FORWARDED 0x03
+
+//
+// Entry counts reports of a target type (Code) which got dropped for being
+// equal to the previous one; only Count is used
+//
+#define VIGEM_STATISTICS_TYPE_REPORTS_SUPPRESSED \
+                                                0x04
+
+//
+// Call count and latency histogram of one IOCTL or URB function.
+//
+// Latency is the time spent in the dispatch routine; requests left
+// pending are measured up to the point where they got queued.
+//
+typedef struct _VIGEM_STATISTICS_ENTRY
+{
+    //
+    // VIGEM_STATISTICS_TYPE_*
+    //
+    ULONG Type;
+
+    //
+    // I/O control code or URB function
+    //
+    ULONG Code;
+
+    //
+    // Number of calls
+    //
+    ULONG64 Count;
+
+    //
+    // Sum of all latencies in microseconds
+    //
+    ULONG64 TotalMicroseconds;
+
+    //
+    // Highest latency seen in microseconds
+    //
+    ULONG64 MaxMicroseconds;
+
+    //
+    // Log2-bucketed latency histogram
+    //
+    ULONG64 Buckets[VIGEM_STATISTICS_BUCKET_COUNT];
+
+} VIGEM_STATISTICS_ENTRY, *PVIGEM_STATISTICS_ENTRY;
+
+//
+// Input buffer of IOCTL_VIGEM_GET_STATISTICS
+//
+typedef struct _VIGEM_GET_STATISTICS
+{
+    //
+    // sizeof(struct _VIGEM_GET_STATISTICS)
+    //
+    ULONG Size;
+
+} VIGEM_GET_STATISTICS, *PVIGEM_GET_STATISTICS;
+
+//
+// Output buffer of IOCTL_VIGEM_GET_STATISTICS
+//
+typedef struct _VIGEM_STATISTICS
+{
+    //
+    // sizeof(struct _VIGEM_STATISTICS)
+    //
+    ULONG Size;
+
+    //
+    // Number of valid entries
+    //
+    ULONG Count;
+
+    VIGEM_STATISTICS_ENTRY Entries[VIGEM_STATISTICS_MAX_ENTRIES];
+
+} VIGEM_STATISTICS, *PVIGEM_STATISTICS;
+
+VOID FORCEINLINE VIGEM_GET_STATISTICS_INIT(
+    PVIGEM_GET_STATISTICS GetStatistics
+)
+{
+    RtlZeroMemory(GetStatistics, sizeof(VIGEM_GET_STATISTICS));
+
+    GetStatistics->Size = sizeof(VIGEM_GET_STATISTICS);
+}
+
+#pragma endregion
+
+#pragma region Session notifications
+
+//
+// Maximum number of updates returned by one session notification
+//
+#define VIGEM_SESSION_NOTIFICATION_MAX_ENTRIES  0x10
+
+//
+// Holds any of the notification structures
+//
+typedef union _VIGEM_ANY_REQUEST_NOTIFICATION
+{
+    //
+    // Common head of all *_REQUEST_NOTIFICATION structures
+    //
+    struct
+    {
+        ULONG Size;
+        ULONG SerialNo;
+    } Header;
+
+    XUSB_REQUEST_NOTIFICATION Xusb;
+    NSWITCH_REQUEST_NOTIFICATION NintSwitch;
+
+} VIGEM_ANY_REQUEST_NOTIFICATION, *PVIGEM_ANY_REQUEST_NOTIFICATION;
+
+//
+// Input buffer of IOCTL_VIGEM_REQUEST_SESSION_NOTIFICATION
+//
+typedef struct _VIGEM_REQUEST_SESSION_NOTIFICATION
+{
+    //
+    // sizeof(struct _VIGEM_REQUEST_SESSION_NOTIFICATION)
+    //
+    ULONG Size;
+
+} VIGEM_REQUEST_SESSION_NOTIFICATION, *PVIGEM_REQUEST_SESSION_NOTIFICATION;
+
+//
+// Output buffer of IOCTL_VIGEM_REQUEST_SESSION_NOTIFICATION.
+//
+// Completes as soon as any target plugged in through the same handle
+// received new output data (rumble, LED or output report). Holds one
+// entry per target that changed since the last notification; the
+// header identifies the target, the entry type follows its SerialNo.
+//
+typedef struct _VIGEM_SESSION_NOTIFICATION
+{
+    //
+    // sizeof(struct _VIGEM_SESSION_NOTIFICATION)
+    //
+    ULONG Size;
+
+    //
+    // Number of valid entries
+    //
+    ULONG Count;
+
+    VIGEM_ANY_REQUEST_NOTIFICATION Entries[VIGEM_SESSION_NOTIFICATION_MAX_ENTRIES];
+
+} VIGEM_SESSION_NOTIFICATION, *PVIGEM_SESSION_NOTIFICATION;
+
+VOID FORCEINLINE VIGEM_REQUEST_SESSION_NOTIFICATION_INIT(
+    PVIGEM_REQUEST_SESSION_NOTIFICATION Request
+)
+{
+    RtlZeroMemory(Request, sizeof(VIGEM_REQUEST_SESSION_NOTIFICATION));
+
+    Request->Size = sizeof(VIGEM_REQUEST_SESSION_NOTIFICATION);
+}
+
+#pragma endregion
+
+#pragma region Output events
+
+//
+// Maximum payload of one output event, the largest host output packet
+//
+#define VIGEM_OUTPUT_EVENT_DATA_SIZE        0x40
+
+//
+// Maximum number of events returned by one request
+//
+#define VIGEM_OUTPUT_EVENTS_MAX_ENTRIES     0x10
+
+//
+// Output data (rumble, LED, output report, ...) sent by the host to a target
+//
+typedef struct _VIGEM_OUTPUT_EVENT
+{
+    //
+    // Increments by one per event of the target, starting at 1; gaps
+    // indicate events which got overwritten before being fetched
+    //
+    ULONG Sequence;
+
+    //
+    // Number of valid bytes in Data
+    //
+    ULONG Length;
+
+    //
+    // System interrupt time the host sent the data at, in 100ns units
+    //
+    ULONGLONG Timestamp;
+
+    //
+    // Packet as sent by the host, its layout depends on the target type
+    //
+    UCHAR Data[VIGEM_OUTPUT_EVENT_DATA_SIZE];
+
+} VIGEM_OUTPUT_EVENT, *PVIGEM_OUTPUT_EVENT;
+
+//
+// Input buffer of IOCTL_VIGEM_REQUEST_OUTPUT_EVENTS
+//
+typedef struct _VIGEM_REQUEST_OUTPUT_EVENTS
+{
+    //
+    // sizeof(struct _VIGEM_REQUEST_OUTPUT_EVENTS)
+    //
+    ULONG Size;
+
+    //
+    // Serial number of the target to fetch the events of
+    //
+    ULONG SerialNo;
+
+} VIGEM_REQUEST_OUTPUT_EVENTS, *PVIGEM_REQUEST_OUTPUT_EVENTS;
+
+//
+// Output buffer of IOCTL_VIGEM_REQUEST_OUTPUT_EVENTS.
+//
+// The bus buffers the output events of every target in a small ring.
+// The request returns the buffered events oldest first, or stays pending
+// until the host sends the next one. Once the ring is full the oldest
+// event gets overwritten.
+//
+typedef struct _VIGEM_OUTPUT_EVENTS
+{
+    //
+    // sizeof(struct _VIGEM_OUTPUT_EVENTS)
+    //
+    ULONG Size;
+
+    //
+    // Serial number of the target the events belong to
+    //
+    ULONG SerialNo;
+
+    //
+    // Number of valid entries
+    //
+    ULONG Count;
+
+    //
+    // Total number of events of the target overwritten before being fetched
+    //
+    ULONG Dropped;
+
+    VIGEM_OUTPUT_EVENT Events[VIGEM_OUTPUT_EVENTS_MAX_ENTRIES];
+
+} VIGEM_OUTPUT_EVENTS, *PVIGEM_OUTPUT_EVENTS;
+
+VOID FORCEINLINE VIGEM_REQUEST_OUTPUT_EVENTS_INIT(
+    PVIGEM_REQUEST_OUTPUT_EVENTS Request,
+    ULONG SerialNo
+)
+{
+    RtlZeroMemory(Request, sizeof(VIGEM_REQUEST_OUTPUT_EVENTS));
+
+    Request->Size = sizeof(VIGEM_REQUEST_OUTPUT_EVENTS);
+    Request->SerialNo = SerialNo;
+}
+
+#pragma endregion
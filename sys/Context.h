@@ -1,6 +1,6 @@
 /*
 * Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
-* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
 *
 * This program is free software: you can redistribute it and/or modify
 * it under the terms of the GNU General Public License as published by
@@ -61,6 +61,11 @@ typedef struct _PDO_IDENTIFICATION_DESCRIPTION
     // 
     LONG SessionId;
 
+    //
+    // Polling profile of the data endpoints
+    // 
+    VIGEM_POLLING_PROFILE PollingProfile;
+
 } PDO_IDENTIFICATION_DESCRIPTION, *PPDO_IDENTIFICATION_DESCRIPTION;
 
 //
@@ -93,6 +98,11 @@ typedef struct _PDO_DEVICE_DATA
     // 
     USHORT ProductId;
 
+    //
+    // Polling profile of the data endpoints
+    // 
+    VIGEM_POLLING_PROFILE PollingProfile;
+
     //
     // Interface for PDO to FDO communication
     // 
@@ -108,6 +118,92 @@ typedef struct _PDO_DEVICE_DATA
     //
     WDFQUEUE PendingNotificationRequests;
 
+    //
+    // Queue holding the request which keeps the shared input ring mapped
+    //
+    WDFQUEUE PendingInputRingRequests;
+
+    //
+    // Queue buffering output events and holding the requests waiting for them
+    //
+    WDFQUEUE PendingOutputEventRequests;
+
+    //
+    // SessionId of the file handle which plugged in this PDO
+    //
+    LONG SessionId;
+
+    //
+    // TRUE if output data changed since the last session notification
+    //
+    BOOLEAN SessionNotificationPending;
+
+    //
+    // Entry in the pending list of the owning session while
+    // SessionNotificationPending is set
+    //
+    LIST_ENTRY SessionNotificationLink;
+
+    //
+    // Owning session, NULL for driver-owned children or if the handle was
+    // closed before; holds a reference on its file object
+    //
+    struct _FDO_FILE_DATA* Session;
+
+    //
+    // Notification callback of a kernel-mode feeder, protected by
+    // NotificationCallbackLock
+    //
+    PVIGEM_BUS_NOTIFICATION_CALLBACK NotificationCallback;
+
+    //
+    // Context passed to NotificationCallback
+    //
+    PVOID NotificationCallbackContext;
+
+    //
+    // Protects the notification callback fields, only held to take a
+    // snapshot of them
+    //
+    KSPIN_LOCK NotificationCallbackLock;
+
+    //
+    // Held across every invocation of NotificationCallback, run down
+    // when a callback gets replaced or the PDO goes away
+    //
+    EX_RUNDOWN_REF NotificationCallbackRundown;
+
+    //
+    // Serializes run-downs of NotificationCallbackRundown
+    //
+    FAST_MUTEX NotificationCallbackMutex;
+
+    //
+    // Protects the mailbox fields below
+    //
+    WDFSPINLOCK MailboxLock;
+
+    //
+    // Latest report submitted by the feeder
+    //
+    VIGEM_ANY_SUBMIT_REPORT Mailbox;
+
+    //
+    // TRUE if Mailbox hasn't been sent to the host yet
+    //
+    BOOLEAN MailboxDirty;
+
+    //
+    // Sequence lock over the report cached in the target context, only
+    // written with MailboxLock held
+    //
+    volatile LONG ReportSequence;
+
+    //
+    // Links this PDO into the serial lookup table of the bus
+    //
+    PDO_TABLE_ENTRY TableEntry;
+
 } PDO_DEVICE_DATA, *PPDO_DEVICE_DATA;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(PDO_DEVICE_DATA, PdoGetData)
@@ -128,24 +224,87 @@ typedef struct _FDO_DEVICE_DATA
     LONG NextSessionId;
 
     //
-    // Collection holding pending plugin requests
+    // Sequential queue for requests altering the child list; plugin requests
+    // stay on it until their children got added
     // 
-    WDFCOLLECTION PendingPluginRequests;
+    WDFQUEUE PnpRequests;
 
     //
-    // Sync lock for pending request collection
+    // Queue holding plugin requests until the PDO reported its stage result
     // 
-    WDFSPINLOCK PendingPluginRequestsLock;
+    WDFQUEUE PendingPluginRequests;
 
     //
-    // Periodic timer sweeping up orphaned requests
+    // Looks up pending plugin requests by serial number and deadline
+    // 
+    PLUGIN_REGISTRY PluginRegistry;
+
+    //
+    // One-shot timer armed for the earliest plugin request deadline,
+    // completes the requests whose stage results didn't show up in time
     // 
     WDFTIMER PendingPluginRequestsCleanupTimer;
 
+    //
+    // Shared tick re-delivering input reports to the children
+    // 
+    PACER Pacer;
+
+    //
+    // Persisted MAC addresses of the Switch targets
+    // 
+    MAC_CACHE MacAddresses;
+
+    //
+    // Switch targets answer the handshake and standard subcommands in-driver
+    // 
+    BOOLEAN NintSwitchResponder;
+
+    //
+    // XUSB targets skip the status-only boot steps
+    // 
+    BOOLEAN XusbFastBoot;
+
+    //
+    // Per-processor IOCTL and URB latency statistics
+    // 
+    STATS_DATA Statistics;
+
+    //
+    // Serial number to PDO lookup table
+    // 
+    PDO_TABLE Pdos;
+
+    //
+    // Serial numbers in use, hands out free ones on request
+    // 
+    SERIAL_POOL Serials;
+
+    //
+    // Sync lock pairing session notifications with PDO updates
+    // 
+    WDFSPINLOCK SessionNotificationLock;
+
+    //
+    // Open file handles, protected by the session notification lock
+    // 
+    LIST_ENTRY Sessions;
+
 } FDO_DEVICE_DATA, *PFDO_DEVICE_DATA;
 
 #define FDO_FIRST_SESSION_ID 100
 
+//
+// Session of kernel-mode feeders calling through the bus interface,
+// they may access every child
+//
+#define FDO_INTERFACE_SESSION_ID 0
+
+//
+// Session of requests without file object, owns no child
+//
+#define FDO_INVALID_SESSION_ID (-1)
+
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FDO_DEVICE_DATA, FdoGetData)
 
 // 
@@ -158,31 +317,119 @@ typedef struct _FDO_FILE_DATA
     // 
     LONG SessionId;
 
+    //
+    // Serials of the children plugged in through this handle
+    // 
+    SESSION_SERIALS OwnedSerials;
+
+    //
+    // Entry in the list of open sessions of the bus
+    // 
+    LIST_ENTRY SessionLink;
+
+    //
+    // Children with updates not yet reported to this session
+    // 
+    LIST_ENTRY PendingNotifications;
+
+    //
+    // Session notification requests of this handle, NULL once it's closed
+    // 
+    WDFQUEUE PendingNotificationRequests;
+
 } FDO_FILE_DATA, *PFDO_FILE_DATA;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FDO_FILE_DATA, FileObjectGetData)
 
+//
+// Target of a batch plugin request
+// 
+typedef struct _FDO_PLUGIN_BATCH_ENTRY
+{
+    //
+    // Child description, copied since the request buffer may go away
+    // 
+    PDO_IDENTIFICATION_DESCRIPTION Description;
+
+    //
+    // STATUS_PENDING until the stage result arrived
+    // 
+    volatile LONG Status;
+
+    //
+    // TRUE if the serial got taken from the allocator for this entry
+    // 
+    BOOLEAN OwnsSerial;
+
+    //
+    // Registry key waiting for the stage result of this entry
+    // 
+    PLUGIN_REGISTRY_KEY Key;
+
+} FDO_PLUGIN_BATCH_ENTRY, *PFDO_PLUGIN_BATCH_ENTRY;
+
+//
+// Owner of a plugin request, see Bus_ParkPluginRequest
+// 
+#define PLUGIN_REQUEST_DISPATCHING 0
+#define PLUGIN_REQUEST_PARKED 1
+#define PLUGIN_REQUEST_CLAIMED 2
+
 //
 // Context data for plugin requests
 // 
 typedef struct _FDO_PLUGIN_REQUEST_DATA
 {
     //
-    // Unique serial number of the device on the bus
+    // Registry key of a single plugin request, holds the serial number of the device
     // 
-    ULONG Serial;
+    PLUGIN_REGISTRY_KEY Key;
 
     //
-    // High resolution timestamp taken when this request got moved to pending state
+    // Interrupt time after which the request gets completed regardless of
+    // the stage results, orders the request in the deadline heap of the registry
     // 
-    LARGE_INTEGER Timestamp;
+    DEADLINE_HEAP_NODE DeadlineNode;
 
     //
-    // Performance counter system frequency taken upon fetching timestamp
+    // TRUE while the request is in the registry
     // 
-    LARGE_INTEGER Frequency;
+    BOOLEAN Registered;
+
+    //
+    // TRUE once the request got removed from the registry for good
+    // 
+    BOOLEAN Closed;
+
+    //
+    // PLUGIN_REQUEST_DISPATCHING while the PnP queue still owns the request
+    // 
+    volatile LONG Owner;
+
+    //
+    // Status to complete the request with if it got claimed while dispatching
+    // 
+    NTSTATUS ClaimStatus;
+
+    //
+    // Number of elements in BatchEntries, zero for a single plugin request
+    // 
+    ULONG BatchCount;
+
+    //
+    // Number of batch entries still waiting for their stage result, protected by the registry lock
+    // 
+    LONG BatchRemaining;
+
+    //
+    // Targets of a batch plugin request, the context gets enlarged to hold them
+    // 
+    FDO_PLUGIN_BATCH_ENTRY BatchEntries[ANYSIZE_ARRAY];
 
 } FDO_PLUGIN_REQUEST_DATA, *PFDO_PLUGIN_REQUEST_DATA;
 
+#define FDO_PLUGIN_REQUEST_DATA_SIZE(_count_) \
+    (FIELD_OFFSET(FDO_PLUGIN_REQUEST_DATA, BatchEntries) + (_count_) * sizeof(FDO_PLUGIN_BATCH_ENTRY))
+
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FDO_PLUGIN_REQUEST_DATA, PluginRequestGetData)
 
@@ -0,0 +1,119 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#endif
+
+#include "DeadlineHeap.h"
+
+
+static VOID DeadlineHeap_Set(PDEADLINE_HEAP Heap, ULONG Index, PDEADLINE_HEAP_NODE Node)
+{
+    Heap->Nodes[Index] = Node;
+    Node->Index = Index;
+}
+
+//
+// Restores the heap order for the node at Index.
+//
+static VOID DeadlineHeap_Fix(PDEADLINE_HEAP Heap, ULONG Index)
+{
+    PDEADLINE_HEAP_NODE node = Heap->Nodes[Index];
+    ULONG parent;
+    ULONG child;
+
+    while (Index > 0)
+    {
+        parent = (Index - 1) / 2;
+
+        if (Heap->Nodes[parent]->Deadline <= node->Deadline)
+        {
+            break;
+        }
+
+        DeadlineHeap_Set(Heap, Index, Heap->Nodes[parent]);
+        Index = parent;
+    }
+
+    for (;;)
+    {
+        child = Index * 2 + 1;
+
+        if (child >= Heap->Count)
+        {
+            break;
+        }
+
+        if (child + 1 < Heap->Count
+            && Heap->Nodes[child + 1]->Deadline < Heap->Nodes[child]->Deadline)
+        {
+            child++;
+        }
+
+        if (node->Deadline <= Heap->Nodes[child]->Deadline)
+        {
+            break;
+        }
+
+        DeadlineHeap_Set(Heap, Index, Heap->Nodes[child]);
+        Index = child;
+    }
+
+    DeadlineHeap_Set(Heap, Index, node);
+}
+
+VOID DeadlineHeap_Initialize(PDEADLINE_HEAP Heap)
+{
+    RtlZeroMemory(Heap, sizeof(DEADLINE_HEAP));
+}
+
+//
+// Adds a node with its deadline set, FALSE if the heap is full.
+//
+BOOLEAN DeadlineHeap_Insert(PDEADLINE_HEAP Heap, PDEADLINE_HEAP_NODE Node)
+{
+    if (Heap->Count == DEADLINE_HEAP_MAX_NODES)
+    {
+        return FALSE;
+    }
+
+    DeadlineHeap_Set(Heap, Heap->Count++, Node);
+    DeadlineHeap_Fix(Heap, Node->Index);
+
+    return TRUE;
+}
+
+//
+// Takes an inserted node out of the heap.
+//
+VOID DeadlineHeap_Remove(PDEADLINE_HEAP Heap, PDEADLINE_HEAP_NODE Node)
+{
+    ULONG index = Node->Index;
+
+    if (--Heap->Count != index)
+    {
+        DeadlineHeap_Set(Heap, index, Heap->Nodes[Heap->Count]);
+        DeadlineHeap_Fix(Heap, index);
+    }
+
+    Heap->Nodes[Heap->Count] = NULL;
+}
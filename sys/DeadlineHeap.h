@@ -0,0 +1,69 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+#pragma once
+
+//
+// Most nodes a heap can hold
+//
+#define DEADLINE_HEAP_MAX_NODES         0x400
+
+//
+// Orders an object by deadline, embedded in the object.
+//
+typedef struct _DEADLINE_HEAP_NODE
+{
+    //
+    // Interrupt time the owner expires at
+    //
+    ULONGLONG Deadline;
+
+    //
+    // Position in the heap while inserted
+    //
+    ULONG Index;
+
+} DEADLINE_HEAP_NODE, *PDEADLINE_HEAP_NODE;
+
+//
+// Binary min-heap of nodes ordered by deadline.
+//
+// Framework-free and not synchronized, the owner has to lock around it.
+//
+typedef struct _DEADLINE_HEAP
+{
+    PDEADLINE_HEAP_NODE Nodes[DEADLINE_HEAP_MAX_NODES];
+
+    //
+    // Nodes in use
+    //
+    ULONG Count;
+
+} DEADLINE_HEAP, *PDEADLINE_HEAP;
+
+//
+// Node with the earliest deadline, NULL if the heap is empty
+//
+#define DEADLINE_HEAP_PEEK(_heap_)      (((_heap_)->Count > 0) ? (_heap_)->Nodes[0] : NULL)
+
+VOID DeadlineHeap_Initialize(PDEADLINE_HEAP Heap);
+BOOLEAN DeadlineHeap_Insert(PDEADLINE_HEAP Heap, PDEADLINE_HEAP_NODE Node);
+VOID DeadlineHeap_Remove(PDEADLINE_HEAP Heap, PDEADLINE_HEAP_NODE Node);
@@ -1,6 +1,6 @@
 /*
 * Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
-* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
 *
 * This program is free software: you can redistribute it and/or modify
 * it under the terms of the GNU General Public License as published by
@@ -27,6 +27,7 @@
 #pragma alloc_text (PAGE, Bus_DeviceFileCreate)
 #pragma alloc_text (PAGE, Bus_FileClose)
 #pragma alloc_text (PAGE, Bus_EvtDriverContextCleanup)
+#pragma alloc_text (PAGE, Bus_EvtDeviceContextCleanup)
 #pragma alloc_text (PAGE, Bus_PdoStageResult)
 #endif
 
@@ -92,6 +93,13 @@ NTSTATUS Bus_EvtDeviceAdd(IN WDFDRIVER Driver, IN PWDFDEVICE_INIT DeviceInit)
     VIGEM_BUS_INTERFACE         busInterface;
     PINTERFACE                  interfaceHeader;
     WDF_TIMER_CONFIG            reqTimerCfg;
+    WDFKEY                      keyParams;
+    ULONG                       pacerProcessor = PACER_ANY_PROCESSOR;
+    DECLARE_CONST_UNICODE_STRING(pacerProcessorName, L"PacerProcessor");
+    ULONG                       nintSwitchResponder = 0;
+    DECLARE_CONST_UNICODE_STRING(nintSwitchResponderName, L"NintSwitchResponder");
+    ULONG                       xusbFastBoot = 0;
+    DECLARE_CONST_UNICODE_STRING(xusbFastBootName, L"XusbFastBoot");
 
     UNREFERENCED_PARAMETER(Driver);
 
@@ -128,6 +136,7 @@ NTSTATUS Bus_EvtDeviceAdd(IN WDFDRIVER Driver, IN PWDFDEVICE_INIT DeviceInit)
 #pragma region Create FDO
 
     WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&fdoAttributes, FDO_DEVICE_DATA);
+    fdoAttributes.EvtCleanupCallback = Bus_EvtDeviceContextCleanup;
 
     status = WdfDeviceCreate(&DeviceInit, &fdoAttributes, &device);
 
@@ -152,44 +161,138 @@ NTSTATUS Bus_EvtDeviceAdd(IN WDFDRIVER Driver, IN PWDFDEVICE_INIT DeviceInit)
     pFDOData->InterfaceReferenceCounter = 0;
     pFDOData->NextSessionId = FDO_FIRST_SESSION_ID;
 
+    InitializeListHead(&pFDOData->Sessions);
+
+    PdoTable_Initialize(&pFDOData->Pdos);
+    SerialPool_Initialize(&pFDOData->Serials);
+    PluginRegistry_Initialize(&pFDOData->PluginRegistry);
+
+    //
+    // Optionally keep the pacing tick on a fixed processor, answer Switch
+    // subcommands in-driver and shorten the XUSB boot; read once to keep
+    // plug-in off the registry
+    // 
+    status = WdfDriverOpenParametersRegistryKey(WdfGetDriver(), KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &keyParams);
+    if (NT_SUCCESS(status))
+    {
+        if (!NT_SUCCESS(WdfRegistryQueryULong(keyParams, &pacerProcessorName, &pacerProcessor)))
+        {
+            pacerProcessor = PACER_ANY_PROCESSOR;
+        }
+
+        if (!NT_SUCCESS(WdfRegistryQueryULong(keyParams, &nintSwitchResponderName, &nintSwitchResponder)))
+        {
+            nintSwitchResponder = 0;
+        }
+
+        if (!NT_SUCCESS(WdfRegistryQueryULong(keyParams, &xusbFastBootName, &xusbFastBoot)))
+        {
+            xusbFastBoot = 0;
+        }
+
+        WdfRegistryClose(keyParams);
+    }
+
+    pFDOData->NintSwitchResponder = (nintSwitchResponder != 0);
+    pFDOData->XusbFastBoot = (xusbFastBoot != 0);
+
+    Pacer_Initialize(&pFDOData->Pacer, pacerProcessor);
+
 #pragma endregion
 
-#pragma region Create pending requests collection & lock
+#pragma region Create statistics slots
 
-    WDF_OBJECT_ATTRIBUTES_INIT(&collectionAttributes);
-    collectionAttributes.ParentObject = device;
+    status = Stats_Initialize(device, &pFDOData->Statistics);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_DRIVER,
+            "Stats_Initialize failed with status %!STATUS!",
+            status);
+        return status;
+    }
+
+#pragma endregion
 
-    status = WdfCollectionCreate(&collectionAttributes, &pFDOData->PendingPluginRequests);
+#pragma region Load persisted MAC addresses
+
+    status = MacCache_Initialize(device, &pFDOData->MacAddresses);
     if (!NT_SUCCESS(status))
     {
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_DRIVER,
-            "WdfCollectionCreate failed with status %!STATUS!",
+            "MacCache_Initialize failed with status %!STATUS!",
             status);
-        return STATUS_UNSUCCESSFUL;
+        return status;
     }
 
+#pragma endregion
+
+#pragma region Create PnP & pending plugin request queues
+
+    //
+    // Plugin and unplug requests get forwarded here by the default queue
+    // so they can't hold up report submissions
+    // 
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchSequential);
+
+    queueConfig.EvtIoDeviceControl = Bus_EvtIoDeviceControl;
+    queueConfig.EvtIoInternalDeviceControl = Bus_EvtIoInternalDeviceControl;
+
+    status = WdfIoQueueCreate(device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &pFDOData->PnpRequests);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_DRIVER,
+            "WdfIoQueueCreate (PnpRequests) failed with status %!STATUS!",
+            status);
+        return status;
+    }
+
+    //
+    // Pending plugin requests are parked here once their children got
+    // added, so the PnP queue can dispatch the next request
+    // 
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+    queueConfig.EvtIoCanceledOnQueue = Bus_EvtPluginRequestCanceledOnQueue;
+
+    status = WdfIoQueueCreate(device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &pFDOData->PendingPluginRequests);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_DRIVER,
+            "WdfIoQueueCreate (PendingPluginRequests) failed with status %!STATUS!",
+            status);
+        return status;
+    }
+
+#pragma endregion
+
+#pragma region Create session notification lock
+
     WDF_OBJECT_ATTRIBUTES_INIT(&collectionAttributes);
     collectionAttributes.ParentObject = device;
 
-    status = WdfSpinLockCreate(&collectionAttributes, &pFDOData->PendingPluginRequestsLock);
+    status = WdfSpinLockCreate(&collectionAttributes, &pFDOData->SessionNotificationLock);
     if (!NT_SUCCESS(status))
     {
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_DRIVER,
             "WdfSpinLockCreate failed with status %!STATUS!",
             status);
-        return STATUS_UNSUCCESSFUL;
+        return status;
     }
 
 #pragma endregion
 
-#pragma region Create timer for sweeping up orphaned requests
+#pragma region Create timer completing expired plugin requests
 
-    WDF_TIMER_CONFIG_INIT_PERIODIC(
+    //
+    // One-shot, armed for the earliest deadline whenever a request gets pending
+    // 
+    WDF_TIMER_CONFIG_INIT(
         &reqTimerCfg,
-        Bus_PlugInRequestCleanUpEvtTimerFunc,
-        ORC_TIMER_START_DELAY
+        Bus_PlugInRequestCleanUpEvtTimerFunc
     );
     WDF_OBJECT_ATTRIBUTES_INIT(&timerAttributes);
     timerAttributes.ParentObject = device;
@@ -225,6 +328,10 @@ NTSTATUS Bus_EvtDeviceAdd(IN WDFDRIVER Driver, IN PWDFDEVICE_INIT DeviceInit)
     interfaceHeader->InterfaceDereference = WdfDeviceInterfaceDereferenceNoOp;
 
     busInterface.BusPdoStageResult = Bus_PdoStageResult;
+    busInterface.PlugIn = Bus_InterfacePlugIn;
+    busInterface.UnPlug = Bus_InterfaceUnPlug;
+    busInterface.SubmitReport = Bus_InterfaceSubmitReport;
+    busInterface.RegisterNotificationCallback = Bus_InterfaceRegisterNotificationCallback;
 
     WDF_QUERY_INTERFACE_CONFIG queryInterfaceConfig;
 
@@ -333,6 +440,8 @@ Bus_DeviceFileCreate(
     }
     else
     {
+        SessionSerials_Initialize(&pFileData->OwnedSerials);
+
         pFDOData = FdoGetData(Device);
         if (pFDOData == NULL)
         {
@@ -343,16 +452,22 @@ Bus_DeviceFileCreate(
         }
         else
         {
-            refCount = InterlockedIncrement(&pFDOData->InterfaceReferenceCounter);
             sessionId = InterlockedIncrement(&pFDOData->NextSessionId);
 
             pFileData->SessionId = sessionId;
-            status = STATUS_SUCCESS;
 
-            TraceEvents(TRACE_LEVEL_INFORMATION,
-                TRACE_DRIVER,
-                "File/session id = %d, device ref. count = %d",
-                (int)sessionId, (int)refCount);
+            // A failed create never sees Bus_FileClose
+            status = Bus_AttachSession(Device, pFileData);
+
+            if (NT_SUCCESS(status))
+            {
+                refCount = InterlockedIncrement(&pFDOData->InterfaceReferenceCounter);
+
+                TraceEvents(TRACE_LEVEL_INFORMATION,
+                    TRACE_DRIVER,
+                    "File/session id = %d, device ref. count = %d",
+                    (int)sessionId, (int)refCount);
+            }
         }
     }
 
@@ -371,12 +486,7 @@ Bus_FileClose(
 )
 {
     WDFDEVICE                      device;
-    WDFDEVICE                      hChild;
-    NTSTATUS                       status;
-    WDFCHILDLIST                   list;
-    WDF_CHILD_LIST_ITERATOR        iterator;
-    WDF_CHILD_RETRIEVE_INFO        childInfo;
-    PDO_IDENTIFICATION_DESCRIPTION description;
+    NTSTATUS                       status = STATUS_SUCCESS;
     PFDO_FILE_DATA                 pFileData = NULL;
     PFDO_DEVICE_DATA               pFDOData = NULL;
     LONG                           refCount = 0;
@@ -415,61 +525,44 @@ Bus_FileClose(
             TRACE_DRIVER,
             "Device ref. count = %d",
             (int)refCount);
+
+        Bus_DetachSession(device, pFileData);
     }
 
-    list = WdfFdoGetDefaultChildList(device);
+    TraceEvents(TRACE_LEVEL_VERBOSE,
+        TRACE_DRIVER,
+        "Session %d owns %d device(s)",
+        (int)pFileData->SessionId,
+        (int)pFileData->OwnedSerials.Count);
 
-    WDF_CHILD_LIST_ITERATOR_INIT(&iterator, WdfRetrievePresentChildren);
+    //
+    // Unplug devices owned by this session; a plugin still in flight
+    // either finished adding its child or sees the handle closed
+    // 
+    SessionSerials_Lock(&pFileData->OwnedSerials);
 
-    WdfChildListBeginIteration(list, &iterator);
+    Bus_UnPlugSessionDevices(device, pFileData, 0);
 
-    for (;;)
-    {
-        WDF_CHILD_RETRIEVE_INFO_INIT(&childInfo, &description.Header);
-        WDF_CHILD_IDENTIFICATION_DESCRIPTION_HEADER_INIT(&description.Header, sizeof(description));
+    SessionSerials_Free(&pFileData->OwnedSerials);
 
-        status = WdfChildListRetrieveNextDevice(list, &iterator, &hChild, &childInfo);
-        if (!NT_SUCCESS(status) || status == STATUS_NO_MORE_ENTRIES)
-        {
-            break;
-        }
+    SessionSerials_Unlock(&pFileData->OwnedSerials);
 
-        TraceEvents(TRACE_LEVEL_VERBOSE,
-            TRACE_DRIVER,
-            "PDO properties: status = %!STATUS!, pdoPID = %d, curPID = %d, pdoSID = %d, curSID = %d, internal = %d",
-            (int)childInfo.Status,
-            (int)description.OwnerProcessId,
-            (int)CURRENT_PROCESS_ID(),
-            (int)description.SessionId,
-            (int)pFileData->SessionId,
-            (int)description.OwnerIsDriver
-        );
-
-        // Only unplug devices with matching session id
-        if (childInfo.Status == WdfChildListRetrieveDeviceSuccess
-            && description.SessionId == pFileData->SessionId
-            && !description.OwnerIsDriver)
-        {
-            TraceEvents(TRACE_LEVEL_INFORMATION,
-                TRACE_DRIVER,
-                "Unplugging device with serial %d",
-                description.SerialNo);
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Exit with status %!STATUS!", status);
+}
 
-            // "Unplug" child
-            status = WdfChildListUpdateChildDescriptionAsMissing(list, &description.Header);
-            if (!NT_SUCCESS(status))
-            {
-                TraceEvents(TRACE_LEVEL_ERROR,
-                    TRACE_DRIVER,
-                    "WdfChildListUpdateChildDescriptionAsMissing failed with status %!STATUS!",
-                    status);
-            }
-        }
-    }
+//
+// Makes sure the pacing tick is gone before the FDO context gets freed.
+// 
+VOID
+Bus_EvtDeviceContextCleanup(
+    _In_ WDFOBJECT Device
+)
+{
+    PAGED_CODE();
 
-    WdfChildListEndIteration(list, &iterator);
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Entry");
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Exit with status %!STATUS!", status);
+    Pacer_Shutdown(&FdoGetData((WDFDEVICE)Device)->Pacer);
 }
 
 VOID
@@ -516,11 +609,8 @@ Bus_PdoStageResult(
     _In_ NTSTATUS Status
 )
 {
-    ULONG               i;
     PFDO_DEVICE_DATA    pFdoData;
-    WDFREQUEST          curRequest;
-    ULONG               curSerial;
-    ULONG               items;
+    WDFREQUEST          request;
 
     UNREFERENCED_PARAMETER(InterfaceHeader);
 
@@ -538,60 +628,72 @@ Bus_PdoStageResult(
     // 
     if (!NT_SUCCESS(Status) || Stage == ViGEmPdoInitFinished)
     {
-        WdfSpinLockAcquire(pFdoData->PendingPluginRequestsLock);
-
-        items = WdfCollectionGetCount(pFdoData->PendingPluginRequests);
-
-        TraceEvents(TRACE_LEVEL_INFORMATION,
-            TRACE_DRIVER,
-            "Items count: %d",
-            items);
+        // Batch requests only come back with the last result
+        request = PluginRegistry_Resolve(&pFdoData->PluginRegistry, Serial, Status);
 
-        for (i = 0; i < items; i++)
+        if (request != NULL)
         {
-            curRequest = WdfCollectionGetItem(pFdoData->PendingPluginRequests, i);
-            curSerial = PluginRequestGetData(curRequest)->Serial;
-
-            TraceEvents(TRACE_LEVEL_INFORMATION,
-                TRACE_DRIVER,
-                "Serial: %d, curSerial: %d",
-                Serial, curSerial);
-
-            if (Serial == curSerial)
+            if (Bus_FinishPluginRequest(pFdoData, request, Status))
             {
-                WdfRequestComplete(curRequest, Status);
-
-                WdfCollectionRemove(pFdoData->PendingPluginRequests, curRequest);
-
                 TraceEvents(TRACE_LEVEL_INFORMATION,
                     TRACE_DRIVER,
                     "Removed item with serial: %d",
-                    curSerial);
-
-                break;
+                    Serial);
             }
+
+            // Reference handed out by the registry
+            WdfObjectDereference(request);
         }
-        WdfSpinLockRelease(pFdoData->PendingPluginRequestsLock);
     }
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Exit");
 }
 
+//
+// Arms the clean-up timer for the earliest pending deadline, if any.
+// 
+// Called after registering a request; deadlines only ever get added
+// later than the pending ones, so re-arming never delays an earlier one.
+// 
+VOID Bus_ArmPluginRequestTimer(PFDO_DEVICE_DATA FdoData)
+{
+    ULONGLONG   deadline;
+    ULONGLONG   now;
+    LONGLONG    dueTime;
+
+    deadline = PluginRegistry_NextDeadline(&FdoData->PluginRegistry);
+
+    if (deadline == 0)
+    {
+        return;
+    }
+
+    now = KeQueryInterruptTime();
+
+    //
+    // Negative for relative due time, fire right away if already expired
+    // 
+    dueTime = (deadline > now) ? -(LONGLONG)(deadline - now) : -1;
+
+    WdfTimerStart(FdoData->PendingPluginRequestsCleanupTimer, dueTime);
+
+    TraceEvents(TRACE_LEVEL_VERBOSE,
+        TRACE_DRIVER,
+        "Armed clean-up timer for %llu ms",
+        (ULONGLONG)(-dueTime) / WDF_ABS_TIMEOUT_IN_MS(1));
+}
+
 _Use_decl_annotations_
 VOID
 Bus_PlugInRequestCleanUpEvtTimerFunc(
     WDFTIMER  Timer
 )
 {
-    ULONG                       i;
     PFDO_DEVICE_DATA            pFdoData;
-    WDFREQUEST                  curRequest;
-    ULONG                       items;
+    WDFREQUEST                  request;
     WDFDEVICE                   device;
-    PFDO_PLUGIN_REQUEST_DATA    pPluginData;
-    LONGLONG                    freq;
-    LARGE_INTEGER               pcNow;
-    LONGLONG                    ellapsed;
+    ULONGLONG                   nextDeadline;
+    ULONG                       expired = 0;
 
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Entry");
@@ -599,55 +701,35 @@ Bus_PlugInRequestCleanUpEvtTimerFunc(
     device = WdfTimerGetParentObject(Timer);
     pFdoData = FdoGetData(device);
 
-    WdfSpinLockAcquire(pFdoData->PendingPluginRequestsLock);
+    //
+    // Complete every request which passed its deadline in one go
+    // 
+    while ((request = PluginRegistry_PopExpired(
+        &pFdoData->PluginRegistry,
+        KeQueryInterruptTime(),
+        &nextDeadline)) != NULL)
+    {
+        if (Bus_FinishPluginRequest(pFdoData, request, STATUS_SUCCESS))
+        {
+            expired++;
+        }
 
-    items = WdfCollectionGetCount(pFdoData->PendingPluginRequests);
+        // Reference handed out by the registry
+        WdfObjectDereference(request);
+    }
 
     TraceEvents(TRACE_LEVEL_INFORMATION,
         TRACE_DRIVER,
-        "Items count: %d",
-        items);
+        "Removed %d expired request(s)",
+        expired);
 
     //
-    // Collection is empty; no need to keep timer running
+    // Nothing pending anymore; the next plugin request arms the timer again
     // 
-    if (items == 0)
+    if (nextDeadline != 0)
     {
-        TraceEvents(TRACE_LEVEL_VERBOSE,
-            TRACE_DRIVER,
-            "Collection is empty, stopping periodic timer");
-        WdfTimerStop(Timer, FALSE);
-    }
-
-    for (i = 0; i < items; i++)
-    {
-        curRequest = WdfCollectionGetItem(pFdoData->PendingPluginRequests, i);
-        pPluginData = PluginRequestGetData(curRequest);
-
-        freq = pPluginData->Frequency.QuadPart / ORC_PC_FREQUENCY_DIVIDER;
-        pcNow = KeQueryPerformanceCounter(NULL);
-        ellapsed = (pcNow.QuadPart - pPluginData->Timestamp.QuadPart) / freq;
-
-        TraceEvents(TRACE_LEVEL_VERBOSE,
-            TRACE_DRIVER,
-            "PDO (serial = %d) plugin request age: %llu ms",
-            pPluginData->Serial, ellapsed);
-
-        if (ellapsed >= ORC_REQUEST_MAX_AGE)
-        {
-            WdfRequestComplete(curRequest, STATUS_SUCCESS);
-
-            WdfCollectionRemove(pFdoData->PendingPluginRequests, curRequest);
-
-            TraceEvents(TRACE_LEVEL_INFORMATION,
-                TRACE_DRIVER,
-                "Removed item with serial: %d",
-                pPluginData->Serial);
-
-            break;
-        }
+        Bus_ArmPluginRequestTimer(pFdoData);
     }
-    WdfSpinLockRelease(pFdoData->PendingPluginRequestsLock);
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Exit");
 }
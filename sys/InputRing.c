@@ -0,0 +1,225 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "busenum.h"
+#include "inputring.tmh"
+
+//
+// Creates the manual queue keeping the mapping request of a ring alive.
+//
+// The queue has to belong to the FDO so the IOCTL can be forwarded to it.
+//
+NTSTATUS InputRing_CreateQueue(WDFDEVICE Device, WDFQUEUE* Queue)
+{
+    NTSTATUS                status;
+    WDF_IO_QUEUE_CONFIG     queueConfig;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+    PINPUT_RING_QUEUE_DATA  pRingData;
+
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+    queueConfig.EvtIoCanceledOnQueue = InputRing_EvtIoCanceledOnQueue;
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, INPUT_RING_QUEUE_DATA);
+
+    status = WdfIoQueueCreate(Device, &queueConfig, &attributes, Queue);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_INPUTRING,
+            "WdfIoQueueCreate failed with status %!STATUS!",
+            status);
+        return status;
+    }
+
+    pRingData = InputRingQueueGetData(*Queue);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = *Queue;
+
+    status = WdfSpinLockCreate(&attributes, &pRingData->Lock);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_INPUTRING,
+            "WdfSpinLockCreate failed with status %!STATUS!",
+            status);
+    }
+
+    return status;
+}
+
+//
+// Maps the ring supplied as output buffer and keeps the request pending.
+//
+NTSTATUS InputRing_Map(WDFQUEUE Queue, WDFREQUEST Request, ULONG SerialNo)
+{
+    NTSTATUS                status;
+    PVIGEM_INPUT_RING       ring = NULL;
+    size_t                  length = 0;
+    PINPUT_RING_QUEUE_DATA  pRingData;
+    BOOLEAN                 busy;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_INPUTRING, "%!FUNC! Entry (serial: %d)", SerialNo);
+
+    //
+    // Maps the locked-down user buffer into system space for as long
+    // as the request stays alive
+    //
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(VIGEM_INPUT_RING), (PVOID)&ring, &length);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_INPUTRING,
+            "WdfRequestRetrieveOutputBuffer failed with status %!STATUS!",
+            status);
+        return status;
+    }
+
+    if (length != sizeof(VIGEM_INPUT_RING) || ring->Size != sizeof(VIGEM_INPUT_RING))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_INPUTRING,
+            "sizeof(VIGEM_INPUT_RING) buffer size mismatch [%d != %d]",
+            (int)sizeof(VIGEM_INPUT_RING), (int)length);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    pRingData = InputRingQueueGetData(Queue);
+
+    WdfSpinLockAcquire(pRingData->Lock);
+
+    busy = (pRingData->Request != NULL);
+
+    if (!busy)
+    {
+        pRingData->Ring = ring;
+        pRingData->Request = Request;
+        pRingData->SerialNo = SerialNo;
+        // Ignore everything published before the mapping
+        pRingData->Tail = ring->Head;
+    }
+
+    WdfSpinLockRelease(pRingData->Lock);
+
+    if (busy)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_INPUTRING,
+            "A ring is already mapped for serial %d",
+            SerialNo);
+        return STATUS_DEVICE_BUSY;
+    }
+
+    InterlockedExchange(&ring->ConsumerWaiting, 0);
+
+    //
+    // The request stays in the queue until it gets cancelled, either by the
+    // feeder closing its handle or by the PDO going away
+    //
+    status = WdfRequestForwardToIoQueue(Request, Queue);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_INPUTRING,
+            "WdfRequestForwardToIoQueue failed with status %!STATUS!",
+            status);
+
+        WdfSpinLockAcquire(pRingData->Lock);
+
+        if (pRingData->Request == Request)
+        {
+            pRingData->Ring = NULL;
+            pRingData->Request = NULL;
+        }
+
+        WdfSpinLockRelease(pRingData->Lock);
+
+        return status;
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_INPUTRING, "%!FUNC! Exit with status %!STATUS!", STATUS_PENDING);
+
+    return STATUS_PENDING;
+}
+
+//
+// Fetches the newest report published since the last call.
+//
+// Returns FALSE if there's none; the producer gets asked for a doorbell then.
+//
+BOOLEAN InputRing_Drain(WDFQUEUE Queue, PVIGEM_ANY_SUBMIT_REPORT Report)
+{
+    PINPUT_RING_QUEUE_DATA  pRingData;
+    BOOLEAN                 found = FALSE;
+
+    if (Queue == NULL)
+    {
+        return FALSE;
+    }
+
+    pRingData = InputRingQueueGetData(Queue);
+
+    WdfSpinLockAcquire(pRingData->Lock);
+
+    if (pRingData->Ring != NULL)
+    {
+        found = VIGEM_INPUT_RING_TAKE_LATEST(pRingData->Ring,
+            &pRingData->Tail,
+            Report,
+            INPUT_RING_MAX_READ_ATTEMPTS);
+    }
+
+    // The ring feeds exactly one target, don't trust the payload
+    if (found)
+    {
+        Report->Header.SerialNo = pRingData->SerialNo;
+    }
+
+    WdfSpinLockRelease(pRingData->Lock);
+
+    return found;
+}
+
+//
+// Unmaps the ring once the request owning the mapping gets cancelled.
+//
+VOID InputRing_EvtIoCanceledOnQueue(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request
+)
+{
+    PINPUT_RING_QUEUE_DATA pRingData = InputRingQueueGetData(Queue);
+
+    WdfSpinLockAcquire(pRingData->Lock);
+
+    if (pRingData->Request == Request)
+    {
+        pRingData->Ring = NULL;
+        pRingData->Request = NULL;
+    }
+
+    WdfSpinLockRelease(pRingData->Lock);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION,
+        TRACE_INPUTRING,
+        "Unmapped ring of serial %d",
+        pRingData->SerialNo);
+
+    WdfRequestComplete(Request, STATUS_CANCELLED);
+}
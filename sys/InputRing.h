@@ -0,0 +1,65 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+//
+// How often a slot is re-read if the producer keeps overwriting it
+//
+#define INPUT_RING_MAX_READ_ATTEMPTS    0x04
+
+//
+// Context of the queue holding the request which keeps a ring mapped.
+//
+typedef struct _INPUT_RING_QUEUE_DATA
+{
+    //
+    // Protects the fields below
+    //
+    WDFSPINLOCK Lock;
+
+    //
+    // System address of the mapped ring, NULL if none is mapped
+    //
+    PVIGEM_INPUT_RING Ring;
+
+    //
+    // Request owning the mapping
+    //
+    WDFREQUEST Request;
+
+    //
+    // Serial number of the target the ring feeds
+    //
+    ULONG SerialNo;
+
+    //
+    // Consumer position, private copy not exposed to the producer
+    //
+    LONG Tail;
+
+} INPUT_RING_QUEUE_DATA, *PINPUT_RING_QUEUE_DATA;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(INPUT_RING_QUEUE_DATA, InputRingQueueGetData)
+
+EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE InputRing_EvtIoCanceledOnQueue;
+
+NTSTATUS InputRing_CreateQueue(WDFDEVICE Device, WDFQUEUE* Queue);
+NTSTATUS InputRing_Map(WDFQUEUE Queue, WDFREQUEST Request, ULONG SerialNo);
+BOOLEAN InputRing_Drain(WDFQUEUE Queue, PVIGEM_ANY_SUBMIT_REPORT Report);
@@ -0,0 +1,409 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include "busenum.h"
+#include "maccache.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, MacCache_Initialize)
+#pragma alloc_text (PAGE, MacCache_EvtWriteBack)
+#endif
+
+//
+// Longest subkey name of a serial number the cache looks at
+// 
+#define MAC_CACHE_MAX_KEY_NAME          0x10
+
+DECLARE_CONST_UNICODE_STRING(G_MacCacheTargetsKey, L"Targets");
+DECLARE_CONST_UNICODE_STRING(G_MacCacheDeviceKey, L"NintendoSwitchPro");
+DECLARE_CONST_UNICODE_STRING(G_MacCacheValueName, L"TargetMacAddress");
+
+//
+// Opens Parameters\Targets\NintendoSwitchPro, creating it on request.
+// 
+static NTSTATUS MacCache_OpenDeviceKey(BOOLEAN Create, WDFKEY* Key)
+{
+    NTSTATUS    status;
+    WDFKEY      keyParams;
+    WDFKEY      keyTargets;
+
+    status = WdfDriverOpenParametersRegistryKey(WdfGetDriver(),
+        Create ? STANDARD_RIGHTS_ALL : KEY_READ,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &keyParams);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    if (Create)
+    {
+        status = WdfRegistryCreateKey(keyParams, &G_MacCacheTargetsKey, KEY_ALL_ACCESS,
+            REG_OPTION_NON_VOLATILE, NULL, WDF_NO_OBJECT_ATTRIBUTES, &keyTargets);
+    }
+    else
+    {
+        status = WdfRegistryOpenKey(keyParams, &G_MacCacheTargetsKey, KEY_READ,
+            WDF_NO_OBJECT_ATTRIBUTES, &keyTargets);
+    }
+
+    WdfRegistryClose(keyParams);
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    if (Create)
+    {
+        status = WdfRegistryCreateKey(keyTargets, &G_MacCacheDeviceKey, KEY_ALL_ACCESS,
+            REG_OPTION_NON_VOLATILE, NULL, WDF_NO_OBJECT_ATTRIBUTES, Key);
+    }
+    else
+    {
+        status = WdfRegistryOpenKey(keyTargets, &G_MacCacheDeviceKey, KEY_READ,
+            WDF_NO_OBJECT_ATTRIBUTES, Key);
+    }
+
+    WdfRegistryClose(keyTargets);
+
+    return status;
+}
+
+//
+// Opens or creates the key of a single serial number.
+// 
+static NTSTATUS MacCache_CreateSerialKey(ULONG SerialNo, WDFKEY* Key)
+{
+    NTSTATUS    status;
+    WDFKEY      keyDevice;
+
+    DECLARE_UNICODE_STRING_SIZE(serialPath, 4);
+
+    status = MacCache_OpenDeviceKey(TRUE, &keyDevice);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    RtlUnicodeStringPrintf(&serialPath, L"%04d", SerialNo);
+
+    status = WdfRegistryCreateKey(keyDevice, &serialPath, KEY_ALL_ACCESS,
+        REG_OPTION_NON_VOLATILE, NULL, WDF_NO_OBJECT_ATTRIBUTES, Key);
+
+    WdfRegistryClose(keyDevice);
+
+    return status;
+}
+
+//
+// Stores the address of a serial number in the registry.
+// 
+static NTSTATUS MacCache_Persist(ULONG SerialNo, PMAC_ADDRESS Address)
+{
+    NTSTATUS    status;
+    WDFKEY      keySerial;
+
+    status = MacCache_CreateSerialKey(SerialNo, &keySerial);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    status = WdfRegistryAssignValue(keySerial, &G_MacCacheValueName, REG_BINARY, sizeof(MAC_ADDRESS), (PVOID)Address);
+
+    WdfRegistryClose(keySerial);
+
+    return status;
+}
+
+//
+// Synchronous lookup of serials outside of the cached range.
+// 
+static NTSTATUS MacCache_ReadThrough(ULONG SerialNo, PMAC_ADDRESS Address)
+{
+    NTSTATUS    status;
+    WDFKEY      keySerial;
+
+    status = MacCache_CreateSerialKey(SerialNo, &keySerial);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_MACCACHE,
+            "MacCache_CreateSerialKey failed with status %!STATUS!",
+            status);
+        return status;
+    }
+
+    status = WdfRegistryQueryValue(keySerial, &G_MacCacheValueName, sizeof(MAC_ADDRESS), Address, NULL, NULL);
+
+    if (status == STATUS_OBJECT_NAME_NOT_FOUND)
+    {
+        GenerateRandomMacAddress(Address);
+
+        status = WdfRegistryAssignValue(keySerial, &G_MacCacheValueName, REG_BINARY, sizeof(MAC_ADDRESS), (PVOID)Address);
+    }
+
+    WdfRegistryClose(keySerial);
+
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_MACCACHE,
+            "Reading through serial %d failed with status %!STATUS!",
+            SerialNo,
+            status);
+    }
+
+    return status;
+}
+
+//
+// Loads every persisted address of the cached range.
+// 
+static VOID MacCache_Load(PMAC_CACHE Cache)
+{
+    NTSTATUS                status;
+    WDFKEY                  keyDevice;
+    WDFKEY                  keySerial;
+    ULONG                   index;
+    ULONG                   resultLength;
+    ULONG                   serialNo;
+    ULONG                   valueLength;
+    ULONG                   valueType;
+    ULONG                   loaded = 0;
+    UNICODE_STRING          name;
+    MAC_ADDRESS             address;
+    PKEY_BASIC_INFORMATION  info;
+    UCHAR                   buffer[sizeof(KEY_BASIC_INFORMATION) + MAC_CACHE_MAX_KEY_NAME * sizeof(WCHAR)];
+
+    status = MacCache_OpenDeviceKey(FALSE, &keyDevice);
+    if (!NT_SUCCESS(status))
+    {
+        // Nothing persisted yet
+        TraceEvents(TRACE_LEVEL_INFORMATION,
+            TRACE_MACCACHE,
+            "No persisted addresses (%!STATUS!)",
+            status);
+        return;
+    }
+
+    info = (PKEY_BASIC_INFORMATION)buffer;
+
+    for (index = 0; ; index++)
+    {
+        status = ZwEnumerateKey(WdfRegistryWdmGetHandle(keyDevice), index, KeyBasicInformation,
+            buffer, sizeof(buffer), &resultLength);
+
+        if (status == STATUS_NO_MORE_ENTRIES)
+        {
+            break;
+        }
+
+        // Name too long to be one of ours
+        if (!NT_SUCCESS(status))
+        {
+            continue;
+        }
+
+        name.Buffer = info->Name;
+        name.Length = (USHORT)info->NameLength;
+        name.MaximumLength = (USHORT)info->NameLength;
+
+        if (!NT_SUCCESS(RtlUnicodeStringToInteger(&name, 10, &serialNo))
+            || serialNo == 0 || serialNo > MAC_CACHE_MAX_SERIAL)
+        {
+            continue;
+        }
+
+        if (!NT_SUCCESS(WdfRegistryOpenKey(keyDevice, &name, KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &keySerial)))
+        {
+            continue;
+        }
+
+        status = WdfRegistryQueryValue(keySerial, &G_MacCacheValueName, sizeof(MAC_ADDRESS), &address, &valueLength, &valueType);
+
+        WdfRegistryClose(keySerial);
+
+        if (NT_SUCCESS(status) && valueLength == sizeof(MAC_ADDRESS) && valueType == REG_BINARY)
+        {
+            Cache->Entries[serialNo - 1].Address = address;
+            Cache->Entries[serialNo - 1].Valid = TRUE;
+            loaded++;
+        }
+    }
+
+    WdfRegistryClose(keyDevice);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION,
+        TRACE_MACCACHE,
+        "Loaded %d persisted addresses",
+        loaded);
+}
+
+//
+// Creates the write-back work item and fills the cache from the registry.
+// 
+NTSTATUS MacCache_Initialize(WDFDEVICE Device, PMAC_CACHE Cache)
+{
+    NTSTATUS                status;
+    WDF_WORKITEM_CONFIG     workItemConfig;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+
+    PAGED_CODE();
+
+    KeInitializeSpinLock(&Cache->Lock);
+    RtlZeroMemory(Cache->Entries, sizeof(Cache->Entries));
+    Cache->WriteBackFailed = FALSE;
+
+    WDF_WORKITEM_CONFIG_INIT(&workItemConfig, MacCache_EvtWriteBack);
+    // Entries are guarded by the cache lock
+    workItemConfig.AutomaticSerialization = FALSE;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Device;
+
+    status = WdfWorkItemCreate(&workItemConfig, &attributes, &Cache->WriteBackWorkItem);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_MACCACHE,
+            "WdfWorkItemCreate failed with status %!STATUS!",
+            status);
+        return status;
+    }
+
+    MacCache_Load(Cache);
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Returns the address of a serial number, generating a new one if unknown.
+// 
+// Within the cached range this never touches the registry, a generated
+// address gets persisted by the write-back work item later on. Entries
+// which failed to persist get another attempt from here.
+// 
+NTSTATUS MacCache_Lookup(PMAC_CACHE Cache, ULONG SerialNo, PMAC_ADDRESS Address)
+{
+    PMAC_CACHE_ENTRY    entry;
+    MAC_ADDRESS         generated;
+    BOOLEAN             dirty = FALSE;
+    KIRQL               irql;
+
+    if (SerialNo == 0 || SerialNo > MAC_CACHE_MAX_SERIAL)
+    {
+        return MacCache_ReadThrough(SerialNo, Address);
+    }
+
+    entry = &Cache->Entries[SerialNo - 1];
+
+    // Generated outside of the lock, only used if the serial is unknown
+    GenerateRandomMacAddress(&generated);
+
+    KeAcquireSpinLock(&Cache->Lock, &irql);
+
+    if (!entry->Valid)
+    {
+        entry->Address = generated;
+        entry->Valid = TRUE;
+        entry->Dirty = TRUE;
+        dirty = TRUE;
+    }
+
+    // Registry may be writable again
+    if (Cache->WriteBackFailed)
+    {
+        Cache->WriteBackFailed = FALSE;
+        dirty = TRUE;
+    }
+
+    *Address = entry->Address;
+
+    KeReleaseSpinLock(&Cache->Lock, irql);
+
+    if (dirty)
+    {
+        WdfWorkItemEnqueue(Cache->WriteBackWorkItem);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Persists all dirty entries.
+// 
+_Use_decl_annotations_
+VOID MacCache_EvtWriteBack(
+    WDFWORKITEM WorkItem
+)
+{
+    NTSTATUS            status;
+    PMAC_CACHE          cache;
+    PMAC_CACHE_ENTRY    entry;
+    MAC_ADDRESS         address;
+    BOOLEAN             dirty;
+    ULONG               index;
+    KIRQL               irql;
+
+    PAGED_CODE();
+
+    cache = &FdoGetData(WdfWorkItemGetParentObject(WorkItem))->MacAddresses;
+
+    for (index = 0; index < MAC_CACHE_MAX_SERIAL; index++)
+    {
+        entry = &cache->Entries[index];
+
+        KeAcquireSpinLock(&cache->Lock, &irql);
+
+        dirty = entry->Dirty;
+        address = entry->Address;
+        entry->Dirty = FALSE;
+
+        KeReleaseSpinLock(&cache->Lock, irql);
+
+        if (!dirty)
+        {
+            continue;
+        }
+
+        status = MacCache_Persist(index + 1, &address);
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_MACCACHE,
+                "Persisting serial %d failed with status %!STATUS!",
+                index + 1,
+                status);
+
+            //
+            // Keep it for the retry on the next lookup rather than
+            // re-queuing right away against a registry which just failed
+            // 
+            KeAcquireSpinLock(&cache->Lock, &irql);
+
+            entry->Dirty = TRUE;
+            cache->WriteBackFailed = TRUE;
+
+            KeReleaseSpinLock(&cache->Lock, irql);
+        }
+    }
+}
@@ -0,0 +1,81 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#pragma once
+
+//
+// Serials cached in memory, anything above is read through from the registry
+// 
+#define MAC_CACHE_MAX_SERIAL            SERIAL_POOL_MAX_SERIAL
+
+//
+// Cached MAC address of one serial number.
+// 
+typedef struct _MAC_CACHE_ENTRY
+{
+    MAC_ADDRESS Address;
+
+    //
+    // Address is loaded or generated
+    // 
+    BOOLEAN Valid;
+
+    //
+    // Address still has to be persisted
+    // 
+    BOOLEAN Dirty;
+
+} MAC_CACHE_ENTRY, *PMAC_CACHE_ENTRY;
+
+//
+// Serial number to MAC address table of the Switch targets.
+// 
+// Filled from the registry when the bus starts, new addresses are
+// written back lazily so plug-in never waits for the registry.
+// 
+typedef struct _MAC_CACHE
+{
+    //
+    // Protects the entries
+    // 
+    KSPIN_LOCK Lock;
+
+    //
+    // Persists dirty entries
+    // 
+    WDFWORKITEM WriteBackWorkItem;
+
+    //
+    // An entry failed to persist and is dirty again, the next lookup
+    // retries the write-back
+    // 
+    BOOLEAN WriteBackFailed;
+
+    //
+    // Indexed by serial number minus one
+    // 
+    MAC_CACHE_ENTRY Entries[MAC_CACHE_MAX_SERIAL];
+
+} MAC_CACHE, *PMAC_CACHE;
+
+EVT_WDF_WORKITEM MacCache_EvtWriteBack;
+
+NTSTATUS MacCache_Initialize(WDFDEVICE Device, PMAC_CACHE Cache);
+NTSTATUS MacCache_Lookup(PMAC_CACHE Cache, ULONG SerialNo, PMAC_ADDRESS Address);
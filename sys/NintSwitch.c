@@ -1,6 +1,6 @@
 /*
 * Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
-* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
 *
 * This program is free software: you can redistribute it and/or modify
 * it under the terms of the GNU General Public License as published by
@@ -150,8 +150,11 @@ NTSTATUS NintSwitch_PrepareHardware(WDFDEVICE Device)
     RtlCopyBytes(nintSwitchData->InputReport, DefaultHidReport, NSWITCH_REPORT_SIZE);
     RtlZeroMemory(&nintSwitchData->OutputReport, NSWITCH_REPORT_SIZE);
 
-    // Start pending IRP queue flush timer
-    WdfTimerStart(nintSwitchData->PendingUsbInRequestsTimer, NSWITCH_QUEUE_FLUSH_PERIOD);
+    // Have pending IRPs flushed by the bus-wide pacer
+    Pacer_Join(&FdoGetData(WdfPdoGetParent(Device))->Pacer,
+        &nintSwitchData->PacerEntry,
+        Device,
+        NintSwitch_ServicePendingUsbRequests);
 
     return STATUS_SUCCESS;
 }
@@ -160,111 +163,19 @@ NTSTATUS NintSwitch_AssignPdoContext(WDFDEVICE Device, PPDO_IDENTIFICATION_DESCR
 {
     NTSTATUS            status;
     PNSWITCH_DEVICE_DATA    nintSwitch = NintSwitchGetData(Device);
+    PFDO_DEVICE_DATA    fdoData = FdoGetData(WdfPdoGetParent(Device));
 
-    // Initialize periodic timer
-    WDF_TIMER_CONFIG timerConfig;
-    WDF_TIMER_CONFIG_INIT_PERIODIC(&timerConfig, NintSwitch_PendingUsbRequestsTimerFunc, NSWITCH_QUEUE_FLUSH_PERIOD);
-
-    // Timer object attributes
-    WDF_OBJECT_ATTRIBUTES timerAttribs;
-    WDF_OBJECT_ATTRIBUTES_INIT(&timerAttribs);
-
-    // PDO is parent
-    timerAttribs.ParentObject = Device;
-
-    // Create timer
-    status = WdfTimerCreate(&timerConfig, &timerAttribs, &nintSwitch->PendingUsbInRequestsTimer);
+    // Load/generate MAC address, persisted in the background
+    status = MacCache_Lookup(&fdoData->MacAddresses, Description->SerialNo, &nintSwitch->TargetMacAddress);
     if (!NT_SUCCESS(status))
     {
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_NSWITCH,
-            "WdfTimerCreate failed with status %!STATUS!",
+            "MacCache_Lookup failed with status %!STATUS!",
             status);
         return status;
     }
 
-    // Load/generate MAC address
-
-    // TODO: tidy up this region
-
-    WDFKEY keyParams, keyTargets, keyDS, keySerial;
-    UNICODE_STRING keyName, valueName;
-
-    status = WdfDriverOpenParametersRegistryKey(WdfGetDriver(), STANDARD_RIGHTS_ALL, WDF_NO_OBJECT_ATTRIBUTES, &keyParams);
-    if (!NT_SUCCESS(status))
-    {
-        TraceEvents(TRACE_LEVEL_ERROR,
-            TRACE_NSWITCH,
-            "WdfDriverOpenParametersRegistryKey failed with status %!STATUS!",
-            status);
-        return status;
-    }
-
-    RtlUnicodeStringInit(&keyName, L"Targets");
-
-    status = WdfRegistryCreateKey(
-        keyParams,
-        &keyName,
-        KEY_ALL_ACCESS,
-        REG_OPTION_NON_VOLATILE,
-        NULL,
-        WDF_NO_OBJECT_ATTRIBUTES,
-        &keyTargets
-    );
-    if (!NT_SUCCESS(status))
-    {
-        TraceEvents(TRACE_LEVEL_ERROR,
-            TRACE_NSWITCH,
-            "WdfRegistryCreateKey failed with status %!STATUS!",
-            status);
-        return status;
-    }
-
-    RtlUnicodeStringInit(&keyName, L"NintendoSwitchPro");
-
-    status = WdfRegistryCreateKey(
-        keyTargets,
-        &keyName,
-        KEY_ALL_ACCESS,
-        REG_OPTION_NON_VOLATILE,
-        NULL,
-        WDF_NO_OBJECT_ATTRIBUTES,
-        &keyDS
-    );
-    if (!NT_SUCCESS(status))
-    {
-        TraceEvents(TRACE_LEVEL_ERROR,
-            TRACE_NSWITCH,
-            "WdfRegistryCreateKey failed with status %!STATUS!",
-            status);
-        return status;
-    }
-
-    DECLARE_UNICODE_STRING_SIZE(serialPath, 4);
-    RtlUnicodeStringPrintf(&serialPath, L"%04d", Description->SerialNo);
-
-    status = WdfRegistryCreateKey(
-        keyDS,
-        &serialPath,
-        KEY_ALL_ACCESS,
-        REG_OPTION_NON_VOLATILE,
-        NULL,
-        WDF_NO_OBJECT_ATTRIBUTES,
-        &keySerial
-    );
-    if (!NT_SUCCESS(status))
-    {
-        TraceEvents(TRACE_LEVEL_ERROR,
-            TRACE_NSWITCH,
-            "WdfRegistryCreateKey failed with status %!STATUS!",
-            status);
-        return status;
-    }
-
-    RtlUnicodeStringInit(&valueName, L"TargetMacAddress");
-
-    status = WdfRegistryQueryValue(keySerial, &valueName, sizeof(MAC_ADDRESS), &nintSwitch->TargetMacAddress, NULL, NULL);
-
     TraceEvents(TRACE_LEVEL_INFORMATION,
         TRACE_NSWITCH,
         "MAC-Address: %02X:%02X:%02X:%02X:%02X:%02X\n",
@@ -275,33 +186,7 @@ NTSTATUS NintSwitch_AssignPdoContext(WDFDEVICE Device, PPDO_IDENTIFICATION_DESCR
         nintSwitch->TargetMacAddress.Nic1,
         nintSwitch->TargetMacAddress.Nic2);
 
-    if (status == STATUS_OBJECT_NAME_NOT_FOUND)
-    {
-        GenerateRandomMacAddress(&nintSwitch->TargetMacAddress);
-
-        status = WdfRegistryAssignValue(keySerial, &valueName, REG_BINARY, sizeof(MAC_ADDRESS), (PVOID)&nintSwitch->TargetMacAddress);
-        if (!NT_SUCCESS(status))
-        {
-            TraceEvents(TRACE_LEVEL_ERROR,
-                TRACE_NSWITCH,
-                "WdfRegistryAssignValue failed with status %!STATUS!",
-                status);
-            return status;
-        }
-    }
-    else if (!NT_SUCCESS(status))
-    {
-        TraceEvents(TRACE_LEVEL_ERROR,
-            TRACE_NSWITCH,
-            "WdfRegistryQueryValue failed with status %!STATUS!",
-            status);
-        return status;
-    }
-
-    WdfRegistryClose(keySerial);
-    WdfRegistryClose(keyDS);
-    WdfRegistryClose(keyTargets);
-    WdfRegistryClose(keyParams);
+    NintSwitchResponder_Initialize(&nintSwitch->Responder, fdoData->NintSwitchResponder, (PUCHAR)&nintSwitch->TargetMacAddress);
 
     return STATUS_SUCCESS;
 }
@@ -413,8 +298,12 @@ VOID NintSwitch_SelectConfiguration(PUSBD_INTERFACE_INFORMATION pInfo)
 //
 // Completes pending I/O requests if feeder is too slow.
 // 
-VOID NintSwitch_PendingUsbRequestsTimerFunc(
-    _In_ WDFTIMER Timer
+// Called by the bus pacer, one wheel revolution equals the flush period.
+// 
+C_ASSERT(NSWITCH_QUEUE_FLUSH_PERIOD == PACER_WHEEL_SLOTS * PACER_TICK_PERIOD_MS);
+
+VOID NintSwitch_ServicePendingUsbRequests(
+    _In_ WDFDEVICE Device
 )
 {
     NTSTATUS                status;
@@ -427,7 +316,7 @@ VOID NintSwitch_PendingUsbRequestsTimerFunc(
 
     TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_NSWITCH, "%!FUNC! Entry");
 
-    hChild = WdfTimerGetParentObject(Timer);
+    hChild = Device;
     pdoData = PdoGetData(hChild);
     nintSwitchData = NintSwitchGetData(hChild);
 
@@ -453,10 +342,10 @@ VOID NintSwitch_PendingUsbRequestsTimerFunc(
         PUCHAR Buffer = (PUCHAR)urb->UrbBulkOrInterruptTransfer.TransferBuffer;
         // Set buffer length to report size
         urb->UrbBulkOrInterruptTransfer.TransferBufferLength = NSWITCH_REPORT_SIZE;
-			           // Copy cached report to transfer buffer 
+        // Copy cached report to transfer buffer, a submit may update it meanwhile
 		if (Buffer)
 		{
-			RtlCopyBytes(Buffer, nintSwitchData->InputReport, NSWITCH_REPORT_SIZE);
+			SeqLockRead(&pdoData->ReportSequence, Buffer, nintSwitchData->InputReport, NSWITCH_REPORT_SIZE);
 		}
 
 		        // Complete pending request
@@ -466,3 +355,105 @@ VOID NintSwitch_PendingUsbRequestsTimerFunc(
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_NSWITCH, "%!FUNC! Exit with status %!STATUS!", status);
 }
 
+
+C_ASSERT(NSWITCH_RESPONDER_REPORT_SIZE == NSWITCH_REPORT_SIZE);
+
+//
+// Answers a USB-mode handshake command or a standard subcommand in-driver,
+// sparing the feeder round trip.
+// 
+// Returns FALSE if the output report has to be forwarded to user mode.
+// 
+BOOLEAN NintSwitch_AnswerOutputReport(WDFDEVICE Device, PUCHAR OutputReport, ULONG Length)
+{
+    PPDO_DEVICE_DATA            pdoData = PdoGetData(Device);
+    PNSWITCH_DEVICE_DATA        nintSwitchData = NintSwitchGetData(Device);
+    UCHAR                       reply[NSWITCH_REPORT_SIZE];
+    BOOLEAN                     answered;
+    BOOLEAN                     hasReply = TRUE;
+
+    if (OutputReport == NULL || Length == 0 || !nintSwitchData->Responder.Enabled)
+    {
+        return FALSE;
+    }
+
+    WdfSpinLockAcquire(pdoData->MailboxLock);
+
+    if (OutputReport[0] == NSWITCH_RESPONDER_OUTPUT_USB_COMMAND)
+    {
+        answered = NintSwitchResponder_AnswerUsbCommand(&nintSwitchData->Responder,
+            OutputReport,
+            Length,
+            reply,
+            &hasReply);
+    }
+    else
+    {
+        // Reply carries the latest input of the feeder
+        answered = NintSwitchResponder_Answer(&nintSwitchData->Responder,
+            OutputReport,
+            Length,
+            (PUCHAR)&pdoData->Mailbox.NintSwitch.InputReport,
+            reply);
+    }
+
+    //
+    // Bypasses change detection, a retried subcommand has to be answered
+    // again even if the reply only differs in the timer byte
+    // 
+    if (answered && hasReply)
+    {
+        pdoData->Mailbox.Header.Size = sizeof(NSWITCH_SUBMIT_REPORT);
+        pdoData->Mailbox.Header.SerialNo = pdoData->SerialNo;
+        // One-shot reply, keep re-sending the last standard input
+        pdoData->Mailbox.NintSwitch.TimerStatus = NSWITCH_TIMER_STATUS_IGNORED;
+        RtlCopyMemory(&pdoData->Mailbox.NintSwitch.InputReport, reply, NSWITCH_REPORT_SIZE);
+        pdoData->MailboxDirty = TRUE;
+    }
+
+    WdfSpinLockRelease(pdoData->MailboxLock);
+
+    if (!answered)
+    {
+        return FALSE;
+    }
+
+    TraceEvents(TRACE_LEVEL_VERBOSE,
+        TRACE_NSWITCH,
+        "Answered output report 0x%02X",
+        OutputReport[0]);
+
+    if (hasReply)
+    {
+        (VOID)Bus_FlushMailbox(Device);
+    }
+
+    return TRUE;
+}
+
+//
+// Tells the FDO the handshake is over, only the first call reports.
+// 
+VOID NintSwitch_ReportInitFinished(WDFDEVICE Device)
+{
+    PPDO_DEVICE_DATA        pdoData = PdoGetData(Device);
+    PNSWITCH_DEVICE_DATA    nintSwitchData = NintSwitchGetData(Device);
+
+    if (nintSwitchData->InitFinishedReported
+        || InterlockedExchange(&nintSwitchData->InitFinishedReported, TRUE))
+    {
+        return;
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION,
+        TRACE_NSWITCH,
+        "BUS_PDO_REPORT_STAGE_RESULT Stage: ViGEmPdoInitFinished  [serial: %d]",
+        pdoData->SerialNo);
+
+    BUS_PDO_REPORT_STAGE_RESULT(
+        pdoData->BusInterface,
+        ViGEmPdoInitFinished,
+        pdoData->SerialNo,
+        STATUS_SUCCESS
+    );
+}
@@ -1,6 +1,6 @@
 /*
 * Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
-* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
 *
 * This program is free software: you can redistribute it and/or modify
 * it under the terms of the GNU General Public License as published by
@@ -32,6 +32,7 @@
 #define NSWITCH_SERIAL_NAME_LENGTH							0x1A
 
 #define NSWITCH_REPORT_SIZE                                 0x40
+#define NSWITCH_STANDARD_INPUT_REPORT_ID                    0x30
 #define NSWITCH_QUEUE_FLUSH_PERIOD                          0x08
 #define NSWITCH_TIMER_STATUS_DISABLED						0
 #define NSWITCH_TIMER_STATUS_ENABLED_UPDATE					1
@@ -55,9 +56,9 @@ typedef struct _NSWITCH_DEVICE_DATA
 	UCHAR OutputReport[NSWITCH_REPORT_SIZE];
 
     //
-    // Timer for dispatching interrupt transfer
+    // Membership in the bus pacer dispatching interrupt transfers
     //
-    WDFTIMER PendingUsbInRequestsTimer;
+    PACER_ENTRY PacerEntry;
 
     //
     // Auto-generated MAC address of the target device
@@ -69,19 +70,34 @@ typedef struct _NSWITCH_DEVICE_DATA
     //
     MAC_ADDRESS HostMacAddress;
 
+    //
+    // In-driver handshake and subcommand responder, guarded by the PDO mailbox lock
+    //
+    NSWITCH_RESPONDER Responder;
+
+    //
+    // Set once a standard input report reached the host, guarded by the PDO mailbox lock
+    //
+    BOOLEAN StandardReportDelivered;
+
+    //
+    // Set once the handshake is over and the FDO got told
+    //
+    volatile LONG InitFinishedReported;
+
 } NSWITCH_DEVICE_DATA, *PNSWITCH_DEVICE_DATA;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(NSWITCH_DEVICE_DATA, NintSwitchGetData)
 
 
-EVT_WDF_TIMER NintSwitch_PendingUsbRequestsTimerFunc;
+PACER_SERVICE NintSwitch_ServicePendingUsbRequests;
 
 NTSTATUS
 Bus_NintSwitchSubmitReport(
     WDFDEVICE Device,
     ULONG SerialNo,
     PNSWITCH_SUBMIT_REPORT Report,
-    _In_ BOOLEAN FromInterface
+    _In_ LONG SessionId
 );
 
 //
@@ -93,4 +109,6 @@ NTSTATUS NintSwitch_AssignPdoContext(WDFDEVICE Device, PPDO_IDENTIFICATION_DESCR
 VOID NintSwitch_GetConfigurationDescriptorType(PUCHAR Buffer, ULONG Length);
 VOID NintSwitch_GetDeviceDescriptorType(PUSB_DEVICE_DESCRIPTOR pDescriptor, PPDO_DEVICE_DATA pCommon);
 VOID NintSwitch_SelectConfiguration(PUSBD_INTERFACE_INFORMATION pInfo);
+BOOLEAN NintSwitch_AnswerOutputReport(WDFDEVICE Device, PUCHAR OutputReport, ULONG Length);
+VOID NintSwitch_ReportInitFinished(WDFDEVICE Device);
 
@@ -0,0 +1,341 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <string.h>
+
+#include "NintSwitchResponder.h"
+
+//
+// Number of elements of a static array
+//
+#define NSWITCH_RESPONDER_COUNT_OF(_array_)     (sizeof(_array_) / sizeof((_array_)[0]))
+
+//
+// Region of the emulated SPI flash backed by real content.
+//
+typedef struct _NSWITCH_SPI_REGION
+{
+    USHORT Address;
+
+    USHORT Length;
+
+    const UCHAR* Data;
+
+} NSWITCH_SPI_REGION, *PNSWITCH_SPI_REGION;
+
+//
+// Device type and color presence
+//
+static const UCHAR NintSwitchResponder_SpiDevice[] =
+{
+    0x03, 0xA0, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x01
+};
+
+//
+// Factory 6-axis calibration
+//
+static const UCHAR NintSwitchResponder_SpiImuCalibration[] =
+{
+    0xD3, 0xFF, 0xD5, 0xFF, 0x55, 0x01, 0x00, 0x40,
+    0x00, 0x40, 0x00, 0x40, 0x19, 0x00, 0xDD, 0xFF,
+    0xDC, 0xFF, 0x3B, 0x34, 0x3B, 0x34, 0x3B, 0x34
+};
+
+//
+// Factory stick calibration (left, right)
+//
+static const UCHAR NintSwitchResponder_SpiStickCalibration[] =
+{
+    0xBA, 0xF5, 0x62, 0x6F, 0xC8, 0x77, 0xED, 0x95, 0x5B,
+    0x16, 0xD8, 0x7D, 0xF2, 0xB5, 0x5F, 0x86, 0x65, 0x5E
+};
+
+//
+// Body, button and grip colors
+//
+static const UCHAR NintSwitchResponder_SpiColors[] =
+{
+    0x32, 0x32, 0x32, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+//
+// Factory sensor and stick device parameters
+//
+static const UCHAR NintSwitchResponder_SpiStickParameters[] =
+{
+    0x50, 0xFD, 0x00, 0x00, 0xC6, 0x0F, 0x0F, 0x30,
+    0x61, 0x96, 0x30, 0xF3, 0xD4, 0x14, 0x54, 0x41,
+    0x15, 0x54, 0xC7, 0x79, 0x9C, 0x33, 0x36, 0x63,
+    0x0F, 0x30, 0x61, 0x96, 0x30, 0xF3, 0xD4, 0x14,
+    0x54, 0x41, 0x15, 0x54, 0xC7, 0x79, 0x9C, 0x33,
+    0x36, 0x63
+};
+
+//
+// Cached flash image, everything else reads as erased (0xFF) which
+// includes the user calibration at 0x8010
+//
+static const NSWITCH_SPI_REGION NintSwitchResponder_SpiImage[] =
+{
+    { 0x6012, sizeof(NintSwitchResponder_SpiDevice), NintSwitchResponder_SpiDevice },
+    { 0x6020, sizeof(NintSwitchResponder_SpiImuCalibration), NintSwitchResponder_SpiImuCalibration },
+    { 0x603D, sizeof(NintSwitchResponder_SpiStickCalibration), NintSwitchResponder_SpiStickCalibration },
+    { 0x6050, sizeof(NintSwitchResponder_SpiColors), NintSwitchResponder_SpiColors },
+    { 0x6080, sizeof(NintSwitchResponder_SpiStickParameters), NintSwitchResponder_SpiStickParameters },
+};
+
+//
+// Standard input reported while the feeder hasn't sent any yet
+//
+static const UCHAR NintSwitchResponder_IdleState[] =
+{
+    0x91, 0x00, 0x00, 0x00, 0x00, 0x08, 0x80, 0x00, 0x08, 0x80, 0x80
+};
+
+VOID NintSwitchResponder_Initialize(PNSWITCH_RESPONDER Responder, BOOLEAN Enabled, const UCHAR* MacAddress)
+{
+    memset(Responder, 0, sizeof(NSWITCH_RESPONDER));
+
+    Responder->Enabled = Enabled;
+    Responder->InputReportMode = 0x3F;
+
+    memcpy(Responder->MacAddress, MacAddress, sizeof(Responder->MacAddress));
+}
+
+//
+// Copies a range of the emulated SPI flash.
+//
+static VOID NintSwitchResponder_ReadSpi(ULONG Address, ULONG Length, PUCHAR Buffer)
+{
+    ULONG index;
+    ULONG offset;
+    const NSWITCH_SPI_REGION* region;
+
+    memset(Buffer, 0xFF, Length);
+
+    for (index = 0; index < NSWITCH_RESPONDER_COUNT_OF(NintSwitchResponder_SpiImage); index++)
+    {
+        region = &NintSwitchResponder_SpiImage[index];
+
+        for (offset = 0; offset < Length; offset++)
+        {
+            if (Address + offset >= region->Address
+                && Address + offset < (ULONG)region->Address + region->Length)
+            {
+                Buffer[offset] = region->Data[Address + offset - region->Address];
+            }
+        }
+    }
+}
+
+//
+// Builds the 0x21 reply to a standard subcommand.
+//
+// InputState is the latest input report supplied by the feeder (or NULL),
+// its standard input part gets carried over into the reply. Returns FALSE
+// if the report isn't a subcommand or the subcommand isn't a standard one;
+// it has to be forwarded then and the responder state is left untouched.
+//
+BOOLEAN NintSwitchResponder_Answer(
+    PNSWITCH_RESPONDER Responder,
+    const UCHAR* OutputReport,
+    ULONG Length,
+    const UCHAR* InputState,
+    PUCHAR Reply
+)
+{
+    const UCHAR*    args = &OutputReport[NSWITCH_RESPONDER_ARGUMENT_OFFSET];
+    PUCHAR          data = &Reply[NSWITCH_RESPONDER_REPLY_DATA_OFFSET];
+    UCHAR           subcommand;
+    UCHAR           ack = 0x80;
+    ULONG           address;
+
+    if (!Responder->Enabled
+        || Length < NSWITCH_RESPONDER_MIN_OUTPUT_LENGTH
+        || OutputReport[0] != NSWITCH_RESPONDER_OUTPUT_SUBCOMMAND)
+    {
+        return FALSE;
+    }
+
+    subcommand = OutputReport[NSWITCH_RESPONDER_SUBCOMMAND_OFFSET];
+
+    memset(Reply, 0, NSWITCH_RESPONDER_REPORT_SIZE);
+
+    switch (subcommand)
+    {
+    case NSWITCH_SUBCMD_REQUEST_DEVICE_INFO:
+
+        ack = 0x82;
+
+        // Firmware 3.72, Pro Controller
+        data[0] = 0x03;
+        data[1] = 0x48;
+        data[2] = 0x03;
+        data[3] = 0x02;
+        memcpy(&data[4], Responder->MacAddress, sizeof(Responder->MacAddress));
+        data[10] = 0x01;
+        // Colors are stored in SPI
+        data[11] = 0x01;
+
+        break;
+    case NSWITCH_SUBCMD_SET_INPUT_REPORT_MODE:
+
+        Responder->InputReportMode = args[0];
+
+        break;
+    case NSWITCH_SUBCMD_TRIGGER_BUTTONS_ELAPSED:
+
+        ack = 0x83;
+
+        break;
+    case NSWITCH_SUBCMD_SPI_FLASH_READ:
+
+        address = args[0] | (args[1] << 8) | (args[2] << 16) | ((ULONG)args[3] << 24);
+
+        if (args[4] > NSWITCH_RESPONDER_SPI_READ_MAX)
+        {
+            return FALSE;
+        }
+
+        ack = 0x90;
+
+        // Echo address and size, followed by the content
+        memcpy(data, args, 5);
+        NintSwitchResponder_ReadSpi(address, args[4], &data[5]);
+
+        break;
+    case NSWITCH_SUBCMD_SET_PLAYER_LIGHTS:
+
+        Responder->PlayerLights = args[0];
+
+        break;
+    case NSWITCH_SUBCMD_ENABLE_IMU:
+
+        Responder->ImuEnabled = (args[0] != 0);
+
+        break;
+    case NSWITCH_SUBCMD_ENABLE_VIBRATION:
+
+        Responder->VibrationEnabled = (args[0] != 0);
+
+        break;
+    case NSWITCH_SUBCMD_SET_SHIPMENT_STATE:
+    case NSWITCH_SUBCMD_SET_MCU_STATE:
+    case NSWITCH_SUBCMD_SET_HOME_LIGHT:
+    case NSWITCH_SUBCMD_SET_IMU_SENSITIVITY:
+
+        // Plain acknowledge
+
+        break;
+    default:
+        return FALSE;
+    }
+
+    Reply[0] = NSWITCH_RESPONDER_INPUT_REPLY;
+    Reply[1] = Responder->Timer++;
+
+    // Battery, buttons, sticks and vibrator state of the latest input
+    if (InputState != NULL
+        && (InputState[0] == NSWITCH_RESPONDER_INPUT_STANDARD || InputState[0] == NSWITCH_RESPONDER_INPUT_REPLY))
+    {
+        memcpy(&Reply[2], &InputState[2], sizeof(NintSwitchResponder_IdleState));
+    }
+    else
+    {
+        memcpy(&Reply[2], NintSwitchResponder_IdleState, sizeof(NintSwitchResponder_IdleState));
+    }
+
+    Reply[NSWITCH_RESPONDER_ACK_OFFSET] = ack;
+    Reply[NSWITCH_RESPONDER_REPLY_ID_OFFSET] = subcommand;
+
+    return TRUE;
+}
+
+//
+// Handles a USB-mode handshake command (output report 0x80).
+//
+// Some commands are acknowledged with a 0x81 reply, others just change
+// state; HasReply tells them apart. Returns FALSE for unknown commands.
+//
+BOOLEAN NintSwitchResponder_AnswerUsbCommand(
+    PNSWITCH_RESPONDER Responder,
+    const UCHAR* OutputReport,
+    ULONG Length,
+    PUCHAR Reply,
+    PBOOLEAN HasReply
+)
+{
+    ULONG index;
+
+    *HasReply = FALSE;
+
+    if (!Responder->Enabled
+        || Length < 2
+        || OutputReport[0] != NSWITCH_RESPONDER_OUTPUT_USB_COMMAND)
+    {
+        return FALSE;
+    }
+
+    memset(Reply, 0, NSWITCH_RESPONDER_REPORT_SIZE);
+
+    switch (OutputReport[1])
+    {
+    case NSWITCH_USBCMD_REQUEST_STATUS:
+
+        // Pro Controller, address least significant byte first
+        Reply[3] = 0x03;
+
+        for (index = 0; index < sizeof(Responder->MacAddress); index++)
+        {
+            Reply[4 + index] = Responder->MacAddress[sizeof(Responder->MacAddress) - 1 - index];
+        }
+
+        *HasReply = TRUE;
+
+        break;
+    case NSWITCH_USBCMD_HANDSHAKE:
+    case NSWITCH_USBCMD_SET_BAUDRATE:
+
+        *HasReply = TRUE;
+
+        break;
+    case NSWITCH_USBCMD_FORCE_USB:
+
+        Responder->ForceUsb = TRUE;
+
+        break;
+    case NSWITCH_USBCMD_DISABLE_FORCE_USB:
+
+        Responder->ForceUsb = FALSE;
+
+        break;
+    default:
+        return FALSE;
+    }
+
+    if (*HasReply)
+    {
+        Reply[0] = NSWITCH_RESPONDER_INPUT_USB_REPLY;
+        Reply[1] = OutputReport[1];
+    }
+
+    return TRUE;
+}
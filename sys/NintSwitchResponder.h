@@ -0,0 +1,168 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#pragma once
+
+//
+// Doesn't depend on the framework, so it also builds outside the WDK
+// for the handshake replay test
+//
+#ifdef _KERNEL_MODE
+#include <ntdef.h>
+#else
+#include <stdint.h>
+
+typedef void VOID;
+typedef uint8_t UCHAR, *PUCHAR;
+typedef uint8_t BOOLEAN, *PBOOLEAN;
+typedef uint16_t USHORT;
+typedef uint32_t ULONG;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+#endif
+
+//
+// Length of input and output reports
+//
+#define NSWITCH_RESPONDER_REPORT_SIZE           0x40
+
+//
+// Output report carrying rumble data and a subcommand
+//
+#define NSWITCH_RESPONDER_OUTPUT_SUBCOMMAND     0x01
+
+//
+// Input report carrying the standard input and a subcommand reply
+//
+#define NSWITCH_RESPONDER_INPUT_REPLY           0x21
+
+//
+// Input report carrying the standard input only
+//
+#define NSWITCH_RESPONDER_INPUT_STANDARD        0x30
+
+//
+// USB-mode handshake command and its reply
+//
+#define NSWITCH_RESPONDER_OUTPUT_USB_COMMAND    0x80
+#define NSWITCH_RESPONDER_INPUT_USB_REPLY       0x81
+
+//
+// Offsets within the output report
+//
+#define NSWITCH_RESPONDER_SUBCOMMAND_OFFSET     0x0A
+#define NSWITCH_RESPONDER_ARGUMENT_OFFSET       0x0B
+
+//
+// Offsets within the reply
+//
+#define NSWITCH_RESPONDER_ACK_OFFSET            0x0D
+#define NSWITCH_RESPONDER_REPLY_ID_OFFSET       0x0E
+#define NSWITCH_RESPONDER_REPLY_DATA_OFFSET     0x0F
+
+//
+// Shortest output report holding a subcommand with its arguments
+//
+#define NSWITCH_RESPONDER_MIN_OUTPUT_LENGTH     0x10
+
+//
+// Largest SPI flash read a single subcommand may ask for
+//
+#define NSWITCH_RESPONDER_SPI_READ_MAX          0x1D
+
+//
+// USB-mode handshake commands
+//
+#define NSWITCH_USBCMD_REQUEST_STATUS           0x01
+#define NSWITCH_USBCMD_HANDSHAKE                0x02
+#define NSWITCH_USBCMD_SET_BAUDRATE             0x03
+#define NSWITCH_USBCMD_FORCE_USB                0x04
+#define NSWITCH_USBCMD_DISABLE_FORCE_USB        0x05
+
+//
+// Standard subcommands answered in-driver
+//
+#define NSWITCH_SUBCMD_REQUEST_DEVICE_INFO      0x02
+#define NSWITCH_SUBCMD_SET_INPUT_REPORT_MODE    0x03
+#define NSWITCH_SUBCMD_TRIGGER_BUTTONS_ELAPSED  0x04
+#define NSWITCH_SUBCMD_SET_SHIPMENT_STATE       0x08
+#define NSWITCH_SUBCMD_SPI_FLASH_READ           0x10
+#define NSWITCH_SUBCMD_SET_MCU_STATE            0x22
+#define NSWITCH_SUBCMD_SET_PLAYER_LIGHTS        0x30
+#define NSWITCH_SUBCMD_SET_HOME_LIGHT           0x38
+#define NSWITCH_SUBCMD_ENABLE_IMU               0x40
+#define NSWITCH_SUBCMD_SET_IMU_SENSITIVITY      0x41
+#define NSWITCH_SUBCMD_ENABLE_VIBRATION         0x48
+
+//
+// Per-device state the answers are built from, callers serialize access.
+//
+typedef struct _NSWITCH_RESPONDER
+{
+    //
+    // Answer the handshake and standard subcommands instead of forwarding them
+    //
+    BOOLEAN Enabled;
+
+    //
+    // Running counter reported in every reply
+    //
+    UCHAR Timer;
+
+    UCHAR InputReportMode;
+
+    UCHAR PlayerLights;
+
+    BOOLEAN ImuEnabled;
+
+    BOOLEAN VibrationEnabled;
+
+    //
+    // Host asked for USB-only HID reports, ending the handshake
+    //
+    BOOLEAN ForceUsb;
+
+    //
+    // Bluetooth address reported in the device info, most significant byte first
+    //
+    UCHAR MacAddress[6];
+
+} NSWITCH_RESPONDER, *PNSWITCH_RESPONDER;
+
+VOID NintSwitchResponder_Initialize(PNSWITCH_RESPONDER Responder, BOOLEAN Enabled, const UCHAR* MacAddress);
+BOOLEAN NintSwitchResponder_Answer(
+    PNSWITCH_RESPONDER Responder,
+    const UCHAR* OutputReport,
+    ULONG Length,
+    const UCHAR* InputState,
+    PUCHAR Reply
+);
+BOOLEAN NintSwitchResponder_AnswerUsbCommand(
+    PNSWITCH_RESPONDER Responder,
+    const UCHAR* OutputReport,
+    ULONG Length,
+    PUCHAR Reply,
+    PBOOLEAN HasReply
+);
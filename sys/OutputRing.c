@@ -0,0 +1,207 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "busenum.h"
+#include "outputring.tmh"
+
+C_ASSERT((OUTPUT_RING_SLOT_COUNT & (OUTPUT_RING_SLOT_COUNT - 1)) == 0);
+
+//
+// Creates the manual queue parking requests until output events arrive.
+//
+// The queue has to belong to the FDO so the IOCTL can be forwarded to it.
+//
+NTSTATUS OutputRing_CreateQueue(WDFDEVICE Device, ULONG SerialNo, WDFQUEUE* Queue)
+{
+    NTSTATUS                status;
+    WDF_IO_QUEUE_CONFIG     queueConfig;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+    POUTPUT_RING_QUEUE_DATA pRingData;
+
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, OUTPUT_RING_QUEUE_DATA);
+
+    status = WdfIoQueueCreate(Device, &queueConfig, &attributes, Queue);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_OUTPUTRING,
+            "WdfIoQueueCreate failed with status %!STATUS!",
+            status);
+        return status;
+    }
+
+    pRingData = OutputRingQueueGetData(*Queue);
+    pRingData->SerialNo = SerialNo;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = *Queue;
+
+    status = WdfSpinLockCreate(&attributes, &pRingData->Lock);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_OUTPUTRING,
+            "WdfSpinLockCreate failed with status %!STATUS!",
+            status);
+    }
+
+    return status;
+}
+
+//
+// Moves the buffered events into the output buffer, the lock must be held.
+//
+static size_t OutputRing_Drain(POUTPUT_RING_QUEUE_DATA RingData, PVIGEM_OUTPUT_EVENTS Events)
+{
+    Events->Size = sizeof(VIGEM_OUTPUT_EVENTS);
+    Events->SerialNo = RingData->SerialNo;
+    Events->Count = 0;
+
+    while (RingData->Tail != RingData->Head && Events->Count < VIGEM_OUTPUT_EVENTS_MAX_ENTRIES)
+    {
+        RtlCopyMemory(
+            &Events->Events[Events->Count++],
+            &RingData->Slots[RingData->Tail++ & (OUTPUT_RING_SLOT_COUNT - 1)],
+            sizeof(VIGEM_OUTPUT_EVENT)
+        );
+    }
+
+    Events->Dropped = RingData->Dropped;
+
+    return FIELD_OFFSET(VIGEM_OUTPUT_EVENTS, Events) + Events->Count * sizeof(VIGEM_OUTPUT_EVENT);
+}
+
+//
+// Returns the buffered events right away or keeps the request pending until the next one.
+//
+NTSTATUS OutputRing_Request(WDFQUEUE Queue, WDFREQUEST Request, size_t* Transferred)
+{
+    NTSTATUS                status;
+    PVIGEM_OUTPUT_EVENTS    events = NULL;
+    POUTPUT_RING_QUEUE_DATA pRingData = OutputRingQueueGetData(Queue);
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(VIGEM_OUTPUT_EVENTS), (PVOID)&events, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_OUTPUTRING,
+            "WdfRequestRetrieveOutputBuffer failed with status %!STATUS!",
+            status);
+        return status;
+    }
+
+    WdfSpinLockAcquire(pRingData->Lock);
+
+    //
+    // Park the request with the lock held so an event pushed meanwhile
+    // is guaranteed to find it
+    //
+    if (pRingData->Tail != pRingData->Head)
+    {
+        *Transferred = OutputRing_Drain(pRingData, events);
+    }
+    else
+    {
+        status = WdfRequestForwardToIoQueue(Request, Queue);
+
+        if (NT_SUCCESS(status))
+        {
+            status = STATUS_PENDING;
+        }
+        else
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_OUTPUTRING,
+                "WdfRequestForwardToIoQueue failed with status %!STATUS!",
+                status);
+        }
+    }
+
+    WdfSpinLockRelease(pRingData->Lock);
+
+    return status;
+}
+
+//
+// Buffers an output event and hands it to a waiting request, if any.
+//
+// Never blocks the host; the oldest event gets overwritten if the ring is full.
+//
+VOID OutputRing_Push(WDFQUEUE Queue, PVOID Data, ULONG Length)
+{
+    NTSTATUS                status;
+    POUTPUT_RING_QUEUE_DATA pRingData;
+    PVIGEM_OUTPUT_EVENT     slot;
+    PVIGEM_OUTPUT_EVENTS    events;
+    WDFREQUEST              request = NULL;
+    size_t                  transferred = 0;
+
+    if (Queue == NULL || Data == NULL)
+    {
+        return;
+    }
+
+    pRingData = OutputRingQueueGetData(Queue);
+
+    WdfSpinLockAcquire(pRingData->Lock);
+
+    if (pRingData->Head - pRingData->Tail == OUTPUT_RING_SLOT_COUNT)
+    {
+        pRingData->Tail++;
+        pRingData->Dropped++;
+    }
+
+    slot = &pRingData->Slots[pRingData->Head & (OUTPUT_RING_SLOT_COUNT - 1)];
+
+    slot->Sequence = ++pRingData->Head;
+    slot->Length = min(Length, VIGEM_OUTPUT_EVENT_DATA_SIZE);
+    slot->Timestamp = KeQueryInterruptTime();
+
+    RtlCopyMemory(slot->Data, Data, slot->Length);
+
+    //
+    // Requests only get parked while the ring is empty, so at most the
+    // first one needs to be served
+    //
+    status = WdfIoQueueRetrieveNextRequest(Queue, &request);
+
+    if (NT_SUCCESS(status))
+    {
+        // Validated before the request got parked
+        status = WdfRequestRetrieveOutputBuffer(request, sizeof(VIGEM_OUTPUT_EVENTS), (PVOID)&events, NULL);
+
+        if (NT_SUCCESS(status))
+        {
+            transferred = OutputRing_Drain(pRingData, events);
+        }
+    }
+    else
+    {
+        request = NULL;
+    }
+
+    WdfSpinLockRelease(pRingData->Lock);
+
+    if (request != NULL)
+    {
+        WdfRequestCompleteWithInformation(request, status, transferred);
+    }
+}
@@ -0,0 +1,65 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+//
+// Output events buffered per PDO, must be a power of two
+//
+#define OUTPUT_RING_SLOT_COUNT          0x20
+
+//
+// Context of the queue holding requests waiting for output events.
+//
+typedef struct _OUTPUT_RING_QUEUE_DATA
+{
+    //
+    // Protects the fields below
+    //
+    WDFSPINLOCK Lock;
+
+    //
+    // Serial number of the target the events belong to
+    //
+    ULONG SerialNo;
+
+    //
+    // Number of events pushed, the newest one is at Head - 1
+    //
+    ULONG Head;
+
+    //
+    // Number of events consumed or overwritten
+    //
+    ULONG Tail;
+
+    //
+    // Events overwritten before being fetched
+    //
+    ULONG Dropped;
+
+    VIGEM_OUTPUT_EVENT Slots[OUTPUT_RING_SLOT_COUNT];
+
+} OUTPUT_RING_QUEUE_DATA, *POUTPUT_RING_QUEUE_DATA;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(OUTPUT_RING_QUEUE_DATA, OutputRingQueueGetData)
+
+NTSTATUS OutputRing_CreateQueue(WDFDEVICE Device, ULONG SerialNo, WDFQUEUE* Queue);
+NTSTATUS OutputRing_Request(WDFQUEUE Queue, WDFREQUEST Request, size_t* Transferred);
+VOID OutputRing_Push(WDFQUEUE Queue, PVOID Data, ULONG Length);
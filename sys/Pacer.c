@@ -0,0 +1,264 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include "busenum.h"
+#include "pacer.tmh"
+
+//
+// Tick length in interrupt time units (100ns)
+//
+#define PACER_TICK_LENGTH               WDF_ABS_TIMEOUT_IN_MS(PACER_TICK_PERIOD_MS)
+
+//
+// Arms the tick for the next phase with members, none while the wheel is empty.
+//
+// Must be called with the pacer lock held.
+//
+static VOID Pacer_ArmLocked(PPACER Pacer)
+{
+    ULONGLONG       interruptTime;
+    ULONGLONG       next;
+    LARGE_INTEGER   dueTime;
+
+    if (Pacer->Count == 0)
+    {
+        return;
+    }
+
+    interruptTime = KeQueryInterruptTime();
+
+    next = PacerWheel_NextTick(Pacer->SlotCounts, interruptTime / PACER_TICK_LENGTH);
+
+    dueTime.QuadPart = -(LONGLONG)(next * PACER_TICK_LENGTH - interruptTime);
+    KeSetTimer(&Pacer->Timer, dueTime, &Pacer->Dpc);
+}
+
+//
+// Prepares an idle wheel, optionally binding the tick to one processor.
+//
+VOID Pacer_Initialize(PPACER Pacer, ULONG Processor)
+{
+    NTSTATUS            status;
+    PROCESSOR_NUMBER    number;
+    ULONG               i;
+
+    KeInitializeSpinLock(&Pacer->Lock);
+    KeInitializeTimerEx(&Pacer->Timer, NotificationTimer);
+    KeInitializeDpc(&Pacer->Dpc, Pacer_EvtDpc, Pacer);
+
+    for (i = 0; i < PACER_WHEEL_SLOTS; i++)
+    {
+        InitializeListHead(&Pacer->Slots[i]);
+        Pacer->SlotCounts[i] = 0;
+    }
+
+    Pacer->Count = 0;
+    Pacer->LastTick = 0;
+
+    if (Processor == PACER_ANY_PROCESSOR)
+    {
+        return;
+    }
+
+    status = KeGetProcessorNumberFromIndex(Processor, &number);
+    if (NT_SUCCESS(status))
+    {
+        status = KeSetTargetProcessorDpcEx(&Pacer->Dpc, &number);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_WARNING,
+            TRACE_PACER,
+            "Can't bind tick to processor %d, status %!STATUS!",
+            Processor,
+            status);
+    }
+}
+
+//
+// Adds a device to the least crowded phase, starting the tick for the first one.
+//
+VOID Pacer_Join(PPACER Pacer, PPACER_ENTRY Entry, WDFDEVICE Device, PPACER_SERVICE Service)
+{
+    KIRQL           irql;
+    ULONG           slot;
+
+    KeAcquireSpinLock(&Pacer->Lock, &irql);
+
+    if (Entry->Linked)
+    {
+        KeReleaseSpinLock(&Pacer->Lock, irql);
+        return;
+    }
+
+    slot = PacerWheel_AssignSlot(Pacer->SlotCounts);
+
+    Entry->Device = Device;
+    Entry->Service = Service;
+    Entry->Slot = slot;
+    Entry->Linked = TRUE;
+
+    InsertTailList(&Pacer->Slots[slot], &Entry->Link);
+
+    if (++Pacer->Count == 1)
+    {
+        Pacer->LastTick = KeQueryInterruptTime() / PACER_TICK_LENGTH;
+    }
+
+    // The timer may be armed for a later phase
+    if (++Pacer->SlotCounts[slot] == 1)
+    {
+        Pacer_ArmLocked(Pacer);
+    }
+
+    KeReleaseSpinLock(&Pacer->Lock, irql);
+
+    TraceEvents(TRACE_LEVEL_VERBOSE,
+        TRACE_PACER,
+        "Device %p joined phase %d",
+        Device,
+        slot);
+}
+
+//
+// Removes a device, stopping the tick with the last one.
+//
+// A tick which picked the entry before may still call its service once;
+// callers at PASSIVE_LEVEL can wait for that with KeFlushQueuedDpcs.
+//
+VOID Pacer_Leave(PPACER Pacer, PPACER_ENTRY Entry)
+{
+    KIRQL irql;
+
+    KeAcquireSpinLock(&Pacer->Lock, &irql);
+
+    if (Entry->Linked)
+    {
+        RemoveEntryList(&Entry->Link);
+        Pacer->SlotCounts[Entry->Slot]--;
+        Entry->Linked = FALSE;
+
+        if (--Pacer->Count == 0)
+        {
+            KeCancelTimer(&Pacer->Timer);
+        }
+    }
+
+    KeReleaseSpinLock(&Pacer->Lock, irql);
+}
+
+//
+// Stops the tick for good, waiting for a DPC still in flight.
+//
+VOID Pacer_Shutdown(PPACER Pacer)
+{
+    KeCancelTimer(&Pacer->Timer);
+    KeFlushQueuedDpcs();
+}
+
+//
+// Services every phase which came due since the last tick.
+//
+// The system clock may be coarser than a tick, in which case several
+// phases are due at once; each still gets serviced once per revolution.
+// Services may complete requests, so they run outside the lock on
+// referenced devices, in batches of PACER_SERVICE_BATCH.
+//
+VOID Pacer_EvtDpc(
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID DeferredContext,
+    _In_opt_ PVOID SystemArgument1,
+    _In_opt_ PVOID SystemArgument2
+)
+{
+    PPACER          pacer = (PPACER)DeferredContext;
+    PLIST_ENTRY     slot;
+    PPACER_ENTRY    entry;
+    WDFDEVICE       devices[PACER_SERVICE_BATCH];
+    PPACER_SERVICE  services[PACER_SERVICE_BATCH];
+    ULONG           remaining;
+    ULONG           count;
+    ULONG           i;
+    ULONGLONG       now;
+    ULONGLONG       tick;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    if (pacer == NULL)
+    {
+        return;
+    }
+
+    now = KeQueryInterruptTime() / PACER_TICK_LENGTH;
+
+    KeAcquireSpinLockAtDpcLevel(&pacer->Lock);
+
+    // Claim the due phases, a tick running on another processor skips them
+    tick = PacerWheel_ClaimTicks(&pacer->LastTick, now);
+
+    while (tick < now)
+    {
+        tick++;
+
+        slot = &pacer->Slots[tick % PACER_WHEEL_SLOTS];
+        remaining = pacer->SlotCounts[tick % PACER_WHEEL_SLOTS];
+
+        while (remaining > 0 && !IsListEmpty(slot))
+        {
+            //
+            // Serviced members move to the tail, so the next batch picks
+            // up where this one ended even if the phase changed meanwhile
+            //
+            for (count = 0;
+                count < PACER_SERVICE_BATCH && remaining > 0 && !IsListEmpty(slot);
+                count++, remaining--)
+            {
+                entry = CONTAINING_RECORD(RemoveHeadList(slot), PACER_ENTRY, Link);
+                InsertTailList(slot, &entry->Link);
+
+                WdfObjectReference(entry->Device);
+
+                devices[count] = entry->Device;
+                services[count] = entry->Service;
+            }
+
+            KeReleaseSpinLockFromDpcLevel(&pacer->Lock);
+
+            for (i = 0; i < count; i++)
+            {
+                services[i](devices[i]);
+
+                WdfObjectDereference(devices[i]);
+            }
+
+            KeAcquireSpinLockAtDpcLevel(&pacer->Lock);
+
+            // Members may have left meanwhile, don't go round twice
+            remaining = min(remaining, pacer->SlotCounts[tick % PACER_WHEEL_SLOTS]);
+        }
+    }
+
+    Pacer_ArmLocked(pacer);
+
+    KeReleaseSpinLockFromDpcLevel(&pacer->Lock);
+}
@@ -0,0 +1,103 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#pragma once
+
+//
+// Length of one wheel tick
+//
+#define PACER_TICK_PERIOD_MS            0x01
+
+//
+// Tick DPC may run on any processor
+//
+#define PACER_ANY_PROCESSOR             MAXULONG
+
+//
+// Members serviced per lock release of the tick
+//
+#define PACER_SERVICE_BATCH             0x10
+
+//
+// Called at DISPATCH_LEVEL once per revolution for every member, outside
+// the pacer lock and with the device referenced
+//
+typedef VOID PACER_SERVICE(_In_ WDFDEVICE Device);
+typedef PACER_SERVICE *PPACER_SERVICE;
+
+//
+// Wheel membership, embedded in the context of the serviced device.
+//
+typedef struct _PACER_ENTRY
+{
+    LIST_ENTRY Link;
+
+    WDFDEVICE Device;
+
+    PPACER_SERVICE Service;
+
+    //
+    // Phase the entry got assigned to
+    //
+    ULONG Slot;
+
+    BOOLEAN Linked;
+
+} PACER_ENTRY, *PPACER_ENTRY;
+
+//
+// Bus-wide timer wheel servicing all members from a single tick.
+//
+typedef struct _PACER
+{
+    //
+    // Protects the fields below
+    //
+    KSPIN_LOCK Lock;
+
+    //
+    // One-shot, armed for the next phase with members only
+    //
+    KTIMER Timer;
+
+    KDPC Dpc;
+
+    //
+    // Members bucketed by phase
+    //
+    LIST_ENTRY Slots[PACER_WHEEL_SLOTS];
+
+    ULONG SlotCounts[PACER_WHEEL_SLOTS];
+
+    ULONG Count;
+
+    //
+    // Last claimed tick, in PACER_TICK_PERIOD_MS units of interrupt time
+    //
+    ULONGLONG LastTick;
+
+} PACER, *PPACER;
+
+KDEFERRED_ROUTINE Pacer_EvtDpc;
+
+VOID Pacer_Initialize(PPACER Pacer, ULONG Processor);
+VOID Pacer_Join(PPACER Pacer, PPACER_ENTRY Entry, WDFDEVICE Device, PPACER_SERVICE Service);
+VOID Pacer_Leave(PPACER Pacer, PPACER_ENTRY Entry);
+VOID Pacer_Shutdown(PPACER Pacer);
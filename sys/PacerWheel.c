@@ -0,0 +1,91 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#endif
+
+#include "PacerWheel.h"
+
+
+//
+// Returns the least crowded phase, the lowest one on a tie.
+//
+ULONG PacerWheel_AssignSlot(const ULONG* SlotCounts)
+{
+    ULONG i;
+    ULONG slot = 0;
+
+    for (i = 1; i < PACER_WHEEL_SLOTS; i++)
+    {
+        if (SlotCounts[i] < SlotCounts[slot])
+        {
+            slot = i;
+        }
+    }
+
+    return slot;
+}
+
+//
+// Returns the first tick after Now whose phase has members.
+//
+// Some phase must have members, it's found within one revolution.
+//
+ULONGLONG PacerWheel_NextTick(const ULONG* SlotCounts, ULONGLONG Now)
+{
+    ULONGLONG next;
+
+    for (next = Now + 1; SlotCounts[next % PACER_WHEEL_SLOTS] == 0; next++)
+    {
+    }
+
+    return next;
+}
+
+//
+// Claims the ticks which came due since LastTick and moves it to Now.
+//
+// Returns the tick the caller continues after; ticks up to Now are due,
+// at most one revolution of them. A caller seeing LastTick already at or
+// past Now gets nothing, another one claimed those ticks.
+//
+ULONGLONG PacerWheel_ClaimTicks(ULONGLONG* LastTick, ULONGLONG Now)
+{
+    ULONGLONG tick = *LastTick;
+
+    if (tick > Now)
+    {
+        tick = Now;
+    }
+
+    if (Now - tick > PACER_WHEEL_SLOTS)
+    {
+        tick = Now - PACER_WHEEL_SLOTS;
+    }
+
+    if (Now > *LastTick)
+    {
+        *LastTick = Now;
+    }
+
+    return tick;
+}
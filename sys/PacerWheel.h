@@ -0,0 +1,36 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+#pragma once
+
+//
+// Phases of the wheel, every member gets serviced once per revolution
+//
+#define PACER_WHEEL_SLOTS               0x08
+
+//
+// Phase arithmetic of the pacer, framework-free so its scaling can be
+// measured on any host. Ticks count PACER_TICK_PERIOD_MS units.
+//
+
+ULONG PacerWheel_AssignSlot(const ULONG* SlotCounts);
+ULONGLONG PacerWheel_NextTick(const ULONG* SlotCounts, ULONGLONG Now);
+ULONGLONG PacerWheel_ClaimTicks(ULONGLONG* LastTick, ULONGLONG Now);
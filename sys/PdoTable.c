@@ -0,0 +1,104 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "busenum.h"
+
+#define PDO_TABLE_BUCKET(_Serial_) ((_Serial_) & (PDO_TABLE_BUCKET_COUNT - 1))
+
+C_ASSERT((PDO_TABLE_BUCKET_COUNT & (PDO_TABLE_BUCKET_COUNT - 1)) == 0);
+
+VOID PdoTable_Initialize(PPDO_TABLE Table)
+{
+    RtlZeroMemory(Table, sizeof(PDO_TABLE));
+}
+
+//
+// Makes a PDO discoverable by its serial number.
+// 
+// Newer entries shadow older ones with the same serial, so a PDO being
+// re-created while its predecessor is still torn down wins lookups.
+// 
+VOID PdoTable_Insert(PPDO_TABLE Table, PPDO_TABLE_ENTRY Entry, WDFDEVICE Device, ULONG SerialNo)
+{
+    KIRQL               irql;
+    PPDO_TABLE_ENTRY*   bucket = &Table->Buckets[PDO_TABLE_BUCKET(SerialNo)];
+
+    Entry->Device = Device;
+    Entry->SerialNo = SerialNo;
+
+    irql = ExAcquireSpinLockExclusive(&Table->Lock);
+
+    Entry->Next = *bucket;
+    *bucket = Entry;
+
+    ExReleaseSpinLockExclusive(&Table->Lock, irql);
+}
+
+//
+// Unlinks an entry, does nothing if it never got inserted.
+// 
+VOID PdoTable_Remove(PPDO_TABLE Table, PPDO_TABLE_ENTRY Entry)
+{
+    KIRQL               irql;
+    PPDO_TABLE_ENTRY*   link;
+
+    irql = ExAcquireSpinLockExclusive(&Table->Lock);
+
+    for (link = &Table->Buckets[PDO_TABLE_BUCKET(Entry->SerialNo)]; *link != NULL; link = &(*link)->Next)
+    {
+        if (*link == Entry)
+        {
+            *link = Entry->Next;
+            break;
+        }
+    }
+
+    ExReleaseSpinLockExclusive(&Table->Lock, irql);
+
+    Entry->Next = NULL;
+}
+
+//
+// Looks up the PDO with the supplied serial number.
+// 
+// The returned handle is referenced, the caller has to release it with
+// WdfObjectDereference once done.
+// 
+WDFDEVICE PdoTable_Lookup(PPDO_TABLE Table, ULONG SerialNo)
+{
+    KIRQL               irql;
+    PPDO_TABLE_ENTRY    entry;
+    WDFDEVICE           device = NULL;
+
+    irql = ExAcquireSpinLockShared(&Table->Lock);
+
+    for (entry = Table->Buckets[PDO_TABLE_BUCKET(SerialNo)]; entry != NULL; entry = entry->Next)
+    {
+        if (entry->SerialNo == SerialNo)
+        {
+            device = entry->Device;
+            WdfObjectReference(device);
+            break;
+        }
+    }
+
+    ExReleaseSpinLockShared(&Table->Lock, irql);
+
+    return device;
+}
@@ -0,0 +1,69 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+//
+// Number of hash buckets, must be a power of two
+// 
+#define PDO_TABLE_BUCKET_COUNT          0x100
+
+//
+// Links a PDO into the lookup table, embedded in its context.
+// 
+typedef struct _PDO_TABLE_ENTRY
+{
+    //
+    // Next entry in the same bucket
+    // 
+    struct _PDO_TABLE_ENTRY* Next;
+
+    //
+    // PDO owning this entry
+    // 
+    WDFDEVICE Device;
+
+    //
+    // Serial number the entry is hashed by
+    // 
+    ULONG SerialNo;
+
+} PDO_TABLE_ENTRY, *PPDO_TABLE_ENTRY;
+
+//
+// Maps serial numbers to PDOs without walking the child list.
+// 
+typedef struct _PDO_TABLE
+{
+    //
+    // Readers share the lock, only insertion and removal take it exclusively
+    // 
+    EX_SPIN_LOCK Lock;
+
+    //
+    // Singly-linked entry lists, indexed by the low bits of the serial
+    // 
+    PPDO_TABLE_ENTRY Buckets[PDO_TABLE_BUCKET_COUNT];
+
+} PDO_TABLE, *PPDO_TABLE;
+
+VOID PdoTable_Initialize(PPDO_TABLE Table);
+VOID PdoTable_Insert(PPDO_TABLE Table, PPDO_TABLE_ENTRY Entry, WDFDEVICE Device, ULONG SerialNo);
+VOID PdoTable_Remove(PPDO_TABLE Table, PPDO_TABLE_ENTRY Entry);
+WDFDEVICE PdoTable_Lookup(PPDO_TABLE Table, ULONG SerialNo);
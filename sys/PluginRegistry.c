@@ -0,0 +1,316 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "busenum.h"
+
+//
+// Request owning a node of the deadline heap
+// 
+#define PLUGIN_REGISTRY_NODE_REQUEST(_node_) \
+    ((WDFREQUEST)WdfObjectContextGetObject(CONTAINING_RECORD((_node_), FDO_PLUGIN_REQUEST_DATA, DeadlineNode)))
+
+//
+// Removes a request and all of its keys, the registry lock must be held.
+// 
+static VOID PluginRegistry_Unregister(PPLUGIN_REGISTRY Registry, WDFREQUEST Request)
+{
+    PFDO_PLUGIN_REQUEST_DATA pReqData = PluginRequestGetData(Request);
+    ULONG index;
+
+    if (!pReqData->Registered)
+    {
+        return;
+    }
+
+    if (pReqData->BatchCount == 0)
+    {
+        SerialHash_Unlink(&Registry->Keys, &pReqData->Key.Entry);
+    }
+
+    for (index = 0; index < pReqData->BatchCount; index++)
+    {
+        SerialHash_Unlink(&Registry->Keys, &pReqData->BatchEntries[index].Key.Entry);
+    }
+
+    DeadlineHeap_Remove(&Registry->Deadlines, &pReqData->DeadlineNode);
+
+    pReqData->Registered = FALSE;
+}
+
+//
+// Unregisters a request and hands out a reference to the caller.
+// 
+static WDFREQUEST PluginRegistry_Claim(PPLUGIN_REGISTRY Registry, WDFREQUEST Request)
+{
+    PluginRegistry_Unregister(Registry, Request);
+    PluginRequestGetData(Request)->Closed = TRUE;
+
+    WdfObjectReference(Request);
+
+    return Request;
+}
+
+//
+// Records the stage result of a batch entry, the registry lock must be held.
+// 
+static WDFREQUEST PluginRegistry_ResolveBatchEntry(
+    PPLUGIN_REGISTRY Registry,
+    PPLUGIN_REGISTRY_KEY Key,
+    NTSTATUS Status
+)
+{
+    PFDO_PLUGIN_REQUEST_DATA pReqData = PluginRequestGetData(Key->Request);
+    PFDO_PLUGIN_BATCH_ENTRY entry = &pReqData->BatchEntries[Key->Index];
+
+    SerialHash_Unlink(&Registry->Keys, &Key->Entry);
+
+    if (entry->Status != STATUS_PENDING)
+    {
+        return NULL;
+    }
+
+    entry->Status = Status;
+
+    if (--pReqData->BatchRemaining > 0)
+    {
+        return NULL;
+    }
+
+    return PluginRegistry_Claim(Registry, Key->Request);
+}
+
+VOID PluginRegistry_Initialize(PPLUGIN_REGISTRY Registry)
+{
+    KeInitializeSpinLock(&Registry->Lock);
+    SerialHash_Initialize(&Registry->Keys);
+    DeadlineHeap_Initialize(&Registry->Deadlines);
+}
+
+//
+// Registers a pending plugin request, its deadline and keys must be set.
+// 
+// Batch entries which already failed don't get a key linked.
+// 
+NTSTATUS PluginRegistry_Insert(PPLUGIN_REGISTRY Registry, WDFREQUEST Request)
+{
+    PFDO_PLUGIN_REQUEST_DATA pReqData = PluginRequestGetData(Request);
+    NTSTATUS status = STATUS_SUCCESS;
+    KIRQL irql;
+    ULONG index;
+
+    KeAcquireSpinLock(&Registry->Lock, &irql);
+
+    if (pReqData->Closed)
+    {
+        status = STATUS_CANCELLED;
+    }
+    else if (!DeadlineHeap_Insert(&Registry->Deadlines, &pReqData->DeadlineNode))
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+    else
+    {
+        if (pReqData->BatchCount == 0)
+        {
+            SerialHash_Link(&Registry->Keys, &pReqData->Key.Entry);
+        }
+
+        for (index = 0; index < pReqData->BatchCount; index++)
+        {
+            if (pReqData->BatchEntries[index].Status == STATUS_PENDING)
+            {
+                SerialHash_Link(&Registry->Keys, &pReqData->BatchEntries[index].Key.Entry);
+            }
+        }
+
+        pReqData->Registered = TRUE;
+    }
+
+    KeReleaseSpinLock(&Registry->Lock, irql);
+
+    return status;
+}
+
+//
+// Moves a key to a new serial number, e.g. after picking another free serial.
+// 
+VOID PluginRegistry_Rekey(PPLUGIN_REGISTRY Registry, PPLUGIN_REGISTRY_KEY Key, ULONG SerialNo)
+{
+    KIRQL irql;
+    BOOLEAN linked;
+
+    KeAcquireSpinLock(&Registry->Lock, &irql);
+
+    linked = Key->Entry.Linked;
+
+    SerialHash_Unlink(&Registry->Keys, &Key->Entry);
+
+    Key->Entry.SerialNo = SerialNo;
+
+    if (linked)
+    {
+        SerialHash_Link(&Registry->Keys, &Key->Entry);
+    }
+
+    KeReleaseSpinLock(&Registry->Lock, irql);
+}
+
+//
+// Removes a request for good.
+// 
+// Returns TRUE if the caller is the first one to close it, which makes
+// the caller responsible for completing the request.
+// 
+BOOLEAN PluginRegistry_Close(PPLUGIN_REGISTRY Registry, WDFREQUEST Request)
+{
+    PFDO_PLUGIN_REQUEST_DATA pReqData = PluginRequestGetData(Request);
+    KIRQL irql;
+    BOOLEAN first;
+
+    KeAcquireSpinLock(&Registry->Lock, &irql);
+
+    first = !pReqData->Closed;
+
+    PluginRegistry_Unregister(Registry, Request);
+    pReqData->Closed = TRUE;
+
+    KeReleaseSpinLock(&Registry->Lock, irql);
+
+    return first;
+}
+
+//
+// Delivers the stage result of a serial number to the oldest request waiting for it.
+// 
+// Returns a referenced request once it has no more results to wait for, NULL otherwise.
+// 
+WDFREQUEST PluginRegistry_Resolve(PPLUGIN_REGISTRY Registry, ULONG SerialNo, NTSTATUS Status)
+{
+    PSERIAL_HASH_ENTRY entry;
+    PPLUGIN_REGISTRY_KEY key;
+    WDFREQUEST request = NULL;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&Registry->Lock, &irql);
+
+    entry = SerialHash_Find(&Registry->Keys, SerialNo);
+
+    if (entry != NULL)
+    {
+        key = CONTAINING_RECORD(entry, PLUGIN_REGISTRY_KEY, Entry);
+
+        request = (key->Index == PLUGIN_REGISTRY_SINGLE)
+            ? PluginRegistry_Claim(Registry, key->Request)
+            : PluginRegistry_ResolveBatchEntry(Registry, key, Status);
+    }
+
+    KeReleaseSpinLock(&Registry->Lock, irql);
+
+    return request;
+}
+
+//
+// Records the result of a batch entry which failed before reaching the bus.
+// 
+WDFREQUEST PluginRegistry_ResolveEntry(PPLUGIN_REGISTRY Registry, WDFREQUEST Request, ULONG Index, NTSTATUS Status)
+{
+    PFDO_PLUGIN_REQUEST_DATA pReqData = PluginRequestGetData(Request);
+    WDFREQUEST request = NULL;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&Registry->Lock, &irql);
+
+    if (pReqData->Registered)
+    {
+        request = PluginRegistry_ResolveBatchEntry(Registry, &pReqData->BatchEntries[Index].Key, Status);
+    }
+
+    KeReleaseSpinLock(&Registry->Lock, irql);
+
+    return request;
+}
+
+//
+// Drops the count a batch request holds while its entries are being added.
+// 
+WDFREQUEST PluginRegistry_Release(PPLUGIN_REGISTRY Registry, WDFREQUEST Request)
+{
+    PFDO_PLUGIN_REQUEST_DATA pReqData = PluginRequestGetData(Request);
+    WDFREQUEST request = NULL;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&Registry->Lock, &irql);
+
+    if (pReqData->Registered && --pReqData->BatchRemaining == 0)
+    {
+        request = PluginRegistry_Claim(Registry, Request);
+    }
+
+    KeReleaseSpinLock(&Registry->Lock, irql);
+
+    return request;
+}
+
+//
+// Removes the request with the earliest deadline if it passed Now.
+// 
+// NextDeadline receives the earliest remaining deadline, zero if none is left.
+// 
+WDFREQUEST PluginRegistry_PopExpired(PPLUGIN_REGISTRY Registry, ULONGLONG Now, PULONGLONG NextDeadline)
+{
+    PDEADLINE_HEAP_NODE node;
+    WDFREQUEST request = NULL;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&Registry->Lock, &irql);
+
+    node = DEADLINE_HEAP_PEEK(&Registry->Deadlines);
+
+    if (node != NULL && node->Deadline <= Now)
+    {
+        request = PluginRegistry_Claim(Registry, PLUGIN_REGISTRY_NODE_REQUEST(node));
+    }
+
+    node = DEADLINE_HEAP_PEEK(&Registry->Deadlines);
+
+    *NextDeadline = (node != NULL) ? node->Deadline : 0;
+
+    KeReleaseSpinLock(&Registry->Lock, irql);
+
+    return request;
+}
+
+//
+// Returns the earliest deadline of the registered requests, zero if none is left.
+// 
+ULONGLONG PluginRegistry_NextDeadline(PPLUGIN_REGISTRY Registry)
+{
+    PDEADLINE_HEAP_NODE node;
+    ULONGLONG deadline;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&Registry->Lock, &irql);
+
+    node = DEADLINE_HEAP_PEEK(&Registry->Deadlines);
+    deadline = (node != NULL) ? node->Deadline : 0;
+
+    KeReleaseSpinLock(&Registry->Lock, irql);
+
+    return deadline;
+}
@@ -0,0 +1,81 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#define PLUGIN_REGISTRY_MAX_PENDING     DEADLINE_HEAP_MAX_NODES
+
+//
+// Key index of single plugin requests
+// 
+#define PLUGIN_REGISTRY_SINGLE          MAXULONG
+
+//
+// Links a serial number awaiting its stage result to the plugin request.
+// 
+typedef struct _PLUGIN_REGISTRY_KEY
+{
+    //
+    // Hashes the key by the serial number of the child
+    // 
+    SERIAL_HASH_ENTRY Entry;
+
+    //
+    // Request waiting for the result
+    // 
+    WDFREQUEST Request;
+
+    //
+    // Batch entry index, PLUGIN_REGISTRY_SINGLE for single plugin requests
+    // 
+    ULONG Index;
+
+} PLUGIN_REGISTRY_KEY, *PPLUGIN_REGISTRY_KEY;
+
+//
+// Pending plugin requests, looked up by serial number and ordered by deadline.
+// 
+typedef struct _PLUGIN_REGISTRY
+{
+    //
+    // Protects the fields below and the registry fields of the requests
+    // 
+    KSPIN_LOCK Lock;
+
+    //
+    // Keys hashed by serial number, oldest first
+    // 
+    SERIAL_HASH Keys;
+
+    //
+    // Registered requests ordered by deadline
+    // 
+    DEADLINE_HEAP Deadlines;
+
+} PLUGIN_REGISTRY, *PPLUGIN_REGISTRY;
+
+VOID PluginRegistry_Initialize(PPLUGIN_REGISTRY Registry);
+NTSTATUS PluginRegistry_Insert(PPLUGIN_REGISTRY Registry, WDFREQUEST Request);
+VOID PluginRegistry_Rekey(PPLUGIN_REGISTRY Registry, PPLUGIN_REGISTRY_KEY Key, ULONG SerialNo);
+BOOLEAN PluginRegistry_Close(PPLUGIN_REGISTRY Registry, WDFREQUEST Request);
+WDFREQUEST PluginRegistry_Resolve(PPLUGIN_REGISTRY Registry, ULONG SerialNo, NTSTATUS Status);
+WDFREQUEST PluginRegistry_ResolveEntry(PPLUGIN_REGISTRY Registry, WDFREQUEST Request, ULONG Index, NTSTATUS Status);
+WDFREQUEST PluginRegistry_Release(PPLUGIN_REGISTRY Registry, WDFREQUEST Request);
+WDFREQUEST PluginRegistry_PopExpired(PPLUGIN_REGISTRY Registry, ULONGLONG Now, PULONGLONG NextDeadline);
+ULONGLONG PluginRegistry_NextDeadline(PPLUGIN_REGISTRY Registry);
@@ -1,6 +1,6 @@
 /*
 * Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
-* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
 *
 * This program is free software: you can redistribute it and/or modify
 * it under the terms of the GNU General Public License as published by
@@ -24,370 +24,706 @@
 #pragma alloc_text (PAGE, Bus_EvtIoDefault)
 #endif
 
+#pragma region IOCTL input validation
+
 //
-// Responds to I/O control requests sent to the FDO.
+// Validators below rely on every input structure starting with Size followed by SerialNo
 // 
-VOID Bus_EvtIoDeviceControl(
-    IN WDFQUEUE Queue,
-    IN WDFREQUEST Request,
-    IN size_t OutputBufferLength,
-    IN size_t InputBufferLength,
-    IN ULONG IoControlCode
+#define BUS_IOCTL_ASSERT_SIZE_FIELD(_type_) \
+    C_ASSERT(FIELD_OFFSET(_type_, Size) == 0 && RTL_FIELD_SIZE(_type_, Size) == sizeof(ULONG))
+
+#define BUS_IOCTL_ASSERT_SERIAL_FIELD(_type_) \
+    BUS_IOCTL_ASSERT_SIZE_FIELD(_type_); \
+    C_ASSERT(FIELD_OFFSET(_type_, SerialNo) == sizeof(ULONG) && RTL_FIELD_SIZE(_type_, SerialNo) == sizeof(ULONG))
+
+//
+// Batches start with Size followed by Count instead
+// 
+#define BUS_IOCTL_ASSERT_BATCH_FIELDS(_type_) \
+    BUS_IOCTL_ASSERT_SIZE_FIELD(_type_); \
+    C_ASSERT(FIELD_OFFSET(_type_, Count) == sizeof(ULONG) && RTL_FIELD_SIZE(_type_, Count) == sizeof(ULONG))
+
+BUS_IOCTL_ASSERT_SIZE_FIELD(VIGEM_CHECK_VERSION);
+BUS_IOCTL_ASSERT_SERIAL_FIELD(XUSB_SUBMIT_REPORT);
+BUS_IOCTL_ASSERT_SERIAL_FIELD(XUSB_REQUEST_NOTIFICATION);
+BUS_IOCTL_ASSERT_SERIAL_FIELD(XUSB_GET_USER_INDEX);
+BUS_IOCTL_ASSERT_SERIAL_FIELD(NSWITCH_SUBMIT_REPORT);
+BUS_IOCTL_ASSERT_SERIAL_FIELD(NSWITCH_REQUEST_NOTIFICATION);
+BUS_IOCTL_ASSERT_SERIAL_FIELD(XGIP_SUBMIT_REPORT);
+BUS_IOCTL_ASSERT_SERIAL_FIELD(XGIP_SUBMIT_INTERRUPT);
+BUS_IOCTL_ASSERT_SERIAL_FIELD(VIGEM_MAP_INPUT_RING);
+BUS_IOCTL_ASSERT_SERIAL_FIELD(VIGEM_INPUT_RING_DOORBELL);
+BUS_IOCTL_ASSERT_BATCH_FIELDS(VIGEM_SUBMIT_REPORT_BATCH);
+BUS_IOCTL_ASSERT_BATCH_FIELDS(VIGEM_PLUGIN_TARGET_BATCH);
+BUS_IOCTL_ASSERT_SIZE_FIELD(VIGEM_GET_STATISTICS);
+BUS_IOCTL_ASSERT_SIZE_FIELD(VIGEM_REQUEST_SESSION_NOTIFICATION);
+BUS_IOCTL_ASSERT_SERIAL_FIELD(VIGEM_REQUEST_OUTPUT_EVENTS);
+
+//
+// Reads the fields shared by all input structures
+// 
+#define BUS_IOCTL_INPUT_SIZE(_buffer_)      (((PULONG)(_buffer_))[0])
+#define BUS_IOCTL_INPUT_SERIAL(_buffer_)    (((PULONG)(_buffer_))[1])
+#define BUS_IOCTL_BATCH_COUNT(_buffer_)     (((PULONG)(_buffer_))[1])
+
+//
+// Checks the layout of a batch, the entries are checked individually.
+// 
+// HeaderSize is the offset of the entries; results are reported in-place,
+// so the caller has to receive the whole batch back.
+// 
+static NTSTATUS Bus_ValidateBatch(
+    PVOID Batch,
+    size_t Length,
+    size_t OutputBufferLength,
+    size_t HeaderSize,
+    size_t EntrySize,
+    ULONG MaxCount
 )
 {
-    NTSTATUS                    status = STATUS_INVALID_PARAMETER;
-    WDFDEVICE                   Device;
-    size_t                      length = 0;
-    PXUSB_SUBMIT_REPORT         xusbSubmit = NULL;
-    PXUSB_REQUEST_NOTIFICATION  xusbNotify = NULL;
-    PNSWITCH_SUBMIT_REPORT          nintSwitchSubmit = NULL;
-    PNSWITCH_REQUEST_NOTIFICATION   nintSwitchNotify = NULL;
-    PXGIP_SUBMIT_REPORT         xgipSubmit = NULL;
-    PXGIP_SUBMIT_INTERRUPT      xgipInterrupt = NULL;
-    PVIGEM_CHECK_VERSION        pCheckVersion = NULL;
-    PXUSB_GET_USER_INDEX        pXusbGetUserIndex = NULL;
+    ULONG count = BUS_IOCTL_BATCH_COUNT(Batch);
 
-    Device = WdfIoQueueGetDevice(Queue);
+    if (OutputBufferLength < Length)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_QUEUE,
+            "Output buffer %d too small, require at least %d",
+            (int)OutputBufferLength, (int)Length);
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    // Count is bounded before it goes into the size
+    if (count == 0
+        || count > MaxCount
+        || BUS_IOCTL_INPUT_SIZE(Batch) != HeaderSize + count * EntrySize
+        || Length != BUS_IOCTL_INPUT_SIZE(Batch))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_QUEUE,
+            "Invalid batch layout (size: %d, count: %d)",
+            BUS_IOCTL_INPUT_SIZE(Batch), count);
+        return STATUS_INVALID_PARAMETER;
+    }
 
-    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_QUEUE, "%!FUNC! Entry (device: 0x%p)", Device);
+    return STATUS_SUCCESS;
+}
 
-    switch (IoControlCode)
+#pragma endregion
+
+#pragma region IOCTL handlers
+
+static BUS_IOCTL_HANDLER Bus_IoctlCheckVersion;
+static BUS_IOCTL_HANDLER Bus_IoctlPlugInTarget;
+static BUS_IOCTL_HANDLER Bus_IoctlPlugInTargetBatch;
+static BUS_IOCTL_HANDLER Bus_IoctlUnPlugTarget;
+static BUS_IOCTL_HANDLER Bus_IoctlXusbSubmitReport;
+static BUS_IOCTL_HANDLER Bus_IoctlNintSwitchSubmitReport;
+static BUS_IOCTL_HANDLER Bus_IoctlXgipSubmitReport;
+static BUS_IOCTL_HANDLER Bus_IoctlXgipSubmitInterrupt;
+static BUS_IOCTL_HANDLER Bus_IoctlSubmitReportBatch;
+static BUS_IOCTL_HANDLER Bus_IoctlInputRingDoorbell;
+static BUS_IOCTL_HANDLER Bus_IoctlRequestNotification;
+static BUS_IOCTL_HANDLER Bus_IoctlXusbGetUserIndex;
+static BUS_IOCTL_HANDLER Bus_IoctlMapInputRing;
+static BUS_IOCTL_HANDLER Bus_IoctlRequestOutputEvents;
+static BUS_IOCTL_HANDLER Bus_IoctlGetStatistics;
+static BUS_IOCTL_HANDLER Bus_IoctlRequestSessionNotification;
+
+#define BUS_IOCTL_ENTRY(_code_, _in_, _out_, _flags_, _handler_) \
+    { (_code_), (ULONG)(_in_), (ULONG)(_out_), (_flags_), (_handler_), #_code_ }
+
+//
+// I/O control requests accepted by the FDO.
+// 
+// Looked up by a linear scan, so the report submission requests come first.
+// 
+static const BUS_IOCTL_DESCRIPTOR G_BusIoctlTable[] =
+{
+    BUS_IOCTL_ENTRY(IOCTL_XUSB_SUBMIT_REPORT,
+        sizeof(XUSB_SUBMIT_REPORT), 0,
+        BUS_IOCTL_FLAG_SERIAL_REQUIRED | BUS_IOCTL_FLAG_FAST_PATH,
+        Bus_IoctlXusbSubmitReport),
+    BUS_IOCTL_ENTRY(IOCTL_NSWITCH_SUBMIT_REPORT,
+        sizeof(NSWITCH_SUBMIT_REPORT), 0,
+        BUS_IOCTL_FLAG_SERIAL_REQUIRED | BUS_IOCTL_FLAG_FAST_PATH,
+        Bus_IoctlNintSwitchSubmitReport),
+    BUS_IOCTL_ENTRY(IOCTL_XGIP_SUBMIT_REPORT,
+        sizeof(XGIP_SUBMIT_REPORT), 0,
+        BUS_IOCTL_FLAG_SERIAL_REQUIRED | BUS_IOCTL_FLAG_FAST_PATH,
+        Bus_IoctlXgipSubmitReport),
+    BUS_IOCTL_ENTRY(IOCTL_VIGEM_SUBMIT_REPORT_BATCH,
+        VIGEM_SUBMIT_REPORT_BATCH_SIZE(1), 0,
+        BUS_IOCTL_FLAG_VARIABLE_INPUT | BUS_IOCTL_FLAG_FAST_PATH,
+        Bus_IoctlSubmitReportBatch),
+    BUS_IOCTL_ENTRY(IOCTL_VIGEM_INPUT_RING_DOORBELL,
+        sizeof(VIGEM_INPUT_RING_DOORBELL), 0,
+        BUS_IOCTL_FLAG_SERIAL_REQUIRED | BUS_IOCTL_FLAG_FAST_PATH,
+        Bus_IoctlInputRingDoorbell),
+    BUS_IOCTL_ENTRY(IOCTL_XGIP_SUBMIT_INTERRUPT,
+        sizeof(XGIP_SUBMIT_INTERRUPT), 0,
+        BUS_IOCTL_FLAG_SERIAL_REQUIRED,
+        Bus_IoctlXgipSubmitInterrupt),
+    BUS_IOCTL_ENTRY(IOCTL_XUSB_REQUEST_NOTIFICATION,
+        sizeof(XUSB_REQUEST_NOTIFICATION), sizeof(XUSB_REQUEST_NOTIFICATION),
+        BUS_IOCTL_FLAG_SERIAL_REQUIRED,
+        Bus_IoctlRequestNotification),
+    BUS_IOCTL_ENTRY(IOCTL_NSWITCH_REQUEST_NOTIFICATION,
+        sizeof(NSWITCH_REQUEST_NOTIFICATION), sizeof(NSWITCH_REQUEST_NOTIFICATION),
+        BUS_IOCTL_FLAG_SERIAL_REQUIRED,
+        Bus_IoctlRequestNotification),
+    BUS_IOCTL_ENTRY(IOCTL_VIGEM_REQUEST_OUTPUT_EVENTS,
+        sizeof(VIGEM_REQUEST_OUTPUT_EVENTS), sizeof(VIGEM_OUTPUT_EVENTS),
+        BUS_IOCTL_FLAG_SERIAL_REQUIRED,
+        Bus_IoctlRequestOutputEvents),
+    BUS_IOCTL_ENTRY(IOCTL_VIGEM_REQUEST_SESSION_NOTIFICATION,
+        sizeof(VIGEM_REQUEST_SESSION_NOTIFICATION), sizeof(VIGEM_SESSION_NOTIFICATION),
+        0,
+        Bus_IoctlRequestSessionNotification),
+    BUS_IOCTL_ENTRY(IOCTL_XUSB_GET_USER_INDEX,
+        sizeof(XUSB_GET_USER_INDEX), sizeof(XUSB_GET_USER_INDEX),
+        BUS_IOCTL_FLAG_SERIAL_REQUIRED,
+        Bus_IoctlXusbGetUserIndex),
+    BUS_IOCTL_ENTRY(IOCTL_VIGEM_MAP_INPUT_RING,
+        sizeof(VIGEM_MAP_INPUT_RING), 0,
+        BUS_IOCTL_FLAG_SERIAL_REQUIRED,
+        Bus_IoctlMapInputRing),
+    BUS_IOCTL_ENTRY(IOCTL_VIGEM_PLUGIN_TARGET,
+        0, 0,
+        BUS_IOCTL_FLAG_PNP,
+        Bus_IoctlPlugInTarget),
+    BUS_IOCTL_ENTRY(IOCTL_VIGEM_PLUGIN_TARGET_BATCH,
+        VIGEM_PLUGIN_TARGET_BATCH_SIZE(1), VIGEM_PLUGIN_TARGET_BATCH_SIZE(1),
+        BUS_IOCTL_FLAG_VARIABLE_INPUT | BUS_IOCTL_FLAG_PNP,
+        Bus_IoctlPlugInTargetBatch),
+    BUS_IOCTL_ENTRY(IOCTL_VIGEM_UNPLUG_TARGET,
+        0, 0,
+        BUS_IOCTL_FLAG_PNP,
+        Bus_IoctlUnPlugTarget),
+    BUS_IOCTL_ENTRY(IOCTL_VIGEM_CHECK_VERSION,
+        sizeof(VIGEM_CHECK_VERSION), 0,
+        0,
+        Bus_IoctlCheckVersion),
+    BUS_IOCTL_ENTRY(IOCTL_VIGEM_GET_STATISTICS,
+        sizeof(VIGEM_GET_STATISTICS), sizeof(VIGEM_STATISTICS),
+        0,
+        Bus_IoctlGetStatistics),
+};
+
+// Table index doubles as statistics slot, a new IOCTL needs one
+C_ASSERT(ARRAYSIZE(G_BusIoctlTable) == STATS_MAX_IOCTLS);
+
+NTSTATUS Bus_IoctlCheckVersion(
+    WDFDEVICE Device,
+    WDFREQUEST Request,
+    PVOID Buffer,
+    size_t OutputBufferLength,
+    size_t* Transferred
+)
+{
+    PVIGEM_CHECK_VERSION pCheckVersion = Buffer;
+
+    UNREFERENCED_PARAMETER(Device);
+    UNREFERENCED_PARAMETER(Request);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(Transferred);
+
+    TraceEvents(TRACE_LEVEL_VERBOSE,
+        TRACE_QUEUE,
+        "Requested version: 0x%04X, compiled version: 0x%04X",
+        pCheckVersion->Version, VIGEM_COMMON_VERSION);
+
+    return (pCheckVersion->Version == VIGEM_COMMON_VERSION) ? STATUS_SUCCESS : STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS Bus_IoctlPlugInTarget(
+    WDFDEVICE Device,
+    WDFREQUEST Request,
+    PVOID Buffer,
+    size_t OutputBufferLength,
+    size_t* Transferred
+)
+{
+    UNREFERENCED_PARAMETER(Buffer);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    return Bus_PlugInDevice(Device, Request, FALSE, Transferred);
+}
+
+NTSTATUS Bus_IoctlPlugInTargetBatch(
+    WDFDEVICE Device,
+    WDFREQUEST Request,
+    PVOID Buffer,
+    size_t OutputBufferLength,
+    size_t* Transferred
+)
+{
+    NTSTATUS status;
+    PVIGEM_PLUGIN_TARGET_BATCH pPlugInBatch = Buffer;
+
+    status = Bus_ValidateBatch(pPlugInBatch, *Transferred, OutputBufferLength,
+        FIELD_OFFSET(VIGEM_PLUGIN_TARGET_BATCH, Entries),
+        sizeof(VIGEM_PLUGIN_TARGET_BATCH_ENTRY),
+        VIGEM_PLUGIN_TARGET_BATCH_MAX_ENTRIES);
+    if (!NT_SUCCESS(status))
     {
-#pragma region IOCTL_VIGEM_CHECK_VERSION
-    case IOCTL_VIGEM_CHECK_VERSION:
+        return status;
+    }
 
-        TraceEvents(TRACE_LEVEL_INFORMATION,
-            TRACE_QUEUE,
-            "IOCTL_VIGEM_CHECK_VERSION");
+    return Bus_PlugInDeviceBatch(Device, Request, pPlugInBatch);
+}
 
-        status = WdfRequestRetrieveInputBuffer(Request, sizeof(VIGEM_CHECK_VERSION), (PVOID)&pCheckVersion, &length);
+NTSTATUS Bus_IoctlUnPlugTarget(
+    WDFDEVICE Device,
+    WDFREQUEST Request,
+    PVOID Buffer,
+    size_t OutputBufferLength,
+    size_t* Transferred
+)
+{
+    UNREFERENCED_PARAMETER(Buffer);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
 
-        if (!NT_SUCCESS(status) || length != sizeof(VIGEM_CHECK_VERSION))
-        {
-            status = STATUS_INVALID_PARAMETER;
-            break;
-        }
+    return Bus_UnPlugDevice(Device, Request, FALSE, Transferred);
+}
 
-        status = (pCheckVersion->Version == VIGEM_COMMON_VERSION) ? STATUS_SUCCESS : STATUS_NOT_SUPPORTED;
+NTSTATUS Bus_IoctlXusbSubmitReport(
+    WDFDEVICE Device,
+    WDFREQUEST Request,
+    PVOID Buffer,
+    size_t OutputBufferLength,
+    size_t* Transferred
+)
+{
+    PXUSB_SUBMIT_REPORT xusbSubmit = Buffer;
 
-        TraceEvents(TRACE_LEVEL_VERBOSE,
-            TRACE_QUEUE,
-            "Requested version: 0x%04X, compiled version: 0x%04X",
-            pCheckVersion->Version, VIGEM_COMMON_VERSION);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(Transferred);
 
-        break;
-#pragma endregion 
+    return Bus_XusbSubmitReport(Device, xusbSubmit->SerialNo, xusbSubmit, Bus_GetRequestSessionId(Request));
+}
 
-#pragma region IOCTL_VIGEM_PLUGIN_TARGET
-    case IOCTL_VIGEM_PLUGIN_TARGET:
+NTSTATUS Bus_IoctlNintSwitchSubmitReport(
+    WDFDEVICE Device,
+    WDFREQUEST Request,
+    PVOID Buffer,
+    size_t OutputBufferLength,
+    size_t* Transferred
+)
+{
+    PNSWITCH_SUBMIT_REPORT nintSwitchSubmit = Buffer;
 
-        TraceEvents(TRACE_LEVEL_INFORMATION,
-            TRACE_QUEUE,
-            "IOCTL_VIGEM_PLUGIN_TARGET");
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(Transferred);
 
-        status = Bus_PlugInDevice(Device, Request, FALSE, &length);
+    return Bus_NintSwitchSubmitReport(Device, nintSwitchSubmit->SerialNo, nintSwitchSubmit, Bus_GetRequestSessionId(Request));
+}
 
-        break;
-#pragma endregion 
+NTSTATUS Bus_IoctlXgipSubmitReport(
+    WDFDEVICE Device,
+    WDFREQUEST Request,
+    PVOID Buffer,
+    size_t OutputBufferLength,
+    size_t* Transferred
+)
+{
+    PXGIP_SUBMIT_REPORT xgipSubmit = Buffer;
 
-#pragma region IOCTL_VIGEM_UNPLUG_TARGET
-    case IOCTL_VIGEM_UNPLUG_TARGET:
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(Transferred);
 
-        TraceEvents(TRACE_LEVEL_INFORMATION,
-            TRACE_QUEUE,
-            "IOCTL_VIGEM_UNPLUG_TARGET");
+    return Bus_XgipSubmitReport(Device, xgipSubmit->SerialNo, xgipSubmit, Bus_GetRequestSessionId(Request));
+}
 
-        status = Bus_UnPlugDevice(Device, Request, FALSE, &length);
+NTSTATUS Bus_IoctlXgipSubmitInterrupt(
+    WDFDEVICE Device,
+    WDFREQUEST Request,
+    PVOID Buffer,
+    size_t OutputBufferLength,
+    size_t* Transferred
+)
+{
+    PXGIP_SUBMIT_INTERRUPT xgipInterrupt = Buffer;
 
-        break;
-#pragma endregion 
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(Transferred);
 
-#pragma region IOCTL_XUSB_SUBMIT_REPORT
-    case IOCTL_XUSB_SUBMIT_REPORT:
+    return Bus_XgipSubmitInterrupt(Device, xgipInterrupt->SerialNo, xgipInterrupt, Bus_GetRequestSessionId(Request));
+}
 
-        TraceEvents(TRACE_LEVEL_VERBOSE,
-            TRACE_QUEUE,
-            "IOCTL_XUSB_SUBMIT_REPORT");
+NTSTATUS Bus_IoctlSubmitReportBatch(
+    WDFDEVICE Device,
+    WDFREQUEST Request,
+    PVOID Buffer,
+    size_t OutputBufferLength,
+    size_t* Transferred
+)
+{
+    NTSTATUS status;
+    PVIGEM_SUBMIT_REPORT_BATCH pSubmitBatch = Buffer;
+
+    // Validate the batch layout once, the entries are checked individually
+    status = Bus_ValidateBatch(pSubmitBatch, *Transferred, OutputBufferLength,
+        FIELD_OFFSET(VIGEM_SUBMIT_REPORT_BATCH, Entries),
+        sizeof(VIGEM_SUBMIT_REPORT_BATCH_ENTRY),
+        VIGEM_SUBMIT_REPORT_BATCH_MAX_ENTRIES);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
 
-        status = WdfRequestRetrieveInputBuffer(Request, sizeof(XUSB_SUBMIT_REPORT), (PVOID)&xusbSubmit, &length);
+    return Bus_SubmitReportBatch(Device, pSubmitBatch, Bus_GetRequestSessionId(Request));
+}
 
-        if (!NT_SUCCESS(status))
-        {
-            TraceEvents(TRACE_LEVEL_ERROR,
-                TRACE_QUEUE,
-                "WdfRequestRetrieveInputBuffer failed with status %!STATUS!",
-                status);
-            break;
-        }
+NTSTATUS Bus_IoctlInputRingDoorbell(
+    WDFDEVICE Device,
+    WDFREQUEST Request,
+    PVOID Buffer,
+    size_t OutputBufferLength,
+    size_t* Transferred
+)
+{
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(Transferred);
 
-        if ((sizeof(XUSB_SUBMIT_REPORT) == xusbSubmit->Size) && (length == InputBufferLength))
-        {
-            // This request only supports a single PDO at a time
-            if (xusbSubmit->SerialNo == 0)
-            {
-                TraceEvents(TRACE_LEVEL_ERROR,
-                    TRACE_QUEUE,
-                    "Invalid serial 0 submitted");
-
-                status = STATUS_INVALID_PARAMETER;
-                break;
-            }
-
-            status = Bus_XusbSubmitReport(Device, xusbSubmit->SerialNo, xusbSubmit, FALSE);
-        }
+    return Bus_InputRingDoorbell(Device, BUS_IOCTL_INPUT_SERIAL(Buffer), Bus_GetRequestSessionId(Request));
+}
 
-        break;
-#pragma endregion 
+NTSTATUS Bus_IoctlRequestNotification(
+    WDFDEVICE Device,
+    WDFREQUEST Request,
+    PVOID Buffer,
+    size_t OutputBufferLength,
+    size_t* Transferred
+)
+{
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(Transferred);
 
-#pragma region IOCTL_XUSB_REQUEST_NOTIFICATION
-    case IOCTL_XUSB_REQUEST_NOTIFICATION:
+    // XUSB and NSWITCH notification requests share the same header
+    return Bus_QueueNotification(Device, BUS_IOCTL_INPUT_SERIAL(Buffer), Request);
+}
 
-        TraceEvents(TRACE_LEVEL_INFORMATION,
-            TRACE_QUEUE,
-            "IOCTL_XUSB_REQUEST_NOTIFICATION");
+NTSTATUS Bus_IoctlRequestOutputEvents(
+    WDFDEVICE Device,
+    WDFREQUEST Request,
+    PVOID Buffer,
+    size_t OutputBufferLength,
+    size_t* Transferred
+)
+{
+    UNREFERENCED_PARAMETER(OutputBufferLength);
 
-        // Don't accept the request if the output buffer can't hold the results
-        if (OutputBufferLength < sizeof(XUSB_REQUEST_NOTIFICATION))
-        {
-            TraceEvents(TRACE_LEVEL_ERROR,
-                TRACE_QUEUE,
-                "Output buffer %d too small, require at least %d",
-                (int)OutputBufferLength, (int)sizeof(XUSB_REQUEST_NOTIFICATION));
-            break;
-        }
+    return Bus_RequestOutputEvents(Device, BUS_IOCTL_INPUT_SERIAL(Buffer), Request, Transferred);
+}
 
-        status = WdfRequestRetrieveInputBuffer(Request, sizeof(XUSB_REQUEST_NOTIFICATION), (PVOID)&xusbNotify, &length);
+NTSTATUS Bus_IoctlRequestSessionNotification(
+    WDFDEVICE Device,
+    WDFREQUEST Request,
+    PVOID Buffer,
+    size_t OutputBufferLength,
+    size_t* Transferred
+)
+{
+    UNREFERENCED_PARAMETER(Buffer);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
 
-        if (!NT_SUCCESS(status))
-        {
-            TraceEvents(TRACE_LEVEL_ERROR,
-                TRACE_QUEUE,
-                "WdfRequestRetrieveInputBuffer failed with status %!STATUS!",
-                status);
-            break;
-        }
+    return Bus_QueueSessionNotification(Device, Request, Transferred);
+}
 
-        if ((sizeof(XUSB_REQUEST_NOTIFICATION) == xusbNotify->Size) && (length == InputBufferLength))
-        {
-            // This request only supports a single PDO at a time
-            if (xusbNotify->SerialNo == 0)
-            {
-                TraceEvents(TRACE_LEVEL_ERROR,
-                    TRACE_QUEUE,
-                    "Invalid serial 0 submitted");
-
-                status = STATUS_INVALID_PARAMETER;
-                break;
-            }
-
-            status = Bus_QueueNotification(Device, xusbNotify->SerialNo, Request);
-        }
+NTSTATUS Bus_IoctlXusbGetUserIndex(
+    WDFDEVICE Device,
+    WDFREQUEST Request,
+    PVOID Buffer,
+    size_t OutputBufferLength,
+    size_t* Transferred
+)
+{
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(Transferred);
 
-        break;
-#pragma endregion 
+    return Xusb_GetUserIndex(Device, (PXUSB_GET_USER_INDEX)Buffer, Bus_GetRequestSessionId(Request));
+}
 
-#pragma region IOCTL_NSWITCH_SUBMIT_REPORT
-    case IOCTL_NSWITCH_SUBMIT_REPORT:
+NTSTATUS Bus_IoctlMapInputRing(
+    WDFDEVICE Device,
+    WDFREQUEST Request,
+    PVOID Buffer,
+    size_t OutputBufferLength,
+    size_t* Transferred
+)
+{
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(Transferred);
 
-        TraceEvents(TRACE_LEVEL_VERBOSE,
-            TRACE_QUEUE,
-            "IOCTL_NSWITCH_SUBMIT_REPORT");
+    return Bus_MapInputRing(Device, BUS_IOCTL_INPUT_SERIAL(Buffer), Request);
+}
 
-        status = WdfRequestRetrieveInputBuffer(Request, sizeof(NSWITCH_SUBMIT_REPORT), (PVOID)&nintSwitchSubmit, &length);
+NTSTATUS Bus_IoctlGetStatistics(
+    WDFDEVICE Device,
+    WDFREQUEST Request,
+    PVOID Buffer,
+    size_t OutputBufferLength,
+    size_t* Transferred
+)
+{
+    NTSTATUS            status;
+    PSTATS_DATA         pStats = &FdoGetData(Device)->Statistics;
+    PVIGEM_STATISTICS   pStatistics = NULL;
+    PVIGEM_STATISTICS_ENTRY entry;
+    ULONG               index;
+    ULONG64             forwarded;
+    ULONG64             suppressed;
+
+    UNREFERENCED_PARAMETER(Buffer);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
 
-        if (!NT_SUCCESS(status))
-        {
-            TraceEvents(TRACE_LEVEL_ERROR,
-                TRACE_QUEUE,
-                "WdfRequestRetrieveInputBuffer failed with status %!STATUS!",
-                status);
-            break;
-        }
+    // Input and output share the system buffer, the input isn't needed anymore
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(VIGEM_STATISTICS), (PVOID)&pStatistics, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
 
-        if ((sizeof(NSWITCH_SUBMIT_REPORT) == nintSwitchSubmit->Size) && (length == InputBufferLength))
-        {
-            // This request only supports a single PDO at a time
-            if (nintSwitchSubmit->SerialNo == 0)
-            {
-                TraceEvents(TRACE_LEVEL_ERROR,
-                    TRACE_QUEUE,
-                    "Invalid serial 0 submitted");
-
-                status = STATUS_INVALID_PARAMETER;
-                break;
-            }
-
-            status = Bus_NintSwitchSubmitReport(Device, nintSwitchSubmit->SerialNo, nintSwitchSubmit, FALSE);
-        }
+    RtlZeroMemory(pStatistics, sizeof(VIGEM_STATISTICS));
 
-        break;
-#pragma endregion 
+    for (index = 0; index < ARRAYSIZE(G_BusIoctlTable); index++)
+    {
+        entry = &pStatistics->Entries[pStatistics->Count++];
 
-#pragma region IOCTL_NSWITCH_REQUEST_NOTIFICATION
-    case IOCTL_NSWITCH_REQUEST_NOTIFICATION:
+        entry->Type = VIGEM_STATISTICS_TYPE_IOCTL;
+        entry->Code = G_BusIoctlTable[index].IoControlCode;
 
-        TraceEvents(TRACE_LEVEL_INFORMATION,
-            TRACE_QUEUE,
-            "IOCTL_NSWITCH_REQUEST_NOTIFICATION");
+        Stats_MergeIoctl(pStats, index, entry);
+    }
 
-        // Don't accept the request if the output buffer can't hold the results
-        if (OutputBufferLength < sizeof(NSWITCH_REQUEST_NOTIFICATION))
-        {
-            TraceEvents(TRACE_LEVEL_ERROR,
-                TRACE_QUEUE,
-                "Output buffer %d too small, require at least %d",
-                (int)OutputBufferLength, (int)sizeof(NSWITCH_REQUEST_NOTIFICATION));
-            break;
-        }
+    // Only report URB functions which actually occurred
+    for (index = 0; index < STATS_URB_FUNCTION_COUNT; index++)
+    {
+        entry = &pStatistics->Entries[pStatistics->Count];
 
-        status = WdfRequestRetrieveInputBuffer(Request, sizeof(NSWITCH_REQUEST_NOTIFICATION), (PVOID)&nintSwitchNotify, &length);
+        Stats_MergeUrb(pStats, index, entry);
 
-        if (!NT_SUCCESS(status))
+        if (entry->Count == 0)
         {
-            TraceEvents(TRACE_LEVEL_ERROR,
-                TRACE_QUEUE,
-                "WdfRequestRetrieveInputBuffer failed with status %!STATUS!",
-                status);
-            break;
+            RtlZeroMemory(entry, sizeof(VIGEM_STATISTICS_ENTRY));
+            continue;
         }
 
-        if ((sizeof(NSWITCH_REQUEST_NOTIFICATION) == nintSwitchNotify->Size) && (length == InputBufferLength))
+        entry->Type = VIGEM_STATISTICS_TYPE_URB;
+        entry->Code = Stats_UrbFunctions[index];
+
+        pStatistics->Count++;
+    }
+
+    // Report counters only for target types which received any
+    for (index = 0; index < STATS_MAX_TARGET_TYPES; index++)
+    {
+        Stats_MergeReports(pStats, index, &forwarded, &suppressed);
+
+        if (forwarded == 0 && suppressed == 0)
         {
-            // This request only supports a single PDO at a time
-            if (nintSwitchNotify->SerialNo == 0)
-            {
-                TraceEvents(TRACE_LEVEL_ERROR,
-                    TRACE_QUEUE,
-                    "Invalid serial 0 submitted");
-
-                status = STATUS_INVALID_PARAMETER;
-                break;
-            }
-
-            status = Bus_QueueNotification(Device, nintSwitchNotify->SerialNo, Request);
+            continue;
         }
 
-        break;
-#pragma endregion 
+        entry = &pStatistics->Entries[pStatistics->Count++];
 
-#pragma region IOCTL_XGIP_SUBMIT_REPORT
-    case IOCTL_XGIP_SUBMIT_REPORT:
+        entry->Type = VIGEM_STATISTICS_TYPE_REPORTS_FORWARDED;
+        entry->Code = index;
+        entry->Count = forwarded;
 
-        TraceEvents(TRACE_LEVEL_VERBOSE,
-            TRACE_QUEUE,
-            "IOCTL_XGIP_SUBMIT_REPORT");
+        entry = &pStatistics->Entries[pStatistics->Count++];
 
-        status = WdfRequestRetrieveInputBuffer(Request, sizeof(XGIP_SUBMIT_REPORT), (PVOID)&xgipSubmit, &length);
+        entry->Type = VIGEM_STATISTICS_TYPE_REPORTS_SUPPRESSED;
+        entry->Code = index;
+        entry->Count = suppressed;
+    }
 
-        if (!NT_SUCCESS(status))
-        {
-            KdPrint((DRIVERNAME "WdfRequestRetrieveInputBuffer failed 0x%x\n", status));
-            break;
-        }
+    pStatistics->Size = sizeof(VIGEM_STATISTICS);
+
+    *Transferred = sizeof(VIGEM_STATISTICS);
+
+    return STATUS_SUCCESS;
+}
 
-        if ((sizeof(XGIP_SUBMIT_REPORT) == xgipSubmit->Size) && (length == InputBufferLength))
+#pragma endregion
+
+//
+// Looks up the descriptor of an I/O control code, NULL if unknown.
+// 
+static PCBUS_IOCTL_DESCRIPTOR Bus_GetIoctlDescriptor(ULONG IoControlCode)
+{
+    ULONG index;
+
+    for (index = 0; index < ARRAYSIZE(G_BusIoctlTable); index++)
+    {
+        if (G_BusIoctlTable[index].IoControlCode == IoControlCode)
         {
-            // This request only supports a single PDO at a time
-            if (xgipSubmit->SerialNo == 0)
-            {
-                status = STATUS_INVALID_PARAMETER;
-                break;
-            }
-
-            status = Bus_XgipSubmitReport(Device, xgipSubmit->SerialNo, xgipSubmit, FALSE);
+            return &G_BusIoctlTable[index];
         }
+    }
 
-        break;
-#pragma endregion 
+    return NULL;
+}
 
-#pragma region IOCTL_XGIP_SUBMIT_INTERRUPT
-    case IOCTL_XGIP_SUBMIT_INTERRUPT:
+//
+// Moves a request altering the child list to the sequential PnP queue.
+// 
+// Returns FALSE if the request is already on the PnP queue.
+// 
+static BOOLEAN Bus_ForwardToPnpQueue(WDFQUEUE Queue, WDFREQUEST Request)
+{
+    NTSTATUS    status;
+    WDFQUEUE    pnpQueue = FdoGetData(WdfIoQueueGetDevice(Queue))->PnpRequests;
 
-        KdPrint((DRIVERNAME "IOCTL_XGIP_SUBMIT_INTERRUPT\n"));
+    if (Queue == pnpQueue)
+    {
+        return FALSE;
+    }
 
-        status = WdfRequestRetrieveInputBuffer(Request, sizeof(XGIP_SUBMIT_INTERRUPT), (PVOID)&xgipInterrupt, &length);
+    status = WdfRequestForwardToIoQueue(Request, pnpQueue);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_QUEUE,
+            "WdfRequestForwardToIoQueue failed with status %!STATUS!",
+            status);
 
-        if (!NT_SUCCESS(status))
-        {
-            KdPrint((DRIVERNAME "WdfRequestRetrieveInputBuffer failed 0x%x\n", status));
-            break;
-        }
+        WdfRequestComplete(Request, status);
+    }
 
-        if ((sizeof(XGIP_SUBMIT_INTERRUPT) == xgipInterrupt->Size) && (length == InputBufferLength))
-        {
-            // This request only supports a single PDO at a time
-            if (xgipInterrupt->SerialNo == 0)
-            {
-                status = STATUS_INVALID_PARAMETER;
-                break;
-            }
-
-            status = Bus_XgipSubmitInterrupt(Device, xgipSubmit->SerialNo, xgipInterrupt, FALSE);
-        }
+    return TRUE;
+}
 
-        break;
-#pragma endregion 
+//
+// Applies the checks common to all I/O control requests and fetches the input buffer.
+// 
+static NTSTATUS Bus_ValidateIoctl(
+    PCBUS_IOCTL_DESCRIPTOR Descriptor,
+    WDFREQUEST Request,
+    size_t OutputBufferLength,
+    PVOID* Buffer,
+    size_t* Length
+)
+{
+    NTSTATUS status;
 
-#pragma region IOCTL_XUSB_GET_USER_INDEX
-    case IOCTL_XUSB_GET_USER_INDEX:
+    // Don't accept the request if the output buffer can't hold the results
+    if (OutputBufferLength < Descriptor->OutputSize)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_QUEUE,
+            "%s: output buffer %d too small, require at least %d",
+            Descriptor->Name, (int)OutputBufferLength, (int)Descriptor->OutputSize);
+        return STATUS_BUFFER_TOO_SMALL;
+    }
 
-        KdPrint((DRIVERNAME "IOCTL_XUSB_GET_USER_INDEX"));
+    // Handler takes care of the buffers
+    if (Descriptor->InputSize == 0)
+    {
+        return STATUS_SUCCESS;
+    }
 
-        // Don't accept the request if the output buffer can't hold the results
-        if (OutputBufferLength < sizeof(XUSB_GET_USER_INDEX))
-        {
-            KdPrint((DRIVERNAME "IOCTL_XUSB_GET_USER_INDEX: output buffer too small: %ul\n", OutputBufferLength));
-            break;
-        }
+    status = WdfRequestRetrieveInputBuffer(Request, Descriptor->InputSize, Buffer, Length);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_QUEUE,
+            "%s: WdfRequestRetrieveInputBuffer failed with status %!STATUS!",
+            Descriptor->Name, status);
+        return STATUS_INVALID_PARAMETER;
+    }
 
-        status = WdfRequestRetrieveInputBuffer(
-            Request, 
-            sizeof(XUSB_GET_USER_INDEX), 
-            (PVOID)&pXusbGetUserIndex, 
-            &length);
+    if (!(Descriptor->Flags & BUS_IOCTL_FLAG_VARIABLE_INPUT)
+        && BUS_IOCTL_INPUT_SIZE(*Buffer) != Descriptor->InputSize)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_QUEUE,
+            "%s: size mismatch [%d != %d]",
+            Descriptor->Name, BUS_IOCTL_INPUT_SIZE(*Buffer), Descriptor->InputSize);
+        return STATUS_INVALID_PARAMETER;
+    }
 
-        if (!NT_SUCCESS(status))
-        {
-            KdPrint((DRIVERNAME "WdfRequestRetrieveInputBuffer failed 0x%x\n", status));
-            break;
-        }
+    // These requests only support a single PDO at a time
+    if ((Descriptor->Flags & BUS_IOCTL_FLAG_SERIAL_REQUIRED)
+        && BUS_IOCTL_INPUT_SERIAL(*Buffer) == 0)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_QUEUE,
+            "%s: invalid serial 0 submitted",
+            Descriptor->Name);
+        return STATUS_INVALID_PARAMETER;
+    }
 
-        if ((sizeof(XUSB_GET_USER_INDEX) == pXusbGetUserIndex->Size) && (length == InputBufferLength))
-        {
-            // This request only supports a single PDO at a time
-            if (pXusbGetUserIndex->SerialNo == 0)
-            {
-                status = STATUS_INVALID_PARAMETER;
-                break;
-            }
-
-            status = Xusb_GetUserIndex(Device, pXusbGetUserIndex);
-        }
+    return STATUS_SUCCESS;
+}
 
-        break;
-#pragma endregion
+//
+// Responds to I/O control requests sent to the FDO.
+// 
+VOID Bus_EvtIoDeviceControl(
+    IN WDFQUEUE Queue,
+    IN WDFREQUEST Request,
+    IN size_t OutputBufferLength,
+    IN size_t InputBufferLength,
+    IN ULONG IoControlCode
+)
+{
+    NTSTATUS                    status;
+    WDFDEVICE                   Device;
+    size_t                      length = 0;
+    PVOID                       buffer = NULL;
+    PCBUS_IOCTL_DESCRIPTOR      descriptor;
+    LONGLONG                    timestamp = STATS_TIMESTAMP();
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
 
-    default:
+    Device = WdfIoQueueGetDevice(Queue);
+
+    descriptor = Bus_GetIoctlDescriptor(IoControlCode);
 
+    if (descriptor == NULL)
+    {
         TraceEvents(TRACE_LEVEL_WARNING,
             TRACE_QUEUE,
             "Unknown I/O control code 0x%X", IoControlCode);
 
-        break; // default status is STATUS_INVALID_PARAMETER
+        WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+        return;
     }
 
+    // Report traffic never waits behind plugin or unplug requests
+    if ((descriptor->Flags & BUS_IOCTL_FLAG_PNP) && Bus_ForwardToPnpQueue(Queue, Request))
+    {
+        return;
+    }
+
+    if (!(descriptor->Flags & BUS_IOCTL_FLAG_FAST_PATH))
+    {
+        TraceEvents(TRACE_LEVEL_INFORMATION,
+            TRACE_QUEUE,
+            "%s (device: 0x%p)", descriptor->Name, Device);
+    }
+
+    status = Bus_ValidateIoctl(descriptor, Request, OutputBufferLength, &buffer, &length);
+
+    if (NT_SUCCESS(status))
+    {
+        status = descriptor->Handler(Device, Request, buffer, OutputBufferLength, &length);
+    }
+
+    Stats_RecordIoctl(&FdoGetData(Device)->Statistics, (ULONG)(descriptor - G_BusIoctlTable), timestamp);
+
     if (status != STATUS_PENDING)
     {
         WdfRequestCompleteWithInformation(Request, status, length);
     }
-    
-    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_QUEUE, "%!FUNC! Exit with status %!STATUS!", status);
 }
 
 //
 // Gets called upon driver-to-driver communication.
 // 
-// TODO: incomplete and unused currently
+// Kernel-mode feeders should use the direct calls of VIGEM_BUS_INTERFACE
+// (version 2 and above) instead, which don't require building IRPs.
 // 
 VOID Bus_EvtIoInternalDeviceControl(
     _In_ WDFQUEUE   Queue,
@@ -408,6 +744,12 @@ VOID Bus_EvtIoInternalDeviceControl(
 
     KdPrint((DRIVERNAME "Bus_EvtIoInternalDeviceControl: 0x%p\n", Device));
 
+    // Only plugin and unplug are supported, both alter the child list
+    if (Bus_ForwardToPnpQueue(Queue, Request))
+    {
+        return;
+    }
+
     switch (IoControlCode)
     {
     case IOCTL_VIGEM_PLUGIN_TARGET:
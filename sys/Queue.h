@@ -1,6 +1,6 @@
 /*
 * Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
-* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
 *
 * This program is free software: you can redistribute it and/or modify
 * it under the terms of the GNU General Public License as published by
@@ -22,3 +22,86 @@
 EVT_WDF_IO_QUEUE_IO_DEFAULT Bus_EvtIoDefault;
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL Bus_EvtIoDeviceControl;
 EVT_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL Bus_EvtIoInternalDeviceControl;
+
+
+#pragma region IOCTL dispatch table
+
+//
+// Handles a validated I/O control request.
+// 
+// Buffer is the input buffer (NULL if the descriptor has no InputSize),
+// Transferred is pre-set to its length and may be changed by the handler.
+// 
+typedef
+_Function_class_(BUS_IOCTL_HANDLER)
+NTSTATUS
+BUS_IOCTL_HANDLER(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request,
+    _In_opt_ PVOID Buffer,
+    _In_ size_t OutputBufferLength,
+    _Inout_ size_t* Transferred
+);
+
+typedef BUS_IOCTL_HANDLER *PFN_BUS_IOCTL_HANDLER;
+
+//
+// The input structure begins with a non-zero SerialNo following Size
+// 
+#define BUS_IOCTL_FLAG_SERIAL_REQUIRED  0x00000001
+
+//
+// The input length varies, InputSize is the minimum and Size isn't checked
+// 
+#define BUS_IOCTL_FLAG_VARIABLE_INPUT   0x00000002
+
+//
+// Report submission path, no tracing unless validation fails
+// 
+#define BUS_IOCTL_FLAG_FAST_PATH        0x00000004
+
+//
+// Alters the child list, dispatched one at a time on the PnP queue
+// 
+#define BUS_IOCTL_FLAG_PNP              0x00000008
+
+//
+// Describes an I/O control request accepted by the FDO.
+// 
+typedef struct _BUS_IOCTL_DESCRIPTOR
+{
+    //
+    // I/O control code
+    // 
+    ULONG IoControlCode;
+
+    //
+    // Size of the input structure; if zero, the handler fetches the buffers
+    // 
+    ULONG InputSize;
+
+    //
+    // Minimum output buffer size
+    // 
+    ULONG OutputSize;
+
+    //
+    // BUS_IOCTL_FLAG_*
+    // 
+    ULONG Flags;
+
+    //
+    // Called after the request passed validation
+    // 
+    PFN_BUS_IOCTL_HANDLER Handler;
+
+    //
+    // Name used in trace messages
+    // 
+    PCSTR Name;
+
+} BUS_IOCTL_DESCRIPTOR, *PBUS_IOCTL_DESCRIPTOR;
+
+typedef const BUS_IOCTL_DESCRIPTOR *PCBUS_IOCTL_DESCRIPTOR;
+
+#pragma endregion
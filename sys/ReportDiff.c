@@ -0,0 +1,78 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#endif
+
+#include "ReportDiff.h"
+
+
+//
+// Compares two reports eight bytes at a time.
+// 
+// Bits set in IgnoreMask (may be NULL) are left out of the comparison, it
+// needs one word per started eight bytes of Length. Returns a bit per
+// changed word, zero if the reports are equal.
+// 
+ULONG64 DiffReportWords(const VOID* Old, const VOID* New, SIZE_T Length, const ULONG64* IgnoreMask)
+{
+    const UCHAR*    pOld = (const UCHAR*)Old;
+    const UCHAR*    pNew = (const UCHAR*)New;
+    ULONG64         changed = 0;
+    ULONG64         oldWord;
+    ULONG64         newWord;
+    ULONG64         diff;
+    SIZE_T          offset;
+    ULONG           word;
+
+    NT_ASSERT(Length <= DIFF_REPORT_MAX_LENGTH);
+
+    for (word = 0, offset = 0; offset < Length; word++, offset += sizeof(ULONG64))
+    {
+        if (Length - offset >= sizeof(ULONG64))
+        {
+            oldWord = *(const ULONG64 UNALIGNED*)(pOld + offset);
+            newWord = *(const ULONG64 UNALIGNED*)(pNew + offset);
+        }
+        else
+        {
+            // Zero-extend the tail so both sides compare equal beyond Length
+            oldWord = newWord = 0;
+            RtlCopyMemory(&oldWord, pOld + offset, Length - offset);
+            RtlCopyMemory(&newWord, pNew + offset, Length - offset);
+        }
+
+        diff = oldWord ^ newWord;
+
+        if (IgnoreMask != NULL)
+        {
+            diff &= ~IgnoreMask[word];
+        }
+
+        if (diff != 0)
+        {
+            changed |= 1ULL << word;
+        }
+    }
+
+    return changed;
+}
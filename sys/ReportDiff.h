@@ -0,0 +1,35 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+#pragma once
+
+//
+// Longest buffer DiffReportWords can tell changes apart in
+//
+#define DIFF_REPORT_MAX_LENGTH          (64 * sizeof(ULONG64))
+
+//
+// Ignore mask of the first word of a Switch input report, byte 1 is a
+// free-running timer
+//
+#define DIFF_REPORT_NSWITCH_TIMER_MASK  0x000000000000FF00ULL
+
+ULONG64 DiffReportWords(const VOID* Old, const VOID* New, SIZE_T Length, const ULONG64* IgnoreMask);
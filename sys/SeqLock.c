@@ -0,0 +1,65 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#endif
+
+#include "SeqLock.h"
+
+
+VOID SeqLockWriteBegin(volatile LONG* Sequence)
+{
+    // Full barrier, orders the data writes after the odd count
+    InterlockedIncrement(Sequence);
+}
+
+VOID SeqLockWriteEnd(volatile LONG* Sequence)
+{
+    // Full barrier, orders the data writes before the even count
+    InterlockedIncrement(Sequence);
+}
+
+VOID SeqLockRead(volatile LONG* Sequence, PVOID Destination, const VOID* Source, SIZE_T Length)
+{
+    LONG sequence;
+
+    for (;;)
+    {
+        sequence = *Sequence;
+        KeMemoryBarrier();
+
+        // Writer is busy, it doesn't hold on for long
+        if (sequence & 1)
+        {
+            YieldProcessor();
+            continue;
+        }
+
+        RtlCopyMemory(Destination, Source, Length);
+        KeMemoryBarrier();
+
+        if (*Sequence == sequence)
+        {
+            break;
+        }
+    }
+}
@@ -0,0 +1,34 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+#pragma once
+
+//
+// Sequence lock: the count is odd while the protected data is written.
+//
+// Writers have to be serialized by other means; readers never block them
+// but retry until they copied a consistent snapshot. Framework-free so it
+// can be tortured on any host, see tests/SeqLock.
+//
+
+VOID SeqLockWriteBegin(volatile LONG* Sequence);
+VOID SeqLockWriteEnd(volatile LONG* Sequence);
+VOID SeqLockRead(volatile LONG* Sequence, PVOID Destination, const VOID* Source, SIZE_T Length);
@@ -0,0 +1,96 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#endif
+
+#include "SerialHash.h"
+
+#define SERIAL_HASH_BUCKET(_serial_)    ((_serial_) & (SERIAL_HASH_BUCKET_COUNT - 1))
+
+
+VOID SerialHash_Initialize(PSERIAL_HASH Hash)
+{
+    RtlZeroMemory(Hash, sizeof(SERIAL_HASH));
+}
+
+//
+// Appends an entry to the tail of its bucket so lookups find the oldest first.
+//
+VOID SerialHash_Link(PSERIAL_HASH Hash, PSERIAL_HASH_ENTRY Entry)
+{
+    PSERIAL_HASH_ENTRY* link = &Hash->Buckets[SERIAL_HASH_BUCKET(Entry->SerialNo)];
+
+    while (*link != NULL)
+    {
+        link = &(*link)->Next;
+    }
+
+    Entry->Next = NULL;
+    Entry->Linked = TRUE;
+    *link = Entry;
+}
+
+//
+// Removes an entry, does nothing if it isn't linked.
+//
+VOID SerialHash_Unlink(PSERIAL_HASH Hash, PSERIAL_HASH_ENTRY Entry)
+{
+    PSERIAL_HASH_ENTRY* link = &Hash->Buckets[SERIAL_HASH_BUCKET(Entry->SerialNo)];
+
+    if (!Entry->Linked)
+    {
+        return;
+    }
+
+    while (*link != NULL)
+    {
+        if (*link == Entry)
+        {
+            *link = Entry->Next;
+            break;
+        }
+
+        link = &(*link)->Next;
+    }
+
+    Entry->Next = NULL;
+    Entry->Linked = FALSE;
+}
+
+//
+// Returns the oldest entry linked with SerialNo, NULL if there is none.
+//
+PSERIAL_HASH_ENTRY SerialHash_Find(PSERIAL_HASH Hash, ULONG SerialNo)
+{
+    PSERIAL_HASH_ENTRY entry;
+
+    for (entry = Hash->Buckets[SERIAL_HASH_BUCKET(SerialNo)]; entry != NULL; entry = entry->Next)
+    {
+        if (entry->SerialNo == SerialNo)
+        {
+            break;
+        }
+    }
+
+    return entry;
+}
@@ -0,0 +1,68 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+#pragma once
+
+//
+// Number of hash buckets, must be a power of two
+//
+#define SERIAL_HASH_BUCKET_COUNT        0x100
+
+//
+// Links an object into a serial hash, embedded in the object.
+//
+typedef struct _SERIAL_HASH_ENTRY
+{
+    //
+    // Next entry in the same bucket
+    //
+    struct _SERIAL_HASH_ENTRY* Next;
+
+    //
+    // Serial number the entry is hashed by
+    //
+    ULONG SerialNo;
+
+    //
+    // TRUE while linked into a bucket
+    //
+    BOOLEAN Linked;
+
+} SERIAL_HASH_ENTRY, *PSERIAL_HASH_ENTRY;
+
+//
+// Entries hashed by serial number, several entries may share one serial.
+//
+// Framework-free and not synchronized, the owner has to lock around it.
+//
+typedef struct _SERIAL_HASH
+{
+    //
+    // Singly-linked entry lists, oldest first
+    //
+    PSERIAL_HASH_ENTRY Buckets[SERIAL_HASH_BUCKET_COUNT];
+
+} SERIAL_HASH, *PSERIAL_HASH;
+
+VOID SerialHash_Initialize(PSERIAL_HASH Hash);
+VOID SerialHash_Link(PSERIAL_HASH Hash, PSERIAL_HASH_ENTRY Entry);
+VOID SerialHash_Unlink(PSERIAL_HASH Hash, PSERIAL_HASH_ENTRY Entry);
+PSERIAL_HASH_ENTRY SerialHash_Find(PSERIAL_HASH Hash, ULONG SerialNo);
@@ -0,0 +1,98 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#endif
+
+#include "SerialPool.h"
+
+C_ASSERT(SERIAL_POOL_MAX_SERIAL % 64 == 0);
+
+VOID SerialPool_Initialize(PSERIAL_POOL Pool)
+{
+    RtlZeroMemory((PVOID)Pool->Bitmap, sizeof(Pool->Bitmap));
+}
+
+//
+// Takes the lowest free serial number, returns 0 if all are in use.
+// 
+// Lock-free; if another caller grabs the same bit first, the scan
+// simply moves on to the next free one.
+// 
+ULONG SerialPool_Allocate(PSERIAL_POOL Pool)
+{
+    ULONG   word;
+    ULONG   bit;
+    LONG64  value;
+
+    for (word = 0; word < ARRAYSIZE(Pool->Bitmap); word++)
+    {
+        for (;;)
+        {
+            value = Pool->Bitmap[word];
+
+            if (!BitScanForward64(&bit, ~(ULONG64)value))
+            {
+                // Word is full
+                break;
+            }
+
+            if (!InterlockedBitTestAndSet64(&Pool->Bitmap[word], bit))
+            {
+                return word * 64 + bit + 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+//
+// Marks a serial number chosen by the caller as taken.
+// 
+// Returns TRUE if the caller now owns it; FALSE if it was taken already or
+// lies outside of the allocator range, in which case it must not be freed.
+// 
+BOOLEAN SerialPool_Reserve(PSERIAL_POOL Pool, ULONG SerialNo)
+{
+    ULONG index = SerialNo - 1;
+
+    if (SerialNo == 0 || SerialNo > SERIAL_POOL_MAX_SERIAL)
+    {
+        return FALSE;
+    }
+
+    return !InterlockedBitTestAndSet64(&Pool->Bitmap[index / 64], index % 64);
+}
+
+//
+// Hands a serial number back for reuse, ignores numbers outside of the range.
+// 
+VOID SerialPool_Free(PSERIAL_POOL Pool, ULONG SerialNo)
+{
+    ULONG index = SerialNo - 1;
+
+    if (SerialNo == 0 || SerialNo > SERIAL_POOL_MAX_SERIAL)
+    {
+        return;
+    }
+
+    InterlockedBitTestAndReset64(&Pool->Bitmap[index / 64], index % 64);
+}
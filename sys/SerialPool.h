@@ -0,0 +1,42 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+//
+// Highest serial number handed out by the allocator, must be a multiple of 64
+// 
+#define SERIAL_POOL_MAX_SERIAL          0x400
+
+//
+// Tracks which of the serial numbers 1 to SERIAL_POOL_MAX_SERIAL are in use.
+// 
+typedef struct _SERIAL_POOL
+{
+    //
+    // Bit n set means serial n + 1 is taken
+    // 
+    volatile LONG64 Bitmap[SERIAL_POOL_MAX_SERIAL / 64];
+
+} SERIAL_POOL, *PSERIAL_POOL;
+
+VOID SerialPool_Initialize(PSERIAL_POOL Pool);
+ULONG SerialPool_Allocate(PSERIAL_POOL Pool);
+BOOLEAN SerialPool_Reserve(PSERIAL_POOL Pool, ULONG SerialNo);
+VOID SerialPool_Free(PSERIAL_POOL Pool, ULONG SerialNo);
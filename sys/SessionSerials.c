@@ -0,0 +1,153 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "busenum.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, SessionSerials_Initialize)
+#pragma alloc_text (PAGE, SessionSerials_Lock)
+#pragma alloc_text (PAGE, SessionSerials_Unlock)
+#pragma alloc_text (PAGE, SessionSerials_Reserve)
+#pragma alloc_text (PAGE, SessionSerials_Add)
+#pragma alloc_text (PAGE, SessionSerials_RemoveAt)
+#pragma alloc_text (PAGE, SessionSerials_Free)
+#endif
+
+VOID SessionSerials_Initialize(PSESSION_SERIALS Serials)
+{
+    PAGED_CODE();
+
+    RtlZeroMemory(Serials, sizeof(SESSION_SERIALS));
+
+    ExInitializeFastMutex(&Serials->Lock);
+}
+
+VOID SessionSerials_Lock(PSESSION_SERIALS Serials)
+{
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&Serials->Lock);
+}
+
+VOID SessionSerials_Unlock(PSESSION_SERIALS Serials)
+{
+    ExReleaseFastMutex(&Serials->Lock);
+}
+
+//
+// Makes room for Count more serials so adding them afterwards can't fail.
+// 
+NTSTATUS SessionSerials_Reserve(PSESSION_SERIALS Serials, ULONG Count)
+{
+    NTSTATUS    status;
+    ULONG       required;
+    ULONG       capacity;
+    ULONG       size;
+    PULONG      data;
+
+    PAGED_CODE();
+
+    status = RtlULongAdd(Serials->Count, Count, &required);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    if (required <= Serials->Capacity)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    capacity = max(Serials->Capacity, SESSION_SERIALS_INITIAL_CAPACITY);
+
+    while (capacity < required)
+    {
+        status = RtlULongMult(capacity, 2, &capacity);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+
+    status = RtlULongMult(capacity, sizeof(ULONG), &size);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    data = (PULONG)ExAllocatePoolWithTag(PagedPool, size, SESSION_SERIALS_POOL_TAG);
+    if (data == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (Serials->Serials != NULL)
+    {
+        RtlCopyMemory(data, Serials->Serials, Serials->Count * sizeof(ULONG));
+        ExFreePoolWithTag(Serials->Serials, SESSION_SERIALS_POOL_TAG);
+    }
+
+    Serials->Serials = data;
+    Serials->Capacity = capacity;
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Remembers a serial, room must have been reserved before.
+// 
+VOID SessionSerials_Add(PSESSION_SERIALS Serials, ULONG SerialNo)
+{
+    PAGED_CODE();
+
+    NT_ASSERT(Serials->Count < Serials->Capacity);
+
+    Serials->Serials[Serials->Count++] = SerialNo;
+}
+
+//
+// Forgets the serial at Index; the last one takes its slot, so iterating
+// backwards while removing visits every serial exactly once.
+// 
+VOID SessionSerials_RemoveAt(PSESSION_SERIALS Serials, ULONG Index)
+{
+    PAGED_CODE();
+
+    NT_ASSERT(Index < Serials->Count);
+
+    Serials->Serials[Index] = Serials->Serials[--Serials->Count];
+}
+
+//
+// Releases the array and marks the handle closed, the lock stays usable.
+// 
+VOID SessionSerials_Free(PSESSION_SERIALS Serials)
+{
+    PAGED_CODE();
+
+    if (Serials->Serials != NULL)
+    {
+        ExFreePoolWithTag(Serials->Serials, SESSION_SERIALS_POOL_TAG);
+    }
+
+    Serials->Serials = NULL;
+    Serials->Count = 0;
+    Serials->Capacity = 0;
+    Serials->Closed = TRUE;
+}
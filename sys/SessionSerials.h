@@ -0,0 +1,67 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#define SESSION_SERIALS_INITIAL_CAPACITY    0x08
+#define SESSION_SERIALS_POOL_TAG            'SSiV'
+
+//
+// Serial numbers of the children a file handle plugged in.
+// 
+// Touched from the PnP queue and on file close which aren't serialized
+// against each other; all functions except Initialize need the lock held.
+// 
+typedef struct _SESSION_SERIALS
+{
+    //
+    // Held across adding a child and recording its serial, so closing
+    // the handle can't slip in between
+    // 
+    FAST_MUTEX Lock;
+
+    //
+    // Handle got closed, no more children may be added
+    // 
+    BOOLEAN Closed;
+
+    //
+    // Paged pool array, NULL until the first plugin
+    // 
+    PULONG Serials;
+
+    //
+    // Slots used
+    // 
+    ULONG Count;
+
+    //
+    // Slots allocated
+    // 
+    ULONG Capacity;
+
+} SESSION_SERIALS, *PSESSION_SERIALS;
+
+VOID SessionSerials_Initialize(PSESSION_SERIALS Serials);
+VOID SessionSerials_Lock(PSESSION_SERIALS Serials);
+VOID SessionSerials_Unlock(PSESSION_SERIALS Serials);
+NTSTATUS SessionSerials_Reserve(PSESSION_SERIALS Serials, ULONG Count);
+VOID SessionSerials_Add(PSESSION_SERIALS Serials, ULONG SerialNo);
+VOID SessionSerials_RemoveAt(PSESSION_SERIALS Serials, ULONG Index);
+VOID SessionSerials_Free(PSESSION_SERIALS Serials);
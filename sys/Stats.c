@@ -0,0 +1,293 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include "busenum.h"
+
+const USHORT Stats_UrbFunctions[STATS_URB_FUNCTION_COUNT] =
+{
+    URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER,
+    URB_FUNCTION_CONTROL_TRANSFER,
+    URB_FUNCTION_CONTROL_TRANSFER_EX,
+    URB_FUNCTION_CLASS_INTERFACE,
+    URB_FUNCTION_SELECT_CONFIGURATION,
+    URB_FUNCTION_SELECT_INTERFACE,
+    URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE,
+    URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE,
+    URB_FUNCTION_GET_STATUS_FROM_DEVICE,
+    URB_FUNCTION_ABORT_PIPE
+};
+
+//
+// Converts the time passed since Start to microseconds.
+// 
+static ULONG64 Stats_ElapsedMicroseconds(PSTATS_DATA Stats, LONGLONG Start)
+{
+    LONGLONG elapsed = STATS_TIMESTAMP() - Start;
+
+    if (elapsed <= 0)
+    {
+        return 0;
+    }
+
+    return (ULONG64)(elapsed * 1000000 / Stats->Frequency);
+}
+
+//
+// Adds one measurement to a counter of the current processor.
+// 
+static VOID Stats_Update(PSTATS_COUNTER Counter, ULONG64 Microseconds)
+{
+    ULONG bucket = 0;
+
+    if (Microseconds > 0)
+    {
+        bucket = (ULONG)RtlFindMostSignificantBit(Microseconds) + 1;
+
+        if (bucket >= VIGEM_STATISTICS_BUCKET_COUNT)
+        {
+            bucket = VIGEM_STATISTICS_BUCKET_COUNT - 1;
+        }
+    }
+
+    Counter->Count++;
+    Counter->TotalMicroseconds += Microseconds;
+    Counter->Buckets[bucket]++;
+
+    if (Microseconds > Counter->MaxMicroseconds)
+    {
+        Counter->MaxMicroseconds = Microseconds;
+    }
+}
+
+//
+// Sums up the counters of all processors.
+// 
+// Slots are read while their owners might update them, so the result
+// is a close approximation rather than an exact snapshot.
+// 
+static VOID Stats_Merge(PSTATS_DATA Stats, SIZE_T Offset, PVIGEM_STATISTICS_ENTRY Entry)
+{
+    ULONG cpu;
+    ULONG bucket;
+    PSTATS_COUNTER counter;
+
+    for (cpu = 0; cpu < Stats->SlotCount; cpu++)
+    {
+        counter = (PSTATS_COUNTER)((PUCHAR)&Stats->Slots[cpu] + Offset);
+
+        Entry->Count += counter->Count;
+        Entry->TotalMicroseconds += counter->TotalMicroseconds;
+
+        if (counter->MaxMicroseconds > Entry->MaxMicroseconds)
+        {
+            Entry->MaxMicroseconds = counter->MaxMicroseconds;
+        }
+
+        for (bucket = 0; bucket < VIGEM_STATISTICS_BUCKET_COUNT; bucket++)
+        {
+            Entry->Buckets[bucket] += counter->Buckets[bucket];
+        }
+    }
+}
+
+//
+// Returns the counter slot of a URB function, STATS_URB_FUNCTION_COUNT if
+// the children don't handle it. The interrupt transfer comes first.
+// 
+static ULONG Stats_UrbSlot(USHORT Function)
+{
+    ULONG index;
+
+    for (index = 0; index < STATS_URB_FUNCTION_COUNT; index++)
+    {
+        if (Stats_UrbFunctions[index] == Function)
+        {
+            break;
+        }
+    }
+
+    return index;
+}
+
+//
+// Allocates the per-processor slots, they get freed along with the device.
+// 
+// Slots only cover what gets dispatched, the IOCTL table and the handled
+// URB functions, about 6 KB each. Processors added at runtime aren't counted.
+// 
+NTSTATUS Stats_Initialize(WDFDEVICE Device, PSTATS_DATA Stats)
+{
+    NTSTATUS                status;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+    WDFMEMORY               memory;
+    LARGE_INTEGER           frequency;
+    size_t                  size;
+
+    KeQueryPerformanceCounter(&frequency);
+
+    Stats->Frequency = frequency.QuadPart;
+    Stats->SlotCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    size = (size_t)Stats->SlotCount * sizeof(STATS_CPU_SLOT);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Device;
+
+    status = WdfMemoryCreate(&attributes, NonPagedPool, VIGEM_POOL_TAG, size, &memory, (PVOID*)&Stats->Slots);
+    if (!NT_SUCCESS(status))
+    {
+        Stats->Slots = NULL;
+        Stats->SlotCount = 0;
+        return status;
+    }
+
+    RtlZeroMemory(Stats->Slots, size);
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Records the dispatch latency of an IOCTL, Index being its descriptor number.
+// 
+VOID Stats_RecordIoctl(PSTATS_DATA Stats, ULONG Index, LONGLONG Start)
+{
+    ULONG64 microseconds;
+    ULONG   cpu;
+    KIRQL   irql;
+
+    if (Stats->Slots == NULL || Index >= STATS_MAX_IOCTLS)
+    {
+        return;
+    }
+
+    microseconds = Stats_ElapsedMicroseconds(Stats, Start);
+
+    // No interlocked operations needed as long as we can't get moved to another processor
+    KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+    cpu = KeGetCurrentProcessorNumberEx(NULL);
+
+    if (cpu < Stats->SlotCount)
+    {
+        Stats_Update(&Stats->Slots[cpu].Ioctl[Index], microseconds);
+    }
+
+    KeLowerIrql(irql);
+}
+
+//
+// Records the dispatch latency of a URB.
+// 
+VOID Stats_RecordUrb(PSTATS_DATA Stats, USHORT Function, LONGLONG Start)
+{
+    ULONG64 microseconds;
+    ULONG   slot = Stats_UrbSlot(Function);
+    ULONG   cpu;
+    KIRQL   irql;
+
+    if (Stats->Slots == NULL || slot >= STATS_URB_FUNCTION_COUNT)
+    {
+        return;
+    }
+
+    microseconds = Stats_ElapsedMicroseconds(Stats, Start);
+
+    KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+    cpu = KeGetCurrentProcessorNumberEx(NULL);
+
+    if (cpu < Stats->SlotCount)
+    {
+        Stats_Update(&Stats->Slots[cpu].Urb[slot], microseconds);
+    }
+
+    KeLowerIrql(irql);
+}
+
+VOID Stats_MergeIoctl(PSTATS_DATA Stats, ULONG Index, PVIGEM_STATISTICS_ENTRY Entry)
+{
+    if (Stats->Slots == NULL || Index >= STATS_MAX_IOCTLS)
+    {
+        return;
+    }
+
+    Stats_Merge(Stats, FIELD_OFFSET(STATS_CPU_SLOT, Ioctl) + Index * sizeof(STATS_COUNTER), Entry);
+}
+
+VOID Stats_MergeUrb(PSTATS_DATA Stats, ULONG Index, PVIGEM_STATISTICS_ENTRY Entry)
+{
+    if (Stats->Slots == NULL || Index >= STATS_URB_FUNCTION_COUNT)
+    {
+        return;
+    }
+
+    Stats_Merge(Stats, FIELD_OFFSET(STATS_CPU_SLOT, Urb) + Index * sizeof(STATS_COUNTER), Entry);
+}
+
+//
+// Counts a submitted report as either forwarded to the host or suppressed.
+// 
+VOID Stats_RecordReport(PSTATS_DATA Stats, ULONG TargetType, BOOLEAN Forwarded)
+{
+    ULONG   cpu;
+    KIRQL   irql;
+
+    if (Stats->Slots == NULL || TargetType >= STATS_MAX_TARGET_TYPES)
+    {
+        return;
+    }
+
+    KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+    cpu = KeGetCurrentProcessorNumberEx(NULL);
+
+    if (cpu < Stats->SlotCount)
+    {
+        if (Forwarded)
+        {
+            Stats->Slots[cpu].ReportsForwarded[TargetType]++;
+        }
+        else
+        {
+            Stats->Slots[cpu].ReportsSuppressed[TargetType]++;
+        }
+    }
+
+    KeLowerIrql(irql);
+}
+
+VOID Stats_MergeReports(PSTATS_DATA Stats, ULONG TargetType, PULONG64 Forwarded, PULONG64 Suppressed)
+{
+    ULONG cpu;
+
+    *Forwarded = 0;
+    *Suppressed = 0;
+
+    if (Stats->Slots == NULL || TargetType >= STATS_MAX_TARGET_TYPES)
+    {
+        return;
+    }
+
+    for (cpu = 0; cpu < Stats->SlotCount; cpu++)
+    {
+        *Forwarded += Stats->Slots[cpu].ReportsForwarded[TargetType];
+        *Suppressed += Stats->Slots[cpu].ReportsSuppressed[TargetType];
+    }
+}
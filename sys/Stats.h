@@ -0,0 +1,108 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#pragma once
+
+//
+// Number of IOCTL descriptors, one counter each
+// 
+#define STATS_MAX_IOCTLS                0x11
+
+//
+// Number of URB functions the children handle, see Stats_UrbFunctions
+// 
+#define STATS_URB_FUNCTION_COUNT        0x0A
+
+//
+// Report counters are tracked by target type, anything above is ignored
+// 
+#define STATS_MAX_TARGET_TYPES          0x08
+
+C_ASSERT(STATS_MAX_IOCTLS + STATS_URB_FUNCTION_COUNT + 2 * STATS_MAX_TARGET_TYPES <= VIGEM_STATISTICS_MAX_ENTRIES);
+
+//
+// URB functions with a counter, in slot order
+// 
+extern const USHORT Stats_UrbFunctions[STATS_URB_FUNCTION_COUNT];
+
+//
+// Counters of one IOCTL or URB function on one processor
+// 
+typedef struct _STATS_COUNTER
+{
+    ULONG64 Count;
+
+    ULONG64 TotalMicroseconds;
+
+    ULONG64 MaxMicroseconds;
+
+    ULONG64 Buckets[VIGEM_STATISTICS_BUCKET_COUNT];
+
+} STATS_COUNTER, *PSTATS_COUNTER;
+
+//
+// Counters owned by a single processor, only ever written from it
+// 
+typedef struct DECLSPEC_CACHEALIGN _STATS_CPU_SLOT
+{
+    STATS_COUNTER Ioctl[STATS_MAX_IOCTLS];
+
+    STATS_COUNTER Urb[STATS_URB_FUNCTION_COUNT];
+
+    ULONG64 ReportsForwarded[STATS_MAX_TARGET_TYPES];
+
+    ULONG64 ReportsSuppressed[STATS_MAX_TARGET_TYPES];
+
+} STATS_CPU_SLOT, *PSTATS_CPU_SLOT;
+
+//
+// Per-bus latency statistics
+// 
+typedef struct _STATS_DATA
+{
+    //
+    // One slot per processor active when the bus started
+    // 
+    PSTATS_CPU_SLOT Slots;
+
+    //
+    // Number of elements in Slots
+    // 
+    ULONG SlotCount;
+
+    //
+    // Performance counter frequency used to convert timestamps
+    // 
+    LONGLONG Frequency;
+
+} STATS_DATA, *PSTATS_DATA;
+
+//
+// Takes the timestamp a measurement starts at
+// 
+#define STATS_TIMESTAMP() (KeQueryPerformanceCounter(NULL).QuadPart)
+
+NTSTATUS Stats_Initialize(WDFDEVICE Device, PSTATS_DATA Stats);
+VOID Stats_RecordIoctl(PSTATS_DATA Stats, ULONG Index, LONGLONG Start);
+VOID Stats_RecordUrb(PSTATS_DATA Stats, USHORT Function, LONGLONG Start);
+VOID Stats_MergeIoctl(PSTATS_DATA Stats, ULONG Index, PVIGEM_STATISTICS_ENTRY Entry);
+VOID Stats_MergeUrb(PSTATS_DATA Stats, ULONG Index, PVIGEM_STATISTICS_ENTRY Entry);
+VOID Stats_RecordReport(PSTATS_DATA Stats, ULONG TargetType, BOOLEAN Forwarded);
+VOID Stats_MergeReports(PSTATS_DATA Stats, ULONG TargetType, PULONG64 Forwarded, PULONG64 Suppressed);
@@ -1,6 +1,6 @@
 /*
 * Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
-* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
 *
 * This program is free software: you can redistribute it and/or modify
 * it under the terms of the GNU General Public License as published by
@@ -19,6 +19,12 @@
 
 #pragma once
 
+//
+// Endpoints carrying the input and output reports on interface 0
+// 
+#define USBPDO_DATA_IN_ENDPOINT         0x81
+#define USBPDO_DATA_OUT_ENDPOINT        0x01
+
 BOOLEAN USB_BUSIFFN UsbPdo_IsDeviceHighSpeed(IN PVOID BusContext);
 NTSTATUS USB_BUSIFFN UsbPdo_QueryBusInformation(
     IN PVOID BusContext,
@@ -34,6 +40,7 @@ VOID USB_BUSIFFN UsbPdo_GetUSBDIVersion(
     IN OUT PUSBD_VERSION_INFORMATION VersionInformation,
     IN OUT PULONG HcdCapabilities
 );
+UCHAR UsbPdo_GetDataInterval(PPDO_DEVICE_DATA pCommon, UCHAR DefaultInterval);
 NTSTATUS UsbPdo_GetDeviceDescriptorType(PURB urb, PPDO_DEVICE_DATA pCommon);
 NTSTATUS UsbPdo_GetConfigurationDescriptorType(PURB urb, PPDO_DEVICE_DATA pCommon);
 NTSTATUS UsbPdo_GetStringDescriptorType(PURB urb, PPDO_DEVICE_DATA pCommon);
@@ -1,6 +1,6 @@
 /*
 * Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
-* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
 *
 * This program is free software: you can redistribute it and/or modify
 * it under the terms of the GNU General Public License as published by
@@ -24,7 +24,12 @@
 // 
 #define CURRENT_PROCESS_ID() ((DWORD)((DWORD_PTR)PsGetCurrentProcessId() & 0xFFFFFFFF))
 
-#define IS_OWNER(_pdo_) (_pdo_->OwnerProcessId == CURRENT_PROCESS_ID())
+//
+// TRUE if the caller's session may access the PDO. Ownership is bound to
+// the file handle which plugged the PDO in, not to a process.
+// 
+#define IS_OWNER(_pdo_, _session_) \
+    ((_session_) == FDO_INTERFACE_SESSION_ID || (_pdo_)->SessionId == (_session_))
 
 //
 // Represents a MAC address.
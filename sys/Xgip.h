@@ -1,6 +1,6 @@
 /*
 * Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
-* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
 *
 * This program is free software: you can redistribute it and/or modify
 * it under the terms of the GNU General Public License as published by
@@ -51,6 +51,18 @@ DEFINE_GUID(GUID_DEVINTERFACE_XGIP_UNKNOWN_4,
 #define XGIP_REPORT_SIZE                0x12
 #define XGIP_SYS_INIT_PACKETS           0x0F
 #define XGIP_SYS_INIT_PERIOD            0x32
+#define XGIP_SYS_INIT_PACKET_SIZE       RTL_FIELD_SIZE(XGIP_SUBMIT_INTERRUPT, Interrupt)
+
+//
+// System initialization packet cached until all of them arrived
+//
+typedef struct _XGIP_SYS_INIT_PACKET
+{
+    UCHAR Data[XGIP_SYS_INIT_PACKET_SIZE];
+
+    ULONG Length;
+
+} XGIP_SYS_INIT_PACKET, *PXGIP_SYS_INIT_PACKET;
 
 typedef struct _XGIP_DEVICE_DATA
 {
@@ -66,7 +78,25 @@ typedef struct _XGIP_DEVICE_DATA
     //
     WDFQUEUE PendingNotificationRequests;
 
-    WDFCOLLECTION XboxgipSysInitCollection;
+    //
+    // Fixed slots for the system initialization packets
+    //
+    XGIP_SYS_INIT_PACKET XboxgipSysInitPackets[XGIP_SYS_INIT_PACKETS];
+
+    //
+    // Slots handed out to submitters so far
+    //
+    volatile LONG XboxgipSysInitReserved;
+
+    //
+    // Slots filled in completely so far
+    //
+    volatile LONG XboxgipSysInitWritten;
+
+    //
+    // Next slot the timer sends
+    //
+    LONG XboxgipSysInitNext;
 
     BOOLEAN XboxgipSysInitReady;
 
@@ -81,7 +111,7 @@ Bus_XgipSubmitInterrupt(
     WDFDEVICE Device,
     ULONG SerialNo,
     PXGIP_SUBMIT_INTERRUPT Report,
-    _In_ BOOLEAN FromInterface
+    _In_ LONG SessionId
 );
 
 //
@@ -97,4 +127,5 @@ NTSTATUS Xgip_AssignPdoContext(WDFDEVICE Device);
 VOID Xgip_GetConfigurationDescriptorType(PUCHAR Buffer, ULONG Length);
 VOID Xgip_GetDeviceDescriptorType(PUSB_DEVICE_DESCRIPTOR pDescriptor, PPDO_DEVICE_DATA pCommon);
 VOID Xgip_SelectConfiguration(PUSBD_INTERFACE_INFORMATION pInfo);
+NTSTATUS Xgip_QueueSysInitPacket(WDFDEVICE Device, PXGIP_SUBMIT_INTERRUPT Interrupt);
 
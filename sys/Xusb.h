@@ -1,6 +1,6 @@
 /*
 * Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
-* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
 *
 * This program is free software: you can redistribute it and/or modify
 * it under the terms of the GNU General Public License as published by
@@ -60,6 +60,8 @@ DEFINE_GUID(GUID_DEVINTERFACE_XUSB_UNKNOWN_2,
 #define XUSB_BLOB_06_OFFSET             0x23
 #define XUSB_BLOB_07_OFFSET             0x26
 
+#define XUSB_BOOT_STEP_COUNT            0x06
+
 #define XUSB_IS_DATA_PIPE(_x_)          ((BOOLEAN)(_x_->PipeHandle == (USBD_PIPE_HANDLE)0xFFFF0081))
 #define XUSB_IS_CONTROL_PIPE(_x_)       ((BOOLEAN)(_x_->PipeHandle == (USBD_PIPE_HANDLE)0xFFFF0083))
 
@@ -73,6 +75,28 @@ typedef struct _XUSB_INTERRUPT_IN_PACKET
 
 } XUSB_INTERRUPT_IN_PACKET, *PXUSB_INTERRUPT_IN_PACKET;
 
+//
+// Packet served on the data pipe during the boot sequence.
+// 
+typedef struct _XUSB_BOOT_STEP
+{
+    //
+    // Location of the packet in Xusb_BootBlob
+    // 
+    USHORT Offset;
+
+    USHORT Length;
+
+    //
+    // Status-only packet, skipped in fast boot mode
+    // 
+    BOOLEAN Optional;
+
+} XUSB_BOOT_STEP, *PXUSB_BOOT_STEP;
+
+extern const UCHAR Xusb_BootBlob[XUSB_BLOB_STORAGE_SIZE];
+extern const XUSB_BOOT_STEP Xusb_BootSequence[XUSB_BOOT_STEP_COUNT];
+
 //
 // XUSB-specific device context data.
 // 
@@ -109,9 +133,24 @@ typedef struct _XUSB_DEVICE_DATA
     ULONG InterruptInitStage;
 
     //
-    // Storage of binary blobs (packets) for PDO initialization
+    // Skip the optional boot steps, read from the driver parameters
+    // 
+    BOOLEAN FastBoot;
+
+    //
+    // Interrupt time of the first data pipe transfer
+    // 
+    ULONGLONG BootStartTime;
+
+    //
+    // Interrupt time each boot step got served at, zero if skipped
+    // 
+    ULONGLONG BootStepTimes[XUSB_BOOT_STEP_COUNT];
+
+    //
+    // Interrupt time the PDO reported ViGEmPdoInitFinished at
     // 
-    WDFMEMORY InterruptBlobStorage;
+    ULONGLONG BootReadyTime;
 
 } XUSB_DEVICE_DATA, *PXUSB_DEVICE_DATA;
 
@@ -123,7 +162,7 @@ Bus_XusbSubmitReport(
     WDFDEVICE Device,
     ULONG SerialNo,
     PXUSB_SUBMIT_REPORT Report,
-    _In_ BOOLEAN FromInterface
+    _In_ LONG SessionId
 );
 
 //
@@ -135,4 +174,6 @@ NTSTATUS Xusb_AssignPdoContext(WDFDEVICE Device);
 VOID Xusb_GetConfigurationDescriptorType(PUCHAR Buffer, ULONG Length);
 VOID Xusb_GetDeviceDescriptorType(PUSB_DEVICE_DESCRIPTOR pDescriptor, PPDO_DEVICE_DATA pCommon);
 VOID Xusb_SelectConfiguration(PUSBD_INTERFACE_INFORMATION pInfo);
-NTSTATUS Xusb_GetUserIndex(WDFDEVICE Device, PXUSB_GET_USER_INDEX Request);
+NTSTATUS Xusb_GetUserIndex(WDFDEVICE Device, PXUSB_GET_USER_INDEX Request, LONG SessionId);
+BOOLEAN Xusb_ServeBootStep(PXUSB_DEVICE_DATA Xusb, struct _URB_BULK_OR_INTERRUPT_TRANSFER* Transfer);
+VOID Xusb_BootFinished(PXUSB_DEVICE_DATA Xusb);
@@ -1,6 +1,6 @@
 /*
 * Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
-* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
 *
 * This program is free software: you can redistribute it and/or modify
 * it under the terms of the GNU General Public License as published by
@@ -24,10 +24,208 @@
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (PAGE, Bus_PlugInDevice)
+#pragma alloc_text (PAGE, Bus_PlugInDeviceBatch)
 #pragma alloc_text (PAGE, Bus_UnPlugDevice)
+#pragma alloc_text (PAGE, Bus_UnPlugSessionDevices)
+#pragma alloc_text (PAGE, Bus_InterfacePlugIn)
+#pragma alloc_text (PAGE, Bus_InterfaceUnPlug)
 #endif
 
 
+//
+// Bits of the Switch input report excluded from change detection, one word
+// per eight bytes. Byte 1 is a free-running timer.
+//
+static const ULONG64 G_NintSwitchReportIgnoreMask[NSWITCH_REPORT_SIZE / sizeof(ULONG64)] =
+{
+    DIFF_REPORT_NSWITCH_TIMER_MASK
+};
+
+C_ASSERT(RTL_FIELD_SIZE(NSWITCH_SUBMIT_REPORT, InputReport) == NSWITCH_REPORT_SIZE);
+
+//
+// Sets the hardware IDs of a new device, falling back to defaults if the supplied values are invalid.
+// 
+static NTSTATUS Bus_AssignDeviceIds(PPDO_IDENTIFICATION_DESCRIPTION Description, USHORT VendorId, USHORT ProductId)
+{
+    // Set default IDs if supplied values are invalid
+    if (VendorId == 0 || ProductId == 0)
+    {
+        switch (Description->TargetType)
+        {
+        case Xbox360Wired:
+
+            Description->VendorId = 0x045E;
+            Description->ProductId = 0x028E;
+
+            break;
+        case NintendoSwitchWired:
+
+            Description->VendorId = 0x057E;
+            Description->ProductId = 0x2009;
+
+            break;
+        case XboxOneWired:
+
+            Description->VendorId = 0x0E6F;
+            Description->ProductId = 0x0139;
+
+#if !DBG
+            // TODO: implement and remove!
+            return STATUS_NOT_SUPPORTED;
+#endif
+
+            break;
+        }
+    }
+    else
+    {
+        Description->VendorId = VendorId;
+        Description->ProductId = ProductId;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Initializes the description of a child about to be plugged in.
+// 
+static NTSTATUS Bus_InitPluginDescription(
+    PPDO_IDENTIFICATION_DESCRIPTION Description,
+    PVIGEM_PLUGIN_TARGET PlugIn,
+    LONG SessionId,
+    BOOLEAN IsInternal
+)
+{
+    switch (PlugIn->TargetType)
+    {
+    case Xbox360Wired:
+    case NintendoSwitchWired:
+    case XboxOneWired:
+        break;
+    default:
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "Unknown target type: %d",
+            PlugIn->TargetType);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    RtlZeroMemory(Description, sizeof(PDO_IDENTIFICATION_DESCRIPTION));
+
+    WDF_CHILD_IDENTIFICATION_DESCRIPTION_HEADER_INIT(&Description->Header, sizeof(PDO_IDENTIFICATION_DESCRIPTION));
+
+    Description->SerialNo = PlugIn->SerialNo;
+    Description->TargetType = PlugIn->TargetType;
+    Description->OwnerProcessId = CURRENT_PROCESS_ID();
+    Description->SessionId = SessionId;
+    Description->OwnerIsDriver = IsInternal;
+    Description->PollingProfile = VigemPollingProfileDefault;
+
+    return Bus_AssignDeviceIds(Description, PlugIn->VendorId, PlugIn->ProductId);
+}
+
+//
+// Takes a plugin request the caller closed or claimed from the registry off the queue.
+// 
+// Returns NULL if the request got cancelled meanwhile, the cancellation
+// completes it then.
+// 
+WDFREQUEST Bus_TakePluginRequest(WDFQUEUE Queue, WDFREQUEST Request)
+{
+    NTSTATUS        status;
+    WDFREQUEST      foundRequest = NULL;
+
+    status = WdfIoQueueRetrieveFoundRequest(Queue, Request, &foundRequest);
+
+    return NT_SUCCESS(status) ? foundRequest : NULL;
+}
+
+//
+// Hands a plugin request whose children got added over to the pending queue.
+// 
+// Up to here the request is owned by the sequential PnP queue; whoever
+// claimed it from the registry meanwhile left it for us to complete.
+// Returns STATUS_PENDING if the request got parked or completed, a failure
+// status for the caller to complete it with otherwise.
+// 
+NTSTATUS Bus_ParkPluginRequest(PFDO_DEVICE_DATA FdoData, WDFREQUEST Request)
+{
+    NTSTATUS                    status;
+    PFDO_PLUGIN_REQUEST_DATA    pReqData = PluginRequestGetData(Request);
+
+    status = WdfRequestForwardToIoQueue(Request, FdoData->PendingPluginRequests);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "WdfRequestForwardToIoQueue failed with status %!STATUS!",
+            status);
+        return status;
+    }
+
+    if (InterlockedCompareExchange(&pReqData->Owner, PLUGIN_REQUEST_PARKED, PLUGIN_REQUEST_DISPATCHING)
+        == PLUGIN_REQUEST_DISPATCHING)
+    {
+        return STATUS_PENDING;
+    }
+
+    // Claimed during the add, take it back unless a cancellation completed it
+    if (Bus_TakePluginRequest(FdoData->PendingPluginRequests, Request) != NULL)
+    {
+        Bus_CompletePluginRequest(Request, pReqData->ClaimStatus);
+    }
+
+    return STATUS_PENDING;
+}
+
+//
+// Completes a plugin request the caller claimed from the registry.
+// 
+// A request still being dispatched is left to Bus_ParkPluginRequest.
+// Returns TRUE if the request got completed right away.
+// 
+BOOLEAN Bus_FinishPluginRequest(PFDO_DEVICE_DATA FdoData, WDFREQUEST Request, NTSTATUS Status)
+{
+    PFDO_PLUGIN_REQUEST_DATA    pReqData = PluginRequestGetData(Request);
+
+    pReqData->ClaimStatus = Status;
+
+    if (InterlockedCompareExchange(&pReqData->Owner, PLUGIN_REQUEST_CLAIMED, PLUGIN_REQUEST_DISPATCHING)
+        == PLUGIN_REQUEST_DISPATCHING)
+    {
+        return FALSE;
+    }
+
+    if (Bus_TakePluginRequest(FdoData->PendingPluginRequests, Request) == NULL)
+    {
+        return FALSE;
+    }
+
+    Bus_CompletePluginRequest(Request, Status);
+
+    return TRUE;
+}
+
+//
+// Removes a cancelled plugin request from the registry before completing it.
+// 
+VOID Bus_EvtPluginRequestCanceledOnQueue(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request
+)
+{
+    PFDO_DEVICE_DATA pFdoData = FdoGetData(WdfIoQueueGetDevice(Queue));
+
+    (VOID)PluginRegistry_Close(&pFdoData->PluginRegistry, Request);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION,
+        TRACE_BUSENUM,
+        "Plugin request 0x%p got cancelled",
+        Request);
+
+    WdfRequestComplete(Request, STATUS_CANCELLED);
+}
 
 //
 // Simulates a device plug-in event.
@@ -47,6 +245,8 @@ NTSTATUS Bus_PlugInDevice(
     WDF_OBJECT_ATTRIBUTES           requestAttribs;
     PFDO_PLUGIN_REQUEST_DATA        pReqData;
     PFDO_DEVICE_DATA                pFdoData;
+    BOOLEAN                         allocate;
+    BOOLEAN                         ownsSerial = FALSE;
 
     PAGED_CODE();
 
@@ -64,7 +264,11 @@ NTSTATUS Bus_PlugInDevice(
         return status;
     }
 
-    if ((sizeof(VIGEM_PLUGIN_TARGET) != plugIn->Size) || (length != plugIn->Size))
+    //
+    // The extended structure additionally carries the polling profile
+    // 
+    if ((sizeof(VIGEM_PLUGIN_TARGET) != plugIn->Size && sizeof(VIGEM_PLUGIN_TARGET_EX) != plugIn->Size)
+        || (length != plugIn->Size))
     {
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_BUSENUM,
@@ -73,14 +277,21 @@ NTSTATUS Bus_PlugInDevice(
         return STATUS_INVALID_PARAMETER;
     }
 
-    if (plugIn->SerialNo == 0)
+    if (sizeof(VIGEM_PLUGIN_TARGET_EX) == plugIn->Size
+        && ((PVIGEM_PLUGIN_TARGET_EX)plugIn)->PollingProfile >= VigemPollingProfileMax)
     {
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_BUSENUM,
-            "Serial no. 0 not allowed");
+            "Unknown polling profile: %d",
+            ((PVIGEM_PLUGIN_TARGET_EX)plugIn)->PollingProfile);
         return STATUS_INVALID_PARAMETER;
     }
 
+    //
+    // Serial no. 0 lets the bus pick the lowest free one
+    // 
+    allocate = (plugIn->SerialNo == 0);
+
     *Transferred = length;
 
     fileObject = WdfRequestGetFileObject(Request);
@@ -103,53 +314,35 @@ NTSTATUS Bus_PlugInDevice(
         return STATUS_INVALID_PARAMETER;
     }
 
-    //
-    // Initialize the description with the information about the newly
-    // plugged in device.
-    //
-    WDF_CHILD_IDENTIFICATION_DESCRIPTION_HEADER_INIT(&description.Header, sizeof(description));
-
-    description.SerialNo = plugIn->SerialNo;
-    description.TargetType = plugIn->TargetType;
-    description.OwnerProcessId = CURRENT_PROCESS_ID();
-    description.SessionId = pFileData->SessionId;
-    description.OwnerIsDriver = IsInternal;
-
-    // Set default IDs if supplied values are invalid
-    if (plugIn->VendorId == 0 || plugIn->ProductId == 0)
+    status = Bus_InitPluginDescription(&description, plugIn, pFileData->SessionId, IsInternal);
+    if (!NT_SUCCESS(status))
     {
-        switch (plugIn->TargetType)
-        {
-        case Xbox360Wired:
-
-            description.VendorId = 0x045E;
-            description.ProductId = 0x028E;
-
-            break;
-        case NintendoSwitchWired:
-
-            description.VendorId = 0x057E;
-            description.ProductId = 0x2009;
-
-            break;
-        case XboxOneWired:
+        return status;
+    }
 
-            description.VendorId = 0x0E6F;
-            description.ProductId = 0x0139;
+    if (sizeof(VIGEM_PLUGIN_TARGET_EX) == plugIn->Size)
+    {
+        description.PollingProfile = ((PVIGEM_PLUGIN_TARGET_EX)plugIn)->PollingProfile;
+    }
 
-#if !DBG
-            // TODO: implement and remove!
-            return STATUS_NOT_SUPPORTED;
-#endif
+    //
+    // Make room to track the child before it gets added
+    // 
+    if (!description.OwnerIsDriver)
+    {
+        SessionSerials_Lock(&pFileData->OwnedSerials);
+        status = SessionSerials_Reserve(&pFileData->OwnedSerials, 1);
+        SessionSerials_Unlock(&pFileData->OwnedSerials);
 
-            break;
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_BUSENUM,
+                "SessionSerials_Reserve failed with status %!STATUS!",
+                status);
+            return status;
         }
     }
-    else
-    {
-        description.VendorId = plugIn->VendorId;
-        description.ProductId = plugIn->ProductId;
-    }
 
     TraceEvents(TRACE_LEVEL_VERBOSE,
         TRACE_BUSENUM,
@@ -163,75 +356,153 @@ NTSTATUS Bus_PlugInDevice(
         description.ProductId
     );
 
-    WdfSpinLockAcquire(pFdoData->PendingPluginRequestsLock);
-
-    TraceEvents(TRACE_LEVEL_VERBOSE,
-        TRACE_BUSENUM,
-        "Current pending requests count: %d",
-        WdfCollectionGetCount(pFdoData->PendingPluginRequests));
-
-    status = WdfChildListAddOrUpdateChildDescriptionAsPresent(WdfFdoGetDefaultChildList(Device), &description.Header, NULL);
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttribs, FDO_PLUGIN_REQUEST_DATA);
 
+    //
+    // Allocate context data to request
+    // 
+    status = WdfObjectAllocateContext(Request, &requestAttribs, (PVOID)&pReqData);
     if (!NT_SUCCESS(status))
     {
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_BUSENUM,
-            "WdfChildListAddOrUpdateChildDescriptionAsPresent failed with status %!STATUS!",
+            "WdfObjectAllocateContext failed with status %!STATUS!",
             status);
-
-        goto pluginEnd;
+        return status;
     }
 
     //
-    // The requested serial number is already in use
+    // Glue current serial to request
     // 
-    if (status == STATUS_OBJECT_NAME_EXISTS)
-    {
-        status = STATUS_INVALID_PARAMETER;
+    pReqData->Key.Request = Request;
+    pReqData->Key.Entry.SerialNo = description.SerialNo;
+    pReqData->Key.Index = PLUGIN_REGISTRY_SINGLE;
+
+    //
+    // Complete the request by then even if the stage results don't show up
+    // 
+    pReqData->DeadlineNode.Deadline = KeQueryInterruptTime() + WDF_ABS_TIMEOUT_IN_MS(ORC_REQUEST_MAX_AGE);
+
+    //
+    // Register the request before adding the child so an early stage result
+    // can't miss it. The request stays with the sequential PnP queue until
+    // the child got added; a stage result arriving meanwhile is left for
+    // Bus_ParkPluginRequest to pick up.
+    // 
+    // The references keep the handles valid should it get completed once
+    // parked and the file handle closed as a consequence.
+    // 
+    WdfObjectReference(Request);
+    WdfObjectReference(fileObject);
 
+    status = PluginRegistry_Insert(&pFdoData->PluginRegistry, Request);
+    if (!NT_SUCCESS(status))
+    {
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_BUSENUM,
-            "The described PDO already exists (%!STATUS!)",
+            "PluginRegistry_Insert failed with status %!STATUS!",
             status);
-
         goto pluginEnd;
     }
 
-    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttribs, FDO_PLUGIN_REQUEST_DATA);
-
     //
-    // Allocate context data to request
+    // Adding the child and recording it as owned must not be split by
+    // the handle getting closed, the child would be left without owner
     // 
-    status = WdfObjectAllocateContext(Request, &requestAttribs, (PVOID)&pReqData);
-    if (!NT_SUCCESS(status))
+    SessionSerials_Lock(&pFileData->OwnedSerials);
+
+    if (!description.OwnerIsDriver && pFileData->OwnedSerials.Closed)
     {
+        SessionSerials_Unlock(&pFileData->OwnedSerials);
+
+        status = STATUS_DELETE_PENDING;
+
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_BUSENUM,
-            "WdfObjectAllocateContext failed with status %!STATUS!",
+            "File handle got closed (%!STATUS!)",
             status);
 
         goto pluginEnd;
     }
 
     //
-    // Glue current serial to request
+    // Plugin requests are serialized up to here, so no other one can take
+    // the allocated serial before the child holding it got added. Only a
+    // direct call through the bus interface can, adding fails then as for
+    // any serial in use.
     // 
-    pReqData->Serial = plugIn->SerialNo;
+    if (allocate)
+    {
+        description.SerialNo = SerialPool_Allocate(&pFdoData->Serials);
+        if (description.SerialNo == 0)
+        {
+            SessionSerials_Unlock(&pFileData->OwnedSerials);
+
+            status = STATUS_INSUFFICIENT_RESOURCES;
+
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_BUSENUM,
+                "No free serial number left (%!STATUS!)",
+                status);
+
+            goto pluginEnd;
+        }
+
+        ownsSerial = TRUE;
+
+        TraceEvents(TRACE_LEVEL_VERBOSE,
+            TRACE_BUSENUM,
+            "Allocated serial: %d",
+            description.SerialNo);
+    }
+    else
+    {
+        ownsSerial = SerialPool_Reserve(&pFdoData->Serials, description.SerialNo);
+    }
 
     //
-    // Timestamp the request to track its age
+    // Stage results look the request up by this serial
     // 
-    pReqData->Timestamp = KeQueryPerformanceCounter(&pReqData->Frequency);
+    PluginRegistry_Rekey(&pFdoData->PluginRegistry, &pReqData->Key, description.SerialNo);
+
+    status = WdfChildListAddOrUpdateChildDescriptionAsPresent(WdfFdoGetDefaultChildList(Device), &description.Header, NULL);
 
     //
-    // Keep track of pending request in collection
+    // Remember the child so unplugging and closing the handle don't have
+    // to walk all of them
     // 
-    status = WdfCollectionAdd(pFdoData->PendingPluginRequests, Request);
+    if (NT_SUCCESS(status) && status != STATUS_OBJECT_NAME_EXISTS && !description.OwnerIsDriver)
+    {
+        SessionSerials_Add(&pFileData->OwnedSerials, description.SerialNo);
+    }
+
+    SessionSerials_Unlock(&pFileData->OwnedSerials);
+
     if (!NT_SUCCESS(status))
     {
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_BUSENUM,
-            "WdfCollectionAdd failed with status %!STATUS!",
+            "WdfChildListAddOrUpdateChildDescriptionAsPresent failed with status %!STATUS!",
+            status);
+
+        if (ownsSerial)
+        {
+            SerialPool_Free(&pFdoData->Serials, description.SerialNo);
+        }
+
+        goto pluginEnd;
+    }
+
+    //
+    // The requested serial number is already in use
+    // 
+    if (status == STATUS_OBJECT_NAME_EXISTS)
+    {
+        status = STATUS_INVALID_PARAMETER;
+
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "The described PDO already exists (%!STATUS!)",
             status);
 
         goto pluginEnd;
@@ -240,24 +511,29 @@ NTSTATUS Bus_PlugInDevice(
     TraceEvents(TRACE_LEVEL_INFORMATION,
         TRACE_BUSENUM,
         "Added item with serial: %d",
-        plugIn->SerialNo);
+        description.SerialNo);
 
     //
-    // At least one request present in the collection; start clean-up timer
+    // At least one request present in the registry; arm clean-up timer
     // 
-    WdfTimerStart(
-        pFdoData->PendingPluginRequestsCleanupTimer,
-        WDF_REL_TIMEOUT_IN_MS(ORC_TIMER_PERIODIC_DUE_TIME)
-    );
-    TraceEvents(TRACE_LEVEL_VERBOSE,
-        TRACE_DRIVER,
-        "Started periodic timer");
+    Bus_ArmPluginRequestTimer(pFdoData);
 
-    status = NT_SUCCESS(status) ? STATUS_PENDING : status;
+    //
+    // Releases the PnP queue for the next request; the input buffer must
+    // not be touched anymore from here on
+    // 
+    status = Bus_ParkPluginRequest(pFdoData, Request);
 
 pluginEnd:
 
-    WdfSpinLockRelease(pFdoData->PendingPluginRequestsLock);
+    // Still ours, the caller fails it
+    if (status != STATUS_PENDING)
+    {
+        (VOID)PluginRegistry_Close(&pFdoData->PluginRegistry, Request);
+    }
+
+    WdfObjectDereference(fileObject);
+    WdfObjectDereference(Request);
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_BUSENUM, "%!FUNC! Exit with status %!STATUS!", status);
 
@@ -265,23 +541,334 @@ pluginEnd:
 }
 
 //
-// Simulates a device unplug event.
+// Simulates plug-in events of multiple devices with a single bus re-enumeration.
 // 
-NTSTATUS Bus_UnPlugDevice(
+// The request completes once every entry got its stage result (or the
+// request timed out), the per-entry results are returned in the output buffer.
+// 
+NTSTATUS Bus_PlugInDeviceBatch(
     _In_ WDFDEVICE Device,
     _In_ WDFREQUEST Request,
-    _In_ BOOLEAN IsInternal,
-    _Out_ size_t* Transferred)
+    _In_ PVIGEM_PLUGIN_TARGET_BATCH Batch
+)
 {
-    NTSTATUS                            status;
-    WDFDEVICE                           hChild;
-    WDFCHILDLIST                        list;
-    WDF_CHILD_LIST_ITERATOR             iterator;
-    WDF_CHILD_RETRIEVE_INFO             childInfo;
-    PDO_IDENTIFICATION_DESCRIPTION      description;
-    BOOLEAN                             unplugAll;
-    PVIGEM_UNPLUG_TARGET                unPlug;
-    WDFFILEOBJECT                       fileObject;
+    NTSTATUS                        status;
+    WDFFILEOBJECT                   fileObject;
+    WDFCHILDLIST                    list;
+    WDF_CHILD_LIST_ITERATOR         iterator;
+    WDF_OBJECT_ATTRIBUTES           requestAttribs;
+    PFDO_PLUGIN_REQUEST_DATA        pReqData;
+    PFDO_PLUGIN_BATCH_ENTRY         entry;
+    PVIGEM_PLUGIN_TARGET            plugIn;
+    PFDO_DEVICE_DATA                pFdoData;
+    PFDO_FILE_DATA                  pFileData;
+    ULONG                           index;
+
+    PAGED_CODE();
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_BUSENUM, "%!FUNC! Entry (count: %d)", Batch->Count);
+
+    pFdoData = FdoGetData(Device);
+
+    fileObject = WdfRequestGetFileObject(Request);
+    if (fileObject == NULL)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "WdfRequestGetFileObject failed to fetch WDFFILEOBJECT from request 0x%p",
+            Request);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    pFileData = FileObjectGetData(fileObject);
+
+    //
+    // Make room to track all children before any gets added
+    // 
+    SessionSerials_Lock(&pFileData->OwnedSerials);
+    status = SessionSerials_Reserve(&pFileData->OwnedSerials, Batch->Count);
+    SessionSerials_Unlock(&pFileData->OwnedSerials);
+
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "SessionSerials_Reserve failed with status %!STATUS!",
+            status);
+        return status;
+    }
+
+    //
+    // The entries live in the request context, it stays valid for as long
+    // as we hold a reference, even if the request gets cancelled
+    // 
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttribs, FDO_PLUGIN_REQUEST_DATA);
+    requestAttribs.ContextSizeOverride = FDO_PLUGIN_REQUEST_DATA_SIZE(Batch->Count);
+
+    status = WdfObjectAllocateContext(Request, &requestAttribs, (PVOID)&pReqData);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "WdfObjectAllocateContext failed with status %!STATUS!",
+            status);
+        return status;
+    }
+
+    pReqData->DeadlineNode.Deadline = KeQueryInterruptTime() + WDF_ABS_TIMEOUT_IN_MS(ORC_REQUEST_MAX_AGE);
+    pReqData->BatchCount = Batch->Count;
+    // Biased by one so the request can't complete before all children got added
+    pReqData->BatchRemaining = 1;
+
+    for (index = 0; index < Batch->Count; index++)
+    {
+        entry = &pReqData->BatchEntries[index];
+        plugIn = &Batch->Entries[index].Target;
+
+        if (plugIn->Size != sizeof(VIGEM_PLUGIN_TARGET))
+        {
+            entry->Status = STATUS_INVALID_PARAMETER;
+            continue;
+        }
+
+        status = Bus_InitPluginDescription(&entry->Description, plugIn, pFileData->SessionId, FALSE);
+        if (!NT_SUCCESS(status))
+        {
+            entry->Status = status;
+            continue;
+        }
+
+        //
+        // Serial no. 0 lets the bus pick one, see Bus_PlugInDevice
+        // 
+        if (plugIn->SerialNo == 0)
+        {
+            entry->Description.SerialNo = SerialPool_Allocate(&pFdoData->Serials);
+            if (entry->Description.SerialNo == 0)
+            {
+                entry->Status = STATUS_INSUFFICIENT_RESOURCES;
+                continue;
+            }
+
+            entry->OwnsSerial = TRUE;
+        }
+        else
+        {
+            entry->OwnsSerial = SerialPool_Reserve(&pFdoData->Serials, entry->Description.SerialNo);
+        }
+
+        entry->Key.Request = Request;
+        entry->Key.Entry.SerialNo = entry->Description.SerialNo;
+        entry->Key.Index = index;
+
+        entry->Status = STATUS_PENDING;
+        pReqData->BatchRemaining++;
+    }
+
+    //
+    // Register the request before adding the children, it stays with the
+    // PnP queue until they got added, see Bus_PlugInDevice
+    // 
+    WdfObjectReference(Request);
+    WdfObjectReference(fileObject);
+
+    status = PluginRegistry_Insert(&pFdoData->PluginRegistry, Request);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "PluginRegistry_Insert failed with status %!STATUS!",
+            status);
+
+        for (index = 0; index < pReqData->BatchCount; index++)
+        {
+            if (pReqData->BatchEntries[index].OwnsSerial)
+            {
+                SerialPool_Free(&pFdoData->Serials, pReqData->BatchEntries[index].Description.SerialNo);
+            }
+        }
+
+        // Still ours, the caller fails it
+        (VOID)PluginRegistry_Close(&pFdoData->PluginRegistry, Request);
+
+        WdfObjectDereference(fileObject);
+        WdfObjectDereference(Request);
+        return status;
+    }
+
+    list = WdfFdoGetDefaultChildList(Device);
+
+    // Keeps closing the handle from splitting adding and recording a child
+    SessionSerials_Lock(&pFileData->OwnedSerials);
+
+    //
+    // Children added while iterating get reported to the PnP manager
+    // all at once when the iteration ends. Unlike a scan this doesn't
+    // mark the already present children as missing.
+    // 
+    WDF_CHILD_LIST_ITERATOR_INIT(&iterator, WdfRetrievePresentChildren);
+
+    WdfChildListBeginIteration(list, &iterator);
+
+    for (index = 0; index < pReqData->BatchCount; index++)
+    {
+        entry = &pReqData->BatchEntries[index];
+
+        if (entry->Status != STATUS_PENDING)
+        {
+            continue;
+        }
+
+        // A closed handle would leave the child without owner
+        if (pFileData->OwnedSerials.Closed)
+        {
+            status = STATUS_DELETE_PENDING;
+        }
+        else
+        {
+            status = WdfChildListAddOrUpdateChildDescriptionAsPresent(list, &entry->Description.Header, NULL);
+        }
+
+        // The serial belongs to the existing child, don't free it
+        if (!NT_SUCCESS(status) && entry->OwnsSerial)
+        {
+            SerialPool_Free(&pFdoData->Serials, entry->Description.SerialNo);
+        }
+
+        // The requested serial number is already in use
+        if (status == STATUS_OBJECT_NAME_EXISTS)
+        {
+            status = STATUS_INVALID_PARAMETER;
+        }
+
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_BUSENUM,
+                "Adding serial %d failed with status %!STATUS!",
+                entry->Description.SerialNo,
+                status);
+
+            // Can't be the last one thanks to the bias
+            (VOID)PluginRegistry_ResolveEntry(&pFdoData->PluginRegistry, Request, index, status);
+        }
+        else
+        {
+            SessionSerials_Add(&pFileData->OwnedSerials, entry->Description.SerialNo);
+        }
+    }
+
+    WdfChildListEndIteration(list, &iterator);
+
+    SessionSerials_Unlock(&pFileData->OwnedSerials);
+
+    Bus_ArmPluginRequestTimer(pFdoData);
+
+    // Releases the PnP queue for the next request
+    status = Bus_ParkPluginRequest(pFdoData, Request);
+
+    //
+    // Drop the bias once parked; if all entries are resolved already (e.g.
+    // every one of them was invalid) nobody else is going to complete it
+    // 
+    if (status != STATUS_PENDING)
+    {
+        // Still ours, the caller fails it; the children stay with the session
+        (VOID)PluginRegistry_Close(&pFdoData->PluginRegistry, Request);
+    }
+    else if (PluginRegistry_Release(&pFdoData->PluginRegistry, Request) != NULL)
+    {
+        (VOID)Bus_FinishPluginRequest(pFdoData, Request, STATUS_SUCCESS);
+
+        // Reference handed out by the registry
+        WdfObjectDereference(Request);
+    }
+
+    WdfObjectDereference(fileObject);
+    WdfObjectDereference(Request);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_BUSENUM, "%!FUNC! Exit with status %!STATUS!", status);
+
+    return status;
+}
+
+//
+// Completes a plugin request taken off the pending queue.
+// 
+// Batch entries without result yet get Status, the request itself succeeds
+// so the per-entry results reach the caller.
+// 
+VOID Bus_CompletePluginRequest(WDFREQUEST Request, NTSTATUS Status)
+{
+    NTSTATUS                    status;
+    PFDO_PLUGIN_REQUEST_DATA    pReqData = PluginRequestGetData(Request);
+    PVIGEM_PLUGIN_TARGET_BATCH  batch = NULL;
+    PVIGEM_PLUGIN_TARGET        plugIn = NULL;
+    ULONG                       index;
+    LONG                        result;
+
+    if (pReqData->BatchCount == 0)
+    {
+        //
+        // Report the serial back to callers supplying an output buffer,
+        // they need it if the bus allocated one
+        // 
+        if (NT_SUCCESS(Status)
+            && NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request, sizeof(VIGEM_PLUGIN_TARGET), (PVOID)&plugIn, NULL)))
+        {
+            plugIn->SerialNo = pReqData->Key.Entry.SerialNo;
+
+            WdfRequestCompleteWithInformation(Request, Status, sizeof(VIGEM_PLUGIN_TARGET));
+            return;
+        }
+
+        WdfRequestComplete(Request, Status);
+        return;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        VIGEM_PLUGIN_TARGET_BATCH_SIZE(pReqData->BatchCount),
+        (PVOID)&batch,
+        NULL);
+    if (!NT_SUCCESS(status))
+    {
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    for (index = 0; index < pReqData->BatchCount; index++)
+    {
+        result = pReqData->BatchEntries[index].Status;
+
+        batch->Entries[index].Status = (result == STATUS_PENDING) ? Status : result;
+
+        if (NT_SUCCESS(batch->Entries[index].Status))
+        {
+            batch->Entries[index].Target.SerialNo = pReqData->BatchEntries[index].Description.SerialNo;
+        }
+    }
+
+    WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, VIGEM_PLUGIN_TARGET_BATCH_SIZE(pReqData->BatchCount));
+}
+
+//
+// Simulates a device unplug event.
+// 
+NTSTATUS Bus_UnPlugDevice(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request,
+    _In_ BOOLEAN IsInternal,
+    _Out_ size_t* Transferred)
+{
+    NTSTATUS                            status;
+    WDFDEVICE                           hChild;
+    WDFCHILDLIST                        list;
+    WDF_CHILD_LIST_ITERATOR             iterator;
+    WDF_CHILD_RETRIEVE_INFO             childInfo;
+    PDO_IDENTIFICATION_DESCRIPTION      description;
+    BOOLEAN                             unplugAll;
+    PVIGEM_UNPLUG_TARGET                unPlug;
+    WDFFILEOBJECT                       fileObject;
     PFDO_FILE_DATA                      pFileData = NULL;
     size_t                              length = 0;
 
@@ -333,6 +920,17 @@ NTSTATUS Bus_UnPlugDevice(
                 fileObject);
             return STATUS_INVALID_PARAMETER;
         }
+
+        //
+        // Only owned children may be unplugged, no need to look at others
+        // 
+        SessionSerials_Lock(&pFileData->OwnedSerials);
+        Bus_UnPlugSessionDevices(Device, pFileData, unPlug->SerialNo);
+        SessionSerials_Unlock(&pFileData->OwnedSerials);
+
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_BUSENUM, "%!FUNC! Exit with status %!STATUS!", STATUS_SUCCESS);
+
+        return STATUS_SUCCESS;
     }
 
     TraceEvents(TRACE_LEVEL_VERBOSE,
@@ -383,24 +981,14 @@ NTSTATUS Bus_UnPlugDevice(
             continue;
         }
 
-        TraceEvents(TRACE_LEVEL_VERBOSE,
-            TRACE_BUSENUM,
-            "description.SessionId = %d, pFileData->SessionId = %d",
-            description.SessionId,
-            pFileData->SessionId);
-
-        // Only unplug owned children
-        if (IsInternal || description.SessionId == pFileData->SessionId)
+        // Unplug child
+        status = WdfChildListUpdateChildDescriptionAsMissing(list, &description.Header);
+        if (!NT_SUCCESS(status))
         {
-            // Unplug child
-            status = WdfChildListUpdateChildDescriptionAsMissing(list, &description.Header);
-            if (!NT_SUCCESS(status))
-            {
-                TraceEvents(TRACE_LEVEL_ERROR,
-                    TRACE_BUSENUM,
-                    "WdfChildListUpdateChildDescriptionAsMissing failed with status %!STATUS!",
-                    status);
-            }
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_BUSENUM,
+                "WdfChildListUpdateChildDescriptionAsMissing failed with status %!STATUS!",
+                status);
         }
     }
 
@@ -415,14 +1003,104 @@ NTSTATUS Bus_UnPlugDevice(
     return STATUS_SUCCESS;
 }
 
+//
+// Unplugs the children plugged in through a file handle, all of them if
+// SerialNo is 0.
+// 
+// Only the serials the session tracks get looked at. All children go
+// missing with a single re-enumeration once the iteration ends. The
+// caller has to hold the lock of the session's serials.
+// 
+VOID Bus_UnPlugSessionDevices(
+    _In_ WDFDEVICE Device,
+    _In_ PFDO_FILE_DATA FileData,
+    _In_ ULONG SerialNo)
+{
+    NTSTATUS                            status;
+    WDFCHILDLIST                        list;
+    WDF_CHILD_LIST_ITERATOR             iterator;
+    WDF_CHILD_RETRIEVE_INFO             childInfo;
+    PDO_IDENTIFICATION_DESCRIPTION      description;
+    PSESSION_SERIALS                    owned = &FileData->OwnedSerials;
+    ULONG                               index;
+    ULONG                               serial;
+
+    PAGED_CODE();
+
+    list = WdfFdoGetDefaultChildList(Device);
+
+    WDF_CHILD_LIST_ITERATOR_INIT(&iterator, WdfRetrievePresentChildren);
+
+    WdfChildListBeginIteration(list, &iterator);
+
+    // Backwards since removing moves the last serial into the free slot
+    for (index = owned->Count; index-- > 0;)
+    {
+        serial = owned->Serials[index];
+
+        if (SerialNo != 0 && serial != SerialNo)
+        {
+            continue;
+        }
+
+        SessionSerials_RemoveAt(owned, index);
+
+        RtlZeroMemory(&description, sizeof(description));
+        WDF_CHILD_IDENTIFICATION_DESCRIPTION_HEADER_INIT(&description.Header, sizeof(description));
+        description.SerialNo = serial;
+        description.SessionId = FileData->SessionId;
+        description.OwnerIsDriver = FALSE;
+
+        //
+        // The child may have been unplugged by an internal request and the
+        // serial re-used by someone else since, so match the owner as well
+        // 
+        WDF_CHILD_RETRIEVE_INFO_INIT(&childInfo, &description.Header);
+        childInfo.EvtChildListIdentificationDescriptionCompare = Bus_EvtChildListOwnerDescriptionCompare;
+
+        (VOID)WdfChildListRetrievePdo(list, &childInfo);
+
+        //
+        // A description whose PDO isn't created yet is still present and
+        // has to go as well, or the child shows up after its owner left
+        // 
+        if (childInfo.Status != WdfChildListRetrieveDeviceSuccess
+            && childInfo.Status != WdfChildListRetrieveDeviceNotYetCreated)
+        {
+            TraceEvents(TRACE_LEVEL_VERBOSE,
+                TRACE_BUSENUM,
+                "Serial %d no longer owned (childInfo.Status = %d)",
+                serial,
+                childInfo.Status);
+            continue;
+        }
+
+        TraceEvents(TRACE_LEVEL_INFORMATION,
+            TRACE_BUSENUM,
+            "Unplugging device with serial %d",
+            serial);
+
+        status = WdfChildListUpdateChildDescriptionAsMissing(list, &description.Header);
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_BUSENUM,
+                "WdfChildListUpdateChildDescriptionAsMissing failed with status %!STATUS!",
+                status);
+        }
+    }
+
+    WdfChildListEndIteration(list, &iterator);
+}
+
 //
 // Sends a report update to an XUSB PDO.
 // 
-NTSTATUS Bus_XusbSubmitReport(WDFDEVICE Device, ULONG SerialNo, PXUSB_SUBMIT_REPORT Report, BOOLEAN FromInterface)
+NTSTATUS Bus_XusbSubmitReport(WDFDEVICE Device, ULONG SerialNo, PXUSB_SUBMIT_REPORT Report, LONG SessionId)
 {
     TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_BUSENUM, "%!FUNC! Entry");
 
-    return Bus_SubmitReport(Device, SerialNo, Report, FromInterface);
+    return Bus_SubmitReport(Device, SerialNo, Report, SessionId);
 }
 
 //
@@ -458,17 +1136,19 @@ NTSTATUS Bus_QueueNotification(WDFDEVICE Device, ULONG SerialNo, WDFREQUEST Requ
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_BUSENUM,
             "PdoGetData failed");
+        WdfObjectDereference(hChild);
         return STATUS_INVALID_PARAMETER;
     }
 
     // Check if caller owns this PDO
-    if (!IS_OWNER(pdoData))
+    if (!IS_OWNER(pdoData, Bus_GetRequestSessionId(Request)))
     {
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_BUSENUM,
             "PDO & Request ownership mismatch: %d != %d",
-            pdoData->OwnerProcessId,
-            CURRENT_PROCESS_ID());
+            pdoData->SessionId,
+            Bus_GetRequestSessionId(Request));
+        WdfObjectDereference(hChild);
         return STATUS_ACCESS_DENIED;
     }
 
@@ -525,64 +1205,820 @@ NTSTATUS Bus_QueueNotification(WDFDEVICE Device, ULONG SerialNo, WDFREQUEST Requ
 
     status = (NT_SUCCESS(status)) ? STATUS_PENDING : status;
 
+    WdfObjectDereference(hChild);
+
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_BUSENUM, "%!FUNC! Exit with status %!STATUS!", status);
 
     return status;
 }
 
 //
-// Sends a report update to a NSWITCH PDO.
+// Fills in the current output data of a PDO, returns FALSE if its type has none.
 // 
-NTSTATUS Bus_NintSwitchSubmitReport(WDFDEVICE Device, ULONG SerialNo, PNSWITCH_SUBMIT_REPORT Report, BOOLEAN FromInterface)
+static BOOLEAN Bus_FillNotification(WDFDEVICE Child, PVIGEM_ANY_REQUEST_NOTIFICATION Notification)
 {
-    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_BUSENUM, "%!FUNC! Entry");
+    PPDO_DEVICE_DATA    pdoData = PdoGetData(Child);
+    PXUSB_DEVICE_DATA   xusbData;
 
-    return Bus_SubmitReport(Device, SerialNo, Report, FromInterface);
-}
+    switch (pdoData->TargetType)
+    {
+    case Xbox360Wired:
 
-NTSTATUS Bus_XgipSubmitReport(WDFDEVICE Device, ULONG SerialNo, PXGIP_SUBMIT_REPORT Report, BOOLEAN FromInterface)
-{
-    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_BUSENUM, "%!FUNC! Entry");
+        xusbData = XusbGetData(Child);
 
-    return Bus_SubmitReport(Device, SerialNo, Report, FromInterface);
+        Notification->Xusb.Size = sizeof(XUSB_REQUEST_NOTIFICATION);
+        Notification->Xusb.SerialNo = pdoData->SerialNo;
+        Notification->Xusb.LedNumber = xusbData->LedNumber;
+        Notification->Xusb.LargeMotor = xusbData->Rumble[3];
+        Notification->Xusb.SmallMotor = xusbData->Rumble[4];
+
+        return TRUE;
+    case NintendoSwitchWired:
+
+        Notification->NintSwitch.Size = sizeof(NSWITCH_REQUEST_NOTIFICATION);
+        Notification->NintSwitch.SerialNo = pdoData->SerialNo;
+
+        RtlCopyMemory(&Notification->NintSwitch.OutputReport, &NintSwitchGetData(Child)->OutputReport, NSWITCH_REPORT_SIZE);
+
+        return TRUE;
+    default:
+
+        return FALSE;
+    }
+}
+
+//
+// Fills a session notification with the pending updates of a session.
+// 
+// Must be called with the session notification lock held.
+// 
+static ULONG Bus_CollectSessionNotifications(PFDO_FILE_DATA Session, PVIGEM_SESSION_NOTIFICATION Notification)
+{
+    PLIST_ENTRY         entry;
+    PPDO_DEVICE_DATA    pdoData;
+
+    RtlZeroMemory(Notification, sizeof(VIGEM_SESSION_NOTIFICATION));
+
+    while (Notification->Count < VIGEM_SESSION_NOTIFICATION_MAX_ENTRIES
+        && !IsListEmpty(&Session->PendingNotifications))
+    {
+        entry = RemoveHeadList(&Session->PendingNotifications);
+        pdoData = CONTAINING_RECORD(entry, PDO_DEVICE_DATA, SessionNotificationLink);
+
+        pdoData->SessionNotificationPending = FALSE;
+
+        if (Bus_FillNotification((WDFDEVICE)WdfObjectContextGetObject(pdoData),
+            &Notification->Entries[Notification->Count]))
+        {
+            Notification->Count++;
+        }
+    }
+
+    Notification->Size = sizeof(VIGEM_SESSION_NOTIFICATION);
+
+    return Notification->Count;
+}
+
+//
+// Looks up an open session by its ID, returns NULL if the handle is gone.
+// 
+// Must be called with the session notification lock held. Only used to
+// bind a new child, signalling goes through the session pointer.
+// 
+static PFDO_FILE_DATA Bus_FindSession(PFDO_DEVICE_DATA FdoData, LONG SessionId)
+{
+    PLIST_ENTRY     entry;
+    PFDO_FILE_DATA  session;
+
+    for (entry = FdoData->Sessions.Flink; entry != &FdoData->Sessions; entry = entry->Flink)
+    {
+        session = CONTAINING_RECORD(entry, FDO_FILE_DATA, SessionLink);
+
+        if (session->SessionId == SessionId)
+        {
+            return session;
+        }
+    }
+
+    return NULL;
 }
 
-NTSTATUS Bus_XgipSubmitInterrupt(WDFDEVICE Device, ULONG SerialNo, PXGIP_SUBMIT_INTERRUPT Report, BOOLEAN FromInterface)
+//
+// Queues an inverted call to receive updates of all PDOs owned by the caller's session.
+// 
+NTSTATUS Bus_QueueSessionNotification(WDFDEVICE Device, WDFREQUEST Request, size_t* Transferred)
 {
+    NTSTATUS                    status;
+    WDFFILEOBJECT               fileObject;
+    PFDO_DEVICE_DATA            pFdoData;
+    PVIGEM_SESSION_NOTIFICATION notification = NULL;
+    PFDO_FILE_DATA              session;
+    ULONG                       count;
+
     TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_BUSENUM, "%!FUNC! Entry");
 
-    return Bus_SubmitReport(Device, SerialNo, Report, FromInterface);
+    fileObject = WdfRequestGetFileObject(Request);
+    if (fileObject == NULL)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "WdfRequestGetFileObject failed to fetch WDFFILEOBJECT from request 0x%p",
+            Request);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    session = FileObjectGetData(fileObject);
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(VIGEM_SESSION_NOTIFICATION), (PVOID)&notification, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "WdfRequestRetrieveOutputBuffer failed with status %!STATUS!",
+            status);
+        return status;
+    }
+
+    pFdoData = FdoGetData(Device);
+
+    WdfSpinLockAcquire(pFdoData->SessionNotificationLock);
+
+    // Complete right away if updates arrived while no request was pending
+    count = Bus_CollectSessionNotifications(session, notification);
+
+    if (count == 0)
+    {
+        status = (session->PendingNotificationRequests != NULL)
+            ? WdfRequestForwardToIoQueue(Request, session->PendingNotificationRequests)
+            : STATUS_FILE_CLOSED;
+    }
+
+    WdfSpinLockRelease(pFdoData->SessionNotificationLock);
+
+    if (count > 0)
+    {
+        *Transferred = sizeof(VIGEM_SESSION_NOTIFICATION);
+        return STATUS_SUCCESS;
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "WdfRequestForwardToIoQueue failed with status %!STATUS!",
+            status);
+        return status;
+    }
+
+    return STATUS_PENDING;
+}
+
+//
+// Makes a newly opened handle reachable for updates of its children.
+// 
+NTSTATUS Bus_AttachSession(WDFDEVICE Device, PFDO_FILE_DATA Session)
+{
+    NTSTATUS            status;
+    PFDO_DEVICE_DATA    pFdoData = FdoGetData(Device);
+    WDF_IO_QUEUE_CONFIG queueConfig;
+
+    InitializeListHead(&Session->PendingNotifications);
+
+    // Own queue per handle, signalling a child doesn't search for requests
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+
+    status = WdfIoQueueCreate(Device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &Session->PendingNotificationRequests);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "WdfIoQueueCreate (PendingNotificationRequests) failed with status %!STATUS!",
+            status);
+        Session->PendingNotificationRequests = NULL;
+        return status;
+    }
+
+    WdfSpinLockAcquire(pFdoData->SessionNotificationLock);
+
+    InsertTailList(&pFdoData->Sessions, &Session->SessionLink);
+
+    WdfSpinLockRelease(pFdoData->SessionNotificationLock);
+
+    return STATUS_SUCCESS;
 }
 
+//
+// Unlinks a closing handle, children still being removed can't signal it anymore.
+// 
+VOID Bus_DetachSession(WDFDEVICE Device, PFDO_FILE_DATA Session)
+{
+    PFDO_DEVICE_DATA    pFdoData = FdoGetData(Device);
+    PLIST_ENTRY         entry;
+    WDFQUEUE            queue;
+
+    WdfSpinLockAcquire(pFdoData->SessionNotificationLock);
+
+    RemoveEntryList(&Session->SessionLink);
+
+    while (!IsListEmpty(&Session->PendingNotifications))
+    {
+        entry = RemoveHeadList(&Session->PendingNotifications);
+
+        CONTAINING_RECORD(entry, PDO_DEVICE_DATA, SessionNotificationLink)->SessionNotificationPending = FALSE;
+    }
+
+    // Children still holding on to the session see it closed
+    queue = Session->PendingNotificationRequests;
+    Session->PendingNotificationRequests = NULL;
+
+    WdfSpinLockRelease(pFdoData->SessionNotificationLock);
+
+    // The queue belongs to the FDO and would outlive the handle
+    if (queue != NULL)
+    {
+        WdfIoQueuePurgeSynchronously(queue);
+        WdfObjectDelete(queue);
+    }
+}
+
+//
+// Binds a new child to the session which plugged it in, if it's still open.
+// 
+VOID Bus_BindSession(WDFDEVICE Child)
+{
+    PFDO_DEVICE_DATA    pFdoData = FdoGetData(WdfPdoGetParent(Child));
+    PPDO_DEVICE_DATA    pdoData = PdoGetData(Child);
+    PFDO_FILE_DATA      session;
+
+    WdfSpinLockAcquire(pFdoData->SessionNotificationLock);
+
+    session = Bus_FindSession(pFdoData, pdoData->SessionId);
+
+    // Keeps the session memory valid after the handle got closed
+    if (session != NULL)
+    {
+        WdfObjectReference(WdfObjectContextGetObject(session));
+    }
+
+    pdoData->Session = session;
+
+    WdfSpinLockRelease(pFdoData->SessionNotificationLock);
+}
+
+//
+// Takes a PDO about to go away off the pending list of its session and
+// drops its reference on the session.
+// 
+VOID Bus_CancelSessionNotification(WDFDEVICE Child)
+{
+    PFDO_DEVICE_DATA    pFdoData = FdoGetData(WdfPdoGetParent(Child));
+    PPDO_DEVICE_DATA    pdoData = PdoGetData(Child);
+    PFDO_FILE_DATA      session;
+
+    WdfSpinLockAcquire(pFdoData->SessionNotificationLock);
+
+    if (pdoData->SessionNotificationPending)
+    {
+        RemoveEntryList(&pdoData->SessionNotificationLink);
+        pdoData->SessionNotificationPending = FALSE;
+    }
+
+    session = pdoData->Session;
+    pdoData->Session = NULL;
+
+    WdfSpinLockRelease(pFdoData->SessionNotificationLock);
+
+    if (session != NULL)
+    {
+        WdfObjectDereference(WdfObjectContextGetObject(session));
+    }
+}
+
+//
+// Flags new output data of a PDO, completes a session notification of its owner
+// and invokes the notification callback of a kernel-mode feeder.
+// 
+VOID Bus_SignalSessionNotification(WDFDEVICE Child)
+{
+    NTSTATUS                    status = STATUS_SUCCESS;
+    WDFDEVICE                   device;
+    PFDO_DEVICE_DATA            pFdoData;
+    PPDO_DEVICE_DATA            pdoData;
+    PFDO_FILE_DATA              session;
+    WDFREQUEST                  request = NULL;
+    PVIGEM_SESSION_NOTIFICATION notification = NULL;
+    VIGEM_ANY_REQUEST_NOTIFICATION callbackNotification;
+    PVIGEM_BUS_NOTIFICATION_CALLBACK callback;
+    PVOID                       callbackContext;
+    KIRQL                       irql;
+
+    pdoData = PdoGetData(Child);
+    device = WdfPdoGetParent(Child);
+    pFdoData = FdoGetData(device);
+
+    WdfSpinLockAcquire(pFdoData->SessionNotificationLock);
+
+    // Driver-owned children and those of a closed handle have no session to notify
+    session = pdoData->Session;
+
+    if (session != NULL && session->PendingNotificationRequests != NULL)
+    {
+        if (!pdoData->SessionNotificationPending)
+        {
+            pdoData->SessionNotificationPending = TRUE;
+            InsertTailList(&session->PendingNotifications, &pdoData->SessionNotificationLink);
+        }
+
+        if (!NT_SUCCESS(WdfIoQueueRetrieveNextRequest(session->PendingNotificationRequests, &request)))
+        {
+            request = NULL;
+        }
+    }
+
+    if (request != NULL)
+    {
+        status = WdfRequestRetrieveOutputBuffer(request, sizeof(VIGEM_SESSION_NOTIFICATION), (PVOID)&notification, NULL);
+
+        // Nothing reportable, keep the request waiting for the next update
+        if (NT_SUCCESS(status) && Bus_CollectSessionNotifications(session, notification) == 0)
+        {
+            status = WdfRequestForwardToIoQueue(request, session->PendingNotificationRequests);
+
+            if (NT_SUCCESS(status))
+            {
+                request = NULL;
+            }
+        }
+    }
+
+    WdfSpinLockRelease(pFdoData->SessionNotificationLock);
+
+    // Otherwise the update gets picked up by the next request
+    if (request != NULL)
+    {
+        WdfRequestCompleteWithInformation(request, status, NT_SUCCESS(status) ? sizeof(VIGEM_SESSION_NOTIFICATION) : 0);
+    }
+
+    //
+    // Invoked without any lock held so the callback may call back into the
+    // bus; the rundown reference keeps deregistration from returning while
+    // the snapshot is still in use
+    // 
+    KeAcquireSpinLock(&pdoData->NotificationCallbackLock, &irql);
+
+    callback = pdoData->NotificationCallback;
+    callbackContext = pdoData->NotificationCallbackContext;
+
+    if (callback != NULL && !ExAcquireRundownProtection(&pdoData->NotificationCallbackRundown))
+    {
+        callback = NULL;
+    }
+
+    KeReleaseSpinLock(&pdoData->NotificationCallbackLock, irql);
+
+    if (callback == NULL)
+    {
+        return;
+    }
+
+    RtlZeroMemory(&callbackNotification, sizeof(VIGEM_ANY_REQUEST_NOTIFICATION));
+
+    if (Bus_FillNotification(Child, &callbackNotification))
+    {
+        // Callers may run below DISPATCH_LEVEL, callbacks always get it
+        KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+        callback(callbackContext, &callbackNotification);
+
+        KeLowerIrql(irql);
+    }
+
+    ExReleaseRundownProtection(&pdoData->NotificationCallbackRundown);
+}
+
+//
+// Sends a report update to a NSWITCH PDO.
+// 
+NTSTATUS Bus_NintSwitchSubmitReport(WDFDEVICE Device, ULONG SerialNo, PNSWITCH_SUBMIT_REPORT Report, LONG SessionId)
+{
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_BUSENUM, "%!FUNC! Entry");
+
+    return Bus_SubmitReport(Device, SerialNo, Report, SessionId);
+}
+
+NTSTATUS Bus_XgipSubmitReport(WDFDEVICE Device, ULONG SerialNo, PXGIP_SUBMIT_REPORT Report, LONG SessionId)
+{
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_BUSENUM, "%!FUNC! Entry");
+
+    return Bus_SubmitReport(Device, SerialNo, Report, SessionId);
+}
+
+NTSTATUS Bus_XgipSubmitInterrupt(WDFDEVICE Device, ULONG SerialNo, PXGIP_SUBMIT_INTERRUPT Report, LONG SessionId)
+{
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_BUSENUM, "%!FUNC! Entry");
+
+    return Bus_SubmitReport(Device, SerialNo, Report, SessionId);
+}
+
+//
+// Returns the session of the file handle a request got sent through.
+// 
+LONG Bus_GetRequestSessionId(WDFREQUEST Request)
+{
+    WDFFILEOBJECT fileObject = WdfRequestGetFileObject(Request);
+
+    return (fileObject != NULL) ? FileObjectGetData(fileObject)->SessionId : FDO_INVALID_SESSION_ID;
+}
+
+//
+// Looks up a PDO by serial number, the caller has to dereference the result.
+// 
 WDFDEVICE Bus_GetPdo(IN WDFDEVICE Device, IN ULONG SerialNo)
 {
-    WDFCHILDLIST                list;
-    WDF_CHILD_RETRIEVE_INFO     info;
+    return PdoTable_Lookup(&FdoGetData(Device)->Pdos, SerialNo);
+}
 
-    list = WdfFdoGetDefaultChildList(Device);
+NTSTATUS Bus_SubmitReport(WDFDEVICE Device, ULONG SerialNo, PVOID Report, LONG SessionId)
+{
+    NTSTATUS                    status;
+    WDFDEVICE                   hChild;
+    PPDO_DEVICE_DATA            pdoData;
+
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_BUSENUM, "%!FUNC! Entry");
+
+    hChild = Bus_GetPdo(Device, SerialNo);
+
+    // Validate child
+    if (hChild == NULL)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "Bus_GetPdo: PDO with serial %d not found",
+            SerialNo);
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    pdoData = PdoGetData(hChild);
+
+    // Check if caller owns this PDO
+    if (!IS_OWNER(pdoData, SessionId))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "PDO & Request ownership mismatch: %d != %d",
+            pdoData->SessionId,
+            SessionId);
+        status = STATUS_ACCESS_DENIED;
+    }
+    else
+    {
+        status = Bus_SubmitReportToPdo(hChild, Report);
+    }
+
+    WdfObjectDereference(hChild);
+
+    return status;
+}
+
+//
+// Stores the supplied report in the mailbox of a PDO and completes a pending USB IN request with it.
+// 
+NTSTATUS Bus_SubmitReportToPdo(WDFDEVICE Child, PVOID Report)
+{
+    NTSTATUS                    status = STATUS_SUCCESS;
+    PPDO_DEVICE_DATA            pdoData;
+    PNSWITCH_SUBMIT_REPORT      nintSwitchReport;
+    UCHAR                       timerStatus;
+    ULONG64                     changedWords;
+    BOOLEAN                     changed;
+    BOOLEAN                     valid;
+
+    pdoData = PdoGetData(Child);
+
+    // Check if the report matches the target type
+    switch (pdoData->TargetType)
+    {
+    case Xbox360Wired:
+
+        valid = (((PXUSB_SUBMIT_REPORT)Report)->Size == sizeof(XUSB_SUBMIT_REPORT));
+
+        break;
+    case NintendoSwitchWired:
+
+        valid = (((PNSWITCH_SUBMIT_REPORT)Report)->Size == sizeof(NSWITCH_SUBMIT_REPORT));
+
+        break;
+    case XboxOneWired:
+
+        valid = (((PXGIP_SUBMIT_REPORT)Report)->Size == sizeof(XGIP_SUBMIT_REPORT))
+            || (((PXGIP_SUBMIT_INTERRUPT)Report)->Size == sizeof(XGIP_SUBMIT_INTERRUPT));
+
+        break;
+    default:
+
+        valid = FALSE;
+
+        break;
+    }
+
+    if (!valid)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "Report type doesn't match target type %d",
+            pdoData->TargetType);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Request is control data
+    if (pdoData->TargetType == XboxOneWired
+        && ((PXGIP_SUBMIT_INTERRUPT)Report)->Size == sizeof(XGIP_SUBMIT_INTERRUPT))
+    {
+        return Xgip_QueueSysInitPacket(Child, (PXGIP_SUBMIT_INTERRUPT)Report);
+    }
+
+    WdfSpinLockAcquire(pdoData->MailboxLock);
+
+    // Check if input is different from the latest submitted value
+    switch (pdoData->TargetType)
+    {
+    case Xbox360Wired:
+
+        changedWords = DiffReportWords(&pdoData->Mailbox.Xusb.Report,
+            &((PXUSB_SUBMIT_REPORT)Report)->Report,
+            sizeof(XUSB_REPORT), NULL);
+
+        break;
+    case NintendoSwitchWired:
+
+        nintSwitchReport = (PNSWITCH_SUBMIT_REPORT)Report;
+
+        timerStatus = (nintSwitchReport->TimerStatus != NSWITCH_TIMER_STATUS_IGNORED)
+            ? nintSwitchReport->TimerStatus
+            : NintSwitchGetData(Child)->TimerStatus;
+
+        //
+        // Only standard input reports can be deduplicated. Subcommand replies
+        // have to reach the host even if repeated, and without the timer
+        // re-sending the cache the feeder paces the host itself.
+        // 
+        if (((PUCHAR)&nintSwitchReport->InputReport)[0] != NSWITCH_STANDARD_INPUT_REPORT_ID
+            || timerStatus == NSWITCH_TIMER_STATUS_DISABLED)
+        {
+            changedWords = MAXULONG64;
+        }
+        else
+        {
+            changedWords = DiffReportWords(&pdoData->Mailbox.NintSwitch.InputReport,
+                &nintSwitchReport->InputReport,
+                NSWITCH_REPORT_SIZE, G_NintSwitchReportIgnoreMask);
+        }
+
+        // A timer mode switch has to reach the device even without new input
+        if (nintSwitchReport->TimerStatus != NSWITCH_TIMER_STATUS_IGNORED
+            && nintSwitchReport->TimerStatus != pdoData->Mailbox.NintSwitch.TimerStatus)
+        {
+            changedWords |= 1;
+        }
+
+        break;
+    case XboxOneWired:
+
+        // The sequence byte gets generated upon completion, it's not part of the report
+        changedWords = DiffReportWords(&pdoData->Mailbox.Xgip.Report,
+            &((PXGIP_SUBMIT_REPORT)Report)->Report,
+            sizeof(XGIP_REPORT), NULL);
+
+        break;
+    default:
+
+        changedWords = MAXULONG64;
+
+        break;
+    }
+
+    changed = (changedWords != 0);
+
+    // Latest value wins, an unsent older report gets replaced
+    if (changed)
+    {
+        RtlCopyMemory(&pdoData->Mailbox, Report, ((PVIGEM_ANY_SUBMIT_REPORT)Report)->Header.Size);
+        pdoData->MailboxDirty = TRUE;
+    }
+
+    WdfSpinLockRelease(pdoData->MailboxLock);
+
+    Stats_RecordReport(&FdoGetData(WdfPdoGetParent(Child))->Statistics, pdoData->TargetType, changed);
+
+    // Don't waste pending IRP if input hasn't changed
+    if (!changed)
+    {
+        TraceEvents(TRACE_LEVEL_VERBOSE,
+            TRACE_BUSENUM,
+            "Input report hasn't changed since last update, aborting with %!STATUS!",
+            status);
+        return status;
+    }
+
+    TraceEvents(TRACE_LEVEL_VERBOSE,
+        TRACE_BUSENUM,
+        "Received new report (changed words: 0x%llX), processing",
+        changedWords);
+
+    return Bus_FlushMailbox(Child);
+}
+
+//
+// Interrupt IN packet of any target type
+// 
+typedef union _BUS_USB_IN_PACKET
+{
+    XUSB_INTERRUPT_IN_PACKET Xusb;
+    UCHAR NintSwitch[NSWITCH_REPORT_SIZE];
+    UCHAR Xgip[XGIP_REPORT_SIZE];
+} BUS_USB_IN_PACKET, *PBUS_USB_IN_PACKET;
+
+//
+// Merges a submitted report into the one cached in the target context.
+// 
+// Produces the interrupt IN packet to send and returns its length. Has to
+// be called inside the sequence lock's write section.
+// 
+static ULONG Bus_UpdateCachedReport(WDFDEVICE Child, PVIGEM_ANY_SUBMIT_REPORT Report, PBUS_USB_IN_PACKET Packet)
+{
+    PPDO_DEVICE_DATA        pdoData = PdoGetData(Child);
+    PNSWITCH_DEVICE_DATA    nintSwitchData;
+    PXGIP_DEVICE_DATA       xgip;
+
+    switch (pdoData->TargetType)
+    {
+    case Xbox360Wired:
+
+        // Copy submitted report to cache
+        RtlCopyBytes(&XusbGetData(Child)->Packet.Report, &Report->Xusb.Report, sizeof(XUSB_REPORT));
+        // Copy cached report to packet
+        RtlCopyBytes(&Packet->Xusb, &XusbGetData(Child)->Packet, sizeof(XUSB_INTERRUPT_IN_PACKET));
+
+        return sizeof(XUSB_INTERRUPT_IN_PACKET);
+    case NintendoSwitchWired:
+
+        nintSwitchData = NintSwitchGetData(Child);
+
+        if (Report->NintSwitch.TimerStatus != NSWITCH_TIMER_STATUS_IGNORED)
+        {
+            nintSwitchData->TimerStatus = Report->NintSwitch.TimerStatus;
+        }
+
+        // Only cache the report while the timer is up to re-send it
+        if (Report->NintSwitch.TimerStatus == 1)
+            RtlCopyBytes(nintSwitchData->InputReport, &Report->NintSwitch.InputReport, NSWITCH_REPORT_SIZE);
+
+        RtlCopyBytes(Packet->NintSwitch, &Report->NintSwitch.InputReport, NSWITCH_REPORT_SIZE);
+
+        // The host is past the handshake once it gets regular input
+        if (Packet->NintSwitch[0] == NSWITCH_STANDARD_INPUT_REPORT_ID)
+        {
+            nintSwitchData->StandardReportDelivered = TRUE;
+        }
+
+        return NSWITCH_REPORT_SIZE;
+    case XboxOneWired:
+
+        xgip = XgipGetData(Child);
+
+        // Increase event counter on every call (can roll-over)
+        xgip->Report[2]++;
+
+        /* Copy report to cache and packet
+         * Skip first four bytes as they are not part of the report */
+        RtlCopyBytes(xgip->Report + 4, &Report->Xgip.Report, sizeof(XGIP_REPORT));
+        RtlCopyBytes(Packet->Xgip, xgip->Report, XGIP_REPORT_SIZE);
+
+        return XGIP_REPORT_SIZE;
+    default:
+        return 0;
+    }
+}
+
+//
+// Completes a pending USB IN request with the mailbox content, if it hasn't been sent yet.
+// 
+// Without a pending request the report stays in the mailbox until the host asks for input.
+// 
+NTSTATUS Bus_FlushMailbox(WDFDEVICE Child)
+{
+    NTSTATUS                    status = STATUS_SUCCESS;
+    PPDO_DEVICE_DATA            pdoData;
+    WDFQUEUE                    queue;
+    WDFREQUEST                  usbRequest;
+    PIRP                        pendingIrp;
+    BUS_USB_IN_PACKET           packet;
+    ULONG                       length;
+
+    pdoData = PdoGetData(Child);
+
+    // Get queue of pending USB requests
+    switch (pdoData->TargetType)
+    {
+    case Xbox360Wired:
+    case NintendoSwitchWired:
+
+        queue = pdoData->PendingUsbInRequests;
+
+        break;
+    case XboxOneWired:
+
+        queue = XgipGetData(Child)->PendingUsbInRequests;
+
+        break;
+    default:
+
+        status = STATUS_NOT_SUPPORTED;
+
+        TraceEvents(TRACE_LEVEL_WARNING,
+            TRACE_BUSENUM,
+            "Unknown target type: %d (%!STATUS!)",
+            pdoData->TargetType,
+            status);
+
+        return status;
+    }
+
+    //
+    // Pair the report with a request under the lock so a concurrent
+    // submit can neither get lost nor be sent twice. The lock also
+    // serializes the writers of the cached report.
+    // 
+    WdfSpinLockAcquire(pdoData->MailboxLock);
+
+    if (pdoData->MailboxDirty)
+    {
+        status = WdfIoQueueRetrieveNextRequest(queue, &usbRequest);
+
+        if (NT_SUCCESS(status))
+        {
+            SeqLockWriteBegin(&pdoData->ReportSequence);
+            length = Bus_UpdateCachedReport(Child, &pdoData->Mailbox, &packet);
+            SeqLockWriteEnd(&pdoData->ReportSequence);
+
+            pdoData->MailboxDirty = FALSE;
+        }
+    }
+    else
+    {
+        status = STATUS_NO_MORE_ENTRIES;
+    }
+
+    WdfSpinLockRelease(pdoData->MailboxLock);
+
+    // Nothing to send or nobody to send it to, both is fine
+    if (status == STATUS_NO_MORE_ENTRIES)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    TraceEvents(TRACE_LEVEL_VERBOSE,
+        TRACE_BUSENUM,
+        "Processing pending IRP");
+
+    // Get pending IRP
+    pendingIrp = WdfRequestWdmGetIrp(usbRequest);
+
+    // Get USB request block
+    PURB urb = (PURB)URB_FROM_IRP(pendingIrp);
+
+    // Get transfer buffer
+    PUCHAR Buffer = (PUCHAR)urb->UrbBulkOrInterruptTransfer.TransferBuffer;
 
-    PDO_IDENTIFICATION_DESCRIPTION description;
+    urb->UrbBulkOrInterruptTransfer.TransferBufferLength = length;
 
-    WDF_CHILD_IDENTIFICATION_DESCRIPTION_HEADER_INIT(&description.Header, sizeof(description));
+    if (Buffer)
+        RtlCopyBytes(Buffer, &packet, length);
 
-    description.SerialNo = SerialNo;
+    // Complete pending request
+    WdfRequestComplete(usbRequest, status);
 
-    WDF_CHILD_RETRIEVE_INFO_INIT(&info, &description.Header);
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_BUSENUM, "%!FUNC! Exit with status %!STATUS!", status);
 
-    return WdfChildListRetrievePdo(list, &info);
+    return status;
 }
 
-NTSTATUS Bus_SubmitReport(WDFDEVICE Device, ULONG SerialNo, PVOID Report, BOOLEAN FromInterface)
+//
+// Maps a feeder-supplied input ring for a PDO.
+// 
+NTSTATUS Bus_MapInputRing(WDFDEVICE Device, ULONG SerialNo, WDFREQUEST Request)
 {
-    NTSTATUS                    status = STATUS_SUCCESS;
+    NTSTATUS                    status;
     WDFDEVICE                   hChild;
     PPDO_DEVICE_DATA            pdoData;
-    WDFREQUEST                  usbRequest;
-    PIRP                        pendingIrp;
-    BOOLEAN                     changed;
 
-
-    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_BUSENUM, "%!FUNC! Entry");
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_BUSENUM, "%!FUNC! Entry");
 
     hChild = Bus_GetPdo(Device, SerialNo);
 
@@ -596,229 +2032,373 @@ NTSTATUS Bus_SubmitReport(WDFDEVICE Device, ULONG SerialNo, PVOID Report, BOOLEA
         return STATUS_NO_SUCH_DEVICE;
     }
 
-    // Check common context
     pdoData = PdoGetData(hChild);
-    if (pdoData == NULL)
+
+    // Check if caller owns this PDO
+    if (!IS_OWNER(pdoData, Bus_GetRequestSessionId(Request)))
     {
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_BUSENUM,
-            "PdoGetData failed");
-        return STATUS_INVALID_PARAMETER;
+            "PDO & Request ownership mismatch: %d != %d",
+            pdoData->SessionId,
+            Bus_GetRequestSessionId(Request));
+        status = STATUS_ACCESS_DENIED;
+    }
+    else
+    {
+        status = InputRing_Map(pdoData->PendingInputRingRequests, Request, SerialNo);
+    }
+
+    WdfObjectDereference(hChild);
+
+    return status;
+}
+
+//
+// Fetches the buffered output events of a PDO, pends until there are some.
+// 
+NTSTATUS Bus_RequestOutputEvents(WDFDEVICE Device, ULONG SerialNo, WDFREQUEST Request, size_t* Transferred)
+{
+    NTSTATUS                    status;
+    WDFDEVICE                   hChild;
+    PPDO_DEVICE_DATA            pdoData;
+
+    hChild = Bus_GetPdo(Device, SerialNo);
+
+    // Validate child
+    if (hChild == NULL)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "Bus_GetPdo: PDO with serial %d not found",
+            SerialNo);
+        return STATUS_NO_SUCH_DEVICE;
     }
 
+    pdoData = PdoGetData(hChild);
+
     // Check if caller owns this PDO
-    if (!FromInterface && !IS_OWNER(pdoData))
+    if (!IS_OWNER(pdoData, Bus_GetRequestSessionId(Request)))
     {
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_BUSENUM,
             "PDO & Request ownership mismatch: %d != %d",
-            pdoData->OwnerProcessId,
-            CURRENT_PROCESS_ID());
-        return STATUS_ACCESS_DENIED;
+            pdoData->SessionId,
+            Bus_GetRequestSessionId(Request));
+        status = STATUS_ACCESS_DENIED;
     }
-
-    // Check if input is different from previous value
-    switch (pdoData->TargetType)
+    else
     {
-    case Xbox360Wired:
-
-        changed = (RtlCompareMemory(&XusbGetData(hChild)->Packet.Report,
-            &((PXUSB_SUBMIT_REPORT)Report)->Report,
-            sizeof(XUSB_REPORT)) != sizeof(XUSB_REPORT));
+        status = OutputRing_Request(pdoData->PendingOutputEventRequests, Request, Transferred);
+    }
 
-        break;
-    case NintendoSwitchWired:
+    WdfObjectDereference(hChild);
 
-        changed = TRUE;
+    return status;
+}
 
-        break;
-    case XboxOneWired:
+//
+// Picks up a report the feeder published while the host was waiting.
+// 
+NTSTATUS Bus_InputRingDoorbell(WDFDEVICE Device, ULONG SerialNo, LONG SessionId)
+{
+    NTSTATUS                    status;
+    WDFDEVICE                   hChild;
+    PPDO_DEVICE_DATA            pdoData;
 
-        // TODO: necessary?
-        changed = TRUE;
+    hChild = Bus_GetPdo(Device, SerialNo);
 
-        break;
-    default:
+    // Validate child
+    if (hChild == NULL)
+    {
+        return STATUS_NO_SUCH_DEVICE;
+    }
 
-        changed = FALSE;
+    pdoData = PdoGetData(hChild);
 
-        break;
+    // Check if caller owns this PDO
+    if (!IS_OWNER(pdoData, SessionId))
+    {
+        status = STATUS_ACCESS_DENIED;
     }
-
-    // Don't waste pending IRP if input hasn't changed
-    if (!changed)
+    else
     {
-        TraceEvents(TRACE_LEVEL_VERBOSE,
-            TRACE_BUSENUM,
-            "Input report hasn't changed since last update, aborting with %!STATUS!",
-            status);
-        return status;
+        Bus_DrainInputRing(hChild);
+        status = STATUS_SUCCESS;
     }
 
-    TraceEvents(TRACE_LEVEL_VERBOSE,
-        TRACE_BUSENUM,
-        "Received new report, processing");
+    WdfObjectDereference(hChild);
 
-    // Get pending USB request
-    switch (pdoData->TargetType)
+    return status;
+}
+
+//
+// Feeds the newest report of the shared input ring (if any) to the PDO.
+// 
+VOID Bus_DrainInputRing(WDFDEVICE Child)
+{
+    VIGEM_ANY_SUBMIT_REPORT     report;
+
+    if (InputRing_Drain(PdoGetData(Child)->PendingInputRingRequests, &report)
+        && IS_ANY_SUBMIT_REPORT_SIZE(report.Header.Size))
     {
-    case Xbox360Wired:
+        (VOID)Bus_SubmitReportToPdo(Child, &report);
+    }
+}
 
-        status = WdfIoQueueRetrieveNextRequest(pdoData->PendingUsbInRequests, &usbRequest);
+//
+// Serves a freshly queued USB IN request with the newest input available.
+// 
+VOID Bus_ServeUsbInRequest(WDFDEVICE Child)
+{
+    Bus_DrainInputRing(Child);
 
-        break;
-    case NintendoSwitchWired:
+    // Report submitted while no request was pending
+    (VOID)Bus_FlushMailbox(Child);
+}
 
-        status = WdfIoQueueRetrieveNextRequest(pdoData->PendingUsbInRequests, &usbRequest);
+//
+// Sends report updates to multiple PDOs, storing the result in each entry.
+// 
+NTSTATUS Bus_SubmitReportBatch(WDFDEVICE Device, PVIGEM_SUBMIT_REPORT_BATCH Batch, LONG SessionId)
+{
+    ULONG                               index;
+    PVIGEM_SUBMIT_REPORT_BATCH_ENTRY    entry;
 
-        break;
-    case XboxOneWired:
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_BUSENUM, "%!FUNC! Entry (count: %d)", Batch->Count);
+
+    for (index = 0; index < Batch->Count; index++)
+    {
+        entry = &Batch->Entries[index];
 
-        // Request is control data
-        if (((PXGIP_SUBMIT_INTERRUPT)Report)->Size == sizeof(XGIP_SUBMIT_INTERRUPT))
+        // Only report structures fit into an entry
+        if (!IS_ANY_SUBMIT_REPORT_SIZE(entry->Report.Header.Size))
         {
-            PXGIP_DEVICE_DATA xgip = XgipGetData(hChild);
-            PXGIP_SUBMIT_INTERRUPT interrupt = (PXGIP_SUBMIT_INTERRUPT)Report;
-            WDFMEMORY memory;
-            WDF_OBJECT_ATTRIBUTES memAttribs;
-            WDF_OBJECT_ATTRIBUTES_INIT(&memAttribs);
+            entry->Status = STATUS_INVALID_PARAMETER;
+            continue;
+        }
 
-            memAttribs.ParentObject = hChild;
+        // Serial 0 isn't addressing a single PDO
+        if (entry->Report.Header.SerialNo == 0)
+        {
+            entry->Status = STATUS_INVALID_PARAMETER;
+            continue;
+        }
 
-            // Allocate kernel memory
-            status = WdfMemoryCreate(&memAttribs, NonPagedPool, VIGEM_POOL_TAG,
-                interrupt->InterruptLength, &memory, NULL);
-            if (!NT_SUCCESS(status))
-            {
-                KdPrint((DRIVERNAME "WdfMemoryCreate failed with status 0x%X\n", status));
-                goto endSubmitReport;
-            }
+        // Same result the single-report IOCTL would have returned
+        entry->Status = Bus_SubmitReport(Device, entry->Report.Header.SerialNo, &entry->Report, SessionId);
+    }
 
-            // Copy interrupt buffer to memory object
-            status = WdfMemoryCopyFromBuffer(memory, 0, interrupt->Interrupt, interrupt->InterruptLength);
-            if (!NT_SUCCESS(status))
-            {
-                KdPrint((DRIVERNAME "WdfMemoryCopyFromBuffer failed with status 0x%X\n", status));
-                goto endSubmitReport;
-            }
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_BUSENUM, "%!FUNC! Exit");
 
-            // Add memory object to collection
-            status = WdfCollectionAdd(xgip->XboxgipSysInitCollection, memory);
-            if (!NT_SUCCESS(status))
-            {
-                KdPrint((DRIVERNAME "WdfCollectionAdd failed with status 0x%X\n", status));
-                goto endSubmitReport;
-            }
+    //
+    // Per-entry results are returned in the output buffer which
+    // doesn't get copied back on an error status
+    // 
+    return STATUS_SUCCESS;
+}
 
-            // Check if all packets have been received
-            xgip->XboxgipSysInitReady =
-                WdfCollectionGetCount(xgip->XboxgipSysInitCollection) == XGIP_SYS_INIT_PACKETS;
+#pragma region Bus interface
 
-            // If all packets are cached, start initialization timer
-            if (xgip->XboxgipSysInitReady)
-            {
-                WdfTimerStart(xgip->XboxgipSysInitTimer, XGIP_SYS_INIT_PERIOD);
-            }
+//
+// Plugs in a device on behalf of a kernel-mode feeder.
+// 
+// Unlike IOCTL_VIGEM_PLUGIN_TARGET this doesn't wait for the device to
+// finish initialization; the caller is expected to retry submitting
+// reports until the child is ready.
+// 
+NTSTATUS Bus_InterfacePlugIn(
+    PVOID Context,
+    ULONG SerialNo,
+    VIGEM_TARGET_TYPE TargetType,
+    USHORT VendorId,
+    USHORT ProductId
+)
+{
+    NTSTATUS                        status;
+    WDFDEVICE                       device = (WDFDEVICE)Context;
+    VIGEM_PLUGIN_TARGET             plugIn;
+    PDO_IDENTIFICATION_DESCRIPTION  description;
+    BOOLEAN                         ownsSerial;
 
-            goto endSubmitReport;
-        }
+    PAGED_CODE();
 
-        status = WdfIoQueueRetrieveNextRequest(XgipGetData(hChild)->PendingUsbInRequests, &usbRequest);
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_BUSENUM, "%!FUNC! Entry (serial: %d)", SerialNo);
 
-        break;
-    default:
+    if (SerialNo == 0)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "Serial no. 0 not allowed");
+        return STATUS_INVALID_PARAMETER;
+    }
 
-        status = STATUS_NOT_SUPPORTED;
+    RtlZeroMemory(&plugIn, sizeof(VIGEM_PLUGIN_TARGET));
 
-        TraceEvents(TRACE_LEVEL_WARNING,
+    plugIn.Size = sizeof(VIGEM_PLUGIN_TARGET);
+    plugIn.SerialNo = SerialNo;
+    plugIn.TargetType = TargetType;
+    plugIn.VendorId = VendorId;
+    plugIn.ProductId = ProductId;
+
+    // Not bound to any file handle
+    status = Bus_InitPluginDescription(&description, &plugIn, 0, TRUE);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    // Keep the allocator from handing out this serial
+    ownsSerial = SerialPool_Reserve(&FdoGetData(device)->Serials, SerialNo);
+
+    status = WdfChildListAddOrUpdateChildDescriptionAsPresent(WdfFdoGetDefaultChildList(device), &description.Header, NULL);
+
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_BUSENUM,
-            "Unknown target type: %d (%!STATUS!)",
-            pdoData->TargetType,
+            "WdfChildListAddOrUpdateChildDescriptionAsPresent failed with status %!STATUS!",
             status);
 
-        goto endSubmitReport;
+        if (ownsSerial)
+        {
+            SerialPool_Free(&FdoGetData(device)->Serials, SerialNo);
+        }
+
+        return status;
     }
 
-    if (status == STATUS_PENDING)
-        goto endSubmitReport;
-    else if (!NT_SUCCESS(status))
-        goto endSubmitReport;
+    //
+    // The requested serial number is already in use
+    // 
+    if (status == STATUS_OBJECT_NAME_EXISTS)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "The described PDO already exists");
+        return STATUS_INVALID_PARAMETER;
+    }
 
-    TraceEvents(TRACE_LEVEL_VERBOSE,
-        TRACE_BUSENUM,
-        "Processing pending IRP");
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_BUSENUM, "%!FUNC! Exit with status %!STATUS!", status);
 
-    // Get pending IRP
-    pendingIrp = WdfRequestWdmGetIrp(usbRequest);
+    return STATUS_SUCCESS;
+}
 
-    // Get USB request block
-    PURB urb = (PURB)URB_FROM_IRP(pendingIrp);
+//
+// Unplugs a device on behalf of a kernel-mode feeder.
+// 
+NTSTATUS Bus_InterfaceUnPlug(
+    PVOID Context,
+    ULONG SerialNo
+)
+{
+    NTSTATUS                        status;
+    WDFDEVICE                       device = (WDFDEVICE)Context;
+    PDO_IDENTIFICATION_DESCRIPTION  description;
 
-    // Get transfer buffer
-    PUCHAR Buffer = (PUCHAR)urb->UrbBulkOrInterruptTransfer.TransferBuffer;
+    PAGED_CODE();
 
-    switch (pdoData->TargetType)
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_BUSENUM, "%!FUNC! Entry (serial: %d)", SerialNo);
+
+    if (SerialNo == 0)
     {
-    case Xbox360Wired:
+        return STATUS_INVALID_PARAMETER;
+    }
 
-        urb->UrbBulkOrInterruptTransfer.TransferBufferLength = sizeof(XUSB_INTERRUPT_IN_PACKET);
+    WDF_CHILD_IDENTIFICATION_DESCRIPTION_HEADER_INIT(&description.Header, sizeof(description));
 
-        // Copy submitted report to cache
-        RtlCopyBytes(&XusbGetData(hChild)->Packet.Report, &((PXUSB_SUBMIT_REPORT)Report)->Report, sizeof(XUSB_REPORT));
-        // Copy cached report to URB transfer buffer
-        RtlCopyBytes(Buffer, &XusbGetData(hChild)->Packet, sizeof(XUSB_INTERRUPT_IN_PACKET));
+    // Children are identified by serial only
+    description.SerialNo = SerialNo;
 
-        break;
-    case NintendoSwitchWired:
+    status = WdfChildListUpdateChildDescriptionAsMissing(WdfFdoGetDefaultChildList(device), &description.Header);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "WdfChildListUpdateChildDescriptionAsMissing failed with status %!STATUS!",
+            status);
+    }
 
-        urb->UrbBulkOrInterruptTransfer.TransferBufferLength = NSWITCH_REPORT_SIZE;
+    return status;
+}
 
-		PNSWITCH_DEVICE_DATA nintSwitchData = NintSwitchGetData(hChild);
-		if (((PNSWITCH_SUBMIT_REPORT)Report)->TimerStatus != NSWITCH_TIMER_STATUS_IGNORED)
-		{
-			nintSwitchData->TimerStatus = ((PNSWITCH_SUBMIT_REPORT)Report)->TimerStatus;
-		}
+//
+// Submits a report on behalf of a kernel-mode feeder.
+// 
+NTSTATUS Bus_InterfaceSubmitReport(
+    PVOID Context,
+    PVOID Report
+)
+{
+    PVIGEM_ANY_SUBMIT_REPORT report = (PVIGEM_ANY_SUBMIT_REPORT)Report;
 
-        /* Copy report to cache and transfer buffer
-         * Skip first byte as it contains the never changing report id */
-		if (((PNSWITCH_SUBMIT_REPORT)Report)->TimerStatus == 1)
-			RtlCopyBytes(nintSwitchData->InputReport, &((PNSWITCH_SUBMIT_REPORT)Report)->InputReport, NSWITCH_REPORT_SIZE);
+    if (Report == NULL || report->Header.SerialNo == 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
 
-        if (Buffer)
-            RtlCopyBytes(Buffer, &((PNSWITCH_SUBMIT_REPORT)Report)->InputReport, NSWITCH_REPORT_SIZE);
+    return Bus_SubmitReport((WDFDEVICE)Context, report->Header.SerialNo, Report, FDO_INTERFACE_SESSION_ID);
+}
 
-        break;
-    case XboxOneWired:
+//
+// Sets the notification callback of a PDO on behalf of a kernel-mode feeder.
+// 
+// At PASSIVE_LEVEL this waits for running invocations of the replaced
+// callback to return. At DISPATCH_LEVEL, which includes calls from within
+// the callback itself, it can't wait and returns right away.
+// 
+NTSTATUS Bus_InterfaceRegisterNotificationCallback(
+    PVOID Context,
+    ULONG SerialNo,
+    PVIGEM_BUS_NOTIFICATION_CALLBACK Callback,
+    PVOID CallbackContext
+)
+{
+    WDFDEVICE           device = (WDFDEVICE)Context;
+    WDFDEVICE           hChild;
+    PPDO_DEVICE_DATA    pdoData;
+    PVIGEM_BUS_NOTIFICATION_CALLBACK previous;
+    KIRQL               irql;
 
-        // Request is input report
-        if (((PXGIP_SUBMIT_REPORT)Report)->Size == sizeof(XGIP_SUBMIT_REPORT))
-        {
-            urb->UrbBulkOrInterruptTransfer.TransferBufferLength = XGIP_REPORT_SIZE;
+    hChild = Bus_GetPdo(device, SerialNo);
 
-            // Increase event counter on every call (can roll-over)
-            XgipGetData(hChild)->Report[2]++;
+    if (hChild == NULL)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSENUM,
+            "Bus_GetPdo: PDO with serial %d not found",
+            SerialNo);
+        return STATUS_NO_SUCH_DEVICE;
+    }
 
-            /* Copy report to cache and transfer buffer
-             * Skip first four bytes as they are not part of the report */
-            RtlCopyBytes(XgipGetData(hChild)->Report + 4, &((PXGIP_SUBMIT_REPORT)Report)->Report, sizeof(XGIP_REPORT));
-            RtlCopyBytes(Buffer, XgipGetData(hChild)->Report, XGIP_REPORT_SIZE);
+    pdoData = PdoGetData(hChild);
 
-            break;
-        }
+    KeAcquireSpinLock(&pdoData->NotificationCallbackLock, &irql);
 
-        break;
-    default:
-        status = STATUS_INVALID_PARAMETER;
-        break;
-    }
+    previous = pdoData->NotificationCallback;
 
-    // Complete pending request
-    WdfRequestComplete(usbRequest, status);
+    pdoData->NotificationCallback = Callback;
+    pdoData->NotificationCallbackContext = CallbackContext;
 
-endSubmitReport:
+    KeReleaseSpinLock(&pdoData->NotificationCallbackLock, irql);
 
-    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_BUSENUM, "%!FUNC! Exit with status %!STATUS!", status);
+    //
+    // Invocations of the new callback starting meanwhile get skipped until
+    // the rundown reference is usable again
+    // 
+    if (previous != NULL && KeGetCurrentIrql() == PASSIVE_LEVEL)
+    {
+        ExAcquireFastMutex(&pdoData->NotificationCallbackMutex);
 
-    return status;
+        ExWaitForRundownProtectionRelease(&pdoData->NotificationCallbackRundown);
+        ExReInitializeRundownProtection(&pdoData->NotificationCallbackRundown);
+
+        ExReleaseFastMutex(&pdoData->NotificationCallbackMutex);
+    }
+
+    WdfObjectDereference(hChild);
+
+    return STATUS_SUCCESS;
 }
 
+#pragma endregion
@@ -1,6 +1,6 @@
 /*
 * Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
-* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
 *
 * This program is free software: you can redistribute it and/or modify
 * it under the terms of the GNU General Public License as published by
@@ -26,15 +26,31 @@
 #include <ntstrsafe.h>
 #include <ntintsafe.h>
 #include <initguid.h>
-#include "ViGEmBusDriver.h"
 #include <ViGEm/km/BusShared.h>
+#include "ViGEmBusShared.h"
+#include "ViGEmBusDriver.h"
 #include "Queue.h"
 #include <usb.h>
 #include <usbbusif.h>
-#include "Context.h"
+#include "Stats.h"
+#include "PdoTable.h"
+#include "SerialPool.h"
+#include "SessionSerials.h"
+#include "SerialHash.h"
+#include "DeadlineHeap.h"
+#include "PluginRegistry.h"
+#include "PacerWheel.h"
+#include "Pacer.h"
 #include "Util.h"
+#include "SeqLock.h"
+#include "ReportDiff.h"
+#include "MacCache.h"
+#include "Context.h"
+#include "InputRing.h"
+#include "OutputRing.h"
 #include "UsbPdo.h"
 #include "Xusb.h"
+#include "NintSwitchResponder.h"
 #include "NintSwitch.h"
 #include "Xgip.h"
 
@@ -53,9 +69,6 @@
 #define DRIVERNAME                      "ViGEm: "
 #define MAX_HARDWARE_ID_LENGTH          0xFF
 
-#define ORC_PC_FREQUENCY_DIVIDER        1000
-#define ORC_TIMER_START_DELAY           500 // ms
-#define ORC_TIMER_PERIODIC_DUE_TIME     500 // ms
 #define ORC_REQUEST_MAX_AGE             500 // ms
 
 #pragma endregion
@@ -72,6 +85,13 @@
 //
 #define HID_GET_REPORT_TYPE(_req_) ((_req_->Value >> 8) & 0xFF)
 
+//
+// Checks if the size matches one of the reports VIGEM_ANY_SUBMIT_REPORT can hold.
+//
+#define IS_ANY_SUBMIT_REPORT_SIZE(_size_) (((_size_) == sizeof(XUSB_SUBMIT_REPORT)) \
+                                            || ((_size_) == sizeof(NSWITCH_SUBMIT_REPORT)) \
+                                            || ((_size_) == sizeof(XGIP_SUBMIT_REPORT)))
+
 //
 // Some insane macro-magic =3
 // 
@@ -94,20 +114,46 @@ EVT_WDF_CHILD_LIST_CREATE_DEVICE Bus_EvtDeviceListCreatePdo;
 
 EVT_WDF_CHILD_LIST_IDENTIFICATION_DESCRIPTION_COMPARE Bus_EvtChildListIdentificationDescriptionCompare;
 
+EVT_WDF_CHILD_LIST_IDENTIFICATION_DESCRIPTION_COMPARE Bus_EvtChildListOwnerDescriptionCompare;
+
 EVT_WDF_DEVICE_PREPARE_HARDWARE Pdo_EvtDevicePrepareHardware;
 
+EVT_WDF_DEVICE_CONTEXT_CLEANUP Pdo_EvtDeviceContextCleanup;
+
 EVT_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL Pdo_EvtIoInternalDeviceControl;
 
 EVT_WDF_TIMER Xgip_SysInitTimerFunc;
 
 EVT_WDF_OBJECT_CONTEXT_CLEANUP Bus_EvtDriverContextCleanup;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP Bus_EvtDeviceContextCleanup;
 
 EVT_WDF_TIMER Bus_PlugInRequestCleanUpEvtTimerFunc;
 
+EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE Bus_EvtPluginRequestCanceledOnQueue;
+
 #pragma endregion
 
 #pragma region Bus enumeration-specific functions
 
+WDFREQUEST
+Bus_TakePluginRequest(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request
+);
+
+NTSTATUS
+Bus_ParkPluginRequest(
+    _In_ PFDO_DEVICE_DATA FdoData,
+    _In_ WDFREQUEST Request
+);
+
+BOOLEAN
+Bus_FinishPluginRequest(
+    _In_ PFDO_DEVICE_DATA FdoData,
+    _In_ WDFREQUEST Request,
+    _In_ NTSTATUS Status
+);
+
 NTSTATUS
 Bus_PlugInDevice(
     _In_ WDFDEVICE Device,
@@ -116,6 +162,24 @@ Bus_PlugInDevice(
     _Out_ size_t* Transferred
 );
 
+NTSTATUS
+Bus_PlugInDeviceBatch(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request,
+    _In_ PVIGEM_PLUGIN_TARGET_BATCH Batch
+);
+
+VOID
+Bus_CompletePluginRequest(
+    _In_ WDFREQUEST Request,
+    _In_ NTSTATUS Status
+);
+
+VOID
+Bus_ArmPluginRequestTimer(
+    _In_ PFDO_DEVICE_DATA FdoData
+);
+
 NTSTATUS
 Bus_UnPlugDevice(
     _In_ WDFDEVICE Device,
@@ -124,6 +188,13 @@ Bus_UnPlugDevice(
     _Out_ size_t* Transferred
 );
 
+VOID
+Bus_UnPlugSessionDevices(
+    _In_ WDFDEVICE Device,
+    _In_ PFDO_FILE_DATA FileData,
+    _In_ ULONG SerialNo
+);
+
 NTSTATUS
 Bus_CreatePdo(
     _In_ WDFDEVICE Device,
@@ -138,12 +209,46 @@ Bus_QueueNotification(
     WDFREQUEST Request
 );
 
+NTSTATUS
+Bus_QueueSessionNotification(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request,
+    _Out_ size_t* Transferred
+);
+
+VOID
+Bus_SignalSessionNotification(
+    _In_ WDFDEVICE Child
+);
+
+NTSTATUS
+Bus_AttachSession(
+    _In_ WDFDEVICE Device,
+    _In_ PFDO_FILE_DATA Session
+);
+
+VOID
+Bus_DetachSession(
+    _In_ WDFDEVICE Device,
+    _In_ PFDO_FILE_DATA Session
+);
+
+VOID
+Bus_BindSession(
+    _In_ WDFDEVICE Child
+);
+
+VOID
+Bus_CancelSessionNotification(
+    _In_ WDFDEVICE Child
+);
+
 NTSTATUS
 Bus_XgipSubmitReport(
     WDFDEVICE Device,
     ULONG SerialNo,
     PXGIP_SUBMIT_REPORT Report,
-    _In_ BOOLEAN FromInterface
+    _In_ LONG SessionId
 );
 
 NTSTATUS
@@ -151,7 +256,62 @@ Bus_SubmitReport(
     WDFDEVICE Device,
     ULONG SerialNo,
     PVOID Report,
-    _In_ BOOLEAN FromInterface
+    _In_ LONG SessionId
+);
+
+NTSTATUS
+Bus_SubmitReportToPdo(
+    _In_ WDFDEVICE Child,
+    _In_ PVOID Report
+);
+
+NTSTATUS
+Bus_MapInputRing(
+    _In_ WDFDEVICE Device,
+    _In_ ULONG SerialNo,
+    _In_ WDFREQUEST Request
+);
+
+NTSTATUS
+Bus_RequestOutputEvents(
+    _In_ WDFDEVICE Device,
+    _In_ ULONG SerialNo,
+    _In_ WDFREQUEST Request,
+    _Out_ size_t* Transferred
+);
+
+NTSTATUS
+Bus_InputRingDoorbell(
+    _In_ WDFDEVICE Device,
+    _In_ ULONG SerialNo,
+    _In_ LONG SessionId
+);
+
+VOID
+Bus_DrainInputRing(
+    _In_ WDFDEVICE Child
+);
+
+NTSTATUS
+Bus_FlushMailbox(
+    _In_ WDFDEVICE Child
+);
+
+VOID
+Bus_ServeUsbInRequest(
+    _In_ WDFDEVICE Child
+);
+
+NTSTATUS
+Bus_SubmitReportBatch(
+    _In_ WDFDEVICE Device,
+    _Inout_ PVIGEM_SUBMIT_REPORT_BATCH Batch,
+    _In_ LONG SessionId
+);
+
+LONG
+Bus_GetRequestSessionId(
+    _In_ WDFREQUEST Request
 );
 
 WDFDEVICE 
@@ -159,6 +319,35 @@ Bus_GetPdo(
     IN WDFDEVICE Device, 
     IN ULONG SerialNo);
 
+NTSTATUS
+Bus_InterfacePlugIn(
+    _In_ PVOID Context,
+    _In_ ULONG SerialNo,
+    _In_ VIGEM_TARGET_TYPE TargetType,
+    _In_ USHORT VendorId,
+    _In_ USHORT ProductId
+);
+
+NTSTATUS
+Bus_InterfaceUnPlug(
+    _In_ PVOID Context,
+    _In_ ULONG SerialNo
+);
+
+NTSTATUS
+Bus_InterfaceSubmitReport(
+    _In_ PVOID Context,
+    _In_ PVOID Report
+);
+
+NTSTATUS
+Bus_InterfaceRegisterNotificationCallback(
+    _In_ PVOID Context,
+    _In_ ULONG SerialNo,
+    _In_opt_ PVIGEM_BUS_NOTIFICATION_CALLBACK Callback,
+    _In_opt_ PVOID CallbackContext
+);
+
 VOID
 Bus_PdoStageResult(
     _In_ PINTERFACE InterfaceHeader,
@@ -1,6 +1,6 @@
 /*
 * Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
-* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
 *
 * This program is free software: you can redistribute it and/or modify
 * it under the terms of the GNU General Public License as published by
@@ -26,6 +26,7 @@
 #pragma alloc_text(PAGE, Bus_CreatePdo)
 #pragma alloc_text(PAGE, Bus_EvtDeviceListCreatePdo)
 #pragma alloc_text(PAGE, Pdo_EvtDevicePrepareHardware)
+#pragma alloc_text(PAGE, Pdo_EvtDeviceContextCleanup)
 #endif
 
 NTSTATUS Bus_EvtDeviceListCreatePdo(
@@ -64,6 +65,31 @@ BOOLEAN Bus_EvtChildListIdentificationDescriptionCompare(
     return (lhs->SerialNo == rhs->SerialNo) ? TRUE : FALSE;
 }
 
+//
+// Like Bus_EvtChildListIdentificationDescriptionCompare but also requires
+// the same owner; used to look up children on behalf of a session.
+// 
+BOOLEAN Bus_EvtChildListOwnerDescriptionCompare(
+    WDFCHILDLIST DeviceList,
+    PWDF_CHILD_IDENTIFICATION_DESCRIPTION_HEADER FirstIdentificationDescription,
+    PWDF_CHILD_IDENTIFICATION_DESCRIPTION_HEADER SecondIdentificationDescription)
+{
+    PPDO_IDENTIFICATION_DESCRIPTION lhs, rhs;
+
+    UNREFERENCED_PARAMETER(DeviceList);
+
+    lhs = CONTAINING_RECORD(FirstIdentificationDescription,
+        PDO_IDENTIFICATION_DESCRIPTION,
+        Header);
+    rhs = CONTAINING_RECORD(SecondIdentificationDescription,
+        PDO_IDENTIFICATION_DESCRIPTION,
+        Header);
+
+    return (lhs->SerialNo == rhs->SerialNo
+        && lhs->SessionId == rhs->SessionId
+        && lhs->OwnerIsDriver == rhs->OwnerIsDriver) ? TRUE : FALSE;
+}
+
 //
 // Creates and initializes a PDO (child).
 // 
@@ -274,6 +300,8 @@ NTSTATUS Bus_CreatePdo(
     // Add common device data context
     WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&pdoAttributes, PDO_DEVICE_DATA);
 
+    pdoAttributes.EvtCleanupCallback = Pdo_EvtDeviceContextCleanup;
+
     status = WdfDeviceCreate(&DeviceInit, &pdoAttributes, &hChild);
     if (!NT_SUCCESS(status))
     {
@@ -372,8 +400,10 @@ NTSTATUS Bus_CreatePdo(
     pdoData->SerialNo = Description->SerialNo;
     pdoData->TargetType = Description->TargetType;
     pdoData->OwnerProcessId = Description->OwnerProcessId;
+    pdoData->SessionId = Description->SessionId;
     pdoData->VendorId = Description->VendorId;
     pdoData->ProductId = Description->ProductId;
+    pdoData->PollingProfile = Description->PollingProfile;
 
     TraceEvents(TRACE_LEVEL_VERBOSE,
         TRACE_BUSPDO,
@@ -452,6 +482,43 @@ NTSTATUS Bus_CreatePdo(
         goto endCreatePdo;
     }
 
+    // Create and assign queue keeping the shared input ring mapped
+    status = InputRing_CreateQueue(Device, &pdoData->PendingInputRingRequests);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSPDO,
+            "InputRing_CreateQueue failed with status %!STATUS!",
+            status);
+        goto endCreatePdo;
+    }
+
+    // Create and assign queue buffering output events for user-land requests
+    status = OutputRing_CreateQueue(Device, pdoData->SerialNo, &pdoData->PendingOutputEventRequests);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSPDO,
+            "OutputRing_CreateQueue failed with status %!STATUS!",
+            status);
+        goto endCreatePdo;
+    }
+
+    // Create lock guarding the latest report mailbox
+    status = WdfSpinLockCreate(&attributes, &pdoData->MailboxLock);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_BUSPDO,
+            "WdfSpinLockCreate (MailboxLock) failed with status %!STATUS!",
+            status);
+        goto endCreatePdo;
+    }
+
+    KeInitializeSpinLock(&pdoData->NotificationCallbackLock);
+    ExInitializeRundownProtection(&pdoData->NotificationCallbackRundown);
+    ExInitializeFastMutex(&pdoData->NotificationCallbackMutex);
+
 #pragma endregion 
 
 #pragma region Default I/O queue setup
@@ -506,7 +573,34 @@ NTSTATUS Bus_CreatePdo(
 
 #pragma endregion
 
+    // Output updates go straight to the owning handle
+    Bus_BindSession(hChild);
+
+    // Fully set up, make it reachable for report submission
+    PdoTable_Insert(&FdoGetData(Device)->Pdos, &pdoData->TableEntry, hChild, Description->SerialNo);
+
     endCreatePdo:
+                //
+                // Queues parented to the FDO don't go away with a failed PDO,
+                // nothing can be pending on them before the table insert
+                // 
+                if (!NT_SUCCESS(status) && hChild != NULL)
+                {
+                    pdoData = PdoGetData(hChild);
+
+                    if (pdoData->PendingInputRingRequests != NULL)
+                    {
+                        WdfObjectDelete(pdoData->PendingInputRingRequests);
+                        pdoData->PendingInputRingRequests = NULL;
+                    }
+
+                    if (pdoData->PendingOutputEventRequests != NULL)
+                    {
+                        WdfObjectDelete(pdoData->PendingOutputEventRequests);
+                        pdoData->PendingOutputEventRequests = NULL;
+                    }
+                }
+
                 TraceEvents(TRACE_LEVEL_INFORMATION,
                     TRACE_BUSPDO,
                     "BUS_PDO_REPORT_STAGE_RESULT Stage: ViGEmPdoCreate  [serial: %d, status: %!STATUS!]",
@@ -577,6 +671,62 @@ NTSTATUS Pdo_EvtDevicePrepareHardware(
     return status;
 }
 
+//
+// Releases resources the PDO holds outside of its own object tree.
+// 
+VOID Pdo_EvtDeviceContextCleanup(
+    _In_ WDFOBJECT Device
+)
+{
+    PPDO_DEVICE_DATA pdoData = PdoGetData((WDFDEVICE)Device);
+
+    PAGED_CODE();
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_BUSPDO, "%!FUNC! Entry (serial: %d)", pdoData->SerialNo);
+
+    PdoTable_Remove(&FdoGetData(WdfPdoGetParent((WDFDEVICE)Device))->Pdos, &pdoData->TableEntry);
+
+    // Serial may be handed out again
+    SerialPool_Free(&FdoGetData(WdfPdoGetParent((WDFDEVICE)Device))->Serials, pdoData->SerialNo);
+
+    // The owning session must not report us anymore
+    Bus_CancelSessionNotification((WDFDEVICE)Device);
+
+    // Nor may a kernel-mode feeder's callback still be running
+    ExAcquireFastMutex(&pdoData->NotificationCallbackMutex);
+    ExWaitForRundownProtectionRelease(&pdoData->NotificationCallbackRundown);
+    ExReleaseFastMutex(&pdoData->NotificationCallbackMutex);
+
+    // Pipe may not have been aborted before removal
+    if (pdoData->TargetType == NintendoSwitchWired && NintSwitchGetData((WDFDEVICE)Device) != NULL)
+    {
+        Pacer_Leave(&FdoGetData(WdfPdoGetParent((WDFDEVICE)Device))->Pacer,
+            &NintSwitchGetData((WDFDEVICE)Device)->PacerEntry);
+
+        // A tick may have picked us just before, let it finish
+        KeFlushQueuedDpcs();
+    }
+
+    //
+    // The queue belongs to the FDO and would outlive us, purging it cancels
+    // a still pending mapping request which unmaps the ring
+    // 
+    if (pdoData->PendingInputRingRequests != NULL)
+    {
+        WdfIoQueuePurgeSynchronously(pdoData->PendingInputRingRequests);
+        WdfObjectDelete(pdoData->PendingInputRingRequests);
+        pdoData->PendingInputRingRequests = NULL;
+    }
+
+    // Same goes for requests waiting for output events
+    if (pdoData->PendingOutputEventRequests != NULL)
+    {
+        WdfIoQueuePurgeSynchronously(pdoData->PendingOutputEventRequests);
+        WdfObjectDelete(pdoData->PendingOutputEventRequests);
+        pdoData->PendingOutputEventRequests = NULL;
+    }
+}
+
 //
 // Responds to IRP_MJ_INTERNAL_DEVICE_CONTROL requests sent to PDO.
 // 
@@ -598,8 +748,8 @@ VOID Pdo_EvtIoInternalDeviceControl(
     PURB                    urb;
     PPDO_DEVICE_DATA        pdoData;
     PIO_STACK_LOCATION      irpStack;
-    PXUSB_DEVICE_DATA       pXusbData;
-    PUCHAR                  blobBuffer;
+    USHORT                  urbFunction;
+    LONGLONG                timestamp = STATS_TIMESTAMP();
 
 
     TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_BUSPDO, "%!FUNC! Entry");
@@ -619,8 +769,10 @@ VOID Pdo_EvtIoInternalDeviceControl(
             ">> IOCTL_INTERNAL_USB_SUBMIT_URB");
 
         urb = (PURB)URB_FROM_IRP(irp);
+        // The URB may be gone once the request got queued and completed elsewhere
+        urbFunction = urb->UrbHeader.Function;
 
-        switch (urb->UrbHeader.Function)
+        switch (urbFunction)
         {
         case URB_FUNCTION_CONTROL_TRANSFER:
 
@@ -633,14 +785,12 @@ VOID Pdo_EvtIoInternalDeviceControl(
             case 0x04:
                 if (pdoData->TargetType == Xbox360Wired)
                 {
-                    pXusbData = XusbGetData(hDevice);
-                    blobBuffer = WdfMemoryGetBuffer(pXusbData->InterruptBlobStorage, NULL);
                     //
                     // Xenon magic
                     // 
                     RtlCopyMemory(
                         urb->UrbControlTransfer.TransferBuffer,
-                        &blobBuffer[XUSB_BLOB_07_OFFSET],
+                        &Xusb_BootBlob[XUSB_BLOB_07_OFFSET],
                         0x04
                     );
                     status = STATUS_SUCCESS;
@@ -814,22 +964,6 @@ VOID Pdo_EvtIoInternalDeviceControl(
 
             status = UsbPdo_GetDescriptorFromInterface(urb, pdoData);
 
-            //
-            // The NSWITCH is basically ready to operate at this stage
-            // 
-            if (pdoData->TargetType == NintendoSwitchWired)
-            {
-                //
-                // Report back to FDO that we are ready to operate
-                // 
-                BUS_PDO_REPORT_STAGE_RESULT(
-                    pdoData->BusInterface,
-                    ViGEmPdoInitFinished,
-                    pdoData->SerialNo,
-                    STATUS_SUCCESS
-                );
-            }
-
             break;
 
         default:
@@ -837,11 +971,13 @@ VOID Pdo_EvtIoInternalDeviceControl(
             TraceEvents(TRACE_LEVEL_VERBOSE,
                 TRACE_BUSPDO,
                 ">> >>  Unknown function: 0x%X",
-                urb->UrbHeader.Function);
+                urbFunction);
 
             break;
         }
 
+        Stats_RecordUrb(&FdoGetData(WdfPdoGetParent(hDevice))->Statistics, urbFunction, timestamp);
+
         TraceEvents(TRACE_LEVEL_VERBOSE,
             TRACE_BUSPDO,
             "<<");
@@ -1,6 +1,6 @@
 /*
 * Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
-* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
 *
 * This program is free software: you can redistribute it and/or modify
 * it under the terms of the GNU General Public License as published by
@@ -38,6 +38,10 @@
         WPP_DEFINE_BIT(TRACE_UTIL)                                     \
         WPP_DEFINE_BIT(TRACE_XGIP)                                     \
         WPP_DEFINE_BIT(TRACE_XUSB)                                     \
+        WPP_DEFINE_BIT(TRACE_INPUTRING)                                \
+        WPP_DEFINE_BIT(TRACE_OUTPUTRING)                               \
+        WPP_DEFINE_BIT(TRACE_PACER)                                    \
+        WPP_DEFINE_BIT(TRACE_MACCACHE)                                 \
         )                             
 
 #define WPP_FLAG_LEVEL_LOGGER(flag, level)                                  \
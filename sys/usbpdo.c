@@ -1,6 +1,6 @@
 /*
 * Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
-* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
 *
 * This program is free software: you can redistribute it and/or modify
 * it under the terms of the GNU General Public License as published by
@@ -150,6 +150,94 @@ NTSTATUS UsbPdo_GetDeviceDescriptorType(PURB urb, PPDO_DEVICE_DATA pCommon)
     return STATUS_SUCCESS;
 }
 
+//
+// Translates the polling profile into a high-speed bInterval (2^(bInterval-1) microframes).
+// 
+UCHAR UsbPdo_GetDataInterval(PPDO_DEVICE_DATA pCommon, UCHAR DefaultInterval)
+{
+    switch (pCommon->PollingProfile)
+    {
+    case VigemPollingProfile1ms:
+        return 0x04;
+    case VigemPollingProfile2ms:
+        return 0x05;
+    case VigemPollingProfile4ms:
+        return 0x06;
+    case VigemPollingProfile8ms:
+        return 0x07;
+    case VigemPollingProfileMicroframe:
+        return 0x01;
+    default:
+        return DefaultInterval;
+    }
+}
+
+//
+// Patches the data endpoint descriptors of a freshly copied configuration descriptor.
+// 
+static VOID UsbPdo_ApplyPollingProfileToDescriptor(PPDO_DEVICE_DATA pCommon, PUCHAR Buffer, ULONG Length)
+{
+    PUSB_ENDPOINT_DESCRIPTOR pEndpoint;
+    ULONG offset = 0;
+
+    if (pCommon->PollingProfile == VigemPollingProfileDefault)
+    {
+        return;
+    }
+
+    while (offset + sizeof(USB_COMMON_DESCRIPTOR) <= Length)
+    {
+        PUSB_COMMON_DESCRIPTOR pDescriptor = (PUSB_COMMON_DESCRIPTOR)&Buffer[offset];
+
+        // Malformed or truncated, don't walk any further
+        if (pDescriptor->bLength == 0 || offset + pDescriptor->bLength > Length)
+        {
+            break;
+        }
+
+        if (pDescriptor->bDescriptorType == USB_ENDPOINT_DESCRIPTOR_TYPE
+            && pDescriptor->bLength >= sizeof(USB_ENDPOINT_DESCRIPTOR))
+        {
+            pEndpoint = (PUSB_ENDPOINT_DESCRIPTOR)pDescriptor;
+
+            if (pEndpoint->bEndpointAddress == USBPDO_DATA_IN_ENDPOINT
+                || pEndpoint->bEndpointAddress == USBPDO_DATA_OUT_ENDPOINT)
+            {
+                pEndpoint->bInterval = UsbPdo_GetDataInterval(pCommon, pEndpoint->bInterval);
+            }
+        }
+
+        offset += pDescriptor->bLength;
+    }
+}
+
+//
+// Patches the data pipes of interface 0 so they match the reported descriptor.
+// 
+static VOID UsbPdo_ApplyPollingProfileToPipes(PPDO_DEVICE_DATA pCommon, PUSBD_INTERFACE_INFORMATION pInfo)
+{
+    ULONG i;
+
+    if (pCommon->PollingProfile == VigemPollingProfileDefault)
+    {
+        return;
+    }
+
+    for (i = 0; i < pInfo->NumberOfPipes; i++)
+    {
+        if (pInfo->Pipes[i].EndpointAddress == USBPDO_DATA_IN_ENDPOINT
+            || pInfo->Pipes[i].EndpointAddress == USBPDO_DATA_OUT_ENDPOINT)
+        {
+            pInfo->Pipes[i].Interval = UsbPdo_GetDataInterval(pCommon, pInfo->Pipes[i].Interval);
+        }
+    }
+
+    TraceEvents(TRACE_LEVEL_VERBOSE,
+        TRACE_USBPDO,
+        "Applied polling profile %d to data pipes",
+        pCommon->PollingProfile);
+}
+
 //
 // Set configuration descriptor, expose interfaces and endpoints.
 // 
@@ -185,6 +273,7 @@ NTSTATUS UsbPdo_GetConfigurationDescriptorType(PURB urb, PPDO_DEVICE_DATA pCommo
     }
 
     ULONG length = urb->UrbControlDescriptorRequest.TransferBufferLength;
+    ULONG written = 0;
 
     // Second request can store the whole descriptor
     switch (pCommon->TargetType)
@@ -194,6 +283,7 @@ NTSTATUS UsbPdo_GetConfigurationDescriptorType(PURB urb, PPDO_DEVICE_DATA pCommo
         if (length >= XUSB_DESCRIPTOR_SIZE)
         {
             Xusb_GetConfigurationDescriptorType(Buffer, XUSB_DESCRIPTOR_SIZE);
+            written = XUSB_DESCRIPTOR_SIZE;
         }
 
         break;
@@ -202,6 +292,7 @@ NTSTATUS UsbPdo_GetConfigurationDescriptorType(PURB urb, PPDO_DEVICE_DATA pCommo
         if (length >= NSWITCH_DESCRIPTOR_SIZE)
         {
             NintSwitch_GetConfigurationDescriptorType(Buffer, NSWITCH_DESCRIPTOR_SIZE);
+            written = NSWITCH_DESCRIPTOR_SIZE;
         }
 
         break;
@@ -210,6 +301,7 @@ NTSTATUS UsbPdo_GetConfigurationDescriptorType(PURB urb, PPDO_DEVICE_DATA pCommo
         if (length >= XGIP_DESCRIPTOR_SIZE)
         {
             Xgip_GetConfigurationDescriptorType(Buffer, XGIP_DESCRIPTOR_SIZE);
+            written = XGIP_DESCRIPTOR_SIZE;
         }
 
         break;
@@ -217,6 +309,8 @@ NTSTATUS UsbPdo_GetConfigurationDescriptorType(PURB urb, PPDO_DEVICE_DATA pCommo
         return STATUS_UNSUCCESSFUL;
     }
 
+    UsbPdo_ApplyPollingProfileToDescriptor(pCommon, Buffer, written);
+
     return STATUS_SUCCESS;
 }
 
@@ -417,6 +511,9 @@ NTSTATUS UsbPdo_SelectConfiguration(PURB urb, PPDO_DEVICE_DATA pCommon)
         return STATUS_UNSUCCESSFUL;
     }
 
+    // Must agree with the intervals reported in the configuration descriptor
+    UsbPdo_ApplyPollingProfileToPipes(pCommon, pInfo);
+
     return STATUS_SUCCESS;
 }
 
@@ -534,7 +631,6 @@ NTSTATUS UsbPdo_BulkOrInterruptTransfer(PURB urb, WDFDEVICE Device, WDFREQUEST R
     NTSTATUS                                    status;
     PPDO_DEVICE_DATA                            pdoData;
     WDFREQUEST                                  notifyRequest;
-    PUCHAR                                      blobBuffer;
 
     pdoData = PdoGetData(Device);
 
@@ -570,77 +666,28 @@ NTSTATUS UsbPdo_BulkOrInterruptTransfer(PURB urb, WDFDEVICE Device, WDFREQUEST R
                 TRACE_USBPDO,
                 ">> >> >> Incoming request, queuing...");
 
-            blobBuffer = WdfMemoryGetBuffer(xusb->InterruptBlobStorage, NULL);
-
             if (XUSB_IS_DATA_PIPE(pTransfer))
             {
                 //
                 // Send "boot sequence" first, then the actual inputs
                 // 
-                switch (xusb->InterruptInitStage)
+                if (Xusb_ServeBootStep(xusb, pTransfer))
                 {
-                case 0:
-                    pTransfer->TransferBufferLength = XUSB_INIT_STAGE_SIZE;
-                    xusb->InterruptInitStage++;
-                    RtlCopyMemory(
-                        pTransfer->TransferBuffer, 
-                        &blobBuffer[XUSB_BLOB_00_OFFSET],
-                        XUSB_INIT_STAGE_SIZE
-                        );
                     return STATUS_SUCCESS;
-                case 1:
-                    pTransfer->TransferBufferLength = XUSB_INIT_STAGE_SIZE;
-                    xusb->InterruptInitStage++;
-                    RtlCopyMemory(
-                        pTransfer->TransferBuffer, 
-                        &blobBuffer[XUSB_BLOB_01_OFFSET],
-                        XUSB_INIT_STAGE_SIZE
-                        );
-                    return STATUS_SUCCESS;
-                case 2:
-                    pTransfer->TransferBufferLength = XUSB_INIT_STAGE_SIZE;
-                    xusb->InterruptInitStage++;
-                    RtlCopyMemory(
-                        pTransfer->TransferBuffer, 
-                        &blobBuffer[XUSB_BLOB_02_OFFSET],
-                        XUSB_INIT_STAGE_SIZE
-                        );
-                    return STATUS_SUCCESS;
-                case 3:
-                    pTransfer->TransferBufferLength = XUSB_INIT_STAGE_SIZE;
-                    xusb->InterruptInitStage++;
-                    RtlCopyMemory(
-                        pTransfer->TransferBuffer, 
-                        &blobBuffer[XUSB_BLOB_03_OFFSET],
-                        XUSB_INIT_STAGE_SIZE
-                        );
-                    return STATUS_SUCCESS;
-                case 4:
-                    pTransfer->TransferBufferLength = sizeof(XUSB_INTERRUPT_IN_PACKET);
-                    xusb->InterruptInitStage++;
-                    RtlCopyMemory(
-                        pTransfer->TransferBuffer, 
-                        &blobBuffer[XUSB_BLOB_04_OFFSET],
-                        sizeof(XUSB_INTERRUPT_IN_PACKET)
-                        );
-                    return STATUS_SUCCESS;
-                case 5:
-                    pTransfer->TransferBufferLength = XUSB_INIT_STAGE_SIZE;
-                    xusb->InterruptInitStage++;
-                    RtlCopyMemory(
-                        pTransfer->TransferBuffer, 
-                        &blobBuffer[XUSB_BLOB_05_OFFSET],
-                        XUSB_INIT_STAGE_SIZE
-                        );
-                    return STATUS_SUCCESS;
-                default:
-                    /* This request is sent periodically and relies on data the "feeder"
-                    * has to supply, so we queue this request and return with STATUS_PENDING.
-                    * The request gets completed as soon as the "feeder" sent an update. */
-                    status = WdfRequestForwardToIoQueue(Request, pdoData->PendingUsbInRequests);
+                }
 
-                    return (NT_SUCCESS(status)) ? STATUS_PENDING : status;
+                /* This request is sent periodically and relies on data the "feeder"
+                * has to supply, so we queue this request and return with STATUS_PENDING.
+                * The request gets completed as soon as the "feeder" sent an update. */
+                status = WdfRequestForwardToIoQueue(Request, pdoData->PendingUsbInRequests);
+
+                // Serve the request right away if the feeder already published a report
+                if (NT_SUCCESS(status))
+                {
+                    Bus_ServeUsbInRequest(Device);
                 }
+
+                return (NT_SUCCESS(status)) ? STATUS_PENDING : status;
             }
 
             if (XUSB_IS_CONTROL_PIPE(pTransfer))
@@ -649,7 +696,7 @@ NTSTATUS UsbPdo_BulkOrInterruptTransfer(PURB urb, WDFDEVICE Device, WDFREQUEST R
                 {
                     RtlCopyMemory(
                         pTransfer->TransferBuffer, 
-                        &blobBuffer[XUSB_BLOB_06_OFFSET],
+                        &Xusb_BootBlob[XUSB_BLOB_06_OFFSET],
                         XUSB_INIT_STAGE_SIZE
                         );
 
@@ -693,6 +740,9 @@ NTSTATUS UsbPdo_BulkOrInterruptTransfer(PURB urb, WDFDEVICE Device, WDFREQUEST R
                     TRACE_USBPDO,
                     "-- LED Number: %d",
                     xusb->LedNumber);
+
+                Xusb_BootFinished(xusb);
+
                 //
                 // Report back to FDO that we are ready to operate
                 // 
@@ -725,6 +775,11 @@ NTSTATUS UsbPdo_BulkOrInterruptTransfer(PURB urb, WDFDEVICE Device, WDFREQUEST R
             RtlCopyBytes(xusb->Rumble, Buffer, pTransfer->TransferBufferLength);
         }
 
+        // Keep every packet, the fields above only hold the latest state
+        OutputRing_Push(pdoData->PendingOutputEventRequests, pTransfer->TransferBuffer, pTransfer->TransferBufferLength);
+
+        Bus_SignalSessionNotification(Device);
+
         // Notify user-mode process that new data is available
         status = WdfIoQueueRetrieveNextRequest(pdoData->PendingNotificationRequests, &notifyRequest);
 
@@ -774,6 +829,23 @@ NTSTATUS UsbPdo_BulkOrInterruptTransfer(PURB urb, WDFDEVICE Device, WDFREQUEST R
                The request gets completed as soon as the "feeder" sent an update. */
             status = WdfRequestForwardToIoQueue(Request, pdoData->PendingUsbInRequests);
 
+            // Serve the request right away if the feeder already published a report
+            if (NT_SUCCESS(status))
+            {
+                Bus_ServeUsbInRequest(Device);
+            }
+
+            //
+            // Without the responder the feeder owns the handshake, the
+            // first poll is as far as the bus can tell. Otherwise wait
+            // until the host received the first standard input report.
+            // 
+            if (NT_SUCCESS(status)
+                && (!nintSwitchData->Responder.Enabled || nintSwitchData->StandardReportDelivered))
+            {
+                NintSwitch_ReportInitFinished(Device);
+            }
+
             return (NT_SUCCESS(status)) ? STATUS_PENDING : status;
         }
 	
@@ -781,6 +853,22 @@ NTSTATUS UsbPdo_BulkOrInterruptTransfer(PURB urb, WDFDEVICE Device, WDFREQUEST R
         // Store relevant bytes of buffer in PDO context
         RtlCopyBytes(&nintSwitchData->OutputReport, (PUCHAR)pTransfer->TransferBuffer, NSWITCH_REPORT_SIZE);
 
+        OutputRing_Push(pdoData->PendingOutputEventRequests, pTransfer->TransferBuffer, NSWITCH_REPORT_SIZE);
+
+        // Handshake and standard subcommands don't need to travel to user mode
+        if (NintSwitch_AnswerOutputReport(Device, (PUCHAR)pTransfer->TransferBuffer, pTransfer->TransferBufferLength))
+        {
+            // Host switched to USB-only mode, the handshake is done
+            if (nintSwitchData->Responder.ForceUsb)
+            {
+                NintSwitch_ReportInitFinished(Device);
+            }
+
+            break;
+        }
+
+        Bus_SignalSessionNotification(Device);
+
         // Notify user-mode process that new data is available
         status = WdfIoQueueRetrieveNextRequest(pdoData->PendingNotificationRequests, &notifyRequest);
 
@@ -825,6 +913,12 @@ NTSTATUS UsbPdo_BulkOrInterruptTransfer(PURB urb, WDFDEVICE Device, WDFREQUEST R
             The request gets completed as soon as the "feeder" sent an update. */
             status = WdfRequestForwardToIoQueue(Request, xgipData->PendingUsbInRequests);
 
+            // Serve the request right away if the feeder already published a report
+            if (NT_SUCCESS(status))
+            {
+                Bus_ServeUsbInRequest(Device);
+            }
+
             return (NT_SUCCESS(status)) ? STATUS_PENDING : status;
         }
 
@@ -834,6 +928,8 @@ NTSTATUS UsbPdo_BulkOrInterruptTransfer(PURB urb, WDFDEVICE Device, WDFREQUEST R
             pTransfer->TransferFlags,
             pTransfer->TransferBufferLength));
 
+        OutputRing_Push(pdoData->PendingOutputEventRequests, pTransfer->TransferBuffer, pTransfer->TransferBufferLength);
+
         break;
     }
     default:
@@ -866,8 +962,8 @@ NTSTATUS UsbPdo_AbortPipe(WDFDEVICE Device)
             return STATUS_UNSUCCESSFUL;
         }
 
-        // Higher driver shutting down, emptying PDOs queues
-        WdfTimerStop(nintSwitch->PendingUsbInRequestsTimer, TRUE);
+        // Higher driver shutting down, stop flushing PDOs queues
+        Pacer_Leave(&FdoGetData(WdfPdoGetParent(Device))->Pacer, &nintSwitch->PacerEntry);
 
         break;
     }
@@ -1,6 +1,6 @@
 /*
 * Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
-* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
 *
 * This program is free software: you can redistribute it and/or modify
 * it under the terms of the GNU General Public License as published by
@@ -153,17 +153,11 @@ NTSTATUS Xgip_AssignPdoContext(WDFDEVICE Device)
         return status;
     }
 
-    WDF_OBJECT_ATTRIBUTES collectionAttribs;
-    WDF_OBJECT_ATTRIBUTES_INIT(&collectionAttribs);
-
-    collectionAttribs.ParentObject = Device;
-
-    status = WdfCollectionCreate(&collectionAttribs, &xgip->XboxgipSysInitCollection);
-    if (!NT_SUCCESS(status))
-    {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_XGIP, "WdfCollectionCreate failed with status %!STATUS!", status);
-        return status;
-    }
+    // Packet slots are part of the context, nothing to allocate
+    xgip->XboxgipSysInitReserved = 0;
+    xgip->XboxgipSysInitWritten = 0;
+    xgip->XboxgipSysInitNext = 0;
+    xgip->XboxgipSysInitReady = FALSE;
 
     // Initialize periodic timer
     WDF_TIMER_CONFIG timerConfig;
@@ -339,14 +333,14 @@ VOID Xgip_SysInitTimerFunc(
     WDFREQUEST usbRequest;
     PIRP pendingIrp;
     PIO_STACK_LOCATION irpStack;
-    WDFMEMORY mem;
+    PXGIP_SYS_INIT_PACKET packet;
 
     hChild = WdfTimerGetParentObject(Timer);
     xgip = XgipGetData(hChild);
 
     if (xgip == NULL) return;
 
-    // Is TRUE when collection is filled up
+    // Is TRUE when all slots are filled up
     if (xgip->XboxgipSysInitReady)
     {
         TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_XGIP, "XBOXGIP ready, completing requests...");
@@ -358,8 +352,8 @@ VOID Xgip_SysInitTimerFunc(
         {
             TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_XGIP, "Request found");
 
-            // Get top memory object
-            mem = (WDFMEMORY)WdfCollectionGetFirstItem(xgip->XboxgipSysInitCollection);
+            // Get next packet in line
+            packet = &xgip->XboxgipSysInitPackets[xgip->XboxgipSysInitNext++];
 
             // Get pending IRP
             pendingIrp = WdfRequestWdmGetIrp(usbRequest);
@@ -368,13 +362,9 @@ VOID Xgip_SysInitTimerFunc(
             // Get USB request block
             PURB urb = (PURB)irpStack->Parameters.Others.Argument1;
 
-            // Get buffer size and content
-            size_t size;
-            PUCHAR Buffer = WdfMemoryGetBuffer(mem, &size);
-
             // Assign buffer size and content to URB
-            urb->UrbBulkOrInterruptTransfer.TransferBufferLength = (ULONG)size;
-            RtlCopyBytes(urb->UrbBulkOrInterruptTransfer.TransferBuffer, Buffer, size);
+            urb->UrbBulkOrInterruptTransfer.TransferBufferLength = packet->Length;
+            RtlCopyBytes(urb->UrbBulkOrInterruptTransfer.TransferBuffer, packet->Data, packet->Length);
 
             TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_XGIP, "[%X] Buffer length: %d",
                 ((PUCHAR)urb->UrbBulkOrInterruptTransfer.TransferBuffer)[0],
@@ -382,19 +372,61 @@ VOID Xgip_SysInitTimerFunc(
 
             // Complete pending request
             WdfRequestComplete(usbRequest, status);
-
-            // Free memory from collection
-            WdfCollectionRemoveItem(xgip->XboxgipSysInitCollection, 0);
-            WdfObjectDelete(mem);
         }
 
-        // Stop timer when collection is purged
-        if (WdfCollectionGetCount(xgip->XboxgipSysInitCollection) == 0)
+        // Stop timer when all packets are sent
+        if (xgip->XboxgipSysInitNext == XGIP_SYS_INIT_PACKETS)
         {
-            TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_XGIP, "Collection finished");
+            TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_XGIP, "All system init packets sent");
 
             WdfTimerStop(xgip->XboxgipSysInitTimer, FALSE);
+
+            // Free the slots for the next sequence, reserving comes last
+            xgip->XboxgipSysInitReady = FALSE;
+            xgip->XboxgipSysInitNext = 0;
+            InterlockedExchange(&xgip->XboxgipSysInitWritten, 0);
+            InterlockedExchange(&xgip->XboxgipSysInitReserved, 0);
         }
     }
 }
 
+//
+// Caches a system initialization packet in the next free slot.
+//
+// Once all slots are filled in the timer starts sending them, further
+// packets get rejected until it's done.
+//
+NTSTATUS Xgip_QueueSysInitPacket(WDFDEVICE Device, PXGIP_SUBMIT_INTERRUPT Interrupt)
+{
+    PXGIP_DEVICE_DATA xgip = XgipGetData(Device);
+    LONG slot;
+
+    if (Interrupt->InterruptLength > XGIP_SYS_INIT_PACKET_SIZE)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_XGIP, "Interrupt length %d exceeds %d",
+            Interrupt->InterruptLength, (int)XGIP_SYS_INIT_PACKET_SIZE);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    slot = InterlockedIncrement(&xgip->XboxgipSysInitReserved) - 1;
+
+    if (slot >= XGIP_SYS_INIT_PACKETS)
+    {
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_XGIP, "All system init slots in use");
+        return STATUS_DEVICE_BUSY;
+    }
+
+    RtlCopyBytes(xgip->XboxgipSysInitPackets[slot].Data, Interrupt->Interrupt, Interrupt->InterruptLength);
+    xgip->XboxgipSysInitPackets[slot].Length = Interrupt->InterruptLength;
+
+    // Whoever fills in the last slot starts the initialization timer
+    if (InterlockedIncrement(&xgip->XboxgipSysInitWritten) == XGIP_SYS_INIT_PACKETS)
+    {
+        xgip->XboxgipSysInitReady = TRUE;
+
+        WdfTimerStart(xgip->XboxgipSysInitTimer, XGIP_SYS_INIT_PERIOD);
+    }
+
+    return STATUS_SUCCESS;
+}
+
@@ -1,6 +1,6 @@
 /*
 * Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
-* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+* Copyright (C) 2016-2018  Benjamin Höglinger-Stelzer
 *
 * This program is free software: you can redistribute it and/or modify
 * it under the terms of the GNU General Public License as published by
@@ -20,6 +20,44 @@
 #include "busenum.h"
 #include "xusb.tmh"
 
+//
+// Packets served during initialization, identical for every PDO
+// 
+const UCHAR Xusb_BootBlob[XUSB_BLOB_STORAGE_SIZE] =
+{
+    // 0
+    0x01, 0x03, 0x0E,
+    // 1
+    0x02, 0x03, 0x00,
+    // 2
+    0x03, 0x03, 0x03,
+    // 3
+    0x08, 0x03, 0x00,
+    // 4
+    0x00, 0x14, 0x00, 0x00, 0x00, 0x00, 0xe4, 0xf2,
+    0xb3, 0xf8, 0x49, 0xf3, 0xb0, 0xfc, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00,
+    // 5
+    0x01, 0x03, 0x03,
+    // 6
+    0x05, 0x03, 0x00,
+    // 7
+    0x31, 0x3F, 0xCF, 0xDC
+};
+
+//
+// Data pipe "boot sequence", served in order before the actual inputs
+// 
+const XUSB_BOOT_STEP Xusb_BootSequence[XUSB_BOOT_STEP_COUNT] =
+{
+    { XUSB_BLOB_00_OFFSET, XUSB_INIT_STAGE_SIZE, TRUE },
+    { XUSB_BLOB_01_OFFSET, XUSB_INIT_STAGE_SIZE, TRUE },
+    { XUSB_BLOB_02_OFFSET, XUSB_INIT_STAGE_SIZE, TRUE },
+    { XUSB_BLOB_03_OFFSET, XUSB_INIT_STAGE_SIZE, TRUE },
+    { XUSB_BLOB_04_OFFSET, sizeof(XUSB_INTERRUPT_IN_PACKET), FALSE },
+    { XUSB_BLOB_05_OFFSET, XUSB_INIT_STAGE_SIZE, FALSE }
+};
+
 NTSTATUS Xusb_PreparePdo(
     PWDFDEVICE_INIT DeviceInit,
     USHORT VendorId,
@@ -243,11 +281,6 @@ NTSTATUS Xusb_PrepareHardware(WDFDEVICE Device)
 NTSTATUS Xusb_AssignPdoContext(WDFDEVICE Device)
 {
     NTSTATUS                status;
-    WDF_OBJECT_ATTRIBUTES   attributes;
-    PUCHAR                  blobBuffer;
-
-    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
-    attributes.ParentObject = Device;
 
     TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_XUSB, "Initializing XUSB context...");
 
@@ -260,45 +293,8 @@ NTSTATUS Xusb_AssignPdoContext(WDFDEVICE Device)
     // Packet size (20 bytes = 0x14)
     xusb->Packet.Size = 0x14;
 
-    // Allocate blob storage
-    status = WdfMemoryCreate(
-        &attributes,
-        NonPagedPoolNx,
-        XUSB_POOL_TAG,
-        XUSB_BLOB_STORAGE_SIZE,
-        &xusb->InterruptBlobStorage,
-        &blobBuffer
-    );
-    if (!NT_SUCCESS(status))
-    {
-        TraceEvents(TRACE_LEVEL_ERROR,
-            TRACE_XUSB,
-            "WdfMemoryCreate failed with status %!STATUS!",
-            status);
-        return status;
-    }
-
-    // Fill blob storage
-    COPY_BYTE_ARRAY(blobBuffer, P99_PROTECT({
-        // 0
-        0x01, 0x03, 0x0E,
-        // 1
-        0x02, 0x03, 0x00,
-        // 2
-        0x03, 0x03, 0x03,
-        // 3
-        0x08, 0x03, 0x00,
-        // 4
-        0x00, 0x14, 0x00, 0x00, 0x00, 0x00, 0xe4, 0xf2,
-        0xb3, 0xf8, 0x49, 0xf3, 0xb0, 0xfc, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00,
-        // 5
-        0x01, 0x03, 0x03,
-        // 6
-        0x05, 0x03, 0x00,
-        // 7
-        0x31, 0x3F, 0xCF, 0xDC
-        }));
+    // Optionally skip the status-only boot steps to get ready sooner
+    xusb->FastBoot = FdoGetData(WdfPdoGetParent(Device))->XusbFastBoot;
 
     // I/O Queue for pending IRPs
     WDF_IO_QUEUE_CONFIG holdingInQueueConfig;
@@ -600,7 +596,7 @@ VOID Xusb_SelectConfiguration(PUSBD_INTERFACE_INFORMATION pInfo)
     pInfo->InterfaceHandle = (USBD_INTERFACE_HANDLE)0xFFFF0000;
 }
 
-NTSTATUS Xusb_GetUserIndex(WDFDEVICE Device, PXUSB_GET_USER_INDEX Request)
+NTSTATUS Xusb_GetUserIndex(WDFDEVICE Device, PXUSB_GET_USER_INDEX Request, LONG SessionId)
 {
     NTSTATUS                    status = STATUS_INVALID_DEVICE_REQUEST;
     WDFDEVICE                   hChild;
@@ -628,22 +624,26 @@ NTSTATUS Xusb_GetUserIndex(WDFDEVICE Device, PXUSB_GET_USER_INDEX Request)
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_XUSB,
             "PdoGetData failed");
+        WdfObjectDereference(hChild);
         return STATUS_INVALID_PARAMETER;
     }
 
     // Check if caller owns this PDO
-    if (!IS_OWNER(pdoData))
+    if (!IS_OWNER(pdoData, SessionId))
     {
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_XUSB,
-            "PID mismatch: %d != %d",
-            pdoData->OwnerProcessId,
-            CURRENT_PROCESS_ID());
+            "Session mismatch: %d != %d",
+            pdoData->SessionId,
+            SessionId);
+        WdfObjectDereference(hChild);
         return STATUS_ACCESS_DENIED;
     }
 
     userIndex = XusbGetData(hChild)->LedNumber;
 
+    WdfObjectDereference(hChild);
+
     if (userIndex >= 0)
     {
         Request->UserIndex = (ULONG)userIndex;
@@ -660,3 +660,79 @@ NTSTATUS Xusb_GetUserIndex(WDFDEVICE Device, PXUSB_GET_USER_INDEX Request)
 
     return status;
 }
+
+//
+// Serves the next step of the boot sequence on the data pipe.
+// 
+// Returns FALSE once the sequence is done and the actual inputs are due.
+// 
+BOOLEAN Xusb_ServeBootStep(PXUSB_DEVICE_DATA Xusb, struct _URB_BULK_OR_INTERRUPT_TRANSFER* Transfer)
+{
+    const XUSB_BOOT_STEP* step;
+
+    if (Xusb->BootStartTime == 0)
+    {
+        Xusb->BootStartTime = KeQueryInterruptTime();
+    }
+
+    while (Xusb->FastBoot
+        && Xusb->InterruptInitStage < XUSB_BOOT_STEP_COUNT
+        && Xusb_BootSequence[Xusb->InterruptInitStage].Optional)
+    {
+        Xusb->InterruptInitStage++;
+    }
+
+    if (Xusb->InterruptInitStage >= XUSB_BOOT_STEP_COUNT)
+    {
+        return FALSE;
+    }
+
+    step = &Xusb_BootSequence[Xusb->InterruptInitStage];
+
+    Xusb->BootStepTimes[Xusb->InterruptInitStage++] = KeQueryInterruptTime();
+
+    Transfer->TransferBufferLength = step->Length;
+    RtlCopyMemory(
+        Transfer->TransferBuffer,
+        &Xusb_BootBlob[step->Offset],
+        step->Length
+    );
+
+    return TRUE;
+}
+
+//
+// Records the time the PDO got ready and traces how long each boot step took.
+// 
+VOID Xusb_BootFinished(PXUSB_DEVICE_DATA Xusb)
+{
+    ULONG index;
+
+    // Only the first LED assignment finishes the boot
+    if (Xusb->BootReadyTime != 0 || Xusb->BootStartTime == 0)
+    {
+        return;
+    }
+
+    Xusb->BootReadyTime = KeQueryInterruptTime();
+
+    for (index = 0; index < XUSB_BOOT_STEP_COUNT; index++)
+    {
+        if (Xusb->BootStepTimes[index] == 0)
+        {
+            continue;
+        }
+
+        TraceEvents(TRACE_LEVEL_VERBOSE,
+            TRACE_XUSB,
+            "Boot step %d served after %llu us",
+            index,
+            (Xusb->BootStepTimes[index] - Xusb->BootStartTime) / 10);
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION,
+        TRACE_XUSB,
+        "Ready %llu us after the first data pipe transfer (fast boot: %d)",
+        (Xusb->BootReadyTime - Xusb->BootStartTime) / 10,
+        Xusb->FastBoot);
+}
@@ -0,0 +1,107 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+
+#pragma once
+
+//
+// Stand-ins for the few WDK/Windows SDK definitions the framework-free
+// driver code and ViGEmBusShared.h rely on, so they build on any host
+// with a GCC-compatible compiler.
+//
+
+#include <assert.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sched.h>
+
+typedef void VOID, *PVOID;
+typedef uint8_t UCHAR, *PUCHAR;
+typedef uint8_t BOOLEAN, *PBOOLEAN;
+typedef uint16_t USHORT, *PUSHORT;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONGLONG, LONG64;
+typedef uint64_t ULONGLONG, ULONG64;
+typedef size_t SIZE_T;
+typedef LONG NTSTATUS;
+
+#define TRUE                            1
+#define FALSE                           0
+#define CONST                           const
+#define ANYSIZE_ARRAY                   1
+#define FIELD_OFFSET(_type_, _field_)   ((LONG)offsetof(_type_, _field_))
+#define ARRAYSIZE(_array_)              (sizeof(_array_) / sizeof((_array_)[0]))
+#define min(_a_, _b_)                   (((_a_) < (_b_)) ? (_a_) : (_b_))
+#define max(_a_, _b_)                   (((_a_) > (_b_)) ? (_a_) : (_b_))
+#define C_ASSERT(_expr_)                _Static_assert((_expr_), #_expr_)
+#define NT_ASSERT(_expr_)               assert(_expr_)
+#define UNALIGNED
+#define FORCEINLINE                     inline __attribute__((always_inline))
+
+#define RtlZeroMemory(_d_, _n_)         memset((_d_), 0, (_n_))
+#define RtlCopyMemory(_d_, _s_, _n_)    memcpy((_d_), (_s_), (_n_))
+
+#define MemoryBarrier()                 __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define KeMemoryBarrier()               MemoryBarrier()
+#define YieldProcessor()                sched_yield()
+
+//
+// Macros rather than functions, the FORCEINLINE helpers of the shared
+// header may not call static functions
+//
+#define InterlockedIncrement(_p_)       __atomic_add_fetch((_p_), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchange(_p_, _v_)   __atomic_exchange_n((_p_), (_v_), __ATOMIC_SEQ_CST)
+
+#define InterlockedCompareExchange(_p_, _x_, _c_)                           \
+    __extension__ ({                                                        \
+        LONG _comparand_ = (_c_);                                           \
+        __atomic_compare_exchange_n((_p_), &_comparand_, (_x_), 0,          \
+            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);                            \
+        _comparand_;                                                        \
+    })
+
+static inline BOOLEAN BitScanForward64(ULONG* Index, ULONG64 Mask)
+{
+    if (Mask == 0)
+    {
+        return FALSE;
+    }
+
+    *Index = (ULONG)__builtin_ctzll(Mask);
+
+    return TRUE;
+}
+
+static inline BOOLEAN InterlockedBitTestAndSet64(volatile LONG64* Base, LONG64 Offset)
+{
+    LONG64 bit = (LONG64)((ULONG64)1 << Offset);
+
+    return (__atomic_fetch_or(Base, bit, __ATOMIC_SEQ_CST) & bit) != 0;
+}
+
+static inline BOOLEAN InterlockedBitTestAndReset64(volatile LONG64* Base, LONG64 Offset)
+{
+    LONG64 bit = (LONG64)((ULONG64)1 << Offset);
+
+    return (__atomic_fetch_and(Base, ~bit, __ATOMIC_SEQ_CST) & bit) != 0;
+}
@@ -0,0 +1,408 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "WinShim.h"
+
+//
+// Stand-ins for the target report types of <ViGEm/km/BusShared.h>, only
+// their size matters to the ring
+//
+typedef enum _VIGEM_TARGET_TYPE
+{
+    Xbox360Wired = 0,
+    XboxOneWired = 2,
+    NintendoSwitchWired = 4
+
+} VIGEM_TARGET_TYPE;
+
+typedef struct _VIGEM_PLUGIN_TARGET
+{
+    ULONG Size;
+    ULONG SerialNo;
+    VIGEM_TARGET_TYPE TargetType;
+    USHORT VendorId;
+    USHORT ProductId;
+
+} VIGEM_PLUGIN_TARGET, *PVIGEM_PLUGIN_TARGET;
+
+typedef struct _XUSB_SUBMIT_REPORT
+{
+    ULONG Size;
+    ULONG SerialNo;
+    UCHAR Report[12];
+
+} XUSB_SUBMIT_REPORT;
+
+typedef struct _NSWITCH_SUBMIT_REPORT
+{
+    ULONG Size;
+    ULONG SerialNo;
+    UCHAR InputReport[0x40];
+    UCHAR TimerStatus;
+
+} NSWITCH_SUBMIT_REPORT;
+
+typedef struct _XGIP_SUBMIT_REPORT
+{
+    ULONG Size;
+    ULONG SerialNo;
+    UCHAR Report[14];
+
+} XGIP_SUBMIT_REPORT;
+
+typedef struct _XUSB_REQUEST_NOTIFICATION
+{
+    ULONG Size;
+    ULONG SerialNo;
+    UCHAR LargeMotor;
+    UCHAR SmallMotor;
+    UCHAR LedNumber;
+
+} XUSB_REQUEST_NOTIFICATION;
+
+typedef struct _NSWITCH_REQUEST_NOTIFICATION
+{
+    ULONG Size;
+    ULONG SerialNo;
+    UCHAR OutputReport[0x40];
+
+} NSWITCH_REQUEST_NOTIFICATION;
+
+#include "ViGEmBusShared.h"
+
+//
+// Stress test of the shared input ring: a producer thread publishes
+// numbered reports as fast as it can while a consumer thread takes the
+// latest one like the bus does on every IN URB.
+//
+// Fails on torn reads, reports going backwards, reports taken twice and
+// on a waiting consumer that never gets its doorbell.
+//
+
+#define STRESS_REPORT_COUNT             2000000
+#define STRESS_READ_ATTEMPTS            0x04
+#define STRESS_PRODUCER_BURST           0x10
+#define STRESS_DOORBELL_TIMEOUT_NS      2000000000LL
+
+static int G_Failures = 0;
+
+#define CHECK(_cond_)                                                       \
+    do                                                                      \
+    {                                                                       \
+        if (!(_cond_))                                                      \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                    \
+                __FILE__, __LINE__, #_cond_);                               \
+            G_Failures++;                                                   \
+        }                                                                   \
+    } while (0)
+
+typedef struct _STRESS_CONTEXT
+{
+    VIGEM_INPUT_RING Ring;
+
+    volatile LONG Doorbell;
+
+    volatile LONG ProducerDone;
+
+    ULONG Doorbells;
+
+    ULONG Taken;
+
+    //
+    // Polls finding the ring empty, only these may ask for a doorbell
+    //
+    ULONG Waits;
+
+    ULONG TornReads;
+
+    ULONG Reordered;
+
+    ULONG LostDoorbells;
+
+} STRESS_CONTEXT, *PSTRESS_CONTEXT;
+
+static STRESS_CONTEXT G_Context;
+
+//
+// Every byte of the report depends on its number, a torn copy mixes two
+//
+static void FillReport(PVIGEM_ANY_SUBMIT_REPORT Report, ULONG Number)
+{
+    ULONG index;
+
+    memset(Report, 0, sizeof(VIGEM_ANY_SUBMIT_REPORT));
+
+    Report->NintSwitch.Size = sizeof(NSWITCH_SUBMIT_REPORT);
+    Report->NintSwitch.SerialNo = 1;
+
+    memcpy(Report->NintSwitch.InputReport, &Number, sizeof(Number));
+
+    for (index = sizeof(Number); index < sizeof(Report->NintSwitch.InputReport); index++)
+    {
+        Report->NintSwitch.InputReport[index] = (UCHAR)(Number * 31 + index);
+    }
+
+    Report->NintSwitch.TimerStatus = (UCHAR)Number;
+}
+
+static BOOLEAN CheckReport(const VIGEM_ANY_SUBMIT_REPORT* Report, ULONG* Number)
+{
+    VIGEM_ANY_SUBMIT_REPORT expected;
+
+    memcpy(Number, Report->NintSwitch.InputReport, sizeof(*Number));
+
+    FillReport(&expected, *Number);
+
+    return memcmp(&expected.NintSwitch, &Report->NintSwitch, sizeof(NSWITCH_SUBMIT_REPORT)) == 0;
+}
+
+static LONGLONG Now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (LONGLONG)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void* Producer(void* Argument)
+{
+    PSTRESS_CONTEXT context = (PSTRESS_CONTEXT)Argument;
+    VIGEM_ANY_SUBMIT_REPORT report;
+    ULONG number;
+
+    for (number = 1; number <= STRESS_REPORT_COUNT; number++)
+    {
+        FillReport(&report, number);
+
+        // The bus asked for a doorbell, the host is waiting
+        if (VIGEM_INPUT_RING_PUSH(&context->Ring, &report, sizeof(NSWITCH_SUBMIT_REPORT)))
+        {
+            InterlockedExchange(&context->Doorbell, 1);
+            context->Doorbells++;
+        }
+
+        // Let the consumer in on machines with a single processor
+        if ((number % STRESS_PRODUCER_BURST) == 0)
+        {
+            YieldProcessor();
+        }
+    }
+
+    InterlockedExchange(&context->ProducerDone, 1);
+
+    return NULL;
+}
+
+//
+// Waits for the doorbell like the bus waits for the IOCTL
+//
+static BOOLEAN WaitForDoorbell(PSTRESS_CONTEXT Context, LONG Tail)
+{
+    LONGLONG deadline = Now() + STRESS_DOORBELL_TIMEOUT_NS;
+
+    while (InterlockedExchange(&Context->Doorbell, 0) == 0)
+    {
+        if (InterlockedCompareExchange(&Context->ProducerDone, 0, 0) != 0
+            && Context->Ring.Head == Tail)
+        {
+            return FALSE;
+        }
+
+        if (Now() > deadline)
+        {
+            // Reports are waiting but nobody rang
+            if (Context->Ring.Head != Tail)
+            {
+                Context->LostDoorbells++;
+            }
+
+            return FALSE;
+        }
+
+        YieldProcessor();
+    }
+
+    return TRUE;
+}
+
+static void* Consumer(void* Argument)
+{
+    PSTRESS_CONTEXT context = (PSTRESS_CONTEXT)Argument;
+    VIGEM_ANY_SUBMIT_REPORT report;
+    LONG tail = 0;
+    ULONG number;
+    ULONG last = 0;
+
+    while (last < STRESS_REPORT_COUNT)
+    {
+        // Head only moves forward, the take can't see an empty ring otherwise
+        if (context->Ring.Head == tail)
+        {
+            context->Waits++;
+        }
+
+        if (VIGEM_INPUT_RING_TAKE_LATEST(&context->Ring, &tail, &report, STRESS_READ_ATTEMPTS))
+        {
+            context->Taken++;
+
+            if (!CheckReport(&report, &number))
+            {
+                context->TornReads++;
+                continue;
+            }
+
+            // Every take has to see a newer report than the previous one
+            if (number <= last)
+            {
+                context->Reordered++;
+            }
+
+            last = number;
+            continue;
+        }
+
+        // Producer kept overwriting the slot, just try again
+        if (context->Ring.Head != tail)
+        {
+            continue;
+        }
+
+        if (!WaitForDoorbell(context, tail))
+        {
+            break;
+        }
+    }
+
+    CHECK(last == STRESS_REPORT_COUNT);
+
+    return NULL;
+}
+
+//
+// Single-threaded checks of the consumer protocol
+//
+static void TestProtocol(void)
+{
+    VIGEM_INPUT_RING ring;
+    VIGEM_ANY_SUBMIT_REPORT report;
+    LONG tail = 0;
+    ULONG number;
+
+    VIGEM_INPUT_RING_INIT(&ring, 1);
+
+    CHECK(ring.Size == sizeof(VIGEM_INPUT_RING));
+    CHECK(ring.SerialNo == 1);
+
+    // Empty ring asks for a doorbell, the next push gets told
+    CHECK(!VIGEM_INPUT_RING_TAKE_LATEST(&ring, &tail, &report, STRESS_READ_ATTEMPTS));
+    CHECK(ring.ConsumerWaiting == 1);
+
+    FillReport(&report, 1);
+    CHECK(VIGEM_INPUT_RING_PUSH(&ring, &report, sizeof(NSWITCH_SUBMIT_REPORT)));
+
+    CHECK(VIGEM_INPUT_RING_TAKE_LATEST(&ring, &tail, &report, STRESS_READ_ATTEMPTS));
+    CHECK(CheckReport(&report, &number) && number == 1);
+    CHECK(ring.ConsumerWaiting == 0);
+    CHECK(tail == 1 && ring.Tail == 1);
+
+    // The first push after a request rings, the ones after it don't
+    CHECK(!VIGEM_INPUT_RING_TAKE_LATEST(&ring, &tail, &report, STRESS_READ_ATTEMPTS));
+    CHECK(ring.ConsumerWaiting == 1);
+
+    FillReport(&report, 2);
+    CHECK(VIGEM_INPUT_RING_PUSH(&ring, &report, sizeof(NSWITCH_SUBMIT_REPORT)));
+    CHECK(ring.ConsumerWaiting == 0);
+
+    FillReport(&report, 3);
+    CHECK(!VIGEM_INPUT_RING_PUSH(&ring, &report, sizeof(NSWITCH_SUBMIT_REPORT)));
+
+    CHECK(VIGEM_INPUT_RING_TAKE_LATEST(&ring, &tail, &report, STRESS_READ_ATTEMPTS));
+    CHECK(CheckReport(&report, &number) && number == 3);
+
+    // Nobody is waiting, no doorbell needed
+    FillReport(&report, 4);
+    CHECK(!VIGEM_INPUT_RING_PUSH(&ring, &report, sizeof(NSWITCH_SUBMIT_REPORT)));
+
+    // Only the newest report gets taken, even after the ring wrapped
+    for (number = 5; number <= 3 * VIGEM_INPUT_RING_SLOT_COUNT; number++)
+    {
+        FillReport(&report, number);
+        VIGEM_INPUT_RING_PUSH(&ring, &report, sizeof(NSWITCH_SUBMIT_REPORT));
+    }
+
+    CHECK(VIGEM_INPUT_RING_TAKE_LATEST(&ring, &tail, &report, STRESS_READ_ATTEMPTS));
+    CHECK(CheckReport(&report, &number) && number == 3 * VIGEM_INPUT_RING_SLOT_COUNT);
+    CHECK(!VIGEM_INPUT_RING_TAKE_LATEST(&ring, &tail, &report, STRESS_READ_ATTEMPTS));
+
+    // Oversized payloads are refused
+    CHECK(!VIGEM_INPUT_RING_PUSH(&ring, &report, sizeof(VIGEM_ANY_SUBMIT_REPORT) + 1));
+    CHECK(ring.Head == 3 * VIGEM_INPUT_RING_SLOT_COUNT);
+}
+
+static void TestStress(void)
+{
+    pthread_t producer;
+    pthread_t consumer;
+
+    memset(&G_Context, 0, sizeof(G_Context));
+    VIGEM_INPUT_RING_INIT(&G_Context.Ring, 1);
+
+    CHECK(pthread_create(&consumer, NULL, Consumer, &G_Context) == 0);
+    CHECK(pthread_create(&producer, NULL, Producer, &G_Context) == 0);
+
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+
+    printf("%u reports, %u taken, %u waits, %u doorbells\n",
+        STRESS_REPORT_COUNT,
+        G_Context.Taken,
+        G_Context.Waits,
+        G_Context.Doorbells);
+
+    CHECK(G_Context.TornReads == 0);
+    CHECK(G_Context.Reordered == 0);
+    CHECK(G_Context.LostDoorbells == 0);
+    CHECK(G_Context.Doorbells <= G_Context.Waits);
+    CHECK(G_Context.Taken > 0);
+}
+
+int main(void)
+{
+    TestProtocol();
+    TestStress();
+
+    if (G_Failures != 0)
+    {
+        fprintf(stderr, "%d check(s) failed\n", G_Failures);
+        return 1;
+    }
+
+    printf("Input ring stress test passed\n");
+
+    return 0;
+}
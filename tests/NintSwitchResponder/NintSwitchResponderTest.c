@@ -0,0 +1,269 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "NintSwitchResponder.h"
+
+//
+// Replays the handshake the Linux hid-nintendo driver performs on a wired
+// Pro Controller and checks every answer of the in-driver responder.
+//
+
+static int G_Failures = 0;
+
+#define CHECK(_cond_)                                                       \
+    do                                                                      \
+    {                                                                       \
+        if (!(_cond_))                                                      \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                    \
+                __FILE__, __LINE__, #_cond_);                               \
+            G_Failures++;                                                   \
+        }                                                                   \
+    } while (0)
+
+static const UCHAR G_MacAddress[6] = { 0x98, 0xB6, 0xE9, 0x12, 0x34, 0x56 };
+
+//
+// Output report 0x80 as sent by joycon_send_usb()
+//
+static BOOLEAN SendUsbCommand(PNSWITCH_RESPONDER Responder, UCHAR Command, PUCHAR Reply, PBOOLEAN HasReply)
+{
+    UCHAR report[NSWITCH_RESPONDER_REPORT_SIZE] = { 0 };
+
+    report[0] = NSWITCH_RESPONDER_OUTPUT_USB_COMMAND;
+    report[1] = Command;
+
+    return NintSwitchResponder_AnswerUsbCommand(Responder, report, 2, Reply, HasReply);
+}
+
+//
+// Output report 0x01 as sent by joycon_send_subcmd()
+//
+static BOOLEAN SendSubcommand(
+    PNSWITCH_RESPONDER Responder,
+    UCHAR Subcommand,
+    const UCHAR* Args,
+    ULONG ArgsLength,
+    const UCHAR* InputState,
+    PUCHAR Reply
+)
+{
+    static UCHAR packetNumber = 0;
+    UCHAR report[NSWITCH_RESPONDER_REPORT_SIZE] = { 0 };
+
+    report[0] = NSWITCH_RESPONDER_OUTPUT_SUBCOMMAND;
+    report[1] = packetNumber++ & 0x0F;
+    report[NSWITCH_RESPONDER_SUBCOMMAND_OFFSET] = Subcommand;
+    if (ArgsLength > 0)
+    {
+        memcpy(&report[NSWITCH_RESPONDER_ARGUMENT_OFFSET], Args, ArgsLength);
+    }
+
+    return NintSwitchResponder_Answer(Responder,
+        report,
+        NSWITCH_RESPONDER_ARGUMENT_OFFSET + ArgsLength < NSWITCH_RESPONDER_MIN_OUTPUT_LENGTH
+            ? NSWITCH_RESPONDER_MIN_OUTPUT_LENGTH
+            : NSWITCH_RESPONDER_ARGUMENT_OFFSET + ArgsLength,
+        InputState,
+        Reply);
+}
+
+//
+// Checks the common part of a 0x21 reply
+//
+static void CheckReply(const UCHAR* Reply, UCHAR Subcommand, UCHAR Ack, UCHAR Timer)
+{
+    CHECK(Reply[0] == NSWITCH_RESPONDER_INPUT_REPLY);
+    CHECK(Reply[1] == Timer);
+    CHECK(Reply[NSWITCH_RESPONDER_ACK_OFFSET] == Ack);
+    CHECK(Reply[NSWITCH_RESPONDER_REPLY_ID_OFFSET] == Subcommand);
+}
+
+//
+// Reads a flash range like joycon_request_spi_flash_read()
+//
+static void CheckSpiRead(PNSWITCH_RESPONDER Responder, ULONG Address, UCHAR Size, const UCHAR* Expected, UCHAR Timer)
+{
+    UCHAR args[5];
+    UCHAR reply[NSWITCH_RESPONDER_REPORT_SIZE];
+
+    args[0] = (UCHAR)Address;
+    args[1] = (UCHAR)(Address >> 8);
+    args[2] = (UCHAR)(Address >> 16);
+    args[3] = (UCHAR)(Address >> 24);
+    args[4] = Size;
+
+    CHECK(SendSubcommand(Responder, NSWITCH_SUBCMD_SPI_FLASH_READ, args, sizeof(args), NULL, reply));
+    CheckReply(reply, NSWITCH_SUBCMD_SPI_FLASH_READ, 0x90, Timer);
+
+    // Address and size are echoed ahead of the content
+    CHECK(memcmp(&reply[NSWITCH_RESPONDER_REPLY_DATA_OFFSET], args, sizeof(args)) == 0);
+    CHECK(memcmp(&reply[NSWITCH_RESPONDER_REPLY_DATA_OFFSET + 5], Expected, Size) == 0);
+}
+
+static void TestUsbHandshake(PNSWITCH_RESPONDER Responder)
+{
+    UCHAR reply[NSWITCH_RESPONDER_REPORT_SIZE];
+    BOOLEAN hasReply;
+    ULONG index;
+
+    // Connection status reports the controller type and address
+    CHECK(SendUsbCommand(Responder, NSWITCH_USBCMD_REQUEST_STATUS, reply, &hasReply));
+    CHECK(hasReply);
+    CHECK(reply[0] == NSWITCH_RESPONDER_INPUT_USB_REPLY);
+    CHECK(reply[1] == NSWITCH_USBCMD_REQUEST_STATUS);
+    CHECK(reply[3] == 0x03);
+
+    for (index = 0; index < sizeof(G_MacAddress); index++)
+    {
+        CHECK(reply[4 + index] == G_MacAddress[sizeof(G_MacAddress) - 1 - index]);
+    }
+
+    // Handshake, 3 Mbit baud rate, handshake again
+    CHECK(SendUsbCommand(Responder, NSWITCH_USBCMD_HANDSHAKE, reply, &hasReply));
+    CHECK(hasReply && reply[0] == NSWITCH_RESPONDER_INPUT_USB_REPLY && reply[1] == NSWITCH_USBCMD_HANDSHAKE);
+
+    CHECK(SendUsbCommand(Responder, NSWITCH_USBCMD_SET_BAUDRATE, reply, &hasReply));
+    CHECK(hasReply && reply[0] == NSWITCH_RESPONDER_INPUT_USB_REPLY && reply[1] == NSWITCH_USBCMD_SET_BAUDRATE);
+
+    CHECK(SendUsbCommand(Responder, NSWITCH_USBCMD_HANDSHAKE, reply, &hasReply));
+    CHECK(hasReply && reply[0] == NSWITCH_RESPONDER_INPUT_USB_REPLY && reply[1] == NSWITCH_USBCMD_HANDSHAKE);
+
+    // USB-only mode isn't acknowledged, it just ends the handshake
+    CHECK(!Responder->ForceUsb);
+    CHECK(SendUsbCommand(Responder, NSWITCH_USBCMD_FORCE_USB, reply, &hasReply));
+    CHECK(!hasReply);
+    CHECK(Responder->ForceUsb);
+
+    // Unknown commands go to the feeder
+    CHECK(!SendUsbCommand(Responder, 0x7F, reply, &hasReply));
+    CHECK(!hasReply);
+}
+
+static void TestSubcommands(PNSWITCH_RESPONDER Responder)
+{
+    static const UCHAR erased[0x1D] =
+    {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+    };
+    static const UCHAR leftStick[9] = { 0xBA, 0xF5, 0x62, 0x6F, 0xC8, 0x77, 0xED, 0x95, 0x5B };
+    static const UCHAR rightStick[9] = { 0x16, 0xD8, 0x7D, 0xF2, 0xB5, 0x5F, 0x86, 0x65, 0x5E };
+    static const UCHAR imuCalibration[4] = { 0xD3, 0xFF, 0xD5, 0xFF };
+    UCHAR input[NSWITCH_RESPONDER_REPORT_SIZE] = { 0 };
+    UCHAR reply[NSWITCH_RESPONDER_REPORT_SIZE];
+    UCHAR arg;
+    UCHAR timer = 0;
+
+    // Device info carries firmware, type and address
+    CHECK(SendSubcommand(Responder, NSWITCH_SUBCMD_REQUEST_DEVICE_INFO, NULL, 0, NULL, reply));
+    CheckReply(reply, NSWITCH_SUBCMD_REQUEST_DEVICE_INFO, 0x82, timer++);
+    CHECK(reply[NSWITCH_RESPONDER_REPLY_DATA_OFFSET + 2] == 0x03);
+    CHECK(memcmp(&reply[NSWITCH_RESPONDER_REPLY_DATA_OFFSET + 4], G_MacAddress, sizeof(G_MacAddress)) == 0);
+
+    // No feeder input yet, the idle state is reported
+    CHECK(reply[2] == 0x91);
+
+    // User calibration is erased, factory calibration follows
+    CheckSpiRead(Responder, 0x8010, 0x16, erased, timer++);
+    CheckSpiRead(Responder, 0x603D, sizeof(leftStick), leftStick, timer++);
+    CheckSpiRead(Responder, 0x6046, sizeof(rightStick), rightStick, timer++);
+    CheckSpiRead(Responder, 0x8026, 0x1A, erased, timer++);
+    CheckSpiRead(Responder, 0x6020, sizeof(imuCalibration), imuCalibration, timer++);
+
+    // Oversized reads are left to the feeder
+    {
+        UCHAR args[5] = { 0x00, 0x60, 0x00, 0x00, 0x1E };
+
+        CHECK(!SendSubcommand(Responder, NSWITCH_SUBCMD_SPI_FLASH_READ, args, sizeof(args), NULL, reply));
+    }
+
+    // Replies carry the latest standard input of the feeder from now on
+    input[0] = NSWITCH_RESPONDER_INPUT_STANDARD;
+    input[2] = 0x8E;
+    input[3] = 0x01;
+
+    arg = NSWITCH_RESPONDER_INPUT_STANDARD;
+    CHECK(SendSubcommand(Responder, NSWITCH_SUBCMD_SET_INPUT_REPORT_MODE, &arg, 1, input, reply));
+    CheckReply(reply, NSWITCH_SUBCMD_SET_INPUT_REPORT_MODE, 0x80, timer++);
+    CHECK(Responder->InputReportMode == NSWITCH_RESPONDER_INPUT_STANDARD);
+    CHECK(reply[2] == 0x8E && reply[3] == 0x01);
+
+    arg = 0x01;
+    CHECK(SendSubcommand(Responder, NSWITCH_SUBCMD_ENABLE_VIBRATION, &arg, 1, input, reply));
+    CheckReply(reply, NSWITCH_SUBCMD_ENABLE_VIBRATION, 0x80, timer++);
+    CHECK(Responder->VibrationEnabled);
+
+    CHECK(SendSubcommand(Responder, NSWITCH_SUBCMD_ENABLE_IMU, &arg, 1, input, reply));
+    CheckReply(reply, NSWITCH_SUBCMD_ENABLE_IMU, 0x80, timer++);
+    CHECK(Responder->ImuEnabled);
+
+    arg = 0x01;
+    CHECK(SendSubcommand(Responder, NSWITCH_SUBCMD_SET_PLAYER_LIGHTS, &arg, 1, input, reply));
+    CheckReply(reply, NSWITCH_SUBCMD_SET_PLAYER_LIGHTS, 0x80, timer++);
+    CHECK(Responder->PlayerLights == 0x01);
+
+    CHECK(SendSubcommand(Responder, NSWITCH_SUBCMD_SET_HOME_LIGHT, NULL, 0, input, reply));
+    CheckReply(reply, NSWITCH_SUBCMD_SET_HOME_LIGHT, 0x80, timer++);
+
+    // Unknown subcommands go to the feeder without touching the timer
+    CHECK(!SendSubcommand(Responder, 0x50, NULL, 0, input, reply));
+    CHECK(Responder->Timer == timer);
+}
+
+static void TestDisabled(void)
+{
+    NSWITCH_RESPONDER responder;
+    UCHAR reply[NSWITCH_RESPONDER_REPORT_SIZE];
+    BOOLEAN hasReply;
+
+    NintSwitchResponder_Initialize(&responder, FALSE, G_MacAddress);
+
+    CHECK(!SendUsbCommand(&responder, NSWITCH_USBCMD_REQUEST_STATUS, reply, &hasReply));
+    CHECK(!SendSubcommand(&responder, NSWITCH_SUBCMD_REQUEST_DEVICE_INFO, NULL, 0, NULL, reply));
+    CHECK(responder.Timer == 0);
+}
+
+int main(void)
+{
+    NSWITCH_RESPONDER responder;
+
+    NintSwitchResponder_Initialize(&responder, TRUE, G_MacAddress);
+
+    TestUsbHandshake(&responder);
+    TestSubcommands(&responder);
+    TestDisabled();
+
+    if (G_Failures != 0)
+    {
+        fprintf(stderr, "%d check(s) failed\n", G_Failures);
+        return 1;
+    }
+
+    printf("NintSwitchResponder handshake replay passed\n");
+
+    return 0;
+}
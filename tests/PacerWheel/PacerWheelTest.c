@@ -0,0 +1,370 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "PacerWheel.h"
+
+//
+// Correctness checks and scaling benchmark of the pacer wheel, the phase
+// assignment on join and the due phase arithmetic of every tick, at 1 to
+// 256 members; the members are host stand-ins serviced by a counter.
+//
+
+#define MAX_MEMBERS                     256
+
+#define SIM_TICKS                       (PACER_WHEEL_SLOTS * 1000)
+
+#define BENCH_ROUNDS                    2000
+
+static int G_Failures = 0;
+
+#define CHECK(_cond_)                                                       \
+    do                                                                      \
+    {                                                                       \
+        if (!(_cond_))                                                      \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                    \
+                __FILE__, __LINE__, #_cond_);                               \
+            G_Failures++;                                                   \
+        }                                                                   \
+    } while (0)
+
+//
+// Host stand-in for the pacer, phases hold member numbers
+//
+typedef struct _WHEEL
+{
+    ULONG Slots[PACER_WHEEL_SLOTS][MAX_MEMBERS];
+
+    ULONG SlotCounts[PACER_WHEEL_SLOTS];
+
+    ULONG MemberSlot[MAX_MEMBERS];
+
+    ULONG Serviced[MAX_MEMBERS];
+
+    ULONG Count;
+
+    ULONGLONG LastTick;
+
+} WHEEL, *PWHEEL;
+
+static WHEEL G_Wheel;
+
+static ULONG G_Seed = 1;
+
+static ULONG NextRandom(void)
+{
+    G_Seed = G_Seed * 1103515245 + 12345;
+
+    return (G_Seed >> 16) & 0x7FFF;
+}
+
+static ULONG64 NowNs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (ULONG64)now.tv_sec * 1000000000ULL + (ULONG64)now.tv_nsec;
+}
+
+static void WheelReset(PWHEEL Wheel)
+{
+    memset(Wheel, 0, sizeof(*Wheel));
+}
+
+static void WheelJoin(PWHEEL Wheel, ULONG Member)
+{
+    ULONG slot = PacerWheel_AssignSlot(Wheel->SlotCounts);
+
+    Wheel->Slots[slot][Wheel->SlotCounts[slot]++] = Member;
+    Wheel->MemberSlot[Member] = slot;
+    Wheel->Count++;
+}
+
+static void WheelLeave(PWHEEL Wheel, ULONG Member)
+{
+    ULONG slot = Wheel->MemberSlot[Member];
+    ULONG index;
+
+    for (index = 0; Wheel->Slots[slot][index] != Member; index++)
+    {
+    }
+
+    Wheel->Slots[slot][index] = Wheel->Slots[slot][--Wheel->SlotCounts[slot]];
+    Wheel->Count--;
+}
+
+//
+// One expiry of the pacer timer, mirrors Pacer_EvtDpc and Pacer_ArmLocked;
+// returns the tick the timer is armed for
+//
+static ULONGLONG WheelTick(PWHEEL Wheel, ULONGLONG Now)
+{
+    ULONGLONG tick = PacerWheel_ClaimTicks(&Wheel->LastTick, Now);
+    ULONG slot;
+    ULONG index;
+
+    while (tick < Now)
+    {
+        tick++;
+
+        slot = (ULONG)(tick % PACER_WHEEL_SLOTS);
+
+        for (index = 0; index < Wheel->SlotCounts[slot]; index++)
+        {
+            Wheel->Serviced[Wheel->Slots[slot][index]]++;
+        }
+    }
+
+    return PacerWheel_NextTick(Wheel->SlotCounts, Now);
+}
+
+//
+// Runs the timer for SIM_TICKS on a clock advancing in steps of
+// Granularity ticks; returns the number of timer expiries
+//
+static ULONG WheelRun(PWHEEL Wheel, ULONG Granularity)
+{
+    ULONGLONG now = 0;
+    ULONGLONG due = PacerWheel_NextTick(Wheel->SlotCounts, 0);
+    ULONG expiries = 0;
+
+    Wheel->LastTick = 0;
+
+    while (due <= SIM_TICKS)
+    {
+        // The timer expires at the first clock update at or after due
+        now = (due + Granularity - 1) / Granularity * Granularity;
+
+        due = WheelTick(Wheel, now);
+        expiries++;
+    }
+
+    return expiries;
+}
+
+static void TestAssignSlot(void)
+{
+    ULONG counts[PACER_WHEEL_SLOTS] = { 0 };
+    ULONG member;
+    ULONG slot;
+    ULONG round;
+
+    CHECK(PacerWheel_AssignSlot(counts) == 0);
+
+    counts[0] = 1;
+    CHECK(PacerWheel_AssignSlot(counts) == 1);
+
+    // Joining from empty deals the members round robin
+    WheelReset(&G_Wheel);
+
+    for (member = 0; member < MAX_MEMBERS; member++)
+    {
+        WheelJoin(&G_Wheel, member);
+        CHECK(G_Wheel.MemberSlot[member] == member % PACER_WHEEL_SLOTS);
+    }
+
+    // Under churn a join always lands on a least crowded phase
+    for (round = 0; round < 100000; round++)
+    {
+        member = NextRandom() % MAX_MEMBERS;
+
+        WheelLeave(&G_Wheel, member);
+        WheelJoin(&G_Wheel, member);
+
+        for (slot = 0; slot < PACER_WHEEL_SLOTS; slot++)
+        {
+            CHECK(G_Wheel.SlotCounts[G_Wheel.MemberSlot[member]] - 1 <= G_Wheel.SlotCounts[slot]);
+        }
+    }
+
+    CHECK(G_Wheel.Count == MAX_MEMBERS);
+}
+
+static void TestNextTick(void)
+{
+    ULONG counts[PACER_WHEEL_SLOTS] = { 0 };
+
+    counts[3] = 1;
+
+    CHECK(PacerWheel_NextTick(counts, 0) == 3);
+    CHECK(PacerWheel_NextTick(counts, 2) == 3);
+    CHECK(PacerWheel_NextTick(counts, 3) == 3 + PACER_WHEEL_SLOTS);
+    CHECK(PacerWheel_NextTick(counts, 1000) == 1003);
+
+    counts[0] = 1;
+
+    CHECK(PacerWheel_NextTick(counts, 3) == PACER_WHEEL_SLOTS);
+}
+
+static void TestClaimTicks(void)
+{
+    ULONGLONG lastTick = 100;
+
+    // Due ticks since the last claim
+    CHECK(PacerWheel_ClaimTicks(&lastTick, 103) == 100);
+    CHECK(lastTick == 103);
+
+    // A second claim at the same time finds them taken
+    CHECK(PacerWheel_ClaimTicks(&lastTick, 103) == 103);
+
+    // A processor whose clock lags behind gets nothing and moves nothing
+    CHECK(PacerWheel_ClaimTicks(&lastTick, 101) == 101);
+    CHECK(lastTick == 103);
+
+    // A long stall catches up a single revolution
+    CHECK(PacerWheel_ClaimTicks(&lastTick, 1000) == 1000 - PACER_WHEEL_SLOTS);
+    CHECK(lastTick == 1000);
+}
+
+//
+// Every member gets serviced once per revolution on a tick-accurate clock,
+// and equally often on a coarse one
+//
+static void TestService(ULONG Members, ULONG Granularity)
+{
+    ULONG member;
+    ULONG low = ~0U;
+    ULONG high = 0;
+
+    WheelReset(&G_Wheel);
+
+    for (member = 0; member < Members; member++)
+    {
+        WheelJoin(&G_Wheel, member);
+    }
+
+    WheelRun(&G_Wheel, Granularity);
+
+    for (member = 0; member < Members; member++)
+    {
+        low = min(low, G_Wheel.Serviced[member]);
+        high = max(high, G_Wheel.Serviced[member]);
+    }
+
+    CHECK(high - low <= 1);
+
+    if (Granularity == 1)
+    {
+        CHECK(low == SIM_TICKS / PACER_WHEEL_SLOTS);
+        CHECK(high == SIM_TICKS / PACER_WHEEL_SLOTS);
+    }
+}
+
+//
+// Cost of a join, of a timer expiry and timer expiries per second, next
+// to one periodic timer per member at the wheel's revolution
+//
+static void Benchmark(ULONG Members, ULONG Granularity)
+{
+    ULONG64 joinTime = 0;
+    ULONG64 runTime;
+    ULONG64 start;
+    ULONG expiries = 0;
+    ULONG busiest = 0;
+    ULONG member;
+    ULONG slot;
+    ULONG round;
+
+    for (round = 0; round < BENCH_ROUNDS; round++)
+    {
+        WheelReset(&G_Wheel);
+
+        start = NowNs();
+
+        for (member = 0; member < Members; member++)
+        {
+            WheelJoin(&G_Wheel, member);
+        }
+
+        joinTime += NowNs() - start;
+    }
+
+    for (slot = 0; slot < PACER_WHEEL_SLOTS; slot++)
+    {
+        busiest = max(busiest, G_Wheel.SlotCounts[slot]);
+    }
+
+    start = NowNs();
+
+    for (round = 0; round < BENCH_ROUNDS / 100; round++)
+    {
+        memset(G_Wheel.Serviced, 0, sizeof(G_Wheel.Serviced));
+        expiries = WheelRun(&G_Wheel, Granularity);
+    }
+
+    runTime = NowNs() - start;
+
+    CHECK(G_Wheel.Serviced[0] > 0);
+
+    printf("%3u members  %2u ms clock  join %5.1f ns  expiry %6.1f ns  "
+        "busiest phase %2u  expiries/s: wheel %4u  per member timers %5u\n",
+        Members,
+        Granularity,
+        (double)joinTime / ((ULONG64)BENCH_ROUNDS * Members),
+        (double)runTime / ((ULONG64)(BENCH_ROUNDS / 100) * expiries),
+        busiest,
+        expiries * 1000 / SIM_TICKS,
+        Members * 1000 / PACER_WHEEL_SLOTS);
+}
+
+int main(void)
+{
+    static const ULONG members[] = { 1, 2, 4, 8, 16, 64, 256 };
+    ULONG index;
+
+    TestAssignSlot();
+    TestNextTick();
+    TestClaimTicks();
+
+    for (index = 0; index < ARRAYSIZE(members); index++)
+    {
+        TestService(members[index], 1);
+        TestService(members[index], 16);
+    }
+
+    if (G_Failures != 0)
+    {
+        fprintf(stderr, "%d check(s) failed\n", G_Failures);
+        return 1;
+    }
+
+    for (index = 0; index < ARRAYSIZE(members); index++)
+    {
+        Benchmark(members[index], 1);
+    }
+
+    Benchmark(MAX_MEMBERS, 16);
+
+    if (G_Failures != 0)
+    {
+        fprintf(stderr, "%d check(s) failed\n", G_Failures);
+        return 1;
+    }
+
+    printf("Pacer wheel test passed\n");
+
+    return 0;
+}
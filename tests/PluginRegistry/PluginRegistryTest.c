@@ -0,0 +1,389 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "SerialHash.h"
+#include "DeadlineHeap.h"
+
+//
+// Correctness checks and benchmark of the serial hash and deadline heap
+// the pending plugin registry is built from, next to the linear scans of
+// the WDFCOLLECTION they replaced, at 1 to 1000 pending plugin requests.
+//
+
+#define BENCH_ROUNDS                    200000
+
+static int G_Failures = 0;
+
+#define CHECK(_cond_)                                                       \
+    do                                                                      \
+    {                                                                       \
+        if (!(_cond_))                                                      \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                    \
+                __FILE__, __LINE__, #_cond_);                               \
+            G_Failures++;                                                   \
+        }                                                                   \
+    } while (0)
+
+//
+// Host stand-in for the plugin request context
+//
+typedef struct _PENDING_REQUEST
+{
+    SERIAL_HASH_ENTRY Key;
+
+    DEADLINE_HEAP_NODE DeadlineNode;
+
+} PENDING_REQUEST, *PPENDING_REQUEST;
+
+static SERIAL_HASH G_Hash;
+
+static DEADLINE_HEAP G_Heap;
+
+static PENDING_REQUEST G_Requests[DEADLINE_HEAP_MAX_NODES];
+
+//
+// The collection the registry replaced, scanned front to back
+//
+static PPENDING_REQUEST G_Collection[DEADLINE_HEAP_MAX_NODES];
+
+static ULONG G_CollectionCount;
+
+static volatile ULONG64 G_Sink;
+
+static ULONG G_Seed = 1;
+
+static ULONG NextRandom(void)
+{
+    G_Seed = G_Seed * 1103515245 + 12345;
+
+    return (G_Seed >> 8) & 0xFFFFFF;
+}
+
+static ULONG64 Now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (ULONG64)now.tv_sec * 1000000000ULL + (ULONG64)now.tv_nsec;
+}
+
+static PPENDING_REQUEST HashRequest(PSERIAL_HASH_ENTRY Entry)
+{
+    return (PPENDING_REQUEST)((UCHAR*)Entry - offsetof(PENDING_REQUEST, Key));
+}
+
+static PPENDING_REQUEST HeapRequest(PDEADLINE_HEAP_NODE Node)
+{
+    return (PPENDING_REQUEST)((UCHAR*)Node - offsetof(PENDING_REQUEST, DeadlineNode));
+}
+
+//
+// Checks the heap property of every node and its back index
+//
+static BOOLEAN HeapIsValid(void)
+{
+    ULONG index;
+
+    for (index = 0; index < G_Heap.Count; index++)
+    {
+        if (G_Heap.Nodes[index]->Index != index)
+        {
+            return FALSE;
+        }
+
+        if (index > 0 && G_Heap.Nodes[(index - 1) / 2]->Deadline > G_Heap.Nodes[index]->Deadline)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static void TestHeap(void)
+{
+    ULONG index;
+    ULONG64 last = 0;
+    PDEADLINE_HEAP_NODE node;
+
+    DeadlineHeap_Initialize(&G_Heap);
+
+    CHECK(DEADLINE_HEAP_PEEK(&G_Heap) == NULL);
+
+    for (index = 0; index < DEADLINE_HEAP_MAX_NODES; index++)
+    {
+        G_Requests[index].DeadlineNode.Deadline = NextRandom() % 1000;
+        CHECK(DeadlineHeap_Insert(&G_Heap, &G_Requests[index].DeadlineNode));
+    }
+
+    // Full heaps refuse more nodes
+    CHECK(!DeadlineHeap_Insert(&G_Heap, &G_Requests[0].DeadlineNode));
+    CHECK(HeapIsValid());
+
+    // Removal from anywhere keeps the order, like a resolved request does
+    for (index = 0; index < DEADLINE_HEAP_MAX_NODES; index += 3)
+    {
+        DeadlineHeap_Remove(&G_Heap, &G_Requests[index].DeadlineNode);
+    }
+
+    CHECK(HeapIsValid());
+
+    // Expiry pops come out earliest first
+    while ((node = DEADLINE_HEAP_PEEK(&G_Heap)) != NULL)
+    {
+        CHECK(node->Deadline >= last);
+        last = node->Deadline;
+
+        // Removed nodes never come back
+        CHECK((HeapRequest(node) - G_Requests) % 3 != 0);
+
+        DeadlineHeap_Remove(&G_Heap, node);
+    }
+
+    CHECK(G_Heap.Count == 0);
+}
+
+static void TestHash(void)
+{
+    PENDING_REQUEST first;
+    PENDING_REQUEST second;
+    PENDING_REQUEST other;
+
+    SerialHash_Initialize(&G_Hash);
+    memset(&first, 0, sizeof(first));
+    memset(&second, 0, sizeof(second));
+    memset(&other, 0, sizeof(other));
+
+    first.Key.SerialNo = 5;
+    second.Key.SerialNo = 5;
+    // Same bucket, different serial
+    other.Key.SerialNo = 5 + SERIAL_HASH_BUCKET_COUNT;
+
+    CHECK(SerialHash_Find(&G_Hash, 5) == NULL);
+
+    SerialHash_Link(&G_Hash, &other.Key);
+    SerialHash_Link(&G_Hash, &first.Key);
+    SerialHash_Link(&G_Hash, &second.Key);
+
+    // Oldest request waiting for a serial gets its result first
+    CHECK(SerialHash_Find(&G_Hash, 5) == &first.Key);
+    CHECK(SerialHash_Find(&G_Hash, 5 + SERIAL_HASH_BUCKET_COUNT) == &other.Key);
+
+    SerialHash_Unlink(&G_Hash, &first.Key);
+    CHECK(!first.Key.Linked);
+    CHECK(SerialHash_Find(&G_Hash, 5) == &second.Key);
+
+    // Unlinking twice is harmless
+    SerialHash_Unlink(&G_Hash, &first.Key);
+    SerialHash_Unlink(&G_Hash, &second.Key);
+    CHECK(SerialHash_Find(&G_Hash, 5) == NULL);
+    CHECK(SerialHash_Find(&G_Hash, 5 + SERIAL_HASH_BUCKET_COUNT) == &other.Key);
+}
+
+static void Register(PPENDING_REQUEST Request)
+{
+    SerialHash_Link(&G_Hash, &Request->Key);
+    DeadlineHeap_Insert(&G_Heap, &Request->DeadlineNode);
+
+    G_Collection[G_CollectionCount++] = Request;
+}
+
+//
+// Stage result path: registry lookup versus the collection scan
+//
+static PPENDING_REQUEST ResolveRegistry(ULONG SerialNo)
+{
+    PSERIAL_HASH_ENTRY entry = SerialHash_Find(&G_Hash, SerialNo);
+    PPENDING_REQUEST request;
+
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+
+    request = HashRequest(entry);
+
+    SerialHash_Unlink(&G_Hash, &request->Key);
+    DeadlineHeap_Remove(&G_Heap, &request->DeadlineNode);
+
+    return request;
+}
+
+static PPENDING_REQUEST ResolveCollection(ULONG SerialNo)
+{
+    PPENDING_REQUEST request;
+    ULONG index;
+
+    for (index = 0; index < G_CollectionCount; index++)
+    {
+        if (G_Collection[index]->Key.SerialNo == SerialNo)
+        {
+            request = G_Collection[index];
+            G_Collection[index] = G_Collection[--G_CollectionCount];
+
+            return request;
+        }
+    }
+
+    return NULL;
+}
+
+//
+// Cleanup timer path with nothing expired yet
+//
+static ULONG ExpiredRegistry(ULONG64 Time)
+{
+    PDEADLINE_HEAP_NODE node = DEADLINE_HEAP_PEEK(&G_Heap);
+
+    return (node != NULL && node->Deadline <= Time) ? 1 : 0;
+}
+
+static ULONG ExpiredCollection(ULONG64 Time)
+{
+    ULONG expired = 0;
+    ULONG index;
+
+    for (index = 0; index < G_CollectionCount; index++)
+    {
+        if (G_Collection[index]->DeadlineNode.Deadline <= Time)
+        {
+            expired++;
+        }
+    }
+
+    return expired;
+}
+
+static void Benchmark(ULONG Pending)
+{
+    ULONG index;
+    ULONG round;
+    ULONG serial;
+    PPENDING_REQUEST request;
+    ULONG64 start;
+    ULONG64 resolveRegistry;
+    ULONG64 resolveCollection;
+    ULONG64 expireRegistry;
+    ULONG64 expireCollection;
+    ULONG64 sink = 0;
+
+    SerialHash_Initialize(&G_Hash);
+    DeadlineHeap_Initialize(&G_Heap);
+    G_CollectionCount = 0;
+
+    for (index = 0; index < Pending; index++)
+    {
+        G_Requests[index].Key.SerialNo = index + 1;
+        G_Requests[index].DeadlineNode.Deadline = 1000 + NextRandom();
+        Register(&G_Requests[index]);
+    }
+
+    // Every resolved request gets replaced so the pending count stays put
+    start = Now();
+
+    for (round = 0; round < BENCH_ROUNDS; round++)
+    {
+        serial = 1 + (round * 7919) % Pending;
+
+        request = ResolveRegistry(serial);
+        SerialHash_Link(&G_Hash, &request->Key);
+        DeadlineHeap_Insert(&G_Heap, &request->DeadlineNode);
+    }
+
+    resolveRegistry = Now() - start;
+    start = Now();
+
+    for (round = 0; round < BENCH_ROUNDS; round++)
+    {
+        serial = 1 + (round * 7919) % Pending;
+
+        request = ResolveCollection(serial);
+        G_Collection[G_CollectionCount++] = request;
+    }
+
+    resolveCollection = Now() - start;
+    start = Now();
+
+    for (round = 0; round < BENCH_ROUNDS; round++)
+    {
+        sink += ExpiredRegistry(round);
+    }
+
+    expireRegistry = Now() - start;
+    start = Now();
+
+    for (round = 0; round < BENCH_ROUNDS; round++)
+    {
+        sink += ExpiredCollection(round);
+    }
+
+    expireCollection = Now() - start;
+
+    G_Sink = sink;
+
+    CHECK(HeapIsValid());
+    CHECK(G_Heap.Count == Pending);
+
+    printf("%4u pending  resolve: registry %7.1f ns  collection %7.1f ns  "
+        "expiry tick: registry %6.1f ns  collection %7.1f ns\n",
+        Pending,
+        (double)resolveRegistry / BENCH_ROUNDS,
+        (double)resolveCollection / BENCH_ROUNDS,
+        (double)expireRegistry / BENCH_ROUNDS,
+        (double)expireCollection / BENCH_ROUNDS);
+}
+
+int main(void)
+{
+    static const ULONG pending[] = { 1, 10, 100, 1000 };
+    ULONG index;
+
+    TestHeap();
+    TestHash();
+
+    if (G_Failures != 0)
+    {
+        fprintf(stderr, "%d check(s) failed\n", G_Failures);
+        return 1;
+    }
+
+    for (index = 0; index < ARRAYSIZE(pending); index++)
+    {
+        Benchmark(pending[index]);
+    }
+
+    if (G_Failures != 0)
+    {
+        fprintf(stderr, "%d check(s) failed\n", G_Failures);
+        return 1;
+    }
+
+    printf("Plugin registry test passed\n");
+
+    return 0;
+}
@@ -0,0 +1,267 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+
+#include <stdio.h>
+#include <time.h>
+
+#include "ReportDiff.h"
+
+//
+// Correctness checks and microbenchmark of the word-wise report compare
+// used to drop unchanged submits.
+//
+// The benchmark puts DiffReportWords next to a byte-wise compare like
+// RtlCompareMemory, which the bus used for Xbox 360 reports before, at
+// the report sizes of the three target types.
+//
+
+#define BENCH_ITERATIONS                5000000
+
+#define XUSB_REPORT_LENGTH              12
+#define XGIP_REPORT_LENGTH              14
+#define NSWITCH_REPORT_LENGTH           0x40
+
+static int G_Failures = 0;
+
+#define CHECK(_cond_)                                                       \
+    do                                                                      \
+    {                                                                       \
+        if (!(_cond_))                                                      \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                    \
+                __FILE__, __LINE__, #_cond_);                               \
+            G_Failures++;                                                   \
+        }                                                                   \
+    } while (0)
+
+//
+// Same layout as the bus' G_NintSwitchReportIgnoreMask
+//
+static const ULONG64 G_NintSwitchReportIgnoreMask[NSWITCH_REPORT_LENGTH / sizeof(ULONG64)] =
+{
+    DIFF_REPORT_NSWITCH_TIMER_MASK
+};
+
+static volatile ULONG64 G_Sink;
+
+//
+// Keeps the compiler from hoisting a compare of unchanged buffers out of the loop
+//
+#define BENCH_CLOBBER()                 __asm__ __volatile__("" : : : "memory")
+
+static ULONG64 Now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (ULONG64)now.tv_sec * 1000000000ULL + (ULONG64)now.tv_nsec;
+}
+
+static void FillReport(UCHAR* Report, SIZE_T Length, UCHAR Seed)
+{
+    SIZE_T index;
+
+    for (index = 0; index < Length; index++)
+    {
+        Report[index] = (UCHAR)(Seed + index * 7);
+    }
+}
+
+//
+// Byte-wise compare returning the number of matching bytes, like RtlCompareMemory
+//
+static SIZE_T CompareBytes(const VOID* Left, const VOID* Right, SIZE_T Length)
+{
+    const UCHAR* pLeft = (const UCHAR*)Left;
+    const UCHAR* pRight = (const UCHAR*)Right;
+    SIZE_T index;
+
+    for (index = 0; index < Length && pLeft[index] == pRight[index]; index++)
+    {
+    }
+
+    return index;
+}
+
+static void TestSwitchTimerMask(void)
+{
+    ULONG64 oldReport[NSWITCH_REPORT_LENGTH / sizeof(ULONG64)];
+    ULONG64 newReport[NSWITCH_REPORT_LENGTH / sizeof(ULONG64)];
+    UCHAR* pNew = (UCHAR*)newReport;
+    SIZE_T index;
+
+    FillReport((UCHAR*)oldReport, NSWITCH_REPORT_LENGTH, 0x30);
+    memcpy(newReport, oldReport, sizeof(newReport));
+
+    CHECK(DiffReportWords(oldReport, newReport, NSWITCH_REPORT_LENGTH, G_NintSwitchReportIgnoreMask) == 0);
+
+    // The timer byte alone is no change, but only with the mask
+    pNew[1]++;
+    CHECK(DiffReportWords(oldReport, newReport, NSWITCH_REPORT_LENGTH, G_NintSwitchReportIgnoreMask) == 0);
+    CHECK(DiffReportWords(oldReport, newReport, NSWITCH_REPORT_LENGTH, NULL) == 1);
+    pNew[1]--;
+
+    // Every other byte reports the word it lives in
+    for (index = 0; index < NSWITCH_REPORT_LENGTH; index++)
+    {
+        if (index == 1)
+        {
+            continue;
+        }
+
+        pNew[index] ^= 0x80;
+
+        CHECK(DiffReportWords(oldReport, newReport, NSWITCH_REPORT_LENGTH, G_NintSwitchReportIgnoreMask)
+            == 1ULL << (index / sizeof(ULONG64)));
+
+        pNew[index] ^= 0x80;
+    }
+
+    // Changes in several words add up, the timer still doesn't count
+    pNew[1]++;
+    pNew[0x0A]++;
+    pNew[0x3F]++;
+    CHECK(DiffReportWords(oldReport, newReport, NSWITCH_REPORT_LENGTH, G_NintSwitchReportIgnoreMask)
+        == ((1ULL << 1) | (1ULL << 7)));
+}
+
+static void TestTailWords(void)
+{
+    ULONG64 oldReport[DIFF_REPORT_MAX_LENGTH / sizeof(ULONG64)];
+    ULONG64 newReport[DIFF_REPORT_MAX_LENGTH / sizeof(ULONG64)];
+    UCHAR* pNew = (UCHAR*)newReport;
+    const ULONG64 tailMask[2] = { 0, 0x00000000000000FFULL };
+    SIZE_T index;
+
+    FillReport((UCHAR*)oldReport, sizeof(oldReport), 0x11);
+    memcpy(newReport, oldReport, sizeof(newReport));
+
+    // Bytes past the length are never looked at
+    for (index = XUSB_REPORT_LENGTH; index < 2 * sizeof(ULONG64); index++)
+    {
+        pNew[index] ^= 0xFF;
+    }
+
+    CHECK(DiffReportWords(oldReport, newReport, XUSB_REPORT_LENGTH, NULL) == 0);
+
+    // The short tail word still tells changes apart
+    for (index = sizeof(ULONG64); index < XUSB_REPORT_LENGTH; index++)
+    {
+        pNew[index] ^= 0x01;
+        CHECK(DiffReportWords(oldReport, newReport, XUSB_REPORT_LENGTH, NULL) == 2);
+        pNew[index] ^= 0x01;
+    }
+
+    pNew[XGIP_REPORT_LENGTH - 1] = (UCHAR)~((UCHAR*)oldReport)[XGIP_REPORT_LENGTH - 1];
+    CHECK(DiffReportWords(oldReport, newReport, XGIP_REPORT_LENGTH, NULL) == 2);
+
+    memcpy(newReport, oldReport, sizeof(newReport));
+
+    // Masks apply to the tail word as well
+    pNew[sizeof(ULONG64)]++;
+    CHECK(DiffReportWords(oldReport, newReport, XUSB_REPORT_LENGTH, tailMask) == 0);
+    pNew[sizeof(ULONG64) + 1]++;
+    CHECK(DiffReportWords(oldReport, newReport, XUSB_REPORT_LENGTH, tailMask) == 2);
+
+    memcpy(newReport, oldReport, sizeof(newReport));
+
+    // Single byte reports and the longest supported length
+    pNew[0]++;
+    CHECK(DiffReportWords(oldReport, newReport, 1, NULL) == 1);
+    pNew[0]--;
+
+    pNew[DIFF_REPORT_MAX_LENGTH - 1]++;
+    CHECK(DiffReportWords(oldReport, newReport, DIFF_REPORT_MAX_LENGTH, NULL) == 1ULL << 63);
+    CHECK(DiffReportWords(oldReport, newReport, DIFF_REPORT_MAX_LENGTH - 1, NULL) == 0);
+}
+
+static void Benchmark(const char* Name, SIZE_T Length, const ULONG64* IgnoreMask, BOOLEAN Equal)
+{
+    ULONG64 oldReport[NSWITCH_REPORT_LENGTH / sizeof(ULONG64)];
+    ULONG64 newReport[NSWITCH_REPORT_LENGTH / sizeof(ULONG64)];
+    ULONG64 start;
+    ULONG64 words;
+    ULONG64 bytes;
+    ULONG64 sink = 0;
+    ULONG iteration;
+
+    FillReport((UCHAR*)oldReport, sizeof(oldReport), 0x42);
+    memcpy(newReport, oldReport, sizeof(newReport));
+
+    // Worst case for the byte loop, the difference sits in the last byte
+    if (!Equal)
+    {
+        ((UCHAR*)newReport)[Length - 1]++;
+    }
+
+    start = Now();
+
+    for (iteration = 0; iteration < BENCH_ITERATIONS; iteration++)
+    {
+        BENCH_CLOBBER();
+        sink += DiffReportWords(oldReport, newReport, Length, IgnoreMask);
+    }
+
+    words = Now() - start;
+    start = Now();
+
+    for (iteration = 0; iteration < BENCH_ITERATIONS; iteration++)
+    {
+        BENCH_CLOBBER();
+        sink += CompareBytes(oldReport, newReport, Length);
+    }
+
+    bytes = Now() - start;
+
+    G_Sink = sink;
+
+    printf("%-24s %3u bytes %-8s words %6.2f ns  bytes %6.2f ns\n",
+        Name,
+        (unsigned)Length,
+        Equal ? "equal" : "changed",
+        (double)words / BENCH_ITERATIONS,
+        (double)bytes / BENCH_ITERATIONS);
+}
+
+int main(void)
+{
+    TestSwitchTimerMask();
+    TestTailWords();
+
+    if (G_Failures != 0)
+    {
+        fprintf(stderr, "%d check(s) failed\n", G_Failures);
+        return 1;
+    }
+
+    Benchmark("Xbox360Wired", XUSB_REPORT_LENGTH, NULL, TRUE);
+    Benchmark("Xbox360Wired", XUSB_REPORT_LENGTH, NULL, FALSE);
+    Benchmark("XboxOneWired", XGIP_REPORT_LENGTH, NULL, TRUE);
+    Benchmark("XboxOneWired", XGIP_REPORT_LENGTH, NULL, FALSE);
+    Benchmark("NintendoSwitchWired", NSWITCH_REPORT_LENGTH, G_NintSwitchReportIgnoreMask, TRUE);
+    Benchmark("NintendoSwitchWired", NSWITCH_REPORT_LENGTH, G_NintSwitchReportIgnoreMask, FALSE);
+
+    printf("Report diff test passed\n");
+
+    return 0;
+}
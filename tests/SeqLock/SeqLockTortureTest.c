@@ -0,0 +1,204 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "SeqLock.h"
+
+//
+// Torture test of the sequence lock guarding the cached reports: one
+// writer thread keeps rewriting a report sized buffer word by word while
+// several reader threads take snapshots with SeqLockRead.
+//
+// Every word of a generation holds the same value, a torn snapshot mixes
+// two generations. Snapshots going backwards fail the test as well.
+//
+
+#define TORTURE_GENERATIONS         200000
+#define TORTURE_READERS             4
+#define TORTURE_WORDS               16
+#define TORTURE_WRITER_BURST        0x40
+
+static int G_Failures = 0;
+
+#define CHECK(_cond_)                                                       \
+    do                                                                      \
+    {                                                                       \
+        if (!(_cond_))                                                      \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                    \
+                __FILE__, __LINE__, #_cond_);                               \
+            G_Failures++;                                                   \
+        }                                                                   \
+    } while (0)
+
+typedef struct _TORTURE_REPORT
+{
+    ULONG Words[TORTURE_WORDS];
+
+} TORTURE_REPORT;
+
+typedef struct _TORTURE_READER
+{
+    pthread_t Thread;
+
+    ULONG Reads;
+
+    ULONG Generations;
+
+    ULONG TornReads;
+
+    ULONG Reordered;
+
+} TORTURE_READER;
+
+static volatile LONG G_Sequence;
+
+static TORTURE_REPORT G_Report;
+
+static volatile LONG G_WriterDone;
+
+static void* Writer(void* Argument)
+{
+    volatile ULONG* words = G_Report.Words;
+    ULONG generation;
+    ULONG index;
+
+    (void)Argument;
+
+    for (generation = 1; generation <= TORTURE_GENERATIONS; generation++)
+    {
+        SeqLockWriteBegin(&G_Sequence);
+
+        for (index = 0; index < TORTURE_WORDS; index++)
+        {
+            words[index] = generation;
+
+            // Get preempted mid-write now and then, even on one processor
+            if (index == TORTURE_WORDS / 2 && (generation % TORTURE_WRITER_BURST) == 0)
+            {
+                YieldProcessor();
+            }
+        }
+
+        SeqLockWriteEnd(&G_Sequence);
+
+        if ((generation % TORTURE_WRITER_BURST) == 1)
+        {
+            YieldProcessor();
+        }
+    }
+
+    InterlockedExchange(&G_WriterDone, 1);
+
+    return NULL;
+}
+
+static void* Reader(void* Argument)
+{
+    TORTURE_READER* reader = (TORTURE_READER*)Argument;
+    TORTURE_REPORT snapshot;
+    ULONG last = 0;
+    ULONG index;
+    BOOLEAN done;
+
+    do
+    {
+        // Sample before reading, the last snapshot then sees the final write
+        done = InterlockedCompareExchange(&G_WriterDone, 0, 0) != 0;
+
+        SeqLockRead(&G_Sequence, &snapshot, &G_Report, sizeof(snapshot));
+
+        reader->Reads++;
+
+        for (index = 1; index < TORTURE_WORDS; index++)
+        {
+            if (snapshot.Words[index] != snapshot.Words[0])
+            {
+                reader->TornReads++;
+                break;
+            }
+        }
+
+        if (snapshot.Words[0] < last)
+        {
+            reader->Reordered++;
+        }
+        else if (snapshot.Words[0] > last)
+        {
+            reader->Generations++;
+            last = snapshot.Words[0];
+        }
+
+        // Leave the writer some time on machines with a single processor
+        YieldProcessor();
+    } while (!done);
+
+    CHECK(last == TORTURE_GENERATIONS);
+
+    return NULL;
+}
+
+int main(void)
+{
+    TORTURE_READER readers[TORTURE_READERS];
+    pthread_t writer;
+    ULONG index;
+
+    memset(readers, 0, sizeof(readers));
+
+    for (index = 0; index < TORTURE_READERS; index++)
+    {
+        CHECK(pthread_create(&readers[index].Thread, NULL, Reader, &readers[index]) == 0);
+    }
+
+    CHECK(pthread_create(&writer, NULL, Writer, NULL) == 0);
+
+    pthread_join(writer, NULL);
+
+    for (index = 0; index < TORTURE_READERS; index++)
+    {
+        pthread_join(readers[index].Thread, NULL);
+
+        printf("reader %u: %u reads, %u generations seen\n",
+            index,
+            readers[index].Reads,
+            readers[index].Generations);
+
+        CHECK(readers[index].TornReads == 0);
+        CHECK(readers[index].Reordered == 0);
+        CHECK(readers[index].Generations > 1);
+    }
+
+    CHECK(G_Sequence == 2 * TORTURE_GENERATIONS);
+
+    if (G_Failures != 0)
+    {
+        fprintf(stderr, "%d check(s) failed\n", G_Failures);
+        return 1;
+    }
+
+    printf("Sequence lock torture test passed\n");
+
+    return 0;
+}
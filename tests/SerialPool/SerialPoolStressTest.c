@@ -0,0 +1,254 @@
+/*
+* Virtual Gamepad Emulation Framework - Windows kernel-mode bus driver
+* Copyright (C) 2016-2018  Benjamin Hglinger-Stelzer
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "SerialPool.h"
+
+//
+// Stress test of the lock-free serial number allocator: several threads
+// keep allocating and freeing serials at the same time.
+//
+// Fails if a serial gets handed out twice, if a freed serial never comes
+// back or if a full pool hands out anything but 0.
+//
+
+#define STRESS_THREADS              8
+#define STRESS_ROUNDS               2000
+#define STRESS_BURST                200
+
+static int G_Failures = 0;
+
+#define CHECK(_cond_)                                                       \
+    do                                                                      \
+    {                                                                       \
+        if (!(_cond_))                                                      \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                    \
+                __FILE__, __LINE__, #_cond_);                               \
+            G_Failures++;                                                   \
+        }                                                                   \
+    } while (0)
+
+typedef struct _STRESS_THREAD
+{
+    pthread_t Thread;
+
+    ULONG Seed;
+
+    ULONG Allocated;
+
+    ULONG Exhausted;
+
+    ULONG Duplicates;
+
+    ULONG Invalid;
+
+} STRESS_THREAD;
+
+static SERIAL_POOL G_Pool;
+
+//
+// Owner flag per serial, a second owner means it got handed out twice
+//
+static volatile LONG G_Owned[SERIAL_POOL_MAX_SERIAL + 1];
+
+static ULONG NextRandom(ULONG* Seed)
+{
+    *Seed = *Seed * 1103515245 + 12345;
+
+    return (*Seed >> 16) & 0x7FFF;
+}
+
+static void* Worker(void* Argument)
+{
+    STRESS_THREAD* thread = (STRESS_THREAD*)Argument;
+    ULONG serials[STRESS_BURST];
+    ULONG round;
+    ULONG count;
+    ULONG index;
+    ULONG burst;
+
+    for (round = 0; round < STRESS_ROUNDS; round++)
+    {
+        burst = 1 + NextRandom(&thread->Seed) % STRESS_BURST;
+
+        for (count = 0; count < burst; count++)
+        {
+            serials[count] = SerialPool_Allocate(&G_Pool);
+
+            if (serials[count] == 0)
+            {
+                thread->Exhausted++;
+                break;
+            }
+
+            if (serials[count] > SERIAL_POOL_MAX_SERIAL)
+            {
+                thread->Invalid++;
+                break;
+            }
+
+            if (InterlockedExchange(&G_Owned[serials[count]], 1) != 0)
+            {
+                thread->Duplicates++;
+            }
+
+            thread->Allocated++;
+        }
+
+        // Give the others a chance to collide on one processor
+        YieldProcessor();
+
+        for (index = 0; index < count; index++)
+        {
+            InterlockedExchange(&G_Owned[serials[index]], 0);
+            SerialPool_Free(&G_Pool, serials[index]);
+        }
+    }
+
+    return NULL;
+}
+
+//
+// Takes every serial, returns how many distinct ones came out
+//
+static ULONG DrainPool(void)
+{
+    static BOOLEAN seen[SERIAL_POOL_MAX_SERIAL + 1];
+    ULONG serial;
+    ULONG distinct = 0;
+
+    memset(seen, 0, sizeof(seen));
+
+    while ((serial = SerialPool_Allocate(&G_Pool)) != 0)
+    {
+        if (serial > SERIAL_POOL_MAX_SERIAL || seen[serial])
+        {
+            G_Failures++;
+            fprintf(stderr, "unexpected serial %u\n", serial);
+            break;
+        }
+
+        seen[serial] = TRUE;
+        distinct++;
+    }
+
+    return distinct;
+}
+
+//
+// Single-threaded checks of the allocator contract
+//
+static void TestContract(void)
+{
+    ULONG serial;
+
+    SerialPool_Initialize(&G_Pool);
+
+    // Lowest free serial first, starting at 1
+    CHECK(SerialPool_Allocate(&G_Pool) == 1);
+    CHECK(SerialPool_Allocate(&G_Pool) == 2);
+
+    SerialPool_Free(&G_Pool, 1);
+    CHECK(SerialPool_Allocate(&G_Pool) == 1);
+
+    // Reserved serials are skipped, reserving twice fails
+    CHECK(SerialPool_Reserve(&G_Pool, 3));
+    CHECK(!SerialPool_Reserve(&G_Pool, 3));
+    CHECK(SerialPool_Allocate(&G_Pool) == 4);
+
+    // Serials outside of the range are refused and ignored
+    CHECK(!SerialPool_Reserve(&G_Pool, 0));
+    CHECK(!SerialPool_Reserve(&G_Pool, SERIAL_POOL_MAX_SERIAL + 1));
+    SerialPool_Free(&G_Pool, 0);
+    SerialPool_Free(&G_Pool, SERIAL_POOL_MAX_SERIAL + 1);
+
+    // A full pool hands out 0, a single free makes that serial come back
+    CHECK(DrainPool() == SERIAL_POOL_MAX_SERIAL - 4);
+    CHECK(SerialPool_Allocate(&G_Pool) == 0);
+
+    SerialPool_Free(&G_Pool, SERIAL_POOL_MAX_SERIAL);
+    CHECK(SerialPool_Allocate(&G_Pool) == SERIAL_POOL_MAX_SERIAL);
+    CHECK(SerialPool_Allocate(&G_Pool) == 0);
+
+    for (serial = 1; serial <= SERIAL_POOL_MAX_SERIAL; serial++)
+    {
+        SerialPool_Free(&G_Pool, serial);
+    }
+
+    CHECK(DrainPool() == SERIAL_POOL_MAX_SERIAL);
+}
+
+static void TestStress(void)
+{
+    STRESS_THREAD threads[STRESS_THREADS];
+    ULONG index;
+    ULONG allocated = 0;
+    ULONG exhausted = 0;
+
+    SerialPool_Initialize(&G_Pool);
+    memset(threads, 0, sizeof(threads));
+
+    for (index = 0; index < STRESS_THREADS; index++)
+    {
+        threads[index].Seed = index + 1;
+        CHECK(pthread_create(&threads[index].Thread, NULL, Worker, &threads[index]) == 0);
+    }
+
+    for (index = 0; index < STRESS_THREADS; index++)
+    {
+        pthread_join(threads[index].Thread, NULL);
+
+        CHECK(threads[index].Duplicates == 0);
+        CHECK(threads[index].Invalid == 0);
+
+        allocated += threads[index].Allocated;
+        exhausted += threads[index].Exhausted;
+    }
+
+    printf("%u threads, %u serials allocated, pool full %u times\n",
+        STRESS_THREADS,
+        allocated,
+        exhausted);
+
+    // Everything got freed again, so every serial has to come back
+    CHECK(DrainPool() == SERIAL_POOL_MAX_SERIAL);
+    CHECK(SerialPool_Allocate(&G_Pool) == 0);
+}
+
+int main(void)
+{
+    TestContract();
+    TestStress();
+
+    if (G_Failures != 0)
+    {
+        fprintf(stderr, "%d check(s) failed\n", G_Failures);
+        return 1;
+    }
+
+    printf("Serial pool stress test passed\n");
+
+    return 0;
+}